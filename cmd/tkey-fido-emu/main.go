@@ -0,0 +1,104 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"crypto/sha256"
+	"fmt"
+	"log"
+	"os"
+	"strings"
+	"time"
+
+	"github.com/spf13/pflag"
+	"github.com/tillitis/tkey-fido/internal/fidoemu"
+)
+
+// Use when printing err/diag msgs
+var le = log.New(os.Stderr, "", 0)
+
+const progname = "tkey-fido-emu"
+
+// Roughly what the app on a TKey takes, as measured through the host
+const (
+	defaultRegister       = 500 * time.Millisecond
+	defaultCheckOnly      = 5 * time.Millisecond
+	defaultAuthenticateGo = 300 * time.Millisecond
+)
+
+func main() {
+	var latency fidoemu.Latency
+	var touchAfter time.Duration
+	var noTouch, helpOnly bool
+	var lineRate int
+	var seed string
+	pflag.CommandLine.SetOutput(os.Stderr)
+	pflag.CommandLine.SortFlags = false
+	pflag.DurationVar(&latency.GetNameVersion, "getnameversion-time", 0,
+		"Spend `DURATION` computing before responding to GET_NAMEVERSION.")
+	pflag.DurationVar(&latency.Register, "register-time", defaultRegister,
+		"Spend `DURATION` computing before responding to U2F_REGISTER, after being touched.")
+	pflag.DurationVar(&latency.CheckOnly, "checkonly-time", defaultCheckOnly,
+		"Spend `DURATION` computing before responding to U2F_CHECKONLY.")
+	pflag.DurationVar(&latency.AuthenticateSet, "authenticate-set-time", 0,
+		"Spend `DURATION` computing before responding to U2F_AUTHENTICATE_SET.")
+	pflag.DurationVar(&latency.AuthenticateGo, "authenticate-go-time", defaultAuthenticateGo,
+		"Spend `DURATION` computing before responding to U2F_AUTHENTICATE_GO, after being touched.")
+	pflag.DurationVar(&touchAfter, "touch-after", 0,
+		"Get touched `DURATION` after starting to wait for touch.")
+	pflag.BoolVar(&noTouch, "no-touch", false,
+		"Never get touched, but time out like the app does.")
+	pflag.IntVar(&lineRate, "line-rate", 62500,
+		"Limit the serial line to `BPS` (bits per second). Use 0 for no limit.")
+	pflag.StringVar(&seed, "seed", "",
+		"Derive the secret that keyhandles depend on from `STRING`, so they stay valid between runs. The default is a random secret.")
+	pflag.BoolVar(&helpOnly, "help", false, "Output this help.")
+	pflag.Usage = func() {
+		desc := fmt.Sprintf(`Usage: %[1]s [flags...]
+
+%[1]s acts as a TKey running the fido app, on a pseudo terminal whose
+path it prints on stdout. Use it to measure tkey-fido without a TKey, e.g.
+
+  tkey-fido --port <path> --test`, progname)
+		le.Printf("%s\n\n%s", desc,
+			pflag.CommandLine.FlagUsagesWrapped(86))
+	}
+	pflag.Parse()
+
+	if pflag.NArg() > 0 {
+		le.Printf("Unexpected argument: %s\n\n", strings.Join(pflag.Args(), " "))
+		pflag.Usage()
+		os.Exit(2)
+	}
+
+	if helpOnly {
+		pflag.Usage()
+		os.Exit(0)
+	}
+
+	options := []func(*fidoemu.Device){
+		fidoemu.WithLatency(latency),
+		fidoemu.WithTouchAfter(touchAfter),
+		fidoemu.WithLineRate(lineRate),
+	}
+	if noTouch {
+		options = append(options, fidoemu.WithNoTouch())
+	}
+	if seed != "" {
+		options = append(options, fidoemu.WithSecret(sha256.Sum256([]byte(seed))))
+	}
+
+	pty, err := fidoemu.OpenPTY()
+	if err != nil {
+		le.Printf("Failed to open pseudo terminal: %s\n", err)
+		os.Exit(1)
+	}
+
+	fmt.Printf("%s\n", pty.Path)
+
+	if err = fidoemu.New(options...).Serve(pty); err != nil {
+		le.Printf("Serve failed: %s\n", err)
+		os.Exit(1)
+	}
+}
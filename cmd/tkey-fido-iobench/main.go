@@ -0,0 +1,257 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"context"
+	"crypto/sha256"
+	"encoding/binary"
+	"fmt"
+	"log"
+	"os"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/spf13/pflag"
+	"github.com/tillitis/tkey-fido/internal/fidoemu"
+	"github.com/tillitis/tkey-fido/internal/tk1fido"
+	"github.com/tillitis/tkeyclient"
+	"go.bug.st/serial"
+)
+
+// Use when printing err/diag msgs
+var le = log.New(os.Stderr, "", 0)
+
+const progname = "tkey-fido-iobench"
+
+type result struct {
+	name      string
+	latencies []time.Duration
+	elapsed   time.Duration
+}
+
+func main() {
+	var latency fidoemu.Latency
+	var iterations, concurrency, lineRate int
+	var helpOnly bool
+	pflag.CommandLine.SetOutput(os.Stderr)
+	pflag.CommandLine.SortFlags = false
+	pflag.IntVar(&iterations, "iterations", 100,
+		"Run each command `N` times in each mode.")
+	pflag.IntVar(&concurrency, "concurrency", 4,
+		"Run the concurrent checkonly on `N` goroutines.")
+	pflag.IntVar(&lineRate, "line-rate", 62500,
+		"Limit the serial line of the stand-in to `BPS` (bits per second). Use 0 for no limit.")
+	pflag.DurationVar(&latency.CheckOnly, "checkonly-time", 5*time.Millisecond,
+		"Make the stand-in spend `DURATION` computing on U2F_CHECKONLY.")
+	pflag.DurationVar(&latency.AuthenticateGo, "authenticate-go-time", 0,
+		"Make the stand-in spend `DURATION` computing on U2F_AUTHENTICATE_GO.")
+	pflag.BoolVar(&helpOnly, "help", false, "Output this help.")
+	pflag.Usage = func() {
+		desc := fmt.Sprintf(`Usage: %[1]s [flags...]
+
+%[1]s compares the I/O paths of tk1fido against the stand-in of
+internal/fidoemu on a pseudo terminal: the blocking one of tkeyclient,
+used until the app is loaded, and the I/O engine that tkey-fido uses
+after that. It runs checkonly and authenticate one at a time, then
+checkonly from several goroutines at once, and outputs their latency
+percentiles and throughput.`, progname)
+		le.Printf("%s\n\n%s", desc,
+			pflag.CommandLine.FlagUsagesWrapped(86))
+	}
+	pflag.Parse()
+
+	if pflag.NArg() > 0 {
+		le.Printf("Unexpected argument: %s\n\n", strings.Join(pflag.Args(), " "))
+		pflag.Usage()
+		os.Exit(2)
+	}
+
+	if helpOnly {
+		pflag.Usage()
+		os.Exit(0)
+	}
+
+	tkeyclient.SilenceLogging()
+
+	pty, err := fidoemu.OpenPTY()
+	if err != nil {
+		le.Printf("Failed to open pseudo terminal: %s\n", err)
+		os.Exit(1)
+	}
+
+	dev := fidoemu.New(fidoemu.WithLatency(latency), fidoemu.WithLineRate(lineRate))
+	go func() {
+		if err := dev.Serve(pty); err != nil {
+			le.Printf("Serve failed: %s\n", err)
+			os.Exit(1)
+		}
+	}()
+
+	modes := []struct {
+		name string
+		open func(path string) (*tk1fido.Fido, error)
+	}{
+		{"blocking", openBlocking},
+		{"engine", openEngine},
+	}
+
+	fmt.Printf("%-10s %-20s %8s %12s %12s %12s %10s\n", "mode", "command", "n", "p50", "p95", "p99", "ops/s")
+	for _, mode := range modes {
+		fido, err := mode.open(pty.Path)
+		if err != nil {
+			le.Printf("%s: %s\n", mode.name, err)
+			os.Exit(1)
+		}
+
+		results, err := run(fido, iterations, concurrency)
+		fido.Close()
+		if err != nil {
+			le.Printf("%s: %s\n", mode.name, err)
+			os.Exit(1)
+		}
+
+		for _, r := range results {
+			printResult(mode.name, r)
+		}
+	}
+}
+
+func openBlocking(path string) (*tk1fido.Fido, error) {
+	tk := tkeyclient.New()
+	if err := tk.Connect(path); err != nil {
+		return nil, fmt.Errorf("Connect: %w", err)
+	}
+
+	return tk1fido.New(tk), nil
+}
+
+func openEngine(path string) (*tk1fido.Fido, error) {
+	port, err := serial.Open(path, &serial.Mode{BaudRate: tkeyclient.SerialSpeed})
+	if err != nil {
+		return nil, fmt.Errorf("serial.Open: %w", err)
+	}
+
+	return tk1fido.NewWithPort(port), nil
+}
+
+func run(fido *tk1fido.Fido, iterations int, concurrency int) ([]result, error) {
+	ctx := context.Background()
+	appliParam := sha256.Sum256([]byte("example.com"))
+
+	userPresence, kh, _, err := fido.U2FRegister(ctx, appliParam)
+	if err != nil {
+		return nil, fmt.Errorf("U2FRegister: %w", err)
+	}
+	if userPresence == 0 {
+		return nil, fmt.Errorf("U2FRegister: not touched")
+	}
+	keyHandle := *(*[64]byte)(kh)
+
+	checkOnly := func() error {
+		keyHandleValid, err := fido.U2FCheckOnly(ctx, appliParam, keyHandle)
+		if err != nil {
+			return fmt.Errorf("U2FCheckOnly: %w", err)
+		}
+		if !keyHandleValid {
+			return fmt.Errorf("U2FCheckOnly: keyhandle not valid")
+		}
+		return nil
+	}
+
+	var n uint32
+	authenticate := func() error {
+		n++
+		var challSeed [4]byte
+		binary.BigEndian.PutUint32(challSeed[:], n)
+		challParam := sha256.Sum256(challSeed[:])
+
+		keyHandleValid, _, _, err := fido.U2FAuthenticate(ctx, appliParam, challParam, keyHandle, false, n)
+		if err != nil {
+			return fmt.Errorf("U2FAuthenticate: %w", err)
+		}
+		if !keyHandleValid {
+			return fmt.Errorf("U2FAuthenticate: keyhandle not valid")
+		}
+		return nil
+	}
+
+	var results []result
+	for _, cmd := range []struct {
+		name        string
+		f           func() error
+		concurrency int
+	}{
+		{"checkonly", checkOnly, 1},
+		{"authenticate", authenticate, 1},
+		{fmt.Sprintf("checkonly x%d", concurrency), checkOnly, concurrency},
+	} {
+		r, err := measure(cmd.name, cmd.f, iterations, cmd.concurrency)
+		if err != nil {
+			return nil, err
+		}
+		results = append(results, r)
+	}
+
+	return results, nil
+}
+
+// measure runs f iterations times in total on concurrency goroutines.
+func measure(name string, f func() error, iterations int, concurrency int) (result, error) {
+	r := result{name: name}
+
+	var mu sync.Mutex
+	var firstErr error
+	var next int64
+	var wg sync.WaitGroup
+
+	start := time.Now()
+	for i := 0; i < concurrency; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+
+			for atomic.AddInt64(&next, 1) <= int64(iterations) {
+				t := time.Now()
+				err := f()
+				d := time.Since(t)
+
+				mu.Lock()
+				if err != nil && firstErr == nil {
+					firstErr = err
+				}
+				r.latencies = append(r.latencies, d)
+				mu.Unlock()
+
+				if err != nil {
+					return
+				}
+			}
+		}()
+	}
+	wg.Wait()
+	r.elapsed = time.Since(start)
+
+	return r, firstErr
+}
+
+func printResult(mode string, r result) {
+	sort.Slice(r.latencies, func(i, j int) bool { return r.latencies[i] < r.latencies[j] })
+
+	fmt.Printf("%-10s %-20s %8d %12s %12s %12s %10.1f\n", mode, r.name, len(r.latencies),
+		percentile(r.latencies, 50), percentile(r.latencies, 95), percentile(r.latencies, 99),
+		float64(len(r.latencies))/r.elapsed.Seconds())
+}
+
+// percentile by nearest rank of sorted latencies
+func percentile(sorted []time.Duration, p int) time.Duration {
+	i := (p*len(sorted)+99)/100 - 1
+	if i < 0 {
+		i = 0
+	}
+	return sorted[i].Round(time.Microsecond)
+}
@@ -0,0 +1,586 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"crypto/ecdsa"
+	"crypto/elliptic"
+	"encoding/hex"
+	"fmt"
+	"io"
+	"log"
+	"math/big"
+	"math/rand"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strconv"
+	"strings"
+
+	"github.com/spf13/pflag"
+)
+
+// Use when printing err/diag msgs
+var le = log.New(os.Stderr, "", 0)
+
+const progname = "tkey-fido-p256check"
+
+// Return values of p256-m
+const (
+	p256Success          = 0
+	p256RandomFailed     = -1
+	p256InvalidPubkey    = -2
+	p256InvalidPrivkey   = -3
+	p256InvalidSignature = -4
+)
+
+// Requests sent to each backend at a time
+const batchSize = 256
+
+var (
+	curve  = elliptic.P256()
+	params = curve.Params()
+)
+
+// testCase is a request to p256check and what the response must be.
+type testCase struct {
+	op      string
+	request string
+	// want is the expected response. Only the return value is
+	// compared if it's not 0.
+	want string
+}
+
+type backend struct {
+	name string
+	cmd  *exec.Cmd
+	in   io.WriteCloser
+	out  *bufio.Reader
+	// Mismatches by op
+	failures map[string]int
+}
+
+func main() {
+	var iterations int
+	var seed int64
+	var maxFailures int
+	var helpOnly bool
+	pflag.CommandLine.SetOutput(os.Stderr)
+	pflag.CommandLine.SortFlags = false
+	pflag.IntVar(&iterations, "iterations", 10000,
+		"Run `N` random inputs through each of keypair, sign, verify and ECDH, after the edge cases.")
+	pflag.Int64Var(&seed, "seed", 1,
+		"Seed the random inputs with `N`, to reproduce a run.")
+	pflag.IntVar(&maxFailures, "max-failures", 10,
+		"Output at most `N` mismatches per backend.")
+	pflag.BoolVar(&helpOnly, "help", false, "Output this help.")
+	pflag.Usage = func() {
+		desc := fmt.Sprintf(`Usage: %[1]s [flags...] P256CHECK...
+
+%[1]s runs edge cases and random inputs through p256-m's keypair,
+ECDSA sign and verify, and ECDH, in each P256CHECK (built from
+device-fido/host/p256check.c with a P256_BACKEND, by make p256-check).
+It checks every result against Go's crypto/ecdsa and crypto/elliptic,
+and outputs the mismatches and the time each backend spent on each
+operation. It exits non-zero if there was any mismatch.`, progname)
+		le.Printf("%s\n\n%s", desc,
+			pflag.CommandLine.FlagUsagesWrapped(86))
+	}
+	pflag.Parse()
+
+	if helpOnly {
+		pflag.Usage()
+		os.Exit(0)
+	}
+
+	if pflag.NArg() == 0 {
+		le.Printf("Pass at least one P256CHECK.\n\n")
+		pflag.Usage()
+		os.Exit(2)
+	}
+
+	var backends []*backend
+	for _, path := range pflag.Args() {
+		b, err := startBackend(path)
+		if err != nil {
+			le.Printf("Failed to start %s: %s\n", path, err)
+			os.Exit(1)
+		}
+		backends = append(backends, b)
+	}
+
+	rnd := rand.New(rand.NewSource(seed))
+	edge := edgeCases()
+	remaining := len(edge) + 4*iterations
+	shown := make(map[*backend]int)
+
+	for i := 0; remaining > 0; {
+		batch := make([]testCase, 0, batchSize)
+		for len(batch) < batchSize && remaining > 0 {
+			if len(edge) > 0 {
+				batch = append(batch, edge[0])
+				edge = edge[1:]
+			} else {
+				batch = append(batch, randomCase(rnd, i%4))
+				i++
+			}
+			remaining--
+		}
+
+		for _, b := range backends {
+			responses, err := b.run(batch)
+			if err != nil {
+				le.Printf("%s: %s\n", b.name, err)
+				os.Exit(1)
+			}
+
+			for j, tc := range batch {
+				if matches(responses[j], tc.want) {
+					continue
+				}
+				b.failures[tc.op]++
+				if shown[b] < maxFailures {
+					shown[b]++
+					fmt.Printf("%s: MISMATCH %s\n  request: %s\n  got:     %s\n  want:    %s\n",
+						b.name, tc.op, tc.request, responses[j], tc.want)
+				}
+			}
+		}
+	}
+
+	failed := false
+	fmt.Printf("%-12s %-8s %10s %10s %14s\n", "backend", "op", "n", "mismatch", "ns/op")
+	for _, b := range backends {
+		timing, err := b.timing()
+		if err != nil {
+			le.Printf("%s: %s\n", b.name, err)
+			os.Exit(1)
+		}
+		for _, t := range timing {
+			var nsPerOp float64
+			if t.n > 0 {
+				nsPerOp = float64(t.ns) / float64(t.n)
+			}
+			fmt.Printf("%-12s %-8s %10d %10d %14.0f\n", b.name, t.op, t.n, b.failures[t.op], nsPerOp)
+			if b.failures[t.op] > 0 {
+				failed = true
+			}
+		}
+		b.close()
+	}
+
+	if failed {
+		os.Exit(1)
+	}
+}
+
+func startBackend(path string) (*backend, error) {
+	cmd := exec.Command(path)
+	cmd.Stderr = os.Stderr
+
+	in, err := cmd.StdinPipe()
+	if err != nil {
+		return nil, fmt.Errorf("StdinPipe: %w", err)
+	}
+	out, err := cmd.StdoutPipe()
+	if err != nil {
+		return nil, fmt.Errorf("StdoutPipe: %w", err)
+	}
+	if err = cmd.Start(); err != nil {
+		return nil, fmt.Errorf("Start: %w", err)
+	}
+
+	return &backend{
+		name:     strings.TrimPrefix(filepath.Base(path), "p256check-"),
+		cmd:      cmd,
+		in:       in,
+		out:      bufio.NewReader(out),
+		failures: make(map[string]int),
+	}, nil
+}
+
+// run sends the requests of batch and returns the responses.
+func (b *backend) run(batch []testCase) ([]string, error) {
+	var requests bytes.Buffer
+	for _, tc := range batch {
+		requests.WriteString(tc.request)
+		requests.WriteByte('\n')
+	}
+
+	// Write while reading, so neither pipe fills up
+	written := make(chan error, 1)
+	go func() {
+		_, err := b.in.Write(requests.Bytes())
+		written <- err
+	}()
+
+	responses := make([]string, 0, len(batch))
+	for range batch {
+		line, err := b.out.ReadString('\n')
+		if err != nil {
+			return nil, fmt.Errorf("ReadString: %w", err)
+		}
+		responses = append(responses, strings.TrimSuffix(line, "\n"))
+	}
+
+	if err := <-written; err != nil {
+		return nil, fmt.Errorf("Write: %w", err)
+	}
+
+	return responses, nil
+}
+
+type opTiming struct {
+	op string
+	n  int64
+	ns int64
+}
+
+// timing returns the time spent in each operation, measured in the
+// backend itself.
+func (b *backend) timing() ([]opTiming, error) {
+	responses, err := b.run([]testCase{{request: "t"}})
+	if err != nil {
+		return nil, err
+	}
+
+	fields := strings.Fields(responses[0])
+	if len(fields)%3 != 0 {
+		return nil, fmt.Errorf("bad timing response: %s", responses[0])
+	}
+
+	var timing []opTiming
+	for i := 0; i < len(fields); i += 3 {
+		n, err := strconv.ParseInt(fields[i+1], 10, 64)
+		if err != nil {
+			return nil, fmt.Errorf("ParseInt: %w", err)
+		}
+		ns, err := strconv.ParseInt(fields[i+2], 10, 64)
+		if err != nil {
+			return nil, fmt.Errorf("ParseInt: %w", err)
+		}
+		timing = append(timing, opTiming{fields[i], n, ns})
+	}
+
+	return timing, nil
+}
+
+func (b *backend) close() {
+	b.in.Close()
+	if err := b.cmd.Wait(); err != nil {
+		le.Printf("%s: Wait: %s\n", b.name, err)
+	}
+}
+
+// matches tells if a response is the one wanted. For failures, only
+// the return value is compared, as the output is undefined then.
+func matches(got, want string) bool {
+	if strings.HasPrefix(want, "0") {
+		return got == want
+	}
+
+	ret, _, _ := strings.Cut(got, " ")
+	return ret == want
+}
+
+// edgeCases are the inputs at the limits of the ranges p256-m checks,
+// and those where the arithmetic is most likely to carry wrongly.
+func edgeCases() []testCase {
+	n := params.N
+	one := big.NewInt(1)
+	scalars := []*big.Int{
+		big.NewInt(0), one, big.NewInt(2), big.NewInt(3),
+		new(big.Int).Sub(n, big.NewInt(2)), new(big.Int).Sub(n, one), n,
+		new(big.Int).Add(n, one), new(big.Int).Sub(params.P, one), params.P,
+		new(big.Int).Lsh(one, 255),
+		new(big.Int).Sub(new(big.Int).Lsh(one, 256), one),
+		new(big.Int).Sub(new(big.Int).Lsh(one, 128), one),
+		new(big.Int).Lsh(one, 224),
+	}
+
+	var cases []testCase
+	for _, s := range scalars {
+		cases = append(cases, keypairCase(bytes32(s)))
+	}
+
+	hashes := [][]byte{
+		{1}, bytes32(big.NewInt(0)), bytes32(n), bytes32(new(big.Int).Add(n, one)),
+		bytes32(new(big.Int).Sub(new(big.Int).Lsh(one, 256), one)),
+		bytes.Repeat([]byte{0xff}, 48), bytes.Repeat([]byte{0xab}, 64),
+	}
+	priv := bytes32(big.NewInt(0x1234567))
+	for _, k := range scalars {
+		for _, h := range hashes {
+			cases = append(cases, signCase(priv, h, bytes32(k)))
+		}
+		cases = append(cases, signCase(bytes32(k), hashes[5], bytes32(big.NewInt(0x7654321))))
+	}
+
+	// Signatures with r and s at and around their limits, valid
+	// ones, and public keys off the curve or out of range
+	sig, pub := validSignature(priv, hashes[5], bytes32(big.NewInt(42)))
+	for _, s := range scalars {
+		withR := append(bytes32(s), sig[32:]...)
+		withS := append(append([]byte{}, sig[:32]...), bytes32(s)...)
+		cases = append(cases, verifyCase(withR, pub, hashes[5]), verifyCase(withS, pub, hashes[5]))
+	}
+	for _, h := range hashes {
+		sig, pub := validSignature(priv, h, bytes32(big.NewInt(43)))
+		cases = append(cases, verifyCase(sig, pub, h))
+	}
+	badPubs := [][]byte{
+		make([]byte, 64),
+		append(bytes32(params.Gx), bytes32(new(big.Int).Add(params.Gy, one))...),
+		append(bytes32(new(big.Int).Add(params.Gx, params.P)), bytes32(params.Gy)...),
+		append(bytes32(params.Gx), bytes32(new(big.Int).Add(params.Gy, params.P))...),
+		append(bytes32(params.P), bytes32(params.P)...),
+	}
+	for _, p := range badPubs {
+		cases = append(cases, verifyCase(sig, p, hashes[5]), ecdhCase(priv, p))
+	}
+
+	// A signature by u1 * G + u2 * Q where u1 * G == -(u2 * Q), so
+	// the sum is the point at infinity
+	cases = append(cases, infinityCase())
+
+	for _, s := range scalars {
+		cases = append(cases, ecdhCase(bytes32(s), pub))
+	}
+
+	return cases
+}
+
+// randomCase returns a random case of one of the 4 operations. Most
+// inputs are valid, as those go through all the arithmetic.
+func randomCase(rnd *rand.Rand, op int) testCase {
+	priv := randomScalar(rnd)
+
+	switch op {
+	case 0:
+		return keypairCase(priv)
+	case 1:
+		hash := make([]byte, 32)
+		rnd.Read(hash)
+		return signCase(priv, hash, randomScalar(rnd))
+	case 2:
+		hash := make([]byte, 32)
+		rnd.Read(hash)
+		sig, pub := validSignature(priv, hash, randomScalar(rnd))
+		// Break every other signature in one bit of r, s, the
+		// hash or the public key
+		if rnd.Intn(2) == 0 {
+			bit := rnd.Intn(8 * (64 + 32 + 64))
+			switch {
+			case bit < 8*64:
+				sig[bit/8] ^= 1 << (bit % 8)
+			case bit < 8*(64+32):
+				bit -= 8 * 64
+				hash[bit/8] ^= 1 << (bit % 8)
+			default:
+				bit -= 8 * (64 + 32)
+				pub[bit/8] ^= 1 << (bit % 8)
+			}
+		}
+		return verifyCase(sig, pub, hash)
+	default:
+		peer, _ := publicKey(randomScalar(rnd))
+		return ecdhCase(priv, peer)
+	}
+}
+
+func randomScalar(rnd *rand.Rand) []byte {
+	for {
+		b := make([]byte, 32)
+		rnd.Read(b)
+		if s := new(big.Int).SetBytes(b); s.Sign() > 0 && s.Cmp(params.N) < 0 {
+			return b
+		}
+	}
+}
+
+func keypairCase(priv []byte) testCase {
+	tc := testCase{op: "keypair", request: "k " + hex.EncodeToString(priv)}
+
+	pub, ok := publicKey(priv)
+	if !ok {
+		tc.want = strconv.Itoa(p256InvalidPrivkey)
+		return tc
+	}
+	tc.want = "0 " + hex.EncodeToString(pub)
+
+	return tc
+}
+
+func signCase(priv, hash, k []byte) testCase {
+	tc := testCase{
+		op:      "sign",
+		request: fmt.Sprintf("s %x %x %x", priv, hash, k),
+	}
+
+	sig, ret := sign(priv, hash, k)
+	if ret != p256Success {
+		tc.want = strconv.Itoa(ret)
+		return tc
+	}
+
+	// Also check our reference against crypto/ecdsa
+	pub, _ := publicKey(priv)
+	if !verify(sig, pub, hash) {
+		le.Printf("Reference signature did not verify with crypto/ecdsa: %s\n", tc.request)
+		os.Exit(1)
+	}
+	tc.want = "0 " + hex.EncodeToString(sig)
+
+	return tc
+}
+
+func verifyCase(sig, pub, hash []byte) testCase {
+	tc := testCase{
+		op:      "verify",
+		request: fmt.Sprintf("v %x %x %x", sig, pub, hash),
+		want:    strconv.Itoa(p256InvalidSignature),
+	}
+
+	if verify(sig, pub, hash) {
+		tc.want = "0"
+	} else if !onCurve(pub) && inRange(sig[:32]) && inRange(sig[32:]) {
+		tc.want = strconv.Itoa(p256InvalidPubkey)
+	}
+
+	return tc
+}
+
+func ecdhCase(priv, peer []byte) testCase {
+	tc := testCase{op: "ecdh", request: fmt.Sprintf("e %x %x", priv, peer)}
+
+	switch {
+	case !inRange(priv):
+		tc.want = strconv.Itoa(p256InvalidPrivkey)
+	case !onCurve(peer):
+		tc.want = strconv.Itoa(p256InvalidPubkey)
+	default:
+		x, _ := curve.ScalarMult(new(big.Int).SetBytes(peer[:32]), new(big.Int).SetBytes(peer[32:]), priv)
+		tc.want = "0 " + hex.EncodeToString(bytes32(x))
+	}
+
+	return tc
+}
+
+// infinityCase is a verify where R = u1 * G + u2 * Q is the point at
+// infinity, which p256-m must reject.
+func infinityCase() testCase {
+	// With Q = G and e = -r mod n, u1 + u2 = (e + r) / s = 0
+	priv := bytes32(big.NewInt(1))
+	pub, _ := publicKey(priv)
+	r := big.NewInt(5)
+	s := big.NewInt(7)
+	e := new(big.Int).Sub(params.N, r)
+	sig := append(bytes32(r), bytes32(s)...)
+
+	return verifyCase(sig, pub, bytes32(e))
+}
+
+// publicKey returns priv * G, or false if priv isn't in [1, n-1].
+func publicKey(priv []byte) ([]byte, bool) {
+	if !inRange(priv) {
+		return nil, false
+	}
+
+	x, y := curve.ScalarBaseMult(priv)
+	return append(bytes32(x), bytes32(y)...), true
+}
+
+// sign is ECDSA as p256-m does it, with the nonce k, and p256-m's
+// return value.
+func sign(priv, hash, k []byte) ([]byte, int) {
+	if !inRange(k) {
+		// p256-m asks for another nonce, which p256check doesn't have
+		return nil, p256RandomFailed
+	}
+
+	rx, _ := curve.ScalarBaseMult(k)
+	r := new(big.Int).Mod(rx, params.N)
+	if r.Sign() == 0 {
+		return nil, p256RandomFailed
+	}
+
+	if !inRange(priv) {
+		return nil, p256InvalidPrivkey
+	}
+
+	d := new(big.Int).SetBytes(priv)
+	kInv := new(big.Int).ModInverse(new(big.Int).SetBytes(k), params.N)
+	s := new(big.Int).Mul(r, d)
+	s.Add(s, hashToInt(hash))
+	s.Mul(s, kInv)
+	s.Mod(s, params.N)
+	if s.Sign() == 0 {
+		return nil, p256RandomFailed
+	}
+
+	return append(bytes32(r), bytes32(s)...), p256Success
+}
+
+// validSignature returns a signature by priv, with the nonce k, and
+// its public key.
+func validSignature(priv, hash, k []byte) ([]byte, []byte) {
+	sig, ret := sign(priv, hash, k)
+	if ret != p256Success {
+		le.Printf("Failed to sign with %x: %d\n", priv, ret)
+		os.Exit(1)
+	}
+	pub, _ := publicKey(priv)
+
+	return sig, pub
+}
+
+// verify is crypto/ecdsa's verdict on the signature.
+func verify(sig, pub, hash []byte) bool {
+	key := &ecdsa.PublicKey{
+		Curve: curve,
+		X:     new(big.Int).SetBytes(pub[:32]),
+		Y:     new(big.Int).SetBytes(pub[32:]),
+	}
+	if !onCurve(pub) {
+		// Newer Go panics on points off the curve
+		return false
+	}
+
+	return ecdsa.Verify(key, hash, new(big.Int).SetBytes(sig[:32]), new(big.Int).SetBytes(sig[32:]))
+}
+
+// hashToInt is the hash as an integer mod n, as in crypto/ecdsa
+func hashToInt(hash []byte) *big.Int {
+	if len(hash) > 32 {
+		hash = hash[:32]
+	}
+
+	e := new(big.Int).SetBytes(hash)
+	return e.Mod(e, params.N)
+}
+
+// inRange tells if the scalar is in [1, n-1]
+func inRange(scalar []byte) bool {
+	s := new(big.Int).SetBytes(scalar)
+	return s.Sign() > 0 && s.Cmp(params.N) < 0
+}
+
+func onCurve(pub []byte) bool {
+	x := new(big.Int).SetBytes(pub[:32])
+	y := new(big.Int).SetBytes(pub[32:])
+	if x.Cmp(params.P) >= 0 || y.Cmp(params.P) >= 0 {
+		return false
+	}
+
+	return curve.IsOnCurve(x, y)
+}
+
+// bytes32 is x as 32 big-endian bytes, the lowest 256 bits of it.
+func bytes32(x *big.Int) []byte {
+	b := make([]byte, 32)
+	x = new(big.Int).And(x, new(big.Int).Sub(new(big.Int).Lsh(big.NewInt(1), 256), big.NewInt(1)))
+	return x.FillBytes(b)
+}
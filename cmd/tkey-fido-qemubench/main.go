@@ -0,0 +1,207 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"context"
+	"crypto/sha256"
+	"fmt"
+	"log"
+	"os"
+	"strings"
+
+	"github.com/spf13/pflag"
+	"github.com/tillitis/tkey-fido/internal/tk1fido"
+	"github.com/tillitis/tkeyclient"
+)
+
+// Use when printing err/diag msgs
+var le = log.New(os.Stderr, "", 0)
+
+const progname = "tkey-fido-qemubench"
+
+const (
+	wantFWName0 = "tk1 "
+	wantFWName1 = "mkdf"
+)
+
+type counters struct {
+	name    string
+	cycles  uint32
+	instret uint32
+}
+
+func main() {
+	var devPath, appPath string
+	var speed, rounds int
+	var noCounters, debug, helpOnly bool
+	pflag.CommandLine.SetOutput(os.Stderr)
+	pflag.CommandLine.SortFlags = false
+	pflag.StringVar(&devPath, "port", "",
+		"Set serial port device `PATH`, e.g. the pty of QEMU's chardev.")
+	pflag.IntVar(&speed, "speed", tkeyclient.SerialSpeed,
+		"Set serial port speed in `BPS` (bits per second).")
+	pflag.StringVar(&appPath, "app", "device-fido/app.bench.bin",
+		"Load the fido app built with -DBENCH from `FILE`, if the TKey is in firmware mode.")
+	pflag.IntVar(&rounds, "rounds", 1,
+		"Run checkonly and authenticate `N` times after the register, outputting the counters of each.")
+	pflag.BoolVar(&noCounters, "no-counters", false,
+		"Only run the commands, without asking for counters, on the app built without -DBENCH. It waits for touch, as on a TKey. For make pgo-profile.")
+	pflag.BoolVar(&debug, "debug", false, "Dump all frames sent to and received from the TKey on stderr.")
+	pflag.BoolVar(&helpOnly, "help", false, "Output this help.")
+	pflag.Usage = func() {
+		desc := fmt.Sprintf(`Usage: %[1]s --port PATH [flags...]
+
+%[1]s runs each command of the fido app once and outputs the cycles
+and instructions the app spent on it, as counted by the app itself. It
+needs the app built with -DBENCH (make device-fido/app.bench.bin), and
+is run by make bench-qemu. With --no-counters it only runs the commands,
+for make pgo-profile.`, progname)
+		le.Printf("%s\n\n%s", desc,
+			pflag.CommandLine.FlagUsagesWrapped(86))
+	}
+	pflag.Parse()
+
+	if pflag.NArg() > 0 {
+		le.Printf("Unexpected argument: %s\n\n", strings.Join(pflag.Args(), " "))
+		pflag.Usage()
+		os.Exit(2)
+	}
+
+	if helpOnly {
+		pflag.Usage()
+		os.Exit(0)
+	}
+
+	if devPath == "" {
+		le.Printf("Pass --port.\n\n")
+		pflag.Usage()
+		os.Exit(2)
+	}
+
+	if !debug {
+		tkeyclient.SilenceLogging()
+	}
+
+	tk := tkeyclient.New()
+	if err := tk.Connect(devPath, tkeyclient.WithSpeed(speed)); err != nil {
+		le.Printf("Failed to connect: %v\n", err)
+		os.Exit(1)
+	}
+
+	var options []func(*tk1fido.Fido)
+	if debug {
+		options = append(options, tk1fido.WithDebug())
+	}
+	fido := tk1fido.New(tk, options...)
+	defer fido.Close()
+
+	if err := loadApp(tk, appPath); err != nil {
+		le.Printf("%v\n", err)
+		fido.Close()
+		os.Exit(1)
+	}
+
+	results, err := bench(fido, rounds, !noCounters)
+	if err != nil {
+		le.Printf("%v\n", err)
+		fido.Close()
+		os.Exit(1)
+	}
+
+	for _, r := range results {
+		fmt.Printf("%s %d %d\n", r.name, r.cycles, r.instret)
+	}
+}
+
+func loadApp(tk *tkeyclient.TillitisKey, appPath string) error {
+	nameVer, err := tk.GetNameVersion()
+	if err != nil {
+		// Not answering as firmware, so hopefully the bench app
+		return nil
+	}
+	if nameVer.Name0 != wantFWName0 || nameVer.Name1 != wantFWName1 {
+		return nil
+	}
+
+	appBinary, err := os.ReadFile(appPath)
+	if err != nil {
+		return fmt.Errorf("ReadFile: %w", err)
+	}
+
+	le.Printf("Loading %s...\n", appPath)
+	if err = tk.LoadApp(appBinary, nil); err != nil {
+		return fmt.Errorf("LoadApp: %w", err)
+	}
+
+	return nil
+}
+
+// bench runs the commands of a register and rounds of checkonly and
+// authentication, each followed by asking for its counters if counted.
+// The bench app doesn't wait for touch.
+func bench(fido *tk1fido.Fido, rounds int, counted bool) ([]counters, error) {
+	var results []counters
+	ctx := context.Background()
+
+	measure := func(name string) error {
+		if !counted {
+			return nil
+		}
+		cycles, instret, err := fido.BenchCounters(ctx)
+		if err != nil {
+			return fmt.Errorf("BenchCounters after %s: %w", name, err)
+		}
+		results = append(results, counters{name, cycles, instret})
+		return nil
+	}
+
+	appliParam := sha256.Sum256([]byte("example.com"))
+	challParam := sha256.Sum256([]byte("challenge"))
+
+	_, keyHandle, _, err := fido.U2FRegister(ctx, appliParam)
+	if err != nil {
+		return nil, fmt.Errorf("U2FRegister: %w", err)
+	}
+	if len(keyHandle) != 64 {
+		return nil, fmt.Errorf("U2FRegister: no keyhandle")
+	}
+	if err = measure("register"); err != nil {
+		return nil, err
+	}
+
+	for i := 0; i < rounds; i++ {
+		var keyHandleValid bool
+		keyHandleValid, err = fido.U2FCheckOnly(ctx, appliParam, *(*[64]byte)(keyHandle))
+		if err != nil {
+			return nil, fmt.Errorf("U2FCheckOnly: %w", err)
+		}
+		if !keyHandleValid {
+			return nil, fmt.Errorf("U2FCheckOnly: keyhandle not valid")
+		}
+		if err = measure("checkonly"); err != nil {
+			return nil, err
+		}
+
+		if err = fido.U2FAuthenticateSet(ctx, appliParam, challParam); err != nil {
+			return nil, fmt.Errorf("U2FAuthenticateSet: %w", err)
+		}
+		if err = measure("authenticate-set"); err != nil {
+			return nil, err
+		}
+
+		keyHandleValid, _, _, err = fido.U2FAuthenticateGo(ctx, *(*[64]byte)(keyHandle), true, uint32(i+1))
+		if err != nil {
+			return nil, fmt.Errorf("U2FAuthenticateGo: %w", err)
+		}
+		if !keyHandleValid {
+			return nil, fmt.Errorf("U2FAuthenticateGo: keyhandle not valid")
+		}
+		if err = measure("authenticate-go"); err != nil {
+			return nil, err
+		}
+	}
+
+	return results, nil
+}
@@ -0,0 +1,347 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"crypto/sha256"
+	"errors"
+	"fmt"
+	"io"
+	"log"
+	"os"
+	"sort"
+	"time"
+
+	"github.com/spf13/pflag"
+	"github.com/tillitis/tkey-fido/internal/fidoemu"
+	"github.com/tillitis/tkey-fido/internal/tk1fido"
+	"github.com/tillitis/tkeyclient"
+	"go.bug.st/serial"
+)
+
+// Use when printing err/diag msgs
+var le = log.New(os.Stderr, "", 0)
+
+const progname = "tkey-fido-replay"
+
+// exchange is a command in the trace and the responses to it.
+type exchange struct {
+	stream    byte
+	command   string
+	tx        []byte
+	written   time.Time
+	responses [][]byte
+	lastRead  time.Time
+}
+
+func (ex *exchange) recorded() time.Duration {
+	return ex.lastRead.Sub(ex.written)
+}
+
+type stats struct {
+	recorded []time.Duration
+	replayed []time.Duration
+	differed int
+}
+
+func main() {
+	var devPath, seed string
+	var speed, lineRate, stream int
+	var timeout time.Duration
+	var realtime, helpOnly bool
+	pflag.CommandLine.SetOutput(os.Stderr)
+	pflag.CommandLine.SortFlags = false
+	pflag.StringVar(&devPath, "port", "",
+		"Replay to the fido app on serial port `PATH`, e.g. the pty of QEMU's chardev, instead of to a stand-in.")
+	pflag.IntVar(&speed, "speed", tkeyclient.SerialSpeed,
+		"Set serial port speed in `BPS` (bits per second).")
+	pflag.StringVar(&seed, "seed", "",
+		"Derive the secret of the stand-in from `STRING`, as tkey-fido-emu --seed does, so keyhandles in a trace recorded against it are valid.")
+	pflag.IntVar(&lineRate, "line-rate", 62500,
+		"Limit the serial line of the stand-in to `BPS` (bits per second). Use 0 for no limit.")
+	pflag.IntVar(&stream, "stream", -1,
+		"Only replay the frames of stream `N`, the Nth TKey found while recording. The default is all.")
+	pflag.BoolVar(&realtime, "realtime", false,
+		"Keep the time between commands as recorded, instead of sending each right after the responses to the one before.")
+	pflag.DurationVar(&timeout, "timeout", 15*time.Second,
+		"Give up waiting for a response after `DURATION`.")
+	pflag.BoolVar(&helpOnly, "help", false, "Output this help.")
+	pflag.Usage = func() {
+		desc := fmt.Sprintf(`Usage: %[1]s [flags...] FILE
+
+%[1]s sends the commands in the trace FILE, recorded by tkey-fido
+--trace, one at a time to the fido app, and reads as many responses as
+were recorded. It then outputs, per command, the latency percentiles
+as recorded and as replayed, and how many responses differed in header
+or status from those recorded.
+
+Keyhandles in the trace are only valid on the TKey and USS they were
+recorded with, so replaying on another makes checkonly and
+authenticate take the quick path for a bad keyhandle. The app must
+already be running on PATH. Without --port, a stand-in for a TKey
+running the app is used (Linux only).`, progname)
+		le.Printf("%s\n\n%s", desc,
+			pflag.CommandLine.FlagUsagesWrapped(86))
+	}
+	pflag.Parse()
+
+	if helpOnly {
+		pflag.Usage()
+		os.Exit(0)
+	}
+
+	if pflag.NArg() != 1 {
+		le.Printf("Pass the trace FILE.\n\n")
+		pflag.Usage()
+		os.Exit(2)
+	}
+
+	exchanges, incomplete, err := readTrace(pflag.Arg(0), stream)
+	if err != nil {
+		le.Printf("Failed to read trace: %s\n", err)
+		os.Exit(1)
+	}
+	if incomplete > 0 {
+		le.Printf("Skipping %d commands without responses in the trace\n", incomplete)
+	}
+
+	if devPath == "" {
+		devPath, err = startStandIn(seed, lineRate)
+		if err != nil {
+			le.Printf("Failed to start stand-in: %s\n", err)
+			os.Exit(1)
+		}
+	}
+
+	port, err := serial.Open(devPath, &serial.Mode{BaudRate: speed})
+	if err != nil {
+		le.Printf("Failed to open %s: %s\n", devPath, err)
+		os.Exit(1)
+	}
+
+	results, err := replay(port, exchanges, realtime, timeout)
+	port.Close()
+	if err != nil {
+		le.Printf("%s\n", err)
+		os.Exit(1)
+	}
+
+	printResults(results)
+}
+
+func startStandIn(seed string, lineRate int) (string, error) {
+	options := []func(*fidoemu.Device){
+		fidoemu.WithLineRate(lineRate),
+	}
+	if seed != "" {
+		options = append(options, fidoemu.WithSecret(sha256.Sum256([]byte(seed))))
+	}
+
+	pty, err := fidoemu.OpenPTY()
+	if err != nil {
+		return "", fmt.Errorf("OpenPTY: %w", err)
+	}
+
+	go func() {
+		if err := fidoemu.New(options...).Serve(pty); err != nil {
+			le.Printf("Serve failed: %s\n", err)
+			os.Exit(1)
+		}
+	}()
+
+	return pty.Path, nil
+}
+
+// readTrace returns the exchanges of the trace in the order their
+// commands were written, except those that got no response.
+func readTrace(path string, stream int) ([]*exchange, int, error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, 0, fmt.Errorf("Open: %w", err)
+	}
+	defer f.Close()
+
+	tr, err := tk1fido.NewTraceReader(f)
+	if err != nil {
+		return nil, 0, fmt.Errorf("NewTraceReader: %w", err)
+	}
+
+	var exchanges []*exchange
+	// The exchange in progress, by stream and frame ID
+	current := make(map[[2]int]*exchange)
+	for {
+		rec, err := tr.Next()
+		if errors.Is(err, io.EOF) {
+			break
+		}
+		if err != nil {
+			return nil, 0, fmt.Errorf("Next: %w", err)
+		}
+		if stream >= 0 && int(rec.Stream) != stream {
+			continue
+		}
+
+		key := [2]int{int(rec.Stream), tk1fido.FrameID(rec.Frame[0])}
+		if rec.Direction == tk1fido.Written {
+			ex := &exchange{
+				stream:  rec.Stream,
+				command: tk1fido.CommandName(rec.Frame[1]),
+				tx:      rec.Frame,
+				written: rec.Time,
+			}
+			exchanges = append(exchanges, ex)
+			current[key] = ex
+			continue
+		}
+
+		if ex := current[key]; ex != nil {
+			ex.responses = append(ex.responses, rec.Frame)
+			ex.lastRead = rec.Time
+		}
+	}
+
+	complete := exchanges[:0]
+	for _, ex := range exchanges {
+		if len(ex.responses) > 0 {
+			complete = append(complete, ex)
+		}
+	}
+
+	return complete, len(exchanges) - len(complete), nil
+}
+
+func replay(port serial.Port, exchanges []*exchange, realtime bool, timeout time.Duration) (map[string]*stats, error) {
+	results := make(map[string]*stats)
+	if len(exchanges) == 0 {
+		return results, nil
+	}
+
+	start := time.Now()
+	for i, ex := range exchanges {
+		if realtime {
+			time.Sleep(time.Until(start.Add(ex.written.Sub(exchanges[0].written))))
+		}
+
+		if _, err := port.Write(ex.tx); err != nil {
+			return nil, fmt.Errorf("Write: %w", err)
+		}
+		written := time.Now()
+
+		differed := false
+		for _, want := range ex.responses {
+			got, err := readFrame(port, written.Add(timeout))
+			if err != nil {
+				return nil, fmt.Errorf("%s (command %d in trace): %w", ex.command, i, err)
+			}
+			if !sameOutcome(got, want) {
+				differed = true
+			}
+			// No more responses after a bad status
+			if got[0]&0x04 != 0 || (len(got) >= 3 && got[2] != tkeyclient.StatusOK) {
+				break
+			}
+		}
+		replayed := time.Since(written)
+
+		s := results[ex.command]
+		if s == nil {
+			s = &stats{}
+			results[ex.command] = s
+		}
+		s.recorded = append(s.recorded, ex.recorded())
+		s.replayed = append(s.replayed, replayed)
+		if differed {
+			s.differed++
+		}
+	}
+
+	return results, nil
+}
+
+// readFrame reads a frame from port, giving up at deadline.
+func readFrame(port serial.Port, deadline time.Time) ([]byte, error) {
+	var hdr [1]byte
+	if err := readFull(port, hdr[:], deadline); err != nil {
+		return nil, err
+	}
+
+	frame := make([]byte, tk1fido.FrameLen(hdr[0]))
+	frame[0] = hdr[0]
+	if err := readFull(port, frame[1:], deadline); err != nil {
+		return nil, err
+	}
+
+	return frame, nil
+}
+
+func readFull(port serial.Port, buf []byte, deadline time.Time) error {
+	for len(buf) > 0 {
+		left := time.Until(deadline)
+		if left <= 0 {
+			return fmt.Errorf("timed out waiting for response")
+		}
+		if err := port.SetReadTimeout(left); err != nil {
+			return fmt.Errorf("SetReadTimeout: %w", err)
+		}
+
+		n, err := port.Read(buf)
+		if err != nil {
+			return fmt.Errorf("Read: %w", err)
+		}
+		buf = buf[n:]
+	}
+
+	return nil
+}
+
+// sameOutcome tells if two responses have the same frame header,
+// response code and status, as their data may differ between runs.
+func sameOutcome(a, b []byte) bool {
+	n := 3
+	if len(a) < n || len(b) < n {
+		n = 1
+	}
+	return len(a) == len(b) && string(a[:n]) == string(b[:n])
+}
+
+func printResults(results map[string]*stats) {
+	commands := make([]string, 0, len(results))
+	for cmd := range results {
+		commands = append(commands, cmd)
+	}
+	sort.Strings(commands)
+
+	fmt.Printf("%-22s %6s %11s %11s %11s %11s %11s %11s %8s\n", "command", "n",
+		"rec p50", "p50", "delta p50", "rec p95", "p95", "delta p95", "differed")
+	for _, cmd := range commands {
+		s := results[cmd]
+		sortDurations(s.recorded)
+		sortDurations(s.replayed)
+
+		recP50, p50 := percentile(s.recorded, 50), percentile(s.replayed, 50)
+		recP95, p95 := percentile(s.recorded, 95), percentile(s.replayed, 95)
+		fmt.Printf("%-22s %6d %11s %11s %11s %11s %11s %11s %8d\n", cmd, len(s.replayed),
+			recP50, p50, signed(p50-recP50), recP95, p95, signed(p95-recP95), s.differed)
+	}
+}
+
+func sortDurations(d []time.Duration) {
+	sort.Slice(d, func(i, j int) bool { return d[i] < d[j] })
+}
+
+func signed(d time.Duration) string {
+	if d > 0 {
+		return "+" + d.String()
+	}
+	return d.String()
+}
+
+// percentile by nearest rank of sorted latencies
+func percentile(sorted []time.Duration, p int) time.Duration {
+	i := (p*len(sorted)+99)/100 - 1
+	if i < 0 {
+		i = 0
+	}
+	return sorted[i].Round(time.Microsecond)
+}
@@ -0,0 +1,431 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"debug/elf"
+	"encoding/json"
+	"fmt"
+	"io"
+	"log"
+	"os"
+	"os/exec"
+	"regexp"
+	"sort"
+	"strconv"
+	"strings"
+
+	"github.com/spf13/pflag"
+)
+
+// Use when printing err/diag msgs
+var le = log.New(os.Stderr, "", 0)
+
+const progname = "tkey-fido-sampleprof"
+
+var (
+	// A translated block starts with "IN:", then has a line per
+	// instruction, starting with its address
+	inAsmStart = regexp.MustCompile(`^IN:`)
+	inAsmInsn  = regexp.MustCompile(`^0x([0-9a-f]+):\s`)
+	// An executed block: Trace CPU: HOSTPTR [CSBASE/PC/FLAGS/CFLAGS]
+	execTrace = regexp.MustCompile(`^Trace \d+: 0x[0-9a-f]+ \[[0-9a-f]+/([0-9a-f]+)/`)
+)
+
+// counts are how many times each instruction and each block ran.
+type counts struct {
+	insns  map[uint64]uint64
+	blocks map[uint64]uint64
+	// Instructions of the blocks translated, by their address, and
+	// the executions not yet added to insns
+	translated map[uint64][]uint64
+	pending    map[uint64]uint64
+}
+
+// A frame from llvm-symbolizer, innermost first
+type frame struct {
+	FunctionName  string
+	Line          int
+	StartLine     int
+	Discriminator int
+}
+
+type symbolized struct {
+	Address string
+	Symbol  []frame
+}
+
+// lineKey is a line offset from the start of the function, and its
+// discriminator.
+type lineKey struct {
+	offset        int
+	discriminator int
+}
+
+func (k lineKey) String() string {
+	if k.discriminator != 0 {
+		return fmt.Sprintf("%d.%d", k.offset, k.discriminator)
+	}
+	return strconv.Itoa(k.offset)
+}
+
+// function is a function in the profile, with the functions inlined
+// into it by call site.
+type function struct {
+	name    string
+	head    uint64
+	body    map[lineKey]uint64
+	inlined map[lineKey]map[string]*function
+}
+
+func newFunction(name string) *function {
+	return &function{
+		name:    name,
+		body:    make(map[lineKey]uint64),
+		inlined: make(map[lineKey]map[string]*function),
+	}
+}
+
+func main() {
+	var elfPath, logPath, symbolizer string
+	var helpOnly bool
+	pflag.CommandLine.SetOutput(os.Stderr)
+	pflag.CommandLine.SortFlags = false
+	pflag.StringVar(&elfPath, "elf", "",
+		"Attribute the instructions to the functions and lines of the app in ELF `FILE`, built with -g.")
+	pflag.StringVar(&logPath, "log", "-",
+		"Read the QEMU log from `FILE`, which may be a FIFO. The default is stdin.")
+	pflag.StringVar(&symbolizer, "symbolizer", "llvm-symbolizer",
+		"Run `PROGRAM` to symbolize addresses.")
+	pflag.BoolVar(&helpOnly, "help", false, "Output this help.")
+	pflag.Usage = func() {
+		desc := fmt.Sprintf(`Usage: %[1]s --elf FILE [flags...]
+
+%[1]s reads the log of QEMU run with -d in_asm,exec,nochain, counts
+how many times each instruction of the app in the ELF FILE ran, and
+outputs that as a clang sample profile (text format), for
+-fprofile-sample-use. As the counts are exact, rather than sampled,
+each line's count is how many times its most run instruction ran. It
+is run by tools/pgo-profile.`, progname)
+		le.Printf("%s\n\n%s", desc,
+			pflag.CommandLine.FlagUsagesWrapped(86))
+	}
+	pflag.Parse()
+
+	if helpOnly {
+		pflag.Usage()
+		os.Exit(0)
+	}
+
+	if elfPath == "" || pflag.NArg() > 0 {
+		pflag.Usage()
+		os.Exit(2)
+	}
+
+	text, entries, err := readELF(elfPath)
+	if err != nil {
+		le.Printf("Failed to read %s: %s\n", elfPath, err)
+		os.Exit(1)
+	}
+
+	in := os.Stdin
+	if logPath != "-" {
+		if in, err = os.Open(logPath); err != nil {
+			le.Printf("Failed to open log: %s\n", err)
+			os.Exit(1)
+		}
+		defer in.Close()
+	}
+
+	c, err := readLog(in, text)
+	if err != nil {
+		le.Printf("Failed to read log: %s\n", err)
+		os.Exit(1)
+	}
+	if len(c.insns) == 0 {
+		le.Printf("No instructions of %s ran\n", elfPath)
+		os.Exit(1)
+	}
+
+	frames, err := symbolize(symbolizer, elfPath, c.insns)
+	if err != nil {
+		le.Printf("Failed to symbolize: %s\n", err)
+		os.Exit(1)
+	}
+
+	functions := profile(c, frames, entries)
+	w := bufio.NewWriter(os.Stdout)
+	write(w, functions)
+	if err = w.Flush(); err != nil {
+		le.Printf("Failed to write profile: %s\n", err)
+		os.Exit(1)
+	}
+}
+
+type addrRange struct {
+	start, end uint64
+}
+
+// readELF returns the address ranges of the executable sections, and
+// the entry address of each function.
+func readELF(path string) ([]addrRange, map[string]uint64, error) {
+	f, err := elf.Open(path)
+	if err != nil {
+		return nil, nil, fmt.Errorf("elf.Open: %w", err)
+	}
+	defer f.Close()
+
+	var text []addrRange
+	for _, s := range f.Sections {
+		if s.Flags&elf.SHF_EXECINSTR != 0 {
+			text = append(text, addrRange{s.Addr, s.Addr + s.Size})
+		}
+	}
+
+	syms, err := f.Symbols()
+	if err != nil {
+		return nil, nil, fmt.Errorf("Symbols: %w", err)
+	}
+	entries := make(map[string]uint64)
+	for _, sym := range syms {
+		if elf.ST_TYPE(sym.Info) == elf.STT_FUNC {
+			entries[sym.Name] = sym.Value
+		}
+	}
+
+	return text, entries, nil
+}
+
+func inRanges(ranges []addrRange, addr uint64) bool {
+	for _, r := range ranges {
+		if addr >= r.start && addr < r.end {
+			return true
+		}
+	}
+	return false
+}
+
+// readLog counts the executions of the blocks in text, and of their
+// instructions.
+func readLog(r io.Reader, text []addrRange) (*counts, error) {
+	c := &counts{
+		insns:      make(map[uint64]uint64),
+		blocks:     make(map[uint64]uint64),
+		translated: make(map[uint64][]uint64),
+		pending:    make(map[uint64]uint64),
+	}
+
+	// Add the executions of a block to its instructions, before it's
+	// translated again, possibly differently
+	flush := func(pc uint64) {
+		for _, insn := range c.translated[pc] {
+			c.insns[insn] += c.pending[pc]
+		}
+		delete(c.pending, pc)
+	}
+
+	var block []uint64
+	endBlock := func() {
+		if len(block) > 0 && inRanges(text, block[0]) {
+			flush(block[0])
+			c.translated[block[0]] = block
+		}
+		block = nil
+	}
+
+	s := bufio.NewScanner(r)
+	s.Buffer(make([]byte, 64*1024), 1024*1024)
+	inBlock := false
+	for s.Scan() {
+		line := s.Bytes()
+
+		if m := execTrace.FindSubmatch(line); m != nil {
+			if inBlock {
+				endBlock()
+				inBlock = false
+			}
+			pc, err := strconv.ParseUint(string(m[1]), 16, 64)
+			if err != nil {
+				return nil, fmt.Errorf("ParseUint: %w", err)
+			}
+			if inRanges(text, pc) {
+				c.blocks[pc]++
+				c.pending[pc]++
+			}
+			continue
+		}
+
+		if inAsmStart.Match(line) {
+			endBlock()
+			inBlock = true
+			continue
+		}
+
+		if !inBlock {
+			continue
+		}
+		if m := inAsmInsn.FindSubmatch(line); m != nil {
+			addr, err := strconv.ParseUint(string(m[1]), 16, 64)
+			if err != nil {
+				return nil, fmt.Errorf("ParseUint: %w", err)
+			}
+			block = append(block, addr)
+		} else if len(bytes.TrimSpace(line)) == 0 {
+			endBlock()
+			inBlock = false
+		}
+	}
+	if err := s.Err(); err != nil {
+		return nil, fmt.Errorf("Scan: %w", err)
+	}
+	endBlock()
+
+	for pc := range c.pending {
+		flush(pc)
+	}
+
+	return c, nil
+}
+
+// symbolize returns the inlined frames of each instruction.
+func symbolize(symbolizer, elfPath string, insns map[uint64]uint64) (map[uint64][]frame, error) {
+	var addrs bytes.Buffer
+	for addr := range insns {
+		fmt.Fprintf(&addrs, "0x%x\n", addr)
+	}
+
+	cmd := exec.Command(symbolizer, "--obj="+elfPath, "--inlining", "--output-style=JSON")
+	cmd.Stdin = &addrs
+	cmd.Stderr = os.Stderr
+	out, err := cmd.Output()
+	if err != nil {
+		return nil, fmt.Errorf("%s: %w", symbolizer, err)
+	}
+
+	frames := make(map[uint64][]frame)
+	for _, line := range strings.Split(strings.TrimSpace(string(out)), "\n") {
+		var sym symbolized
+		if err = json.Unmarshal([]byte(line), &sym); err != nil {
+			return nil, fmt.Errorf("Unmarshal: %w", err)
+		}
+		addr, err := strconv.ParseUint(strings.TrimPrefix(sym.Address, "0x"), 16, 64)
+		if err != nil {
+			return nil, fmt.Errorf("ParseUint: %w", err)
+		}
+		frames[addr] = sym.Symbol
+	}
+
+	return frames, nil
+}
+
+// profile attributes the count of each instruction to its line in the
+// function it was inlined into, nested by call site.
+func profile(c *counts, frames map[uint64][]frame, entries map[string]uint64) map[string]*function {
+	functions := make(map[string]*function)
+
+	for addr, n := range c.insns {
+		fs := frames[addr]
+		if len(fs) == 0 || fs[len(fs)-1].FunctionName == "??" {
+			continue
+		}
+
+		outer := fs[len(fs)-1]
+		f := functions[outer.FunctionName]
+		if f == nil {
+			f = newFunction(outer.FunctionName)
+			f.head = c.blocks[entries[outer.FunctionName]]
+			functions[outer.FunctionName] = f
+		}
+
+		// Walk in to the innermost frame through the call sites
+		for i := len(fs) - 1; i > 0; i-- {
+			site := lineKey{fs[i].Line - fs[i].StartLine, fs[i].Discriminator}
+			callees := f.inlined[site]
+			if callees == nil {
+				callees = make(map[string]*function)
+				f.inlined[site] = callees
+			}
+			callee := callees[fs[i-1].FunctionName]
+			if callee == nil {
+				callee = newFunction(fs[i-1].FunctionName)
+				callees[fs[i-1].FunctionName] = callee
+			}
+			f = callee
+		}
+
+		line := lineKey{fs[0].Line - fs[0].StartLine, fs[0].Discriminator}
+		if n > f.body[line] {
+			f.body[line] = n
+		}
+	}
+
+	return functions
+}
+
+func (f *function) total() uint64 {
+	var total uint64
+	for _, n := range f.body {
+		total += n
+	}
+	for _, callees := range f.inlined {
+		for _, callee := range callees {
+			total += callee.total()
+		}
+	}
+	return total
+}
+
+// write outputs the profile in the text format of llvm-profdata, the
+// hottest functions first.
+func write(w io.Writer, functions map[string]*function) {
+	var fs []*function
+	for _, f := range functions {
+		fs = append(fs, f)
+	}
+	sort.Slice(fs, func(i, j int) bool { return fs[i].total() > fs[j].total() })
+
+	for _, f := range fs {
+		fmt.Fprintf(w, "%s:%d:%d\n", f.name, f.total(), f.head)
+		writeBody(w, f, 1)
+	}
+}
+
+func writeBody(w io.Writer, f *function, depth int) {
+	indent := strings.Repeat(" ", depth)
+
+	var lines []lineKey
+	for k := range f.body {
+		lines = append(lines, k)
+	}
+	for k := range f.inlined {
+		if _, ok := f.body[k]; !ok {
+			lines = append(lines, k)
+		}
+	}
+	sort.Slice(lines, func(i, j int) bool {
+		if lines[i].offset != lines[j].offset {
+			return lines[i].offset < lines[j].offset
+		}
+		return lines[i].discriminator < lines[j].discriminator
+	})
+
+	for _, k := range lines {
+		if n, ok := f.body[k]; ok {
+			fmt.Fprintf(w, "%s%s: %d\n", indent, k, n)
+		}
+
+		var names []string
+		for name := range f.inlined[k] {
+			names = append(names, name)
+		}
+		sort.Strings(names)
+		for _, name := range names {
+			callee := f.inlined[k][name]
+			fmt.Fprintf(w, "%s%s: %s:%d\n", indent, k, name, callee.total())
+			writeBody(w, callee, depth+1)
+		}
+	}
+}
@@ -0,0 +1,251 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"sync"
+	"time"
+
+	"github.com/psanford/ctapkey/sitesignatures"
+	"github.com/psanford/ctapkey/u2f"
+	"github.com/tillitis/tkey-fido/internal/ctaphid"
+)
+
+// A page or extension spamming requests must not keep the TKey from
+// the user's other logins, as each request may hold it for a touch
+// wait. So softHID only queues a few requests per origin (the U2F
+// application parameter, the hash of the RP ID with CTAP2), takes
+// them from the origins in turn, and rejects what it won't get to
+// soon, rather than letting them pile up.
+const (
+	hidMaxPending          = 16
+	hidMaxPendingPerOrigin = 4
+	// Requests per second, and the burst, accepted from an origin
+	hidOriginRate  = 20
+	hidOriginBurst = 40
+	// The browser has most likely given up on, or retried, a request
+	// that waited this long
+	hidMaxAge = 5 * time.Second
+	// Forget origins we haven't heard from in a while when we know
+	// this many
+	hidMaxOrigins = 256
+)
+
+// pendingRequest is a HID request waiting for the one being handled.
+type pendingRequest struct {
+	ev ctaphid.Event
+	// The decoded U2F request, nil for CTAPHID_CBOR
+	req      *u2f.AuthenticatorRequest
+	origin   [32]byte
+	received time.Time
+}
+
+// originState is an origin's token bucket and queued requests.
+type originState struct {
+	tokens float64
+	last   time.Time
+	queue  []*pendingRequest
+	// When we last rejected one of its requests
+	rejected time.Time
+}
+
+// flooding tells whether we rejected requests of the origin lately.
+func (o *originState) flooding(now time.Time) bool {
+	return !o.rejected.IsZero() && now.Sub(o.rejected) < hidMaxAge
+}
+
+// weight orders origins by how much of the queue they deserve to
+// lose: those we had to reject lately before any other, then those
+// with the most queued.
+func (o *originState) weight(now time.Time) int {
+	w := len(o.queue)
+	if o.flooding(now) {
+		w += hidMaxPendingPerOrigin + 1
+	}
+	return w
+}
+
+// admission is the queue of HID requests between the goroutine
+// reading them and the one handling them.
+type admission struct {
+	mu      sync.Mutex
+	origins map[[32]byte]*originState
+	// Origins with requests queued, in the order they get their turn
+	turns   [][32]byte
+	pending int
+	closed  bool
+	// Signalled when a request is queued or the queue closed
+	ready chan struct{}
+}
+
+func newAdmission() *admission {
+	return &admission{
+		origins: make(map[[32]byte]*originState),
+		ready:   make(chan struct{}, 1),
+	}
+}
+
+// admit queues p, or tells why not: "rate" if its origin is sending
+// too fast, "origin-queue" if its origin has too many queued already,
+// or "queue-full". When the queue is full, the newest request of the
+// origin with the most weight is rejected in favour of p instead, if
+// it has more than p's origin, so that a flood from many origins
+// doesn't crowd out the others. Such a request is returned as evicted
+// and must be answered as rejected too.
+func (a *admission) admit(p *pendingRequest) (evicted *pendingRequest, reason string) {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+
+	o := a.origin(p.origin, p.received)
+
+	switch {
+	case o.tokens < 1:
+		reason = "rate"
+	case len(o.queue) >= hidMaxPendingPerOrigin:
+		reason = "origin-queue"
+	case a.pending >= hidMaxPending:
+		evicted = a.evict(o.weight(p.received), p.received)
+		if evicted == nil {
+			reason = "queue-full"
+		}
+	}
+	if reason != "" {
+		if !o.flooding(p.received) {
+			le.Printf("Rejecting HID requests from site=%s (%s)\n",
+				sitesignatures.FromAppParam(p.origin), reason)
+		}
+		o.rejected = p.received
+		return nil, reason
+	}
+
+	o.tokens--
+	if len(o.queue) == 0 {
+		a.turns = append(a.turns, p.origin)
+	}
+	o.queue = append(o.queue, p)
+	a.pending++
+
+	select {
+	case a.ready <- struct{}{}:
+	default:
+	}
+
+	return evicted, ""
+}
+
+// origin returns the state of origin, with its bucket refilled for
+// the time since it was last seen.
+func (a *admission) origin(origin [32]byte, now time.Time) *originState {
+	o := a.origins[origin]
+	if o == nil {
+		if len(a.origins) >= hidMaxOrigins {
+			a.forgetIdle(now)
+		}
+		o = &originState{tokens: hidOriginBurst, last: now}
+		a.origins[origin] = o
+		return o
+	}
+
+	o.tokens += now.Sub(o.last).Seconds() * hidOriginRate
+	if o.tokens > hidOriginBurst {
+		o.tokens = hidOriginBurst
+	}
+	o.last = now
+
+	return o
+}
+
+// forgetIdle forgets the origins with nothing queued, a full bucket
+// and no recent rejections, which are just like origins never seen.
+func (a *admission) forgetIdle(now time.Time) {
+	for origin, o := range a.origins {
+		refilled := o.tokens + now.Sub(o.last).Seconds()*hidOriginRate
+		if len(o.queue) == 0 && refilled >= hidOriginBurst && !o.flooding(now) {
+			delete(a.origins, origin)
+		}
+	}
+}
+
+// evict removes the newest request of the origin with the most
+// weight, if it has more than weight.
+func (a *admission) evict(weight int, now time.Time) *pendingRequest {
+	turn := -1
+	var longest *originState
+	for i, origin := range a.turns {
+		if o := a.origins[origin]; longest == nil || o.weight(now) > longest.weight(now) {
+			turn = i
+			longest = o
+		}
+	}
+	if longest == nil || longest.weight(now) <= weight {
+		return nil
+	}
+
+	p := longest.queue[len(longest.queue)-1]
+	longest.queue = longest.queue[:len(longest.queue)-1]
+	if len(longest.queue) == 0 {
+		a.turns = append(a.turns[:turn], a.turns[turn+1:]...)
+	}
+	a.pending--
+
+	return p
+}
+
+// next waits for a queued request and returns the oldest of the origin
+// whose turn it is, skipping the turns of origins we had to reject
+// lately while others have requests queued. Returns false when the
+// queue is closed.
+func (a *admission) next() (*pendingRequest, bool) {
+	for {
+		a.mu.Lock()
+		if len(a.turns) > 0 {
+			now := time.Now()
+			turn := 0
+			for i, origin := range a.turns {
+				if !a.origins[origin].flooding(now) {
+					turn = i
+					break
+				}
+			}
+			origin := a.turns[turn]
+			a.turns = append(a.turns[:turn], a.turns[turn+1:]...)
+			o := a.origins[origin]
+			p := o.queue[0]
+			o.queue = o.queue[1:]
+			if len(o.queue) > 0 {
+				a.turns = append(a.turns, origin)
+			}
+			a.pending--
+			a.mu.Unlock()
+
+			return p, true
+		}
+		closed := a.closed
+		a.mu.Unlock()
+
+		if closed {
+			return nil, false
+		}
+		<-a.ready
+	}
+}
+
+// close makes next return false once the queue is empty.
+func (a *admission) close() {
+	a.mu.Lock()
+	a.closed = true
+	a.mu.Unlock()
+
+	select {
+	case a.ready <- struct{}{}:
+	default:
+	}
+}
+
+func (a *admission) len() int {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+
+	return a.pending
+}
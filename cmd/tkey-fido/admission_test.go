@@ -0,0 +1,168 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"testing"
+	"time"
+)
+
+func originOf(b byte) [32]byte {
+	return [32]byte{b}
+}
+
+// mustAdmit queues a request from origin, failing the test if it's
+// rejected or another is evicted.
+func mustAdmit(t *testing.T, a *admission, origin [32]byte, now time.Time) *pendingRequest {
+	t.Helper()
+
+	p := &pendingRequest{origin: origin, received: now}
+	evicted, reason := a.admit(p)
+	if reason != "" || evicted != nil {
+		t.Fatalf("origin %x: rejected (%q), evicted %v", origin[0], reason, evicted)
+	}
+	return p
+}
+
+func mustNext(t *testing.T, a *admission, want *pendingRequest) {
+	t.Helper()
+
+	p, ok := a.next()
+	if !ok {
+		t.Fatalf("queue closed")
+	}
+	if p != want {
+		t.Fatalf("got request of origin %x received %v, want origin %x received %v",
+			p.origin[0], p.received, want.origin[0], want.received)
+	}
+}
+
+func TestAdmissionOriginQueue(t *testing.T) {
+	t.Parallel()
+
+	a := newAdmission()
+	now := time.Now()
+
+	for i := 0; i < hidMaxPendingPerOrigin; i++ {
+		mustAdmit(t, a, originOf(1), now)
+	}
+	if _, reason := a.admit(&pendingRequest{origin: originOf(1), received: now}); reason != "origin-queue" {
+		t.Fatalf("request over the origin's cap: got %q, want origin-queue", reason)
+	}
+
+	// Other origins are not held back by it
+	mustAdmit(t, a, originOf(2), now)
+	if n := a.len(); n != hidMaxPendingPerOrigin+1 {
+		t.Fatalf("%d pending, want %d", n, hidMaxPendingPerOrigin+1)
+	}
+}
+
+func TestAdmissionRate(t *testing.T) {
+	t.Parallel()
+
+	a := newAdmission()
+	now := time.Now()
+
+	// A burst, taken off the queue as fast as it comes
+	for i := 0; i < hidOriginBurst; i++ {
+		mustNext(t, a, mustAdmit(t, a, originOf(1), now))
+	}
+	if _, reason := a.admit(&pendingRequest{origin: originOf(1), received: now}); reason != "rate" {
+		t.Fatalf("request over the burst: got %q, want rate", reason)
+	}
+
+	// Refilled at the rate
+	later := now.Add(time.Second)
+	for i := 0; i < hidOriginRate; i++ {
+		mustNext(t, a, mustAdmit(t, a, originOf(1), later))
+	}
+	if _, reason := a.admit(&pendingRequest{origin: originOf(1), received: later}); reason != "rate" {
+		t.Fatalf("request over the rate: got %q, want rate", reason)
+	}
+}
+
+func TestAdmissionShedding(t *testing.T) {
+	t.Parallel()
+
+	a := newAdmission()
+	now := time.Now()
+
+	// Full, with one origin holding more than the rest
+	heavy := make([]*pendingRequest, 0, hidMaxPendingPerOrigin)
+	for i := 0; i < hidMaxPendingPerOrigin; i++ {
+		heavy = append(heavy, mustAdmit(t, a, originOf(1), now))
+	}
+	for i := hidMaxPendingPerOrigin; i < hidMaxPending; i++ {
+		mustAdmit(t, a, originOf(byte(i)), now)
+	}
+
+	// A new origin gets in at the cost of the newest of the heaviest
+	p := &pendingRequest{origin: originOf(0xff), received: now}
+	evicted, reason := a.admit(p)
+	if reason != "" || evicted != heavy[len(heavy)-1] {
+		t.Fatalf("request of a new origin: rejected (%q), evicted %v", reason, evicted)
+	}
+
+	// Evicted until it's no heavier than the others
+	for i := 0; i < hidMaxPendingPerOrigin-2; i++ {
+		evicted, reason = a.admit(&pendingRequest{origin: originOf(0xf0 + byte(i)), received: now})
+		if reason != "" || evicted != heavy[len(heavy)-2-i] {
+			t.Fatalf("request %d of a new origin: rejected (%q), evicted %v", i, reason, evicted)
+		}
+	}
+
+	// Nobody holds more than an origin already queued
+	if _, reason = a.admit(&pendingRequest{origin: originOf(hidMaxPendingPerOrigin), received: now}); reason != "queue-full" {
+		t.Fatalf("request with all origins equal: got %q, want queue-full", reason)
+	}
+	if n := a.len(); n != hidMaxPending {
+		t.Fatalf("%d pending, want %d", n, hidMaxPending)
+	}
+}
+
+func TestAdmissionTurns(t *testing.T) {
+	t.Parallel()
+
+	a := newAdmission()
+	now := time.Now()
+
+	var first []*pendingRequest
+	for i := 0; i < 3; i++ {
+		first = append(first, mustAdmit(t, a, originOf(1), now))
+	}
+	second := mustAdmit(t, a, originOf(2), now)
+
+	// Origins in turn, not in order received
+	mustNext(t, a, first[0])
+	mustNext(t, a, second)
+	mustNext(t, a, first[1])
+	mustNext(t, a, first[2])
+}
+
+func TestAdmissionFloodingLast(t *testing.T) {
+	t.Parallel()
+
+	a := newAdmission()
+	now := time.Now()
+
+	var flood []*pendingRequest
+	for i := 0; i < hidMaxPendingPerOrigin; i++ {
+		flood = append(flood, mustAdmit(t, a, originOf(1), now))
+	}
+	if _, reason := a.admit(&pendingRequest{origin: originOf(1), received: now}); reason == "" {
+		t.Fatalf("request over the origin's cap admitted")
+	}
+	other := mustAdmit(t, a, originOf(2), now)
+
+	// The origin we had to reject waits for the others
+	mustNext(t, a, other)
+	for _, p := range flood {
+		mustNext(t, a, p)
+	}
+
+	a.close()
+	if _, ok := a.next(); ok {
+		t.Fatalf("request after close")
+	}
+}
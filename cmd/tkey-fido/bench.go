@@ -0,0 +1,253 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"context"
+	"crypto/sha256"
+	"encoding/binary"
+	"fmt"
+	"sort"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// benchCredential is what we registered on a TKey to authenticate with
+// during the bench.
+type benchCredential struct {
+	devPath   string
+	keyHandle [64]byte
+	pubBytes  []byte
+}
+
+type benchResult struct {
+	mu        sync.Mutex
+	latencies map[string][]time.Duration
+	failures  []string
+}
+
+func (r *benchResult) add(cmd string, d time.Duration) {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+
+	r.latencies[cmd] = append(r.latencies[cmd], d)
+}
+
+func (r *benchResult) fail(format string, args ...interface{}) {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+
+	r.failures = append(r.failures, fmt.Sprintf(format, args...))
+}
+
+// sorted returns the latencies of cmd, sorted.
+func (r *benchResult) sorted(cmd string) []time.Duration {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+
+	latencies := r.latencies[cmd]
+	sort.Slice(latencies, func(i, j int) bool { return latencies[i] < latencies[j] })
+
+	return latencies
+}
+
+// benchTarget is what the bench sends checkonly and authenticate to.
+type benchTarget interface {
+	checkOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error)
+	// authenticate returns the counter that was signed, which is
+	// counter unless the target keeps its own
+	authenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, counter uint32) (bool, byte, uint32, []byte, error)
+}
+
+// poolTarget goes straight to the TKeys of the pool.
+type poolTarget struct {
+	s *fidoPool
+}
+
+func (t poolTarget) checkOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error) {
+	return t.s.u2fCheckOnly(ctx, appliParam, keyHandle)
+}
+
+func (t poolTarget) authenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, counter uint32) (bool, byte, uint32, []byte, error) {
+	keyHandleValid, userPresence, sigASN1, err := t.s.u2fAuthenticate(ctx, appliParam,
+		challParam, keyHandle, false, counter)
+	return keyHandleValid, userPresence, counter, sigASN1, err
+}
+
+// bench is test() as a load generator: after registering once on each
+// TKey of the pool, which needs a touch, it runs checkonly and
+// authenticate without checking user presence, iterations times or
+// for duration, on concurrency goroutines spread over the TKeys. Every
+// signature is verified. Returns false if anything failed.
+func bench(s *fidoPool, iterations int, duration time.Duration, concurrency int) bool {
+	defer s.closeNow()
+
+	ctx := context.Background()
+	appliParam := sha256.Sum256([]byte("example.com"))
+
+	devices, err := s.refresh()
+	if err != nil {
+		le.Printf("Failed to find TKeys: %v\n", err)
+		return false
+	}
+
+	result := benchResult{
+		latencies: make(map[string][]time.Duration),
+	}
+
+	var creds []benchCredential
+	for _, dev := range devices {
+		fmt.Printf("Register on %s, touch it...\n", dev.devPath)
+		start := time.Now()
+		userPresence, keyHandle, pubBytes, regErr := dev.u2fRegister(ctx, appliParam)
+		if regErr != nil {
+			le.Printf("U2FRegister on %s failed, leaving it out: %v\n", dev.devPath, regErr)
+			continue
+		}
+		if userPresence == 0 {
+			le.Printf("User not present, bailing out\n")
+			return false
+		}
+		result.add("register", time.Since(start))
+
+		cred := benchCredential{
+			devPath:   dev.devPath,
+			keyHandle: *(*[64]byte)(keyHandle),
+			pubBytes:  pubBytes,
+		}
+		s.remember(cred.keyHandle, dev)
+		creds = append(creds, cred)
+	}
+	if len(creds) == 0 {
+		le.Printf("Registered on no TKey, bailing out\n")
+		return false
+	}
+
+	if concurrency < 1 {
+		concurrency = len(creds)
+	}
+
+	// Each iteration gets its own counter and challenge
+	var next uint64
+	take := func() (uint64, bool) {
+		n := atomic.AddUint64(&next, 1)
+		if duration == 0 && n > uint64(iterations) {
+			return 0, false
+		}
+		return n, true
+	}
+
+	fmt.Printf("Running %d goroutines over %d TKeys...\n", concurrency, len(creds))
+
+	var wg sync.WaitGroup
+	start := time.Now()
+	deadline := start.Add(duration)
+	target := poolTarget{s}
+	for i := 0; i < concurrency; i++ {
+		wg.Add(1)
+		go func(cred benchCredential) {
+			defer wg.Done()
+
+			for {
+				if duration != 0 && time.Now().After(deadline) {
+					return
+				}
+				n, ok := take()
+				if !ok {
+					return
+				}
+				benchOnce(ctx, target, &result, appliParam, cred, n)
+			}
+		}(creds[i%len(creds)])
+	}
+	wg.Wait()
+	elapsed := time.Since(start)
+
+	printBench(&result, elapsed)
+
+	return len(result.failures) == 0
+}
+
+func benchOnce(ctx context.Context, target benchTarget, result *benchResult, appliParam [32]byte, cred benchCredential, n uint64) {
+	var challSeed [8]byte
+	binary.BigEndian.PutUint64(challSeed[:], n)
+	challParam := sha256.Sum256(challSeed[:])
+
+	start := time.Now()
+	keyHandleValid, err := target.checkOnly(ctx, appliParam, cred.keyHandle)
+	if err != nil {
+		result.fail("U2FCheckOnly on %s failed: %v", cred.devPath, err)
+		return
+	}
+	if !keyHandleValid {
+		result.fail("U2FCheckOnly on %s: keyhandle not valid", cred.devPath)
+		return
+	}
+	result.add("checkonly", time.Since(start))
+
+	start = time.Now()
+	keyHandleValid, userPresence, counter, sigASN1, err := target.authenticate(ctx, appliParam,
+		challParam, cred.keyHandle, uint32(n))
+	if err != nil {
+		result.fail("U2FAuthenticate on %s failed: %v", cred.devPath, err)
+		return
+	}
+	if !keyHandleValid {
+		result.fail("U2FAuthenticate on %s: keyhandle not valid", cred.devPath)
+		return
+	}
+	result.add("authenticate", time.Since(start))
+
+	if err = verifySignature(cred.pubBytes, appliParam, challParam, userPresence, counter, sigASN1); err != nil {
+		result.fail("Signature from %s did NOT verify: %v", cred.devPath, err)
+	}
+}
+
+// benchMaxFailures is how many failures printBench shows; the rest are
+// only counted.
+const benchMaxFailures = 10
+
+func printBench(result *benchResult, elapsed time.Duration) {
+	for i, failure := range result.failures {
+		if i == benchMaxFailures {
+			le.Printf("... and %d more failures\n", len(result.failures)-i)
+			break
+		}
+		le.Printf("%s\n", failure)
+	}
+
+	fmt.Printf("%-14s %8s %12s %12s %12s %10s\n", "command", "n", "p50", "p95", "p99", "ops/s")
+	for _, cmd := range []string{"register", "checkonly", "authenticate"} {
+		latencies := result.sorted(cmd)
+		if len(latencies) == 0 {
+			continue
+		}
+
+		// Register ran once per TKey before the clock started
+		throughput := "-"
+		if cmd != "register" {
+			throughput = fmt.Sprintf("%.1f", float64(len(latencies))/elapsed.Seconds())
+		}
+
+		fmt.Printf("%-14s %8d %12s %12s %12s %10s\n", cmd, len(latencies),
+			percentile(latencies, 50).Round(time.Microsecond),
+			percentile(latencies, 95).Round(time.Microsecond),
+			percentile(latencies, 99).Round(time.Microsecond),
+			throughput)
+	}
+
+	authenticated := len(result.latencies["authenticate"])
+	fmt.Printf("%d authentications in %s, %.1f/s, %d failures\n", authenticated,
+		elapsed.Round(time.Millisecond), float64(authenticated)/elapsed.Seconds(), len(result.failures))
+}
+
+// percentile by nearest rank of sorted latencies
+func percentile(sorted []time.Duration, p int) time.Duration {
+	i := (p*len(sorted)+99)/100 - 1
+	if i < 0 {
+		i = 0
+	}
+	return sorted[i]
+}
@@ -0,0 +1,315 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"context"
+	"crypto/sha256"
+	"encoding/binary"
+	"flag"
+	"fmt"
+	"os"
+	"path/filepath"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"github.com/psanford/ctapkey/statuscode"
+	"github.com/psanford/ctapkey/u2f"
+	"github.com/tillitis/tkey-fido/internal/counterstore"
+	"github.com/tillitis/tkey-fido/internal/fidoemu"
+	"github.com/tillitis/tkeyclient"
+)
+
+// The benchmarks register once, then run U2F checkonly and
+// authenticate without user presence on as many goroutines as -cpu
+// says, verifying every signature. They report latency percentiles
+// along with the time per authentication.
+//
+// They run against the stand-in of internal/fidoemu on a pseudo
+// terminal (Linux only), or with
+//
+//	go test -run - -bench . ./cmd/tkey-fido -args -tkey-port PATH
+//
+// against a TKey, which needs touching twice to register.
+var benchPort = flag.String("tkey-port", "",
+	"Run the benchmarks on the TKey at serial port `PATH` instead of on a stand-in.")
+
+// benchEnv is shared by the benchmarks, and set up on first use, so
+// that the TKey is only touched once for each way of registering.
+var benchEnv struct {
+	once sync.Once
+	err  error
+
+	pool     *fidoPool
+	poolCred benchCredential
+	token    *loopbackToken
+	hidCred  benchCredential
+	cleanup  []func()
+}
+
+var benchAppliParam = sha256.Sum256([]byte("example.com"))
+
+func TestMain(m *testing.M) {
+	flag.Parse()
+	code := m.Run()
+
+	for i := len(benchEnv.cleanup) - 1; i >= 0; i-- {
+		benchEnv.cleanup[i]()
+	}
+	os.Exit(code)
+}
+
+func setupBench(b *testing.B) {
+	b.Helper()
+
+	benchEnv.once.Do(func() {
+		benchEnv.err = setupBenchEnv()
+	})
+	if benchEnv.err != nil {
+		b.Skipf("No TKey to benchmark: %v", benchEnv.err)
+	}
+}
+
+func setupBenchEnv() error {
+	path := *benchPort
+	if path == "" {
+		pty, err := fidoemu.OpenPTY()
+		if err != nil {
+			return fmt.Errorf("no -tkey-port and no stand-in: %w", err)
+		}
+		benchEnv.cleanup = append(benchEnv.cleanup, func() { pty.Close() })
+
+		dev := fidoemu.New()
+		go func() {
+			_ = dev.Serve(pty)
+		}()
+		path = pty.Path
+	}
+
+	pool := newFidoPool(path, "", tkeyclient.SerialSpeed, false, "", "", false, false, os.Exit)
+	benchEnv.pool = pool
+	benchEnv.cleanup = append(benchEnv.cleanup, pool.closeNow)
+	ctx := context.Background()
+
+	le.Printf("Register on %s, touch it...\n", path)
+	userPresence, keyHandle, pubBytes, err := pool.u2fRegister(ctx, benchAppliParam)
+	if err != nil {
+		return fmt.Errorf("u2fRegister: %w", err)
+	}
+	if userPresence == 0 {
+		return fmt.Errorf("u2fRegister: user not present")
+	}
+	benchEnv.poolCred = benchCredential{devPath: path, keyHandle: *(*[64]byte)(keyHandle), pubBytes: pubBytes}
+
+	token, err := startLoopbackHID(ctx, pool)
+	if err != nil {
+		return err
+	}
+	benchEnv.token = token
+
+	client, err := token.client(ctx)
+	if err != nil {
+		return fmt.Errorf("client: %w", err)
+	}
+
+	le.Printf("Register through the soft HID, touch the TKey...\n")
+	keyHandle, pubBytes, err = client.u2fRegister(ctx, benchAppliParam, sha256.Sum256([]byte("register")))
+	if err != nil {
+		return fmt.Errorf("register: %w", err)
+	}
+	if len(keyHandle) != 64 {
+		return fmt.Errorf("register: keyhandle length was %d (expected 64)", len(keyHandle))
+	}
+	benchEnv.hidCred = benchCredential{devPath: "soft HID", keyHandle: *(*[64]byte)(keyHandle), pubBytes: pubBytes}
+
+	return nil
+}
+
+// startLoopbackHID runs softHID on the pool, with counters in a
+// temporary file, for clients in this process.
+func startLoopbackHID(ctx context.Context, s *fidoPool) (*loopbackToken, error) {
+	dir, err := os.MkdirTemp("", progname)
+	if err != nil {
+		return nil, fmt.Errorf("MkdirTemp: %w", err)
+	}
+
+	counters, err := counterstore.Open(filepath.Join(dir, "counters"))
+	if err != nil {
+		os.RemoveAll(dir)
+		return nil, fmt.Errorf("counterstore.Open: %w", err)
+	}
+	benchEnv.cleanup = append(benchEnv.cleanup, func() {
+		counters.Close()
+		os.RemoveAll(dir)
+	})
+
+	token := newLoopbackToken()
+	go func() {
+		// Only returns when the process exits
+		_ = newSoftHID(s, counters).serve(ctx, token)
+	}()
+
+	return token, nil
+}
+
+// hidTarget goes through the U2F handling of softHID, as requests
+// from a browser do, with the counters of softHID.
+type hidTarget struct {
+	c hidClient
+}
+
+// newHIDTarget is a hidTarget on a channel of its own.
+func newHIDTarget(ctx context.Context) (benchTarget, error) {
+	c, err := benchEnv.token.client(ctx)
+	if err != nil {
+		return nil, err
+	}
+
+	return hidTarget{c}, nil
+}
+
+func (t hidTarget) checkOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error) {
+	return t.c.u2fCheckOnly(ctx, appliParam, keyHandle)
+}
+
+func (t hidTarget) authenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, _ uint32) (bool, byte, uint32, []byte, error) {
+	return t.c.u2fAuthenticate(ctx, appliParam, challParam, keyHandle, false)
+}
+
+// BenchmarkPool goes straight to the TKey through the device pool.
+func BenchmarkPool(b *testing.B) {
+	setupBench(b)
+
+	runBench(b, benchEnv.poolCred, func(context.Context) (benchTarget, error) {
+		return poolTarget{benchEnv.pool}, nil
+	})
+}
+
+// BenchmarkSoftHID takes the whole path a browser's requests take,
+// from U2F message decoding in the soft HID down to the TKey, with
+// clients in the test in place of /dev/uhid.
+func BenchmarkSoftHID(b *testing.B) {
+	setupBench(b)
+
+	runBench(b, benchEnv.hidCred, newHIDTarget)
+}
+
+// BenchmarkSoftHIDFlood is BenchmarkSoftHID while 16 more goroutines
+// flood the soft HID from another origin, as a misbehaving page could.
+// The soft HID queues only a few requests per origin, serves the
+// origins in turn and rejects the rest right away, so the latency
+// should stay close to that without the flood.
+func BenchmarkSoftHIDFlood(b *testing.B) {
+	setupBench(b)
+
+	var flooding floodResult
+	stop, err := startFlood(context.Background(), benchEnv.token, 16, &flooding)
+	if err != nil {
+		b.Fatalf("startFlood: %v", err)
+	}
+	runBench(b, benchEnv.hidCred, newHIDTarget)
+	stop()
+
+	b.ReportMetric(float64(flooding.handled)/float64(b.N), "flood-handled/op")
+	b.ReportMetric(float64(flooding.rejected)/float64(b.N), "flood-rejected/op")
+}
+
+// runBench runs b.N checkonly and authenticate, on goroutines with
+// their own target each.
+func runBench(b *testing.B, cred benchCredential, newTarget func(context.Context) (benchTarget, error)) {
+	b.Helper()
+
+	ctx := context.Background()
+	result := benchResult{latencies: make(map[string][]time.Duration)}
+	// Each iteration gets its own counter and challenge
+	var next uint64
+
+	b.ResetTimer()
+	b.RunParallel(func(pb *testing.PB) {
+		target, err := newTarget(ctx)
+		if err != nil {
+			result.fail("target: %v", err)
+			return
+		}
+		for pb.Next() {
+			benchOnce(ctx, target, &result, benchAppliParam, cred, atomic.AddUint64(&next, 1))
+		}
+	})
+	b.StopTimer()
+
+	for _, failure := range result.failures {
+		b.Error(failure)
+	}
+
+	for _, cmd := range []string{"checkonly", "authenticate"} {
+		latencies := result.sorted(cmd)
+		if len(latencies) == 0 {
+			continue
+		}
+
+		for _, p := range []int{50, 95, 99} {
+			b.ReportMetric(float64(percentile(latencies, p).Microseconds()),
+				fmt.Sprintf("%s-p%d-us", cmd, p))
+		}
+	}
+}
+
+type floodResult struct {
+	handled  uint64
+	rejected uint64
+}
+
+// startFlood runs n goroutines sending authenticate without user
+// presence, with keyhandles that aren't ours, to softHID as fast as
+// they can, all from the same origin. Call stop when done.
+func startFlood(ctx context.Context, token *loopbackToken, n int, result *floodResult) (func(), error) {
+	ctx, cancel := context.WithCancel(ctx)
+	var wg sync.WaitGroup
+	appliParam := sha256.Sum256([]byte("flood.example"))
+
+	stop := func() {
+		cancel()
+		wg.Wait()
+	}
+
+	for i := 0; i < n; i++ {
+		client, err := token.client(ctx)
+		if err != nil {
+			stop()
+			return nil, err
+		}
+
+		wg.Add(1)
+		go func(client hidClient, i int) {
+			defer wg.Done()
+
+			var keyHandle [64]byte
+			binary.BigEndian.PutUint64(keyHandle[:], uint64(i))
+			msg := u2fMessage(u2f.CmdAuthenticate, byte(u2f.CtrlDontEnforeUserPresenceAndSign),
+				authenticateData(appliParam, [32]byte{}, keyHandle))
+
+			for {
+				r, err := client.u2f(ctx, msg)
+				if err != nil {
+					return
+				}
+				// Handled, the keyhandle is WrongData. Rejected,
+				// authenticate gets ConditionsNotSatisfied, while
+				// a checkonly would get WrongData either way.
+				switch r.status {
+				case statuscode.ConditionsNotSatisfied:
+					atomic.AddUint64(&result.rejected, 1)
+				case statuscode.WrongData:
+					atomic.AddUint64(&result.handled, 1)
+				default:
+					return
+				}
+			}
+		}(client, i)
+	}
+
+	return stop, nil
+}
@@ -0,0 +1,111 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"context"
+	"fmt"
+	"time"
+
+	"github.com/tillitis/tkey-fido/internal/broker"
+	"github.com/tillitis/tkey-fido/internal/counterstore"
+)
+
+// brokerCounterTimeout is how long we wait for the broker to hand out a
+// counter. It doesn't wait for a TKey, only for the broker's counter
+// store.
+const brokerCounterTimeout = 10 * time.Second
+
+// u2fDevice is what softHID and test() need: either the TKeys we have
+// ourselves, or those of a broker.
+type u2fDevice interface {
+	u2fRegister(ctx context.Context, appliParam [32]byte) (byte, []byte, []byte, error)
+	u2fCheckOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error)
+	u2fAuthenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error)
+	closeNow()
+}
+
+// runBroker keeps the TKeys of the pool connected, with the fido app
+// loaded, and serves them to other tkey-fido on the Unix socket at
+// path. Their requests queue on each TKey's operation lock, like our
+// own would. Their signature counters come from counters, so they
+// never go backwards, whichever client signs.
+func runBroker(p *fidoPool, counters *counterstore.Store, path string) error {
+	p.keepConnected = true
+
+	l, err := broker.Listen(path)
+	if err != nil {
+		return fmt.Errorf("broker.Listen: %w", err)
+	}
+	defer l.Close()
+
+	le.Printf("Serving TKeys on %s\n", path)
+	if err = broker.Serve(l, poolBackend{p, counters}); err != nil {
+		return fmt.Errorf("broker.Serve: %w", err)
+	}
+
+	return nil
+}
+
+type poolBackend struct {
+	p        *fidoPool
+	counters *counterstore.Store
+}
+
+func (b poolBackend) U2FRegister(ctx context.Context, appliParam [32]byte) (byte, []byte, []byte, error) {
+	return b.p.u2fRegister(ctx, appliParam)
+}
+
+func (b poolBackend) U2FCheckOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error) {
+	return b.p.u2fCheckOnly(ctx, appliParam, keyHandle)
+}
+
+func (b poolBackend) U2FAuthenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error) {
+	return b.p.u2fAuthenticate(ctx, appliParam, challParam, keyHandle, checkUser, counter)
+}
+
+func (b poolBackend) NextCounter(key [32]byte) (uint32, error) {
+	return b.counters.Next(key)
+}
+
+// brokerDevice uses the TKeys of a broker, so we never open a serial
+// port ourselves.
+type brokerDevice struct {
+	c *broker.Client
+}
+
+func dialBroker(path string) (*brokerDevice, error) {
+	c, err := broker.Dial(path)
+	if err != nil {
+		return nil, fmt.Errorf("broker.Dial: %w", err)
+	}
+
+	return &brokerDevice{c}, nil
+}
+
+func (d *brokerDevice) u2fRegister(ctx context.Context, appliParam [32]byte) (byte, []byte, []byte, error) {
+	return d.c.U2FRegister(ctx, appliParam)
+}
+
+func (d *brokerDevice) u2fCheckOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error) {
+	return d.c.U2FCheckOnly(ctx, appliParam, keyHandle)
+}
+
+func (d *brokerDevice) u2fAuthenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error) {
+	return d.c.U2FAuthenticate(ctx, appliParam, challParam, keyHandle, checkUser, counter)
+}
+
+// Next makes the broker a counterSource for softHID.
+func (d *brokerDevice) Next(key [32]byte) (uint32, error) {
+	ctx, cancel := context.WithTimeout(context.Background(), brokerCounterTimeout)
+	defer cancel()
+
+	return d.c.NextCounter(ctx, key)
+}
+
+func (d *brokerDevice) closeNow() {
+	if err := d.c.Close(); err != nil {
+		le.Printf("Close failed: %s\n", err)
+	}
+}
@@ -0,0 +1,249 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"context"
+	"errors"
+	"fmt"
+	"sync"
+	"time"
+
+	"github.com/psanford/ctapkey/attestation"
+	"github.com/tillitis/tkey-fido/internal/attest"
+	"github.com/tillitis/tkey-fido/internal/counterstore"
+	"github.com/tillitis/tkey-fido/internal/ctap2"
+	"github.com/tillitis/tkey-fido/internal/ctaphid"
+)
+
+// With CTAP2 a browser sends us the whole allow list in a single
+// authenticatorGetAssertion, instead of one U2F authenticate per
+// credential, and we keep it waiting with CTAPHID_KEEPALIVE instead of
+// having it poll while the user is about to touch the TKey.
+
+const keepAliveInterval = 100 * time.Millisecond
+
+func (s *softHID) handleCBOR(ctx context.Context, token hidToken, ev ctaphid.Event) error {
+	defer s.lockOperation("cbor")()
+
+	var rsp []byte
+	var err error
+
+	if len(ev.Msg) == 0 {
+		err = ctap2.StatusInvalidLength
+	} else {
+		params := ev.Msg[1:]
+
+		switch ev.Msg[0] {
+		case ctap2.CmdGetInfo:
+			le.Printf("cbor: getinfo")
+			rsp = ctap2.GetInfo()
+		case ctap2.CmdMakeCredential:
+			rsp, err = s.ctap2MakeCredential(ctx, token, ev, params)
+		case ctap2.CmdGetAssertion:
+			rsp, err = s.ctap2GetAssertion(ctx, token, ev, params)
+		case ctap2.CmdGetNextAssertion:
+			// We only ever return 1 credential
+			err = ctap2.StatusNotAllowed
+		default:
+			le.Printf("cbor: unsupported cmd: 0x%02x\n", ev.Msg[0])
+			err = ctap2.StatusInvalidCommand
+		}
+	}
+
+	status := ctap2.StatusOK
+	select {
+	case <-ev.Cancelled:
+		// The TKey operation isn't interrupted, but the browser
+		// has moved on
+		le.Printf("cbor: cancelled\n")
+		err = ctap2.StatusKeepAliveCancel
+	default:
+	}
+	if err != nil {
+		rsp = nil
+		if !errors.As(err, &status) {
+			le.Printf("cbor: %s\n", err)
+			status = ctap2.StatusOther
+		}
+	}
+
+	if err = token.WriteCBORResponse(ctx, ev, byte(status), rsp); err != nil {
+		return fmt.Errorf("WriteCBORResponse: %w", err)
+	}
+	return nil
+}
+
+func (s *softHID) ctap2MakeCredential(ctx context.Context, token hidToken, ev ctaphid.Event, params []byte) ([]byte, error) {
+	req, err := ctap2.ParseMakeCredential(params)
+	if err != nil {
+		return nil, err
+	}
+	le.Printf("cbor: makecredential rp=%s", req.RPID)
+
+	appliParam := req.AppParam()
+
+	stop := keepAlive(ctx, token, ev)
+	defer stop()
+
+	for _, keyHandle := range req.ExcludeList {
+		keyHandleValid, err := s.theFido.u2fCheckOnly(ctx, appliParam, keyHandle)
+		if err != nil {
+			return nil, fmt.Errorf("u2fCheckOnly failed: %w", err)
+		}
+		if !keyHandleValid {
+			continue
+		}
+
+		// The spec wants user presence before telling, and an
+		// authenticate is the only way to ask the app for a
+		// touch. The signature is thrown away.
+		le.Printf("makecredential: excluded credential, waiting for touch\n")
+		_, userPresence, _, err := s.theFido.u2fAuthenticate(ctx, appliParam, req.ClientDataHash,
+			keyHandle, true, 0)
+		if err != nil {
+			return nil, fmt.Errorf("u2fAuthenticate failed: %w", err)
+		}
+		if userPresence == 0 {
+			metricTouchTimeouts.Inc("makecredential")
+			return nil, ctap2.StatusUserActionTimeout
+		}
+		return nil, ctap2.StatusCredentialExcluded
+	}
+
+	reg := attest.Start(attestation.PrivateKey, appliParam, req.ClientDataHash)
+
+	userPresence, keyHandle, pubBytes, err := s.theFido.u2fRegister(ctx, appliParam)
+	if err != nil {
+		return nil, fmt.Errorf("u2fRegister failed: %w", err)
+	}
+	if userPresence == 0 {
+		le.Printf("makecredential: no user present\n")
+		metricTouchTimeouts.Inc("makecredential")
+		return nil, ctap2.StatusUserActionTimeout
+	}
+
+	attSig, err := reg.Finish(keyHandle, pubBytes)
+	if err != nil {
+		return nil, fmt.Errorf("attestation: %w", err)
+	}
+
+	le.Printf("makecredential: success\n")
+	return ctap2.MakeCredentialResponse(appliParam, keyHandle, pubBytes, attestation.CertDer, attSig), nil
+}
+
+func (s *softHID) ctap2GetAssertion(ctx context.Context, token hidToken, ev ctaphid.Event, params []byte) ([]byte, error) {
+	req, err := ctap2.ParseGetAssertion(params)
+	if err != nil {
+		return nil, err
+	}
+	le.Printf("cbor: getassertion rp=%s credentials=%d up=%v", req.RPID, len(req.AllowList), req.UserPresence)
+
+	appliParam := req.AppParam()
+
+	// Without an allow list we'd need resident keys, which we don't
+	// have
+	var found bool
+	var keyHandle [ctap2.KeyHandleLen]byte
+	for _, kh := range req.AllowList {
+		keyHandleValid, err := s.theFido.u2fCheckOnly(ctx, appliParam, kh)
+		if err != nil {
+			return nil, fmt.Errorf("u2fCheckOnly failed: %w", err)
+		}
+		if keyHandleValid {
+			found = true
+			keyHandle = kh
+			break
+		}
+	}
+	if !found {
+		le.Printf("getassertion: no credential of ours\n")
+		return nil, ctap2.StatusNoCredentials
+	}
+
+	counter, err := s.counters.Next(counterstore.Key(appliParam, keyHandle))
+	if err != nil {
+		return nil, fmt.Errorf("counter: %w", err)
+	}
+
+	if req.UserPresence {
+		stop := keepAlive(ctx, token, ev)
+		defer stop()
+	}
+
+	keyHandleValid, userPresence, sigASN1, err := s.theFido.u2fAuthenticate(ctx, appliParam,
+		req.ClientDataHash, keyHandle, req.UserPresence, counter)
+	if err != nil {
+		return nil, fmt.Errorf("u2fAuthenticate failed: %w", err)
+	}
+	if !keyHandleValid {
+		return nil, ctap2.StatusNoCredentials
+	}
+	if req.UserPresence && userPresence == 0 {
+		le.Printf("getassertion: user not present but required\n")
+		metricTouchTimeouts.Inc("getassertion")
+		return nil, ctap2.StatusUserActionTimeout
+	}
+
+	le.Printf("getassertion: success\n")
+	return ctap2.GetAssertionResponse(appliParam, keyHandle, userPresence, counter, sigASN1), nil
+}
+
+// cborOrigin is the U2F application parameter of a CTAPHID_CBOR
+// request, for admission, or zero if it has none or is malformed.
+func cborOrigin(msg []byte) [32]byte {
+	if len(msg) == 0 {
+		return [32]byte{}
+	}
+
+	switch msg[0] {
+	case ctap2.CmdMakeCredential:
+		if req, err := ctap2.ParseMakeCredential(msg[1:]); err == nil {
+			return req.AppParam()
+		}
+	case ctap2.CmdGetAssertion:
+		if req, err := ctap2.ParseGetAssertion(msg[1:]); err == nil {
+			return req.AppParam()
+		}
+	}
+
+	return [32]byte{}
+}
+
+// keepAlive sends CTAPHID_KEEPALIVE for ev while we wait for the user
+// to touch the TKey. The returned func stops it, and only returns when
+// no keepalive is being written anymore.
+func keepAlive(ctx context.Context, token hidToken, ev ctaphid.Event) func() {
+	done := make(chan struct{})
+	var wg sync.WaitGroup
+
+	wg.Add(1)
+	go func() {
+		defer wg.Done()
+
+		ticker := time.NewTicker(keepAliveInterval)
+		defer ticker.Stop()
+
+		for {
+			select {
+			case <-done:
+				return
+			case <-ctx.Done():
+				return
+			case <-ev.Cancelled:
+				return
+			case <-ticker.C:
+				if err := token.WriteKeepAlive(ctx, ev, ctaphid.StatusUPNeeded); err != nil {
+					le.Printf("WriteKeepAlive failed: %s\n", err)
+					return
+				}
+			}
+		}
+	}()
+
+	return func() {
+		close(done)
+		wg.Wait()
+	}
+}
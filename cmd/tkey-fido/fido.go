@@ -4,20 +4,24 @@
 package main
 
 import (
-	"crypto/elliptic"
+	"context"
 	_ "embed"
 	"errors"
 	"fmt"
 	"io"
 	"os"
 	"os/signal"
+	"sort"
 	"sync"
+	"sync/atomic"
 	"syscall"
 	"time"
 
+	"github.com/tillitis/tkey-fido/internal/attest"
 	"github.com/tillitis/tkey-fido/internal/tk1fido"
 	"github.com/tillitis/tkeyclient"
 	"github.com/tillitis/tkeyutil"
+	"go.bug.st/serial"
 )
 
 // nolint:typecheck // Avoid lint error when the embedding file is missing.
@@ -32,6 +36,12 @@ var notify = func(msg string) {
 
 const (
 	idleDisconnect = 3 * time.Second
+	// Look for TKeys plugged in or out at most this often, unless
+	// none are known
+	rescanInterval = time.Second
+	// and at least this often, so that a TKey plugged in is found
+	// without an operation failing first
+	listInterval = 5 * time.Second
 	// 4 chars each.
 	wantFWName0  = "tk1 "
 	wantFWName1  = "mkdf"
@@ -43,43 +53,410 @@ const (
 // unexported) in a different pkg
 type fido struct {
 	tk              *tkeyclient.TillitisKey
-	tkFido          *tk1fido.Fido
+	tkFido          *tk1fido.Fido // through tk, until the app is loaded
+	fidoOpts        []func(*tk1fido.Fido)
+	engine          atomic.Pointer[tk1fido.Fido] // owning the port, once connected
 	devPath         string
 	speed           int
 	enterUSS        bool
 	fileUSS         string
 	mu              sync.Mutex
+	opMu            sync.Mutex // only 1 operation at a time on this TKey
 	pinentry        string
 	connected       bool
+	keepConnected   bool // never disconnect when idling
+	portOpen        atomic.Bool
 	disconnectTimer *time.Timer
+	// The user picked this TKey for us, so we may load the fido app
+	// onto it, and tell them when we can't use it
+	picked atomic.Bool
+	// Not picked, and not running the fido app, so leave it alone
+	// until it's plugged in again
+	foreign atomic.Bool
 }
 
-func newFido(devPathArg string, speedArg int, enterUSS bool, fileUSS string, pinentry string, exitFunc func(int)) *fido {
-	tkeyclient.SilenceLogging()
+func newFido(devPath string, speed int, enterUSS bool, fileUSS string, pinentry string, debug bool, timing bool, options ...func(*tk1fido.Fido)) *fido {
+	fidoOpts := options
+	if debug {
+		fidoOpts = append(fidoOpts, tk1fido.WithDebug())
+	}
+	fidoOpts = append(fidoOpts, tk1fido.WithObserver(exchangeObserver{devPath, timing}))
 
 	tk := tkeyclient.New()
 
-	tkFido := tk1fido.New(tk)
-	s := &fido{
+	return &fido{
 		tk:       tk,
-		tkFido:   &tkFido,
-		devPath:  devPathArg,
-		speed:    speedArg,
+		tkFido:   tk1fido.New(tk, fidoOpts...),
+		fidoOpts: fidoOpts,
+		devPath:  devPath,
+		speed:    speed,
 		enterUSS: enterUSS,
 		fileUSS:  fileUSS,
 		pinentry: pinentry,
 	}
+}
+
+// exchangeObserver records the metrics of each exchange with the TKey
+// on a serial port, and logs its timing if asked to.
+type exchangeObserver struct {
+	devPath string
+	log     bool
+}
+
+func (o exchangeObserver) Exchange(ex tk1fido.Exchange) {
+	result := "ok"
+	if ex.Err != nil {
+		result = "error"
+		metricSerialErrors.Inc()
+	}
+	metricCommands.Inc(ex.Command, result)
+	metricCommandSeconds.Observe(ex.Read, ex.Command)
+
+	if !o.log {
+		return
+	}
+
+	firstByte := "?"
+	if ex.FirstByte != 0 {
+		firstByte = ex.FirstByte.String()
+	}
+
+	le.Printf("%s: %s write:%v firstbyte:%s read:%v frames:%d/%d bytes:%d/%d err:%v\n",
+		o.devPath, ex.Command, ex.Write, firstByte, ex.Read,
+		ex.FramesOut, ex.FramesIn, ex.BytesOut, ex.BytesIn, ex.Err)
+}
+
+// fidoPool works with all TKeys plugged in, or only the one on the
+// serial port passed with --port. Registrations go to the default
+// TKey. Authentications go to the TKey whose app accepts the
+// keyhandle, which we remember for the next time. Operations on
+// different TKeys run in parallel.
+//
+// Only the TKey the user picked, with --port or --default-port, or
+// the only one plugged in, gets the fido app loaded. Others are used
+// if they already run it, and otherwise left alone for other programs.
+type fidoPool struct {
+	devPath     string // only use this port, if set
+	defaultPath string // port for registrations, if set
+	speed       int
+	enterUSS    bool
+	fileUSS     string
+	pinentry    string
+	debug       bool
+	timing      bool // log the timing of every exchange
+
+	// Keep the TKeys connected instead of letting other programs have
+	// them when idling, set before first use when we're a broker
+	keepConnected bool
+	// Record all frames of the TKeys here, one stream each, if set
+	// before first use
+	trace   *tk1fido.TraceWriter
+	streams int
+
+	mu      sync.Mutex
+	devices map[string]*fido   // by serial port path
+	routes  map[[64]byte]*fido // by keyhandle
+	// When we last listed the serial ports, and whether we must list
+	// them again, as an operation failed
+	scanned time.Time
+	stale   bool
+}
+
+func newFidoPool(devPathArg, defaultPathArg string, speedArg int, enterUSS bool, fileUSS string, pinentry string, debug bool, timing bool, exitFunc func(int)) *fidoPool {
+	if !debug {
+		// tkeyclient.Dump logs through tkeyclient's own logger, so
+		// only silence it when not debugging
+		tkeyclient.SilenceLogging()
+	}
+
+	p := &fidoPool{
+		devPath:     devPathArg,
+		defaultPath: defaultPathArg,
+		speed:       speedArg,
+		enterUSS:    enterUSS,
+		fileUSS:     fileUSS,
+		pinentry:    pinentry,
+		debug:       debug,
+		timing:      timing,
+		devices:     make(map[string]*fido),
+		routes:      make(map[[64]byte]*fido),
+	}
 
 	// Do nothing on HUP, in case old udev rule is still in effect
 	handleSignals(func() {}, syscall.SIGHUP)
 
 	// Start handling signals here to catch abort during USS entering
 	handleSignals(func() {
-		s.closeNow()
+		p.closeNow()
 		exitFunc(1)
 	}, os.Interrupt, syscall.SIGTERM)
 
-	return s
+	return p
+}
+
+// refresh updates the pool with the TKeys currently plugged in, and
+// returns them sorted by serial port path. The serial ports are listed
+// again when we know of no TKey, or an operation failed since the last
+// time, but at most once every rescanInterval, and otherwise once
+// every listInterval. There's no hotplug notification to go by, so a
+// TKey plugged in is used from the first operation after that.
+func (p *fidoPool) refresh() ([]*fido, error) {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+
+	age := time.Since(p.scanned)
+	if len(p.devices) > 0 && (age < rescanInterval || (!p.stale && age < listInterval)) {
+		return p.sorted(), nil
+	}
+
+	var paths []string
+	if p.devPath != "" {
+		paths = []string{p.devPath}
+	} else {
+		ports, err := tkeyclient.GetSerialPorts()
+		if err != nil {
+			return nil, fmt.Errorf("GetSerialPorts: %w", err)
+		}
+		for _, port := range ports {
+			paths = append(paths, port.DevPath)
+		}
+	}
+	p.scanned = time.Now()
+	p.stale = false
+
+	if len(paths) == 0 {
+		notify("Could not find any TKey plugged in.")
+		return nil, tkeyclient.ErrNoDevice
+	}
+
+	present := make(map[string]bool, len(paths))
+	for _, path := range paths {
+		present[path] = true
+		if p.devices[path] != nil {
+			continue
+		}
+		le.Printf("Found TKey on serial port %s\n", path)
+		var options []func(*tk1fido.Fido)
+		if p.trace != nil {
+			options = append(options, tk1fido.WithTrace(p.trace, byte(p.streams)))
+			p.streams++
+		}
+		dev := newFido(path, p.speed, p.enterUSS, p.fileUSS, p.pinentry, p.debug, p.timing, options...)
+		dev.keepConnected = p.keepConnected
+		p.devices[path] = dev
+	}
+
+	for path, dev := range p.devices {
+		if present[path] {
+			continue
+		}
+		le.Printf("TKey on serial port %s is gone\n", path)
+		dev.closeNow()
+		delete(p.devices, path)
+		for keyHandle, routed := range p.routes {
+			if routed == dev {
+				delete(p.routes, keyHandle)
+			}
+		}
+	}
+
+	for path, dev := range p.devices {
+		dev.picked.Store(path == p.devPath || path == p.defaultPath ||
+			(p.defaultPath == "" && len(p.devices) == 1))
+	}
+
+	return p.sorted(), nil
+}
+
+// sorted returns the TKeys by serial port path. Called with mu held.
+func (p *fidoPool) sorted() []*fido {
+	devices := make([]*fido, 0, len(p.devices))
+	for _, dev := range p.devices {
+		devices = append(devices, dev)
+	}
+	sort.Slice(devices, func(i, j int) bool { return devices[i].devPath < devices[j].devPath })
+
+	return devices
+}
+
+// rescan makes the next refresh list the serial ports again, after an
+// operation failed, perhaps because a TKey was plugged in or out.
+func (p *fidoPool) rescan() {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+
+	p.stale = true
+}
+
+// defaultDevice is the TKey to register new credentials on: the one
+// passed with --default-port, or the first one found.
+func (p *fidoPool) defaultDevice() (*fido, error) {
+	devices, err := p.refresh()
+	if err != nil {
+		return nil, err
+	}
+
+	if p.defaultPath == "" {
+		// Rather one we can use than one that is just first
+		for _, dev := range devices {
+			if dev.picked.Load() || !dev.foreign.Load() {
+				return dev, nil
+			}
+		}
+		return devices[0], nil
+	}
+	for _, dev := range devices {
+		if dev.devPath == p.defaultPath {
+			return dev, nil
+		}
+	}
+
+	p.rescan()
+	notify(fmt.Sprintf("The default TKey on %s is not plugged in.", p.defaultPath))
+	return nil, fmt.Errorf("no TKey on default port %s", p.defaultPath)
+}
+
+// routed returns the TKey that last accepted keyHandle, if any.
+func (p *fidoPool) routed(keyHandle [64]byte) *fido {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+
+	return p.routes[keyHandle]
+}
+
+// probe asks all TKeys that may run the fido app in parallel whether
+// they accept keyHandle for appliParam, and remembers the one that
+// does. Returns nil if no TKey accepts it.
+func (p *fidoPool) probe(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (*fido, error) {
+	all, err := p.refresh()
+	if err != nil {
+		return nil, err
+	}
+	devices := make([]*fido, 0, len(all))
+	for _, dev := range all {
+		if !dev.foreign.Load() {
+			devices = append(devices, dev)
+		}
+	}
+	if len(devices) == 0 {
+		p.rescan()
+		return nil, nil
+	}
+
+	var wg sync.WaitGroup
+	valid := make([]bool, len(devices))
+	errs := make([]error, len(devices))
+	for i, dev := range devices {
+		wg.Add(1)
+		go func(i int, dev *fido) {
+			defer wg.Done()
+			valid[i], errs[i] = dev.u2fCheckOnly(ctx, appliParam, keyHandle)
+		}(i, dev)
+	}
+	wg.Wait()
+
+	for i, dev := range devices {
+		if valid[i] {
+			p.remember(keyHandle, dev)
+			return dev, nil
+		}
+	}
+
+	// Its TKey may have been plugged in since we last looked
+	p.rescan()
+
+	// Only fail if no TKey could answer at all
+	for _, err := range errs {
+		if err == nil {
+			return nil, nil
+		}
+	}
+	return nil, errs[0]
+}
+
+func (p *fidoPool) remember(keyHandle [64]byte, dev *fido) {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+
+	p.routes[keyHandle] = dev
+}
+
+func (p *fidoPool) forget(keyHandle [64]byte) {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+
+	delete(p.routes, keyHandle)
+}
+
+func (p *fidoPool) closeNow() {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+
+	for _, dev := range p.devices {
+		dev.closeNow()
+	}
+}
+
+func (p *fidoPool) u2fRegister(ctx context.Context, appliParam [32]byte) (byte, []byte, []byte, error) {
+	dev, err := p.defaultDevice()
+	if err != nil {
+		return 0, nil, nil, err
+	}
+
+	userPresence, keyHandle, pubBytes, err := dev.u2fRegister(ctx, appliParam)
+	if err != nil {
+		p.rescan()
+		// defaultDevice only goes for a TKey found not to run the
+		// fido app if all of them are like that
+		if !dev.picked.Load() && dev.foreign.Load() {
+			notify("Several TKeys are plugged in, but none runs the fido app.\nPass --default-port to pick the one to register on.")
+		}
+	} else if userPresence != 0 {
+		p.remember(*(*[64]byte)(keyHandle), dev)
+	}
+
+	return userPresence, keyHandle, pubBytes, err
+}
+
+func (p *fidoPool) u2fCheckOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error) {
+	if dev := p.routed(keyHandle); dev != nil {
+		keyHandleValid, err := dev.u2fCheckOnly(ctx, appliParam, keyHandle)
+		if err == nil && keyHandleValid {
+			return true, nil
+		}
+		// The TKey might have a new app or USS. Look again.
+		p.forget(keyHandle)
+	}
+
+	dev, err := p.probe(ctx, appliParam, keyHandle)
+	if err != nil {
+		return false, err
+	}
+
+	return dev != nil, nil
+}
+
+func (p *fidoPool) u2fAuthenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error) {
+	// Authenticate checks the keyhandle itself, and returns before
+	// waiting for touch if it's not valid
+	if dev := p.routed(keyHandle); dev != nil {
+		keyHandleValid, userPresence, sigASN1, err := dev.u2fAuthenticate(ctx, appliParam,
+			challParam, keyHandle, checkUser, counter)
+		if err == nil && keyHandleValid {
+			return keyHandleValid, userPresence, sigASN1, nil
+		}
+		p.forget(keyHandle)
+	}
+
+	dev, err := p.probe(ctx, appliParam, keyHandle)
+	if err != nil {
+		return false, 0, nil, err
+	}
+	if dev == nil {
+		return false, 0, nil, nil
+	}
+
+	return dev.u2fAuthenticate(ctx, appliParam, challParam, keyHandle, checkUser, counter)
 }
 
 func (s *fido) connect() bool {
@@ -95,33 +472,30 @@ func (s *fido) connect() bool {
 		return true
 	}
 
-	devPath := s.devPath
-	if devPath == "" {
-		var err error
-		devPath, err = tkeyclient.DetectSerialPort(false)
-		if err != nil {
-			switch {
-			case errors.Is(err, tkeyclient.ErrNoDevice):
-				notify("Could not find any TKey plugged in.")
-			case errors.Is(err, tkeyclient.ErrManyDevices):
-				notify("Cannot work with more than 1 TKey plugged in.")
-			default:
-				notify(fmt.Sprintf("TKey detection failed: %s\n", err))
-			}
-			le.Printf("Failed to detect port: %v\n", err)
-			return false
-		}
-		le.Printf("Auto-detected serial port %s\n", devPath)
+	if s.foreign.Load() {
+		return false
 	}
+	picked := s.picked.Load()
 
-	le.Printf("Connecting to TKey on serial port %s\n", devPath)
-	if err := s.tk.Connect(devPath, tkeyclient.WithSpeed(s.speed)); err != nil {
-		notify(fmt.Sprintf("Failed to connect to a TKey on port %v.", devPath))
+	le.Printf("Connecting to TKey on serial port %s\n", s.devPath)
+	if err := s.tk.Connect(s.devPath, tkeyclient.WithSpeed(s.speed)); err != nil {
+		if picked {
+			notify(fmt.Sprintf("Failed to connect to a TKey on port %v.", s.devPath))
+		}
 		le.Printf("Failed to connect: %v", err)
+		metricSerialErrors.Inc()
 		return false
 	}
+	s.portOpen.Store(true)
+	metricConnects.Inc()
 
 	if s.isFirmwareMode() {
+		if !picked {
+			le.Printf("The TKey on %s is in firmware mode, leaving it for other programs\n", s.devPath)
+			s.foreign.Store(true)
+			s.closeNow()
+			return false
+		}
 		le.Printf("The TKey is in firmware mode.\n")
 		if err := s.loadApp(); err != nil {
 			le.Printf("Failed to load app: %v\n", err)
@@ -131,6 +505,12 @@ func (s *fido) connect() bool {
 	}
 
 	if !s.isWantedApp() {
+		if !picked {
+			le.Printf("The TKey on %s runs another app, leaving it alone\n", s.devPath)
+			s.foreign.Store(true)
+			s.closeNow()
+			return false
+		}
 		// Notifying because we're kinda stuck if we end up here
 		notify("Please remove and plug in your TKey again\n— it might be running the wrong app.")
 		le.Printf("No TKey on the serial port, or it's running wrong app (and is not in firmware mode)")
@@ -138,6 +518,12 @@ func (s *fido) connect() bool {
 		return false
 	}
 
+	if err := s.startEngine(); err != nil {
+		le.Printf("Failed to start I/O: %v\n", err)
+		s.closeNow()
+		return false
+	}
+
 	// We nowadays disconnect from the TKey when idling, so the
 	// fido-app that's running may have been loaded by somebody else.
 	// Therefore we can never be sure it has USS according to the
@@ -159,9 +545,9 @@ func (s *fido) isFirmwareMode() bool {
 }
 
 func (s *fido) isWantedApp() bool {
-	nameVer, err := s.tkFido.GetAppNameVersion()
+	nameVer, err := s.tkFido.GetAppNameVersion(context.Background())
 	if err != nil {
-		if !errors.Is(err, io.EOF) {
+		if !errors.Is(err, io.EOF) && !errors.Is(err, context.DeadlineExceeded) {
 			le.Printf("GetAppNameVersion: %s\n", err)
 		}
 		return false
@@ -171,6 +557,23 @@ func (s *fido) isWantedApp() bool {
 		nameVer.Name1 == wantAppName1
 }
 
+// startEngine hands the port over from tkeyclient, which we only need
+// for loading the app, to the I/O engine of tk1fido.
+func (s *fido) startEngine() error {
+	if err := s.tkFido.Close(); err != nil {
+		return fmt.Errorf("Close: %w", err)
+	}
+
+	port, err := serial.Open(s.devPath, &serial.Mode{BaudRate: s.speed})
+	if err != nil {
+		return fmt.Errorf("serial.Open: %w", err)
+	}
+
+	s.engine.Store(tk1fido.NewWithPort(port, s.fidoOpts...))
+
+	return nil
+}
+
 func (s *fido) loadApp() error {
 	var secret []byte
 	if s.enterUSS {
@@ -196,6 +599,7 @@ func (s *fido) loadApp() error {
 		return fmt.Errorf("LoadApp: %w", err)
 	}
 	le.Printf("Fido app loaded.\n")
+	metricAppLoads.Inc()
 
 	return nil
 }
@@ -208,7 +612,7 @@ func (s *fido) disconnect() {
 	s.mu.Lock()
 	defer s.mu.Unlock()
 
-	if !s.connected {
+	if !s.connected || s.keepConnected {
 		return
 	}
 
@@ -218,6 +622,10 @@ func (s *fido) disconnect() {
 	}
 
 	s.disconnectTimer = time.AfterFunc(idleDisconnect, func() {
+		// Don't pull the port from under an operation that just
+		// started
+		s.opMu.Lock()
+		defer s.opMu.Unlock()
 		s.mu.Lock()
 		defer s.mu.Unlock()
 
@@ -232,21 +640,65 @@ func (s *fido) closeNow() {
 	if s.tkFido == nil {
 		return
 	}
-	if err := s.tkFido.Close(); err != nil {
+	if !s.portOpen.Swap(false) {
+		return
+	}
+
+	var err error
+	if engine := s.engine.Swap(nil); engine != nil {
+		err = engine.Close()
+	} else {
+		err = s.tkFido.Close()
+	}
+	if err != nil {
 		le.Printf("Close failed: %s\n", err)
 	}
 }
 
-func (s *fido) u2fRegister(appliParam [32]byte) (byte, []byte, []byte, error) {
+// app connects if needed, and returns the connection to the fido app.
+func (s *fido) app() (*tk1fido.Fido, error) {
 	if !s.connect() {
-		return 0, nil, nil, fmt.Errorf("Connect failed")
+		return nil, fmt.Errorf("Connect failed")
+	}
+
+	engine := s.engine.Load()
+	if engine == nil {
+		return nil, fmt.Errorf("Connect failed")
+	}
+
+	return engine, nil
+}
+
+// dropIfClosed forgets the connection if its I/O engine stopped, e.g.
+// because the TKey was pulled out, so the next operation connects
+// again.
+func (s *fido) dropIfClosed(err error) {
+	if !errors.Is(err, tk1fido.ErrClosed) {
+		return
+	}
+
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	s.closeNow()
+	s.connected = false
+}
+
+func (s *fido) u2fRegister(ctx context.Context, appliParam [32]byte) (byte, []byte, []byte, error) {
+	s.opMu.Lock()
+	defer s.opMu.Unlock()
+
+	app, err := s.app()
+	if err != nil {
+		return 0, nil, nil, err
 	}
 	defer s.disconnect()
 
 	// Keyhandle is 64 bytes long, pubkey is in uncompressed form with
 	// 0x04 marker first, 65 bytes
-	userPresence, keyHandle, pubBytes, err := s.tkFido.U2FRegister(appliParam)
+	userPresence, keyHandle, pubBytes, err := app.U2FRegister(ctx, appliParam)
 	if err != nil {
+		s.dropIfClosed(err)
 		return 0, nil, nil, fmt.Errorf("U2FRegister: %w", err)
 	}
 
@@ -254,39 +706,48 @@ func (s *fido) u2fRegister(appliParam [32]byte) (byte, []byte, []byte, error) {
 		return userPresence, nil, nil, nil
 	}
 
-	pubX, _ := elliptic.Unmarshal(elliptic.P256(), pubBytes)
-	if pubX == nil {
+	if !attest.ValidPublicKey(pubBytes) {
 		return 0, nil, nil, fmt.Errorf("Failed to unmarshal pubkey bytes")
 	}
 
 	return userPresence, keyHandle, pubBytes, nil
 }
 
-func (s *fido) u2fCheckOnly(appliParam [32]byte, keyHandle [64]byte) (bool, error) {
-	if !s.connect() {
-		return false, fmt.Errorf("Connect failed")
+func (s *fido) u2fCheckOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error) {
+	s.opMu.Lock()
+	defer s.opMu.Unlock()
+
+	app, err := s.app()
+	if err != nil {
+		return false, err
 	}
 	defer s.disconnect()
 
-	keyHandleValid, err := s.tkFido.U2FCheckOnly(appliParam, keyHandle)
+	keyHandleValid, err := app.U2FCheckOnly(ctx, appliParam, keyHandle)
 	if err != nil {
+		s.dropIfClosed(err)
 		return false, fmt.Errorf("U2FCheckOnly: %w", err)
 	}
 
 	return keyHandleValid, nil
 }
 
-func (s *fido) u2fAuthenticate(appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error) {
-	if !s.connect() {
-		return false, 0, nil, fmt.Errorf("Connect failed")
+func (s *fido) u2fAuthenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error) {
+	s.opMu.Lock()
+	defer s.opMu.Unlock()
+
+	app, err := s.app()
+	if err != nil {
+		return false, 0, nil, err
 	}
 	defer s.disconnect()
 
 	// Sig is in DER ASN1 format (ANSI X9.62), should be 71-73 bytes
 	// (or is it 70-73 bytes?)
-	keyHandleValid, userPresence, sigASN1, err := s.tkFido.U2FAuthenticate(appliParam,
+	keyHandleValid, userPresence, sigASN1, err := app.U2FAuthenticate(ctx, appliParam,
 		challParam, keyHandle, checkUser, counter)
 	if err != nil {
+		s.dropIfClosed(err)
 		return false, 0, nil, fmt.Errorf("U2FAuthenticate: %w", err)
 	}
 
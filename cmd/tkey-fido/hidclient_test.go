@@ -0,0 +1,402 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"bytes"
+	"context"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"sync"
+
+	"github.com/psanford/ctapkey/statuscode"
+	"github.com/psanford/ctapkey/u2f"
+	"github.com/tillitis/tkey-fido/internal/ctaphid"
+)
+
+// broadcastChannel is the CTAPHID channel to allocate channels on.
+const broadcastChannel = 0xffffffff
+
+// loopbackToken is a ctaphid.Token on a Device in memory, for clients
+// in this process instead of a browser on /dev/uhid, so that softHID
+// can be load tested. The clients frame their requests into HID
+// reports and take the responses out of them, as a browser does, so
+// the requests take the whole path a browser's do.
+type loopbackToken struct {
+	*ctaphid.Token
+	dev *loopbackDevice
+}
+
+func newLoopbackToken() *loopbackToken {
+	dev := &loopbackDevice{
+		reports: make(chan []byte, 256),
+		closed:  make(chan struct{}),
+		waiting: make(map[uint32]loopbackWaiter),
+		stale:   make(map[uint32]bool),
+	}
+
+	return &loopbackToken{
+		Token: ctaphid.New(dev),
+		dev:   dev,
+	}
+}
+
+// client returns a client on a channel of its own, allocated with
+// CTAPHID_INIT, to send one request at a time on, as a browser does.
+func (t *loopbackToken) client(ctx context.Context) (hidClient, error) {
+	channel, err := t.dev.init(ctx, broadcastChannel)
+	if err != nil {
+		return hidClient{}, err
+	}
+
+	return hidClient{dev: t.dev, channel: channel}, nil
+}
+
+// loopbackDevice is the ctaphid.Device of a loopbackToken, with the
+// clients in place of the host.
+type loopbackDevice struct {
+	reports   chan []byte // written by the clients
+	closed    chan struct{}
+	closeOnce sync.Once
+
+	sendMu sync.Mutex // the reports of one message at a time
+	initMu sync.Mutex // one channel allocation at a time
+	nonces uint64     // of CTAPHID_INIT, so far
+
+	mu      sync.Mutex
+	waiting map[uint32]loopbackWaiter // by channel
+	stale   map[uint32]bool           // channels with a request given up on
+
+	// The message being written by the token, which writes one at a
+	// time
+	rspChannel uint32
+	rspCmd     ctaphid.Command
+	rspWant    int
+	rsp        []byte
+}
+
+// loopbackWaiter is a client waiting for the response cmd on its
+// channel.
+type loopbackWaiter struct {
+	cmd ctaphid.Command
+	rsp chan loopbackMessage
+}
+
+type loopbackMessage struct {
+	cmd ctaphid.Command
+	msg []byte
+}
+
+func (d *loopbackDevice) ReadReport() ([]byte, error) {
+	select {
+	case report := <-d.reports:
+		return report, nil
+	case <-d.closed:
+		return nil, errors.New("closed")
+	}
+}
+
+// WriteReport assembles the responses of the token, and hands each to
+// the client waiting for it.
+func (d *loopbackDevice) WriteReport(report []byte) error {
+	var data []byte
+	if report[4]&0x80 != 0 {
+		d.rspChannel = binary.BigEndian.Uint32(report)
+		d.rspCmd = ctaphid.Command(report[4])
+		d.rspWant = int(binary.BigEndian.Uint16(report[5:]))
+		d.rsp = make([]byte, 0, d.rspWant)
+		data = report[7:]
+	} else {
+		if binary.BigEndian.Uint32(report) != d.rspChannel || d.rsp == nil {
+			return fmt.Errorf("continuation packet %x out of place", report[:5])
+		}
+		data = report[5:]
+	}
+	if n := d.rspWant - len(d.rsp); len(data) > n {
+		data = data[:n]
+	}
+	d.rsp = append(d.rsp, data...)
+	if len(d.rsp) < d.rspWant {
+		return nil
+	}
+
+	channel, cmd, msg := d.rspChannel, d.rspCmd, d.rsp
+	d.rsp = nil
+	if cmd == ctaphid.CmdKeepAlive {
+		return nil
+	}
+
+	d.mu.Lock()
+	w, ok := d.waiting[channel]
+	// A late response to a request given up on isn't what the client
+	// waits for now
+	if ok && (cmd == w.cmd || cmd == ctaphid.CmdError) {
+		delete(d.waiting, channel)
+	} else {
+		ok = false
+	}
+	d.mu.Unlock()
+
+	if ok {
+		w.rsp <- loopbackMessage{cmd, msg}
+	}
+
+	return nil
+}
+
+func (d *loopbackDevice) Close() error {
+	d.closeOnce.Do(func() {
+		close(d.closed)
+	})
+	return nil
+}
+
+// send writes msg as the host does, in an initialization packet and as
+// many continuation packets as needed.
+func (d *loopbackDevice) send(ctx context.Context, channel uint32, cmd ctaphid.Command, msg []byte) error {
+	d.sendMu.Lock()
+	defer d.sendMu.Unlock()
+
+	report := make([]byte, ctaphid.ReportLen)
+	binary.BigEndian.PutUint32(report, channel)
+	report[4] = byte(cmd)
+	binary.BigEndian.PutUint16(report[5:], uint16(len(msg)))
+	msg = msg[copy(report[7:], msg):]
+
+	for seq := byte(0); ; seq++ {
+		select {
+		case d.reports <- report:
+		case <-d.closed:
+			return errors.New("closed")
+		case <-ctx.Done():
+			return fmt.Errorf("ctx.Err: %w", ctx.Err())
+		}
+		if len(msg) == 0 {
+			return nil
+		}
+
+		report = make([]byte, ctaphid.ReportLen)
+		binary.BigEndian.PutUint32(report, channel)
+		report[4] = seq
+		msg = msg[copy(report[5:], msg):]
+	}
+}
+
+// exchange sends the message cmd on channel and waits for the response
+// to it, which has the same command. If ctx is done first, the channel
+// is resynchronized before the next request on it, so that the token
+// drops the request and its response never arrives.
+func (d *loopbackDevice) exchange(ctx context.Context, channel uint32, cmd ctaphid.Command, msg []byte) ([]byte, error) {
+	w := loopbackWaiter{cmd, make(chan loopbackMessage, 1)}
+	d.mu.Lock()
+	d.waiting[channel] = w
+	d.mu.Unlock()
+
+	giveUp := func(err error) ([]byte, error) {
+		d.mu.Lock()
+		delete(d.waiting, channel)
+		d.stale[channel] = true
+		d.mu.Unlock()
+		return nil, err
+	}
+
+	if err := d.send(ctx, channel, cmd, msg); err != nil {
+		return giveUp(err)
+	}
+
+	select {
+	case r := <-w.rsp:
+		if r.cmd == ctaphid.CmdError {
+			return nil, fmt.Errorf("CTAPHID_ERROR %x", r.msg)
+		}
+		return r.msg, nil
+	case <-d.closed:
+		return giveUp(errors.New("closed"))
+	case <-ctx.Done():
+		return giveUp(fmt.Errorf("ctx.Err: %w", ctx.Err()))
+	}
+}
+
+// init sends CTAPHID_INIT on channel, which allocates a channel on the
+// broadcast channel, and resynchronizes any other. Returns the channel
+// allocated or resynchronized.
+func (d *loopbackDevice) init(ctx context.Context, channel uint32) (uint32, error) {
+	if channel == broadcastChannel {
+		// The responses of concurrent allocations would all be on
+		// the broadcast channel
+		d.initMu.Lock()
+		defer d.initMu.Unlock()
+	}
+
+	d.mu.Lock()
+	d.nonces++
+	nonce := binary.BigEndian.AppendUint64(nil, d.nonces)
+	d.mu.Unlock()
+
+	rsp, err := d.exchange(ctx, channel, ctaphid.CmdInit, nonce)
+	if err != nil {
+		return 0, fmt.Errorf("CTAPHID_INIT: %w", err)
+	}
+	// Nonce, channel, versions and capabilities
+	if len(rsp) != 8+4+5 || !bytes.Equal(rsp[:8], nonce) {
+		return 0, fmt.Errorf("CTAPHID_INIT: bad response %x", rsp)
+	}
+
+	return binary.BigEndian.Uint32(rsp[8:]), nil
+}
+
+// request sends the message cmd on channel, resynchronizing it first
+// if the last request on it was given up on, and returns the response.
+func (d *loopbackDevice) request(ctx context.Context, channel uint32, cmd ctaphid.Command, msg []byte) ([]byte, error) {
+	d.mu.Lock()
+	stale := d.stale[channel]
+	delete(d.stale, channel)
+	d.mu.Unlock()
+
+	if stale {
+		if _, err := d.init(ctx, channel); err != nil {
+			d.mu.Lock()
+			d.stale[channel] = true
+			d.mu.Unlock()
+			return nil, err
+		}
+	}
+
+	return d.exchange(ctx, channel, cmd, msg)
+}
+
+type hidResponse struct {
+	data   []byte
+	status uint16
+}
+
+// hidClient sends U2F and CTAP2 requests to softHID through a
+// loopbackToken, as a browser would through the HID device.
+type hidClient struct {
+	dev     *loopbackDevice
+	channel uint32
+}
+
+// u2f sends the U2F message msg and returns the response.
+func (c hidClient) u2f(ctx context.Context, msg []byte) (hidResponse, error) {
+	rsp, err := c.dev.request(ctx, c.channel, ctaphid.CmdMsg, msg)
+	if err != nil {
+		return hidResponse{}, err
+	}
+	if len(rsp) < 2 {
+		return hidResponse{}, fmt.Errorf("U2F response too short")
+	}
+
+	n := len(rsp) - 2
+	return hidResponse{rsp[:n], binary.BigEndian.Uint16(rsp[n:])}, nil
+}
+
+// cbor sends the CTAP2 command cmd with CBOR params, and returns the
+// status and CBOR data of the response.
+func (c hidClient) cbor(ctx context.Context, cmd byte, params []byte) (byte, []byte, error) {
+	msg := append([]byte{cmd}, params...)
+	rsp, err := c.dev.request(ctx, c.channel, ctaphid.CmdCBOR, msg)
+	if err != nil {
+		return 0, nil, err
+	}
+	if len(rsp) < 1 {
+		return 0, nil, fmt.Errorf("CTAP2 response too short")
+	}
+
+	return rsp[0], rsp[1:], nil
+}
+
+// u2fRegister returns the keyhandle and public key of a new
+// credential.
+func (c hidClient) u2fRegister(ctx context.Context, appliParam, challParam [32]byte) ([]byte, []byte, error) {
+	var data []byte
+	data = append(data, challParam[:]...)
+	data = append(data, appliParam[:]...)
+
+	r, err := c.u2f(ctx, u2fMessage(u2f.CmdRegister, 0, data))
+	if err != nil {
+		return nil, nil, err
+	}
+	if r.status != statuscode.NoError {
+		return nil, nil, fmt.Errorf("register: status 0x%04x", r.status)
+	}
+
+	// 0x05, 65 B public key, keyhandle length, keyhandle, certificate
+	// and signature
+	if len(r.data) < 1+65+1 || len(r.data) < 1+65+1+int(r.data[66]) {
+		return nil, nil, fmt.Errorf("register: response too short")
+	}
+	pubBytes := r.data[1 : 1+65]
+	keyHandle := r.data[1+65+1 : 1+65+1+int(r.data[66])]
+
+	return keyHandle, pubBytes, nil
+}
+
+// u2fCheckOnly tells if the keyhandle is one of the TKey's.
+func (c hidClient) u2fCheckOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error) {
+	var challParam [32]byte
+
+	r, err := c.u2f(ctx, u2fMessage(u2f.CmdAuthenticate, byte(u2f.CtrlCheckOnly),
+		authenticateData(appliParam, challParam, keyHandle)))
+	if err != nil {
+		return false, err
+	}
+
+	switch r.status {
+	case statuscode.ConditionsNotSatisfied:
+		return true, nil
+	case statuscode.WrongData:
+		return false, nil
+	default:
+		return false, fmt.Errorf("checkonly: status 0x%04x", r.status)
+	}
+}
+
+// u2fAuthenticate returns whether the keyhandle was valid, user
+// presence, the counter softHID used and the signature.
+func (c hidClient) u2fAuthenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool) (bool, byte, uint32, []byte, error) {
+	ctrl := u2f.CtrlDontEnforeUserPresenceAndSign
+	if checkUser {
+		ctrl = u2f.CtrlEnforeUserPresenceAndSign
+	}
+
+	r, err := c.u2f(ctx, u2fMessage(u2f.CmdAuthenticate, byte(ctrl),
+		authenticateData(appliParam, challParam, keyHandle)))
+	if err != nil {
+		return false, 0, 0, nil, err
+	}
+
+	switch r.status {
+	case statuscode.NoError:
+	case statuscode.WrongData:
+		return false, 0, 0, nil, nil
+	default:
+		return false, 0, 0, nil, fmt.Errorf("authenticate: status 0x%04x", r.status)
+	}
+
+	// User presence, 4 B counter and signature
+	if len(r.data) < 1+4+1 {
+		return false, 0, 0, nil, fmt.Errorf("authenticate: response too short")
+	}
+
+	return true, r.data[0], binary.BigEndian.Uint32(r.data[1:5]), r.data[5:], nil
+}
+
+func authenticateData(appliParam, challParam [32]byte, keyHandle [64]byte) []byte {
+	var data []byte
+	data = append(data, challParam[:]...)
+	data = append(data, appliParam[:]...)
+	data = append(data, byte(len(keyHandle)))
+	data = append(data, keyHandle[:]...)
+
+	return data
+}
+
+// u2fMessage is a U2F request APDU in extended length encoding,
+// without Le.
+func u2fMessage(ins u2f.Command, p1 byte, data []byte) []byte {
+	msg := []byte{0x00, byte(ins), p1, 0x00, 0x00, byte(len(data) >> 8), byte(len(data))}
+	return append(msg, data...)
+}
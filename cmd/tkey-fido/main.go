@@ -4,19 +4,29 @@
 package main
 
 import (
+	"bufio"
 	"bytes"
 	"context"
 	"crypto/ecdsa"
 	"crypto/elliptic"
 	"crypto/sha256"
 	"encoding/binary"
+	"errors"
 	"fmt"
+	"io"
 	"log"
 	"os"
+	"path/filepath"
 	"runtime/debug"
 	"strings"
+	"sync"
+	"time"
 
 	"github.com/spf13/pflag"
+	"github.com/tillitis/tkey-fido/internal/counterstore"
+	"github.com/tillitis/tkey-fido/internal/metrics"
+	"github.com/tillitis/tkey-fido/internal/tk1fido"
+	"github.com/tillitis/tkey-fido/internal/unixsock"
 	"github.com/tillitis/tkeyclient"
 )
 
@@ -28,7 +38,14 @@ const progname = "tkey-fido"
 var version string
 
 func main() {
+	var trace *tk1fido.TraceWriter
+	var traceOut io.Closer
 	exit := func(code int) {
+		if traceOut != nil {
+			if err := traceOut.Close(); err != nil {
+				le.Printf("Failed to write trace: %s\n", err)
+			}
+		}
 		os.Exit(code)
 	}
 
@@ -36,15 +53,18 @@ func main() {
 		version = readBuildInfo()
 	}
 
-	var devPath, fileUSS, pinentry string
-	var speed int
-	var enterUSS, listPortsOnly, testOnly, versionOnly, helpOnly bool
+	var devPath, defaultPath, fileUSS, pinentry, counterFile, metricsAddr, brokerPath, useBrokerPath, traceFile string
+	var speed, benchIterations, benchConcurrency int
+	var benchDuration time.Duration
+	var enterUSS, listPortsOnly, testOnly, benchOnly, debug, versionOnly, helpOnly bool
 	pflag.CommandLine.SetOutput(os.Stderr)
 	pflag.CommandLine.SortFlags = false
 	pflag.BoolVarP(&listPortsOnly, "list-ports", "L", false,
 		"List possible serial ports to use with --port.")
 	pflag.StringVar(&devPath, "port", "",
-		"Set serial port device `PATH`. If this is not passed, auto-detection will be attempted.")
+		"Set serial port device `PATH`. If this is not passed, all TKeys plugged in that run the fido app are used, and the app is only loaded onto the one passed with --default-port, or the only one plugged in.")
+	pflag.StringVar(&defaultPath, "default-port", "",
+		"Register new credentials on the TKey at serial port `PATH` when several are plugged in, loading the fido app onto it if needed. The default is the first one found running the fido app.")
 	pflag.IntVar(&speed, "speed", tkeyclient.SerialSpeed,
 		"Set serial port speed in `BPS` (bits per second).")
 	pflag.BoolVar(&enterUSS, "uss", false,
@@ -54,7 +74,26 @@ func main() {
 		"Read `FILE` and hash its contents as the USS. Use '-' (dash) to read from stdin. The full contents are hashed unmodified (e.g. newlines are not stripped).")
 	pflag.StringVar(&pinentry, "pinentry", "",
 		"Pinentry `PROGRAM` for use by --uss. The default is found by looking in your gpg-agent.conf for pinentry-program, or 'pinentry' if not found there.")
-	pflag.BoolVar(&testOnly, "test", false, "Run a simple U2F register/authenticate test towards the app on the TKey, then exit.")
+	pflag.StringVar(&counterFile, "counter-file", "",
+		"Keep the U2F signature counters in `FILE`. The default is tkey-fido/counters in your user config directory. Only one tkey-fido at a time can use a counter file.")
+	pflag.StringVar(&metricsAddr, "metrics", "",
+		"Serve metrics in the Prometheus text format on /metrics at `ADDR`, either unix:PATH for a Unix socket or HOST:PORT, e.g. localhost:9464.")
+	pflag.StringVar(&brokerPath, "broker", "",
+		"Keep the TKeys connected with the fido app loaded, and share them with other tkey-fido run with --use-broker on the Unix socket `PATH`, instead of running a soft HID.")
+	pflag.StringVar(&useBrokerPath, "use-broker", "",
+		"Use the TKeys of the tkey-fido run with --broker on the Unix socket `PATH`, instead of opening serial ports.")
+	pflag.StringVar(&traceFile, "trace", "",
+		"Record every frame sent to and received from the TKeys, with timestamps, to `FILE`, for replaying with tkey-fido-replay.")
+	pflag.BoolVar(&testOnly, "test", false, "Run a simple U2F register/authenticate test towards the app on the TKey, showing the time each exchange took, then exit.")
+	pflag.BoolVar(&benchOnly, "bench", false,
+		"Register once on each TKey, then run U2F checkonly/authenticate without user presence as a load test, verifying all signatures, and show the latency percentiles and throughput of each command, then exit.")
+	pflag.IntVar(&benchIterations, "iterations", 100,
+		"Run `N` checkonly/authenticate in total with --bench.")
+	pflag.DurationVar(&benchDuration, "duration", 0,
+		"Run for `DURATION` with --bench, instead of a number of iterations.")
+	pflag.IntVar(&benchConcurrency, "concurrency", 0,
+		"Run `N` goroutines with --bench, spread over the TKeys. The default is one per TKey.")
+	pflag.BoolVar(&debug, "debug", false, "Dump all frames sent to and received from the TKey, and the time each exchange took, on stderr.")
 	pflag.BoolVar(&versionOnly, "version", false, "Output version information.")
 	pflag.BoolVar(&helpOnly, "help", false, "Output this help.")
 	pflag.Usage = func() {
@@ -99,14 +138,120 @@ func main() {
 		exit(2)
 	}
 
-	fido := newFido(devPath, speed, enterUSS, fileUSS, pinentry, exit)
+	if brokerPath != "" && useBrokerPath != "" {
+		le.Printf("Pass only one of --broker or --use-broker.\n\n")
+		pflag.Usage()
+		exit(2)
+	}
+
+	if useBrokerPath != "" && benchOnly {
+		le.Printf("--bench needs the TKeys themselves, not --use-broker.\n\n")
+		pflag.Usage()
+		exit(2)
+	}
+
+	if useBrokerPath != "" && counterFile != "" {
+		le.Printf("--counter-file isn't used with --use-broker, the broker keeps the counters.\n\n")
+		pflag.Usage()
+		exit(2)
+	}
+
+	if useBrokerPath != "" && traceFile != "" {
+		le.Printf("--trace needs the TKeys themselves, not --use-broker.\n\n")
+		pflag.Usage()
+		exit(2)
+	}
+
+	// Before anything that can exit on a signal, which closes it
+	if traceFile != "" {
+		var err error
+		trace, traceOut, err = createTrace(traceFile)
+		if err != nil {
+			le.Printf("Failed to create trace: %s\n", err)
+			exit(1)
+		}
+	}
+
+	var fido *fidoPool
+	var brokerDev *brokerDevice
+	var device u2fDevice
+	if useBrokerPath != "" {
+		var err error
+		brokerDev, err = dialBroker(useBrokerPath)
+		if err != nil {
+			le.Printf("Failed to connect to broker: %s\n", err)
+			exit(1)
+		}
+		device = brokerDev
+	} else {
+		fido = newFidoPool(devPath, defaultPath, speed, enterUSS, fileUSS, pinentry, debug, debug || testOnly, exit)
+		device = fido
+	}
+
+	if trace != nil {
+		fido.trace = trace
+	}
 
 	if testOnly {
-		test(fido)
+		test(device)
 		exit(0)
 	}
 
-	softHID := newSoftHID(fido)
+	if benchOnly {
+		if !bench(fido, benchIterations, benchDuration, benchConcurrency) {
+			exit(1)
+		}
+		exit(0)
+	}
+
+	if metricsAddr != "" {
+		go func() {
+			if err := metrics.ListenAndServe(metricsAddr, &metricsRegistry); err != nil {
+				le.Printf("Serving metrics failed: %s\n", err)
+			}
+		}()
+	}
+
+	// With --use-broker, the broker's, so that the counters only go
+	// up whichever of its clients signs
+	var counters counterSource = brokerDev
+	var store *counterstore.Store
+	if brokerDev == nil {
+		if counterFile == "" {
+			dir, err := os.UserConfigDir()
+			if err != nil {
+				le.Printf("Failed to find user config dir: %s\n", err)
+				exit(1)
+			}
+			counterFile = filepath.Join(dir, progname, "counters")
+		}
+
+		var err error
+		store, err = counterstore.Open(counterFile)
+		if errors.Is(err, counterstore.ErrLocked) {
+			le.Printf("Another %s is using the counter file %s. Pass --counter-file to run more than one.\n",
+				progname, counterFile)
+			exit(1)
+		}
+		if err != nil {
+			le.Printf("Failed to open counter file: %s\n", err)
+			exit(1)
+		}
+		counters = store
+	}
+
+	if brokerPath != "" {
+		if err := runBroker(fido, store, brokerPath); errors.Is(err, unixsock.ErrInUse) {
+			le.Printf("Another broker is serving on %s.\n", brokerPath)
+			exit(1)
+		} else if err != nil {
+			le.Printf("Broker failed: %s\n", err)
+			exit(1)
+		}
+		exit(0)
+	}
+
+	softHID := newSoftHID(device, counters)
 	err := softHID.Run(context.Background())
 	if err != nil {
 		le.Printf("Run failed: %s\n", err)
@@ -116,6 +261,61 @@ func main() {
 	exit(0)
 }
 
+// createTrace creates the trace file at path, readable only by us as
+// the frames hold key handles and signatures. What's written is
+// buffered until the returned io.Closer is closed.
+func createTrace(path string) (*tk1fido.TraceWriter, io.Closer, error) {
+	f, err := os.OpenFile(path, os.O_WRONLY|os.O_CREATE|os.O_TRUNC, 0o600)
+	if err != nil {
+		return nil, nil, fmt.Errorf("OpenFile: %w", err)
+	}
+
+	out := &bufferedFile{f: f, w: bufio.NewWriter(f)}
+	trace, err := tk1fido.NewTraceWriter(out)
+	if err != nil {
+		f.Close()
+		return nil, nil, fmt.Errorf("NewTraceWriter: %w", err)
+	}
+
+	return trace, out, nil
+}
+
+// bufferedFile is a file written through a bufio.Writer, flushed on
+// Close. It's safe for concurrent use.
+type bufferedFile struct {
+	mu sync.Mutex
+	f  *os.File
+	w  *bufio.Writer
+}
+
+func (b *bufferedFile) Write(p []byte) (int, error) {
+	b.mu.Lock()
+	defer b.mu.Unlock()
+
+	if b.w == nil {
+		return 0, os.ErrClosed
+	}
+	return b.w.Write(p)
+}
+
+func (b *bufferedFile) Close() error {
+	b.mu.Lock()
+	defer b.mu.Unlock()
+
+	if b.w == nil {
+		return nil
+	}
+	err := b.w.Flush()
+	b.w = nil
+	if closeErr := b.f.Close(); err == nil {
+		err = closeErr
+	}
+	if err != nil {
+		return fmt.Errorf("Close: %w", err)
+	}
+	return nil
+}
+
 func readBuildInfo() string {
 	version := "devel without BuildInfo"
 	if info, ok := debug.ReadBuildInfo(); ok {
@@ -147,15 +347,16 @@ func printPorts() (int, error) {
 	return len(ports), nil
 }
 
-func test(s *fido) {
+func test(s u2fDevice) {
 	defer s.closeNow()
 
+	ctx := context.Background()
 	appliParam := sha256.Sum256([]byte("example.com"))
 
 	// The pubkey bytes are in uncompressed form, with marker first
 	// (65 bytes total)
 	fmt.Printf("Register...\n")
-	userPresence, keyHandle, pubBytes, err := s.u2fRegister(appliParam)
+	userPresence, keyHandle, pubBytes, err := s.u2fRegister(ctx, appliParam)
 	if err != nil {
 		le.Printf("U2FRegister failed: %v\n", err)
 		return
@@ -168,7 +369,7 @@ func test(s *fido) {
 	}
 
 	fmt.Printf("CheckOnly...\n")
-	keyHandleValid, err := s.u2fCheckOnly(appliParam, *(*[64]byte)(keyHandle))
+	keyHandleValid, err := s.u2fCheckOnly(ctx, appliParam, *(*[64]byte)(keyHandle))
 	if err != nil {
 		le.Printf("U2FCheckOnly failed: %v\n", err)
 		return
@@ -186,7 +387,7 @@ func test(s *fido) {
 	counter := uint32(0)
 
 	fmt.Printf("Authenticate...\n")
-	keyHandleValid, userPresence, sigASN1, err := s.u2fAuthenticate(appliParam,
+	keyHandleValid, userPresence, sigASN1, err := s.u2fAuthenticate(ctx, appliParam,
 		challParam, *(*[64]byte)(keyHandle), checkUser, counter)
 	if err != nil {
 		le.Printf("U2FAuthenticate failed: %v\n", err)
@@ -199,10 +400,19 @@ func test(s *fido) {
 		return
 	}
 
+	if err = verifySignature(pubBytes, appliParam, challParam, userPresence, counter, sigASN1); err != nil {
+		fmt.Printf("Their signature did NOT verify: %v\n", err)
+	} else {
+		fmt.Printf("Their signature verified!\n")
+	}
+}
+
+// verifySignature checks an authentication signature from the TKey,
+// over what a U2F authenticate signs, against pubBytes from register.
+func verifySignature(pubBytes []byte, appliParam, challParam [32]byte, userPresence byte, counter uint32, sigASN1 []byte) error {
 	pubX, pubY := elliptic.Unmarshal(elliptic.P256(), pubBytes)
 	if pubX == nil {
-		fmt.Printf("unmarshal fail\n")
-		return
+		return fmt.Errorf("unmarshal fail")
 	}
 	pub := &ecdsa.PublicKey{Curve: elliptic.P256(), X: pubX, Y: pubY}
 
@@ -213,9 +423,8 @@ func test(s *fido) {
 	signData.Write(challParam[:])
 	hash := sha256.Sum256(signData.Bytes())
 
-	if ecdsa.VerifyASN1(pub, hash[:], sigASN1) {
-		fmt.Printf("Their signature verified!\n")
-	} else {
-		fmt.Printf("Their signature did NOT verify\n")
+	if !ecdsa.VerifyASN1(pub, hash[:], sigASN1) {
+		return fmt.Errorf("bad signature")
 	}
+	return nil
 }
@@ -0,0 +1,32 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"github.com/tillitis/tkey-fido/internal/metrics"
+)
+
+// Served with --metrics. Always counted, it's cheap.
+var (
+	metricsRegistry metrics.Registry
+
+	metricCommands = metricsRegistry.NewCounter("tkey_fido_commands_total",
+		"Commands sent to the fido app on a TKey.", "command", "result")
+	metricCommandSeconds = metricsRegistry.NewHistogram("tkey_fido_command_duration_seconds",
+		"Time from writing a command to the fido app until its last response was read, including any wait for touch.",
+		metrics.DurationBuckets, "command")
+	metricTouchTimeouts = metricsRegistry.NewCounter("tkey_fido_touch_timeouts_total",
+		"Operations that needed a touch the user didn't give in time.", "operation")
+	metricConnects = metricsRegistry.NewCounter("tkey_fido_connects_total",
+		"Connections made to a TKey, which happen again after idling.")
+	metricAppLoads = metricsRegistry.NewCounter("tkey_fido_app_loads_total",
+		"Times the fido app was loaded onto a TKey.")
+	metricSerialErrors = metricsRegistry.NewCounter("tkey_fido_serial_errors_total",
+		"Failures to connect to a TKey or exchange frames with it.")
+	metricOperationLockSeconds = metricsRegistry.NewHistogram("tkey_fido_operation_lock_held_seconds",
+		"Time the lock allowing one HID request at a time was held.",
+		metrics.DurationBuckets, "request")
+	metricHIDRejected = metricsRegistry.NewCounter("tkey_fido_hid_rejected_total",
+		"HID requests rejected without being handled, as their origin sent too many or they waited too long.", "reason")
+)
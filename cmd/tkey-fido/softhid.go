@@ -11,18 +11,19 @@ package main
 import (
 	"bytes"
 	"context"
-	"crypto/ecdsa"
-	"crypto/rand"
-	"crypto/sha256"
 	"encoding/binary"
 	"fmt"
 	"sync"
+	"time"
 
 	"github.com/psanford/ctapkey/attestation"
-	"github.com/psanford/ctapkey/fidohid"
 	"github.com/psanford/ctapkey/sitesignatures"
 	"github.com/psanford/ctapkey/statuscode"
 	"github.com/psanford/ctapkey/u2f"
+	"github.com/tillitis/tkey-fido/internal/attest"
+	"github.com/tillitis/tkey-fido/internal/counterstore"
+	"github.com/tillitis/tkey-fido/internal/ctap2"
+	"github.com/tillitis/tkey-fido/internal/ctaphid"
 )
 
 // NOTES
@@ -40,27 +41,73 @@ import (
 
 const uhidName = "tkey-hid"
 
+// hidToken is the HID side of softHID: a ctaphid.Token on /dev/uhid,
+// or the loopbackToken of an in-process client.
+type hidToken interface {
+	Run(ctx context.Context) error
+	Events() chan ctaphid.Event
+	WriteResponse(ctx context.Context, ev ctaphid.Event, data []byte, status uint16) error
+	WriteCBORResponse(ctx context.Context, ev ctaphid.Event, status byte, data []byte) error
+	WriteKeepAlive(ctx context.Context, ev ctaphid.Event, status byte) error
+}
+
+// counterSource hands out the U2F signature counters: a
+// counterstore.Store, or the broker's.
+type counterSource interface {
+	Next(key [32]byte) (uint32, error)
+}
+
 type softHID struct {
-	theFido     *fido
+	theFido     u2fDevice
+	counters    counterSource
 	operationMu sync.Mutex // only handling 1 HID message at a time
 }
 
-func newSoftHID(s *fido) *softHID {
-	return &softHID{theFido: s}
+func newSoftHID(s u2fDevice, counters counterSource) *softHID {
+	return &softHID{theFido: s, counters: counters}
 }
 
 func (s *softHID) Run(ctx context.Context) error {
-	token, err := fidohid.New(ctx, uhidName, fidohid.WithCTAP2Disabled())
+	dev, err := ctaphid.OpenUHID(uhidName)
 	if err != nil {
-		return fmt.Errorf("fidohid.New: %w", err)
+		return fmt.Errorf("OpenUHID: %w", err)
 	}
 
-	go token.Run(ctx)
 	le.Printf("Running soft HID...\n")
+	return s.serve(ctx, ctaphid.New(dev))
+}
 
-	for ev := range token.Events() {
-		if ev.Error != nil {
-			le.Printf("token event error: %s", err)
+// serve handles the requests from token, one at a time, until it
+// stops sending them. Requests needing the TKey go through admission
+// first, so a flood of them is rejected early instead of queueing up.
+func (s *softHID) serve(ctx context.Context, token hidToken) error {
+	events := token.Events()
+	queue := newAdmission()
+	metricsRegistry.NewGaugeFunc("tkey_fido_hid_queue_depth",
+		"HID requests waiting for the one being handled.",
+		func() float64 { return float64(len(events) + queue.len()) })
+
+	go func() {
+		if err := token.Run(ctx); err != nil && ctx.Err() == nil {
+			le.Printf("token: %s\n", err)
+		}
+	}()
+
+	var wg sync.WaitGroup
+	wg.Add(1)
+	go func() {
+		defer wg.Done()
+		s.handlePending(ctx, token, queue)
+	}()
+	defer wg.Wait()
+	defer queue.close()
+
+	for ev := range events {
+		p := &pendingRequest{ev: ev, received: time.Now()}
+
+		if ev.Cmd == ctaphid.CmdCBOR {
+			p.origin = cborOrigin(ev.Msg)
+			s.admit(ctx, token, queue, p)
 			continue
 		}
 
@@ -69,6 +116,7 @@ func (s *softHID) Run(ctx context.Context) error {
 			le.Printf("DecodeAuthenticatorRequest failed: %s", err)
 			continue
 		}
+		p.req = req
 
 		switch req.Command {
 		case u2f.CmdVersion:
@@ -77,16 +125,11 @@ func (s *softHID) Run(ctx context.Context) error {
 				le.Printf("WriteResponse failed: %s\n", err)
 			}
 		case u2f.CmdRegister:
-			le.Printf("cmd: register site=%s", sitesignatures.FromAppParam(req.Register.ApplicationParam))
-			if err := s.handleRegister(ctx, token, ev, req); err != nil {
-				le.Printf("handleRegister error: %s\n", err)
-			}
+			p.origin = req.Register.ApplicationParam
+			s.admit(ctx, token, queue, p)
 		case u2f.CmdAuthenticate:
-			le.Printf("cmd: authenticate site=%s ctrl=%s", sitesignatures.FromAppParam(req.Authenticate.ApplicationParam),
-				authCtrlString(req.Authenticate.Ctrl))
-			if err := s.handleAuthenticate(ctx, token, ev, req); err != nil {
-				le.Printf("handleAuthenticate error: %s\n", err)
-			}
+			p.origin = req.Authenticate.ApplicationParam
+			s.admit(ctx, token, queue, p)
 		default:
 			le.Printf("unsupported cmd: 0x%02x\n", req.Command)
 			// send a not supported error for any commands that we
@@ -102,40 +145,106 @@ func (s *softHID) Run(ctx context.Context) error {
 	return fmt.Errorf("ctx.Err: %w", ctx.Err())
 }
 
-func (s *softHID) handleRegister(ctx context.Context, token *fidohid.SoftToken, ev fidohid.HIDEvent, req *u2f.AuthenticatorRequest) error {
-	s.operationMu.Lock()
-	defer s.operationMu.Unlock()
+// admit queues p for handlePending, or rejects it right away.
+func (s *softHID) admit(ctx context.Context, token hidToken, queue *admission, p *pendingRequest) {
+	evicted, reason := queue.admit(p)
+	if reason != "" {
+		s.reject(ctx, token, p, reason)
+	}
+	if evicted != nil {
+		s.reject(ctx, token, evicted, "queue-full")
+	}
+}
+
+// handlePending handles the queued requests, one at a time, shedding
+// those that waited too long.
+func (s *softHID) handlePending(ctx context.Context, token hidToken, queue *admission) {
+	for {
+		p, ok := queue.next()
+		if !ok {
+			return
+		}
+
+		if time.Since(p.received) > hidMaxAge {
+			s.reject(ctx, token, p, "stale")
+			continue
+		}
 
-	userPresence, keyHandle, pubBytes, err := s.theFido.u2fRegister(req.Register.ApplicationParam)
+		if p.req == nil {
+			if err := s.handleCBOR(ctx, token, p.ev); err != nil {
+				le.Printf("handleCBOR error: %s\n", err)
+			}
+			continue
+		}
+
+		switch req := p.req; req.Command {
+		case u2f.CmdRegister:
+			le.Printf("cmd: register site=%s", sitesignatures.FromAppParam(req.Register.ApplicationParam))
+			if err := s.handleRegister(ctx, token, p.ev, req); err != nil {
+				le.Printf("handleRegister error: %s\n", err)
+			}
+		case u2f.CmdAuthenticate:
+			le.Printf("cmd: authenticate site=%s ctrl=%s", sitesignatures.FromAppParam(req.Authenticate.ApplicationParam),
+				authCtrlString(req.Authenticate.Ctrl))
+			if err := s.handleAuthenticate(ctx, token, p.ev, req); err != nil {
+				le.Printf("handleAuthenticate error: %s\n", err)
+			}
+		}
+	}
+}
+
+// reject answers a request we won't handle so that the browser tries
+// again later: ConditionsNotSatisfied for U2F, as when waiting for
+// touch, and CTAP1_ERR_CHANNEL_BUSY for CTAP2. A U2F checkonly gets
+// WrongData instead, as ConditionsNotSatisfied would claim the
+// keyhandle is ours.
+func (s *softHID) reject(ctx context.Context, token hidToken, p *pendingRequest, reason string) {
+	metricHIDRejected.Inc(reason)
+
+	if p.req == nil {
+		if err := token.WriteCBORResponse(ctx, p.ev, byte(ctap2.StatusChannelBusy), nil); err != nil {
+			le.Printf("WriteCBORResponse failed: %s\n", err)
+		}
+		return
+	}
+
+	status := uint16(statuscode.ConditionsNotSatisfied)
+	if p.req.Command == u2f.CmdAuthenticate && p.req.Authenticate.Ctrl == u2f.CtrlCheckOnly {
+		status = statuscode.WrongData
+	}
+	if err := token.WriteResponse(ctx, p.ev, nil, status); err != nil {
+		le.Printf("WriteResponse failed: %s\n", err)
+	}
+}
+
+func (s *softHID) handleRegister(ctx context.Context, token hidToken, ev ctaphid.Event, req *u2f.AuthenticatorRequest) error {
+	defer s.lockOperation("register")()
+
+	// Hashed and with its nonce computed while the TKey waits for
+	// touch
+	reg := attest.Start(attestation.PrivateKey, req.Register.ApplicationParam, req.Register.ChallengeParam)
+
+	userPresence, keyHandle, pubBytes, err := s.theFido.u2fRegister(ctx, req.Register.ApplicationParam)
 	if err != nil {
 		return fmt.Errorf("u2fRegister failed: %w", err)
 	}
 
 	if userPresence == 0 {
 		le.Printf("register: no user present\n")
+		metricTouchTimeouts.Inc("register")
 		if err = token.WriteResponse(ctx, ev, nil, statuscode.ConditionsNotSatisfied); err != nil {
 			le.Printf("WriteResponse failed: %s\n", err)
 		}
 		return nil
 	}
 
-	// TODO We're doing attestation signing here in the host-program
-	// just like tpm-fido, and using the same "dummy"
-	// certificate/privatekey as they.
-	var attSigData bytes.Buffer
-	attSigData.WriteByte(0x00) // reserved byte
-	attSigData.Write(req.Register.ApplicationParam[:])
-	attSigData.Write(req.Register.ChallengeParam[:])
-	attSigData.Write(keyHandle)
-	attSigData.Write(pubBytes)
-	hash := sha256.Sum256(attSigData.Bytes())
-
-	attSig, err := ecdsa.SignASN1(rand.Reader, attestation.PrivateKey, hash[:])
+	attSig, err := reg.Finish(keyHandle, pubBytes)
 	if err != nil {
-		return fmt.Errorf("SignASN1 (attestation) failed: %w", err)
+		return fmt.Errorf("attestation: %w", err)
 	}
 
 	var resp bytes.Buffer
+	resp.Grow(1 + len(pubBytes) + 1 + len(keyHandle) + len(attestation.CertDer) + len(attSig))
 	resp.WriteByte(0x05) // reserved byte
 	resp.Write(pubBytes)
 	resp.WriteByte(byte(len(keyHandle)))
@@ -151,9 +260,8 @@ func (s *softHID) handleRegister(ctx context.Context, token *fidohid.SoftToken,
 	return nil
 }
 
-func (s *softHID) handleAuthenticate(ctx context.Context, token *fidohid.SoftToken, ev fidohid.HIDEvent, req *u2f.AuthenticatorRequest) error {
-	s.operationMu.Lock()
-	defer s.operationMu.Unlock()
+func (s *softHID) handleAuthenticate(ctx context.Context, token hidToken, ev ctaphid.Event, req *u2f.AuthenticatorRequest) error {
+	defer s.lockOperation("authenticate")()
 
 	// Our keyhandles are always 64 bytes
 	if l := len(req.Authenticate.KeyHandle); l != 64 {
@@ -166,7 +274,7 @@ func (s *softHID) handleAuthenticate(ctx context.Context, token *fidohid.SoftTok
 	keyHandle := *(*[64]byte)(req.Authenticate.KeyHandle)
 	appliParam := req.Authenticate.ApplicationParam
 
-	keyHandleValid, err := s.theFido.u2fCheckOnly(appliParam, keyHandle)
+	keyHandleValid, err := s.theFido.u2fCheckOnly(ctx, appliParam, keyHandle)
 	if err != nil {
 		if err2 := token.WriteResponse(ctx, ev, nil, statuscode.WrongData); err2 != nil {
 			le.Printf("WriteResponse failed: %s\n", err2)
@@ -195,11 +303,18 @@ func (s *softHID) handleAuthenticate(ctx context.Context, token *fidohid.SoftTok
 	}
 
 	checkUser := (req.Authenticate.Ctrl == u2f.CtrlEnforeUserPresenceAndSign)
-	// TODO hardcoded. Here we should read counter from some storage
-	// in user's homedir, increment it, write it back
-	counter := uint32(1)
 
-	keyHandleValid, userPresence, sigASN1, err := s.theFido.u2fAuthenticate(appliParam,
+	// Normally served from a block already reserved on disk, so this
+	// doesn't wait for any I/O.
+	counter, err := s.counters.Next(counterstore.Key(appliParam, keyHandle))
+	if err != nil {
+		if err2 := token.WriteResponse(ctx, ev, nil, statuscode.ConditionsNotSatisfied); err2 != nil {
+			le.Printf("WriteResponse failed: %s\n", err2)
+		}
+		return fmt.Errorf("counter: %w", err)
+	}
+
+	keyHandleValid, userPresence, sigASN1, err := s.theFido.u2fAuthenticate(ctx, appliParam,
 		req.Authenticate.ChallengeParam, keyHandle, checkUser, counter)
 	if err != nil {
 		if err2 := token.WriteResponse(ctx, ev, nil, statuscode.WrongData); err2 != nil {
@@ -216,6 +331,7 @@ func (s *softHID) handleAuthenticate(ctx context.Context, token *fidohid.SoftTok
 
 	if checkUser && userPresence == 0 {
 		le.Printf("authenticate: user not present but required\n")
+		metricTouchTimeouts.Inc("authenticate")
 		if err = token.WriteResponse(ctx, ev, nil, statuscode.ConditionsNotSatisfied); err != nil {
 			le.Printf("WriteResponse failed: %s\n", err)
 		}
@@ -234,6 +350,18 @@ func (s *softHID) handleAuthenticate(ctx context.Context, token *fidohid.SoftTok
 	return nil
 }
 
+// lockOperation takes operationMu and returns the func releasing it,
+// which also records how long it was held.
+func (s *softHID) lockOperation(request string) func() {
+	s.operationMu.Lock()
+	start := time.Now()
+
+	return func() {
+		metricOperationLockSeconds.Observe(time.Since(start), request)
+		s.operationMu.Unlock()
+	}
+}
+
 func authCtrlString(authCtrl u2f.AuthCtrl) string {
 	switch authCtrl {
 	case u2f.CtrlCheckOnly:
@@ -0,0 +1,218 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package main
+
+import (
+	"context"
+	"crypto/ecdsa"
+	"crypto/elliptic"
+	"crypto/rand"
+	"crypto/sha256"
+	"encoding/binary"
+	"path/filepath"
+	"testing"
+	"time"
+
+	"github.com/tillitis/tkey-fido/internal/counterstore"
+	"github.com/tillitis/tkey-fido/internal/ctap2"
+)
+
+// fakeU2F is a u2fDevice with a single credential, whose keyhandle is
+// all appliParam[0], signing as the app does. The user is always
+// present.
+type fakeU2F struct {
+	key *ecdsa.PrivateKey
+}
+
+func newFakeU2F(t *testing.T) *fakeU2F {
+	t.Helper()
+
+	key, err := ecdsa.GenerateKey(elliptic.P256(), rand.Reader)
+	if err != nil {
+		t.Fatalf("GenerateKey: %v", err)
+	}
+
+	return &fakeU2F{key}
+}
+
+func fakeKeyHandle(appliParam [32]byte) [64]byte {
+	var keyHandle [64]byte
+	for i := range keyHandle {
+		keyHandle[i] = appliParam[0]
+	}
+	return keyHandle
+}
+
+func (f *fakeU2F) u2fRegister(ctx context.Context, appliParam [32]byte) (byte, []byte, []byte, error) {
+	keyHandle := fakeKeyHandle(appliParam)
+	pubBytes := elliptic.Marshal(elliptic.P256(), f.key.X, f.key.Y)
+	return 1, keyHandle[:], pubBytes, nil
+}
+
+func (f *fakeU2F) u2fCheckOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error) {
+	return keyHandle == fakeKeyHandle(appliParam), nil
+}
+
+func (f *fakeU2F) u2fAuthenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error) {
+	if keyHandle != fakeKeyHandle(appliParam) {
+		return false, 0, nil, nil
+	}
+
+	var userPresence byte
+	if checkUser {
+		userPresence = 1
+	}
+
+	var signData []byte
+	signData = append(signData, appliParam[:]...)
+	signData = append(signData, userPresence)
+	signData = binary.BigEndian.AppendUint32(signData, counter)
+	signData = append(signData, challParam[:]...)
+	hash := sha256.Sum256(signData)
+
+	sigASN1, err := ecdsa.SignASN1(rand.Reader, f.key, hash[:])
+	if err != nil {
+		return false, 0, nil, err
+	}
+
+	return true, userPresence, sigASN1, nil
+}
+
+func (f *fakeU2F) closeNow() {}
+
+// startSoftHID serves softHID on a fakeU2F through a loopbackToken,
+// and returns a client of it.
+func startSoftHID(t *testing.T) hidClient {
+	t.Helper()
+
+	counters, err := counterstore.Open(filepath.Join(t.TempDir(), "counters"))
+	if err != nil {
+		t.Fatalf("counterstore.Open: %v", err)
+	}
+
+	ctx, cancel := context.WithCancel(context.Background())
+	token := newLoopbackToken()
+	done := make(chan struct{})
+	go func() {
+		defer close(done)
+		_ = newSoftHID(newFakeU2F(t), counters).serve(ctx, token)
+	}()
+	t.Cleanup(func() {
+		cancel()
+		<-done
+		counters.Close()
+	})
+
+	client, err := token.client(testContext(t))
+	if err != nil {
+		t.Fatalf("client: %v", err)
+	}
+
+	return client
+}
+
+func testContext(t *testing.T) context.Context {
+	ctx, cancel := context.WithTimeout(context.Background(), 10*time.Second)
+	t.Cleanup(cancel)
+
+	return ctx
+}
+
+func TestLoopbackU2F(t *testing.T) {
+	t.Parallel()
+	c := startSoftHID(t)
+	ctx := testContext(t)
+
+	appliParam := sha256.Sum256([]byte("example.com"))
+	challParam := sha256.Sum256([]byte("challenge"))
+
+	// The request and response both take continuation packets
+	keyHandle, pubBytes, err := c.u2fRegister(ctx, appliParam, challParam)
+	if err != nil {
+		t.Fatalf("u2fRegister: %v", err)
+	}
+	if len(keyHandle) != 64 {
+		t.Fatalf("keyhandle of %d bytes", len(keyHandle))
+	}
+
+	valid, err := c.u2fCheckOnly(ctx, appliParam, *(*[64]byte)(keyHandle))
+	if err != nil || !valid {
+		t.Fatalf("u2fCheckOnly: got %v, %v, want valid", valid, err)
+	}
+	valid, err = c.u2fCheckOnly(ctx, sha256.Sum256([]byte("example.org")), *(*[64]byte)(keyHandle))
+	if err != nil || valid {
+		t.Fatalf("u2fCheckOnly of another origin: got %v, %v, want not valid", valid, err)
+	}
+
+	var userPresence byte
+	var counter, last uint32
+	var sigASN1 []byte
+	for i := 0; i < 2; i++ {
+		valid, userPresence, counter, sigASN1, err = c.u2fAuthenticate(ctx, appliParam, challParam,
+			*(*[64]byte)(keyHandle), true)
+		if err != nil || !valid {
+			t.Fatalf("u2fAuthenticate: got %v, %v, want valid", valid, err)
+		}
+		if i > 0 && counter <= last {
+			t.Fatalf("counter went from %d to %d", last, counter)
+		}
+		last = counter
+
+		if err = verifySignature(pubBytes, appliParam, challParam, userPresence, counter, sigASN1); err != nil {
+			t.Fatalf("verifySignature: %v", err)
+		}
+	}
+}
+
+// getAssertionParams is authenticatorGetAssertion of keyHandle on
+// example.com, without user presence.
+func getAssertionParams(clientDataHash [32]byte, keyHandle [64]byte) []byte {
+	var p []byte
+	p = append(p, 0xa4)       // map(4)
+	p = append(p, 0x01, 0x6b) // 1: text(11)
+	p = append(p, "example.com"...)
+	p = append(p, 0x02, 0x58, 0x20) // 2: bytes(32)
+	p = append(p, clientDataHash[:]...)
+	p = append(p, 0x03, 0x81, 0xa2)           // 3: [{
+	p = append(p, 0x62, 'i', 'd', 0x58, 0x40) // "id": bytes(64)
+	p = append(p, keyHandle[:]...)
+	p = append(p, 0x64, 't', 'y', 'p', 'e', 0x6a)   // "type": text(10)
+	p = append(p, "public-key"...)                  // }]
+	p = append(p, 0x05, 0xa1, 0x62, 'u', 'p', 0xf4) // 5: {"up": false}
+	return p
+}
+
+func TestLoopbackCBOR(t *testing.T) {
+	t.Parallel()
+	c := startSoftHID(t)
+	ctx := testContext(t)
+
+	status, info, err := c.cbor(ctx, ctap2.CmdGetInfo, nil)
+	if err != nil {
+		t.Fatalf("getInfo: %v", err)
+	}
+	if status != byte(ctap2.StatusOK) || len(info) == 0 || info[0]&0xe0 != 0xa0 {
+		t.Fatalf("getInfo: status 0x%02x, %x", status, info)
+	}
+
+	appliParam := sha256.Sum256([]byte("example.com"))
+	clientDataHash := sha256.Sum256([]byte("client data"))
+	status, rsp, err := c.cbor(ctx, ctap2.CmdGetAssertion,
+		getAssertionParams(clientDataHash, fakeKeyHandle(appliParam)))
+	if err != nil {
+		t.Fatalf("getAssertion: %v", err)
+	}
+	if status != byte(ctap2.StatusOK) || len(rsp) == 0 {
+		t.Fatalf("getAssertion: status 0x%02x, %x", status, rsp)
+	}
+
+	status, _, err = c.cbor(ctx, ctap2.CmdGetAssertion,
+		getAssertionParams(clientDataHash, [64]byte{}))
+	if err != nil {
+		t.Fatalf("getAssertion of another credential: %v", err)
+	}
+	if status != byte(ctap2.StatusNoCredentials) {
+		t.Fatalf("getAssertion of another credential: status 0x%02x", status)
+	}
+}
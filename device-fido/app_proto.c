@@ -39,6 +39,13 @@ void appreply(struct frame_header hdr, enum appcmd rspcode, void *buf)
 		nbytes = 128;
 		break;
 
+#ifdef BENCH
+	case APP_RSP_BENCH_COUNTERS:
+		len = LEN_32;
+		nbytes = 32;
+		break;
+#endif
+
 	case APP_RSP_UNKNOWN_CMD:
 		len = LEN_1;
 		nbytes = 1;
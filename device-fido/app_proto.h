@@ -21,6 +21,11 @@ enum appcmd {
 	APP_CMD_U2F_AUTHENTICATE_GO  = 0x08,
 	APP_RSP_U2F_AUTHENTICATE     = 0x09,
 
+#ifdef BENCH
+	APP_CMD_BENCH_COUNTERS       = 0x40,
+	APP_RSP_BENCH_COUNTERS       = 0x41,
+#endif
+
 	APP_RSP_UNKNOWN_CMD = 0xff,
 };
 // clang-format on
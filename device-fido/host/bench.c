@@ -0,0 +1,220 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Known-answer tests and benchmarks of the app's crypto core, built for
+// the host. u2f.c is included rather than linked so we can reach its
+// static blake2s_mac().
+
+#include "../u2f.c"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../rng.h"
+#include "hal.h"
+
+// clang-format off
+static const uint32_t kat_cdi[8] = {
+	0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c,
+	0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c,
+};
+#define KAT_ENTROPY 0xa5a5a5a5
+// clang-format on
+
+static uint8_t appli_param[32];
+static uint8_t chall_param[32];
+static const uint8_t counter[4] = {0x00, 0x00, 0x01, 0x00};
+
+static int failed;
+
+static void check(const char *name, const uint8_t *got, const char *want)
+{
+	char hex[2 * 129 + 1];
+	size_t n = strlen(want) / 2;
+
+	for (size_t i = 0; i < n; i++) {
+		sprintf(&hex[2 * i], "%02x", got[i]);
+	}
+
+	if (strcmp(hex, want) != 0) {
+		printf("KAT %s: FAIL\n  got:  %s\n  want: %s\n", name, hex,
+		       want);
+		failed = 1;
+		return;
+	}
+	printf("KAT %s: ok\n", name);
+}
+
+static void setup()
+{
+	for (int i = 0; i < 32; i++) {
+		appli_param[i] = i;
+		chall_param[i] = 0xff - i;
+	}
+
+	hal_init(kat_cdi, KAT_ENTROPY);
+	rng_init_state();
+	u2f_init();
+}
+
+// The expected values are what the app on a TKey outputs, given the
+// same CDI and TRNG. They must not change unless we mean to change
+// the keys of every user.
+static void kat(uint8_t keyhandle[64])
+{
+	uint8_t mac[32];
+	uint8_t output[129];
+	uint8_t payload[66];
+	const uint8_t check_user = 1;
+
+	setup();
+
+	blake2s_mac(mac, appli_param, chall_param);
+	check("blake2s_mac", mac,
+	      "9f8cac3d8b78aa7ad4618b8b2bd5190983668a032768ef6899a1f97df9d1a31a");
+
+	if (hal_touch_start() != 0) {
+		printf("KAT: couldn't start touch thread\n");
+		failed = 1;
+		return;
+	}
+
+	if (u2f_register(output, appli_param) != 0 || output[0] != 1) {
+		printf("KAT register: FAIL\n");
+		failed = 1;
+	}
+	check("register keyhandle", &output[1],
+	      "a726a54d6711759b029ae965b76526a9faed7663b21a64cb15c03dc0ab6a4af5"
+	      "771b383e5c3dfeaa2c47107918ffbebe16a65643bacd49b7168b2de547f1d436");
+	check("register pubkey", &output[1 + 64],
+	      "df743a66bab286b8c37be827423e833021668f9e92070345adfab89653d2a385"
+	      "7262460769cc9e4dc28c065d107e6c780db2506e594241e7f34fb835a86368b6");
+	memcpy(keyhandle, &output[1], 64);
+
+	u2f_checkonly(payload, appli_param, keyhandle);
+	check("checkonly", payload, "01");
+	keyhandle[63] ^= 1;
+	u2f_checkonly(payload, appli_param, keyhandle);
+	check("checkonly tampered", payload, "00");
+	keyhandle[63] ^= 1;
+
+	if (u2f_authenticate(payload, appli_param, chall_param, keyhandle,
+			     &check_user, counter) != 0) {
+		printf("KAT authenticate: FAIL\n");
+		failed = 1;
+	}
+	check("authenticate", payload,
+	      "0101bb2d75e4fd6d9174506dd4454d40eca4bbc5a3013777c261816ef445b3b1"
+	      "0dece8f14da337d05da9e321c4dc72a6be51c3690a72206e2e6c3329b6bc9b8f"
+	      "d7c5");
+
+	hal_touch_stop();
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct bench {
+	const char *name;
+	void (*op)(const uint8_t *keyhandle);
+};
+
+static void op_derive(const uint8_t *keyhandle)
+{
+	uint8_t priv[32];
+
+	blake2s_mac(priv, appli_param, keyhandle);
+}
+
+static void op_checkonly(const uint8_t *keyhandle)
+{
+	uint8_t payload[1];
+
+	u2f_checkonly(payload, appli_param, keyhandle);
+}
+
+static void op_register(const uint8_t *keyhandle)
+{
+	uint8_t output[129];
+
+	(void)keyhandle;
+	u2f_register(output, appli_param);
+}
+
+static void op_authenticate(const uint8_t *keyhandle)
+{
+	uint8_t payload[66];
+	const uint8_t check_user = 0;
+
+	u2f_authenticate(payload, appli_param, chall_param, keyhandle,
+			 &check_user, counter);
+}
+
+// run doubles the iterations, like go test -bench, until op has run for
+// at least a second, and returns ns/op
+static double run(const struct bench *b, const uint8_t *keyhandle)
+{
+	uint64_t n = 1;
+
+	for (;;) {
+		uint64_t start = now_ns();
+		for (uint64_t i = 0; i < n; i++) {
+			b->op(keyhandle);
+		}
+		uint64_t elapsed = now_ns() - start;
+
+		if (elapsed >= 1000000000 || n >= (1 << 30)) {
+			printf("%-20s %10llu %14.0f ns/op", b->name,
+			       (unsigned long long)n, (double)elapsed / n);
+			return (double)elapsed / n;
+		}
+		n *= 2;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t keyhandle[64];
+	int kat_only = argc > 1 && strcmp(argv[1], "-k") == 0;
+
+	kat(keyhandle);
+	if (failed) {
+		return 1;
+	}
+	if (kat_only) {
+		return 0;
+	}
+
+	// register waits for touch
+	if (hal_touch_start() != 0) {
+		printf("couldn't start touch thread\n");
+		return 1;
+	}
+
+	const struct bench benches[] = {
+	    {"derive", op_derive},
+	    {"checkonly", op_checkonly},
+	    {"register", op_register},
+	    {"authenticate", op_authenticate},
+	};
+
+	// Relative to keyhandle derivation, a single keyed blake2s
+	double base = 0;
+	for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		double ns = run(&benches[i], keyhandle);
+		if (base == 0) {
+			base = ns;
+		}
+		printf(" %10.1fx derive\n", ns / base);
+	}
+
+	hal_touch_stop();
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <pthread.h>
+#include <sched.h>
+#include <tkey/lib.h>
+#include <tkey/tk1_mem.h>
+
+#include "hal.h"
+
+struct hal_mmio hal_mmio;
+
+static volatile int pressing;
+static pthread_t presser;
+
+void wordcpy(void *dest, void *src, unsigned n)
+{
+	uint32_t *s = src;
+	uint32_t *d = dest;
+
+	for (unsigned i = 0; i < n; i++) {
+		d[i] = s[i];
+	}
+}
+
+void hal_init(const uint32_t cdi[8], uint32_t entropy)
+{
+	memset(&hal_mmio, 0, sizeof(hal_mmio));
+	memcpy(hal_mmio.cdi, cdi, sizeof(hal_mmio.cdi));
+
+	// The TRNG always has a word, and it's always the same, so that
+	// runs are reproducible
+	hal_mmio.trng_status = 1;
+	hal_mmio.trng_entropy = entropy;
+
+	// The touch timeout never runs out
+	hal_mmio.timer_status = 1 << TK1_MMIO_TIMER_STATUS_RUNNING_BIT;
+}
+
+static void *press(void *arg)
+{
+	(void)arg;
+
+	while (pressing) {
+		// wait_touched() clears the event before looking for one,
+		// so keep it coming
+		*(volatile uint32_t *)&hal_mmio.touch =
+		    1 << TK1_MMIO_TOUCH_STATUS_EVENT_BIT;
+		sched_yield();
+	}
+
+	return NULL;
+}
+
+int hal_touch_start()
+{
+	pressing = 1;
+
+	return pthread_create(&presser, NULL, press, NULL);
+}
+
+void hal_touch_stop()
+{
+	pressing = 0;
+	pthread_join(presser, NULL);
+}
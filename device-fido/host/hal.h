@@ -0,0 +1,17 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+
+// Sets the CDI and the TRNG's entropy word that the app reads.
+void hal_init(const uint32_t cdi[8], uint32_t entropy);
+
+// Starts and stops a thread acting as a user keeping a finger on the
+// touch sensor.
+int hal_touch_start();
+void hal_touch_stop();
+
+#endif
@@ -0,0 +1,15 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Host stand-in for tkey-libs' lib.h, with the C library's memcpy()
+// and memset().
+
+#ifndef HOST_LIB_H
+#define HOST_LIB_H
+
+#include <stddef.h>
+#include <string.h>
+
+void wordcpy(void *dest, void *src, unsigned n);
+
+#endif
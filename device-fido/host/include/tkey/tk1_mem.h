@@ -0,0 +1,47 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Host stand-in for tkey-libs' tk1_mem.h. The MMIO addresses the app
+// uses are plain variables in hal.c, so the device code builds
+// unchanged for the host.
+
+#ifndef HOST_TK1_MEM_H
+#define HOST_TK1_MEM_H
+
+#include <stdint.h>
+
+struct hal_mmio {
+	uint32_t cdi[8];
+	uint32_t led;
+	uint32_t touch;
+	uint32_t timer;
+	uint32_t timer_prescaler;
+	uint32_t timer_status;
+	uint32_t timer_ctrl;
+	uint32_t trng_status;
+	uint32_t trng_entropy;
+};
+
+extern struct hal_mmio hal_mmio;
+
+// clang-format off
+#define TK1_MMIO_TK1_CDI_FIRST   (&hal_mmio.cdi[0])
+#define TK1_MMIO_TK1_LED         (&hal_mmio.led)
+#define TK1_MMIO_TOUCH_STATUS    (&hal_mmio.touch)
+#define TK1_MMIO_TIMER_TIMER     (&hal_mmio.timer)
+#define TK1_MMIO_TIMER_PRESCALER (&hal_mmio.timer_prescaler)
+#define TK1_MMIO_TIMER_STATUS    (&hal_mmio.timer_status)
+#define TK1_MMIO_TIMER_CTRL      (&hal_mmio.timer_ctrl)
+#define TK1_MMIO_TRNG_STATUS     (&hal_mmio.trng_status)
+#define TK1_MMIO_TRNG_ENTROPY    (&hal_mmio.trng_entropy)
+
+#define TK1_MMIO_TK1_LED_R_BIT           2
+#define TK1_MMIO_TK1_LED_G_BIT           1
+#define TK1_MMIO_TK1_LED_B_BIT           0
+#define TK1_MMIO_TOUCH_STATUS_EVENT_BIT  0
+#define TK1_MMIO_TIMER_CTRL_START_BIT    0
+#define TK1_MMIO_TIMER_CTRL_STOP_BIT     1
+#define TK1_MMIO_TIMER_STATUS_RUNNING_BIT 0
+// clang-format on
+
+#endif
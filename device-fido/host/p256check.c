@@ -0,0 +1,194 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+// p256-m built for the host with one of its backends (-DP256_BACKEND=),
+// driven by cmd/tkey-fido-p256check, which checks every result against
+// Go's crypto/ecdsa and crypto/elliptic.
+//
+// It reads one request per line on stdin and writes one response line
+// per request on stdout, all numbers in hex:
+//
+//	k PRIV          -> RET PUB       p256_keypair_from_bytes()
+//	s PRIV HASH K   -> RET SIG       p256_ecdsa_sign(), with nonce K
+//	v SIG PUB HASH  -> RET           p256_ecdsa_verify()
+//	e PRIV PEER     -> RET SECRET    p256_ecdh_shared_secret()
+//	t               -> OP N NS ...   time spent in each operation
+//
+// RET is the return value of the operation, in decimal.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../p256/p256-m.h"
+
+// Longest number in a request, a hash of up to 64 bytes
+#define MAXBYTES 64
+
+// What rng_generate() returns next, the nonce of the next signature
+static uint8_t nonce[32];
+static int nonce_left;
+
+int rng_generate(uint8_t *output, unsigned output_size)
+{
+	if (!nonce_left || output_size != sizeof(nonce)) {
+		return -1;
+	}
+
+	memcpy(output, nonce, sizeof(nonce));
+	nonce_left = 0;
+
+	return 0;
+}
+
+enum op { OP_KEYPAIR, OP_SIGN, OP_VERIFY, OP_ECDH, NOPS };
+
+static const char *const op_names[NOPS] = {"keypair", "sign", "verify",
+					   "ecdh"};
+
+static uint64_t op_n[NOPS];
+static uint64_t op_ns[NOPS];
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// hex_decode decodes the next space separated word of line into out,
+// and returns its length in bytes, or -1 if it's not hex or too long.
+static int hex_decode(char **line, uint8_t out[MAXBYTES])
+{
+	char *word = strtok_r(NULL, " \n", line);
+	int n = 0;
+
+	if (word == NULL || strlen(word) % 2 != 0 ||
+	    strlen(word) > 2 * MAXBYTES) {
+		return -1;
+	}
+
+	for (; word[2 * n] != '\0'; n++) {
+		unsigned int b;
+		if (sscanf(&word[2 * n], "%2x", &b) != 1) {
+			return -1;
+		}
+		out[n] = b;
+	}
+
+	return n;
+}
+
+static void hex_print(const uint8_t *p, size_t n)
+{
+	putchar(' ');
+	for (size_t i = 0; i < n; i++) {
+		printf("%02x", p[i]);
+	}
+}
+
+// request handles one request line, returning -1 if it's malformed
+static int request(char *line)
+{
+	uint8_t a[MAXBYTES], b[MAXBYTES], c[MAXBYTES];
+	uint8_t out[64] = {0};
+	int alen, blen, clen;
+	int ret;
+	uint64_t start;
+	char *rest;
+	char *cmd = strtok_r(line, " \n", &rest);
+
+	if (cmd == NULL || strlen(cmd) != 1) {
+		return -1;
+	}
+
+	switch (cmd[0]) {
+	case 'k':
+		if (hex_decode(&rest, a) != 32) {
+			return -1;
+		}
+		start = now_ns();
+		ret = p256_keypair_from_bytes(out, a);
+		op_ns[OP_KEYPAIR] += now_ns() - start;
+		op_n[OP_KEYPAIR]++;
+		printf("%d", ret);
+		hex_print(out, 64);
+		break;
+
+	case 's':
+		alen = hex_decode(&rest, a);
+		blen = hex_decode(&rest, b);
+		clen = hex_decode(&rest, c);
+		if (alen != 32 || blen < 0 || clen != 32) {
+			return -1;
+		}
+		memcpy(nonce, c, sizeof(nonce));
+		nonce_left = 1;
+		start = now_ns();
+		ret = p256_ecdsa_sign(out, a, b, blen);
+		op_ns[OP_SIGN] += now_ns() - start;
+		op_n[OP_SIGN]++;
+		printf("%d", ret);
+		hex_print(out, 64);
+		break;
+
+	case 'v':
+		alen = hex_decode(&rest, a);
+		blen = hex_decode(&rest, b);
+		clen = hex_decode(&rest, c);
+		if (alen != 64 || blen != 64 || clen < 0) {
+			return -1;
+		}
+		start = now_ns();
+		ret = p256_ecdsa_verify(a, b, c, clen);
+		op_ns[OP_VERIFY] += now_ns() - start;
+		op_n[OP_VERIFY]++;
+		printf("%d", ret);
+		break;
+
+	case 'e':
+		alen = hex_decode(&rest, a);
+		blen = hex_decode(&rest, b);
+		if (alen != 32 || blen != 64) {
+			return -1;
+		}
+		start = now_ns();
+		ret = p256_ecdh_shared_secret(out, a, b);
+		op_ns[OP_ECDH] += now_ns() - start;
+		op_n[OP_ECDH]++;
+		printf("%d", ret);
+		hex_print(out, 32);
+		break;
+
+	case 't':
+		for (int i = 0; i < NOPS; i++) {
+			printf("%s%s %llu %llu", i > 0 ? " " : "", op_names[i],
+			       (unsigned long long)op_n[i],
+			       (unsigned long long)op_ns[i]);
+		}
+		break;
+
+	default:
+		return -1;
+	}
+
+	putchar('\n');
+	fflush(stdout);
+
+	return 0;
+}
+
+int main()
+{
+	char line[1024];
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		if (request(line) != 0) {
+			fprintf(stderr, "p256check: bad request\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -25,6 +25,29 @@ const uint32_t app_version = 0x00000001;
 // steady color for app waiting for cmd
 #define APP_LEDVALUE (LED_RED | LED_GREEN) // yellow
 
+#ifdef BENCH
+// Cycles and instructions spent on the last command, from after it was
+// read until its response was written, for APP_CMD_BENCH_COUNTERS
+static uint32_t bench_cycles;
+static uint32_t bench_instret;
+
+static inline uint32_t rdcycle()
+{
+	uint32_t c;
+
+	asm volatile("rdcycle %0" : "=r"(c));
+	return c;
+}
+
+static inline uint32_t rdinstret()
+{
+	uint32_t i;
+
+	asm volatile("rdinstret %0" : "=r"(i));
+	return i;
+}
+#endif
+
 int main(void)
 {
 	struct frame_header hdr; // Used in both directions
@@ -69,6 +92,11 @@ int main(void)
 		// Reset response buffer
 		memset(rsp, 0, CMDLEN_MAXBYTES);
 
+#ifdef BENCH
+		uint32_t cycles = rdcycle();
+		uint32_t instret = rdinstret();
+#endif
+
 		// Min length is 1 byte so this should always be here
 		switch (cmd[0]) {
 		case APP_CMD_GET_NAMEVERSION:
@@ -190,11 +218,27 @@ int main(void)
 			break;
 		}
 
+#ifdef BENCH
+		case APP_CMD_BENCH_COUNTERS:
+			qemu_puts("APP_CMD_BENCH_COUNTERS\n");
+			rsp[0] = STATUS_OK;
+			memcpy(&rsp[1], &bench_cycles, 4);
+			memcpy(&rsp[5], &bench_instret, 4);
+			appreply(hdr, APP_RSP_BENCH_COUNTERS, rsp);
+			// Leave the counters of the command before
+			continue;
+#endif
+
 		default:
 			qemu_puts("Received unknown command: ");
 			qemu_puthex(cmd[0]);
 			qemu_lf();
 			appreply(hdr, APP_RSP_UNKNOWN_CMD, rsp);
 		}
+
+#ifdef BENCH
+		bench_cycles = rdcycle() - cycles;
+		bench_instret = rdinstret() - instret;
+#endif
 	}
 }
@@ -328,6 +328,31 @@ static uint64_t u32_muladd64(uint32_t x, uint32_t y, uint32_t z, uint32_t t)
 #endif /* MUL64_IS_CONSTANT_TIME */
 #endif /* MULADD64_ASM */
 
+/*
+ * Backend for Montgomery multiplication, the core of the field and
+ * scalar arithmetic, selected at build time with -DP256_BACKEND=...
+ *
+ * P256_BACKEND_HAC:  Algorithm 14.36 in Handbook of Applied Cryptography,
+ *                    one multiply-and-add pass for x[i] * y and another for
+ *                    u * m (the default, and what the app on the TKey uses)
+ * P256_BACKEND_FIOS: the two passes interleaved, so that a[] is read and
+ *                    written once per outer iteration
+ *
+ * All backends must give the same results for all inputs; see
+ * device-fido/host/p256check.c.
+ */
+#define P256_BACKEND_HAC    1
+#define P256_BACKEND_FIOS   2
+
+#if !defined(P256_BACKEND)
+#define P256_BACKEND P256_BACKEND_HAC
+#endif
+
+#if P256_BACKEND != P256_BACKEND_HAC && P256_BACKEND != P256_BACKEND_FIOS
+#error "Unknown P256_BACKEND"
+#endif
+
+#if P256_BACKEND == P256_BACKEND_HAC
 /*
  * 288 + 32 x 256 -> 288-bit multiply and add
  *
@@ -392,6 +417,7 @@ static void u288_rshift32(uint32_t z[9], uint32_t c)
     }
     z[8] = c;
 }
+#endif /* P256_BACKEND_HAC */
 
 /*
  * 256-bit import from big-endian bytes
@@ -576,6 +602,7 @@ static void m256_sub_p(uint32_t z[8],
  *
  * Note: as a memory area, z may overlap with x or y.
  */
+#if P256_BACKEND == P256_BACKEND_HAC
 static void m256_mul(uint32_t z[8],
                      const uint32_t x[8], const uint32_t y[8],
                      const m256_mod *mod)
@@ -607,6 +634,53 @@ static void m256_mul(uint32_t z[8],
     uint32_t use_sub = carry_add | (1 - carry_sub);     // see m256_add()
     u256_cmov(z, a, 1 - use_sub);
 }
+#elif P256_BACKEND == P256_BACKEND_FIOS
+static void m256_mul(uint32_t z[8],
+                     const uint32_t x[8], const uint32_t y[8],
+                     const m256_mod *mod)
+{
+    /*
+     * Same as above, but computing a + x[i] * y and adding u * m to it
+     * word by word in the same loop, each with its own carry.
+     */
+    uint32_t m_prime = mod->ni;
+    uint32_t a[9];
+
+    for (unsigned i = 0; i < 9; i++) {
+        a[i] = 0;
+    }
+
+    for (unsigned i = 0; i < 8; i++) {
+        /* the "mod 2^32" is implicit from the type */
+        uint32_t u = (a[0] + x[i] * y[0]) * m_prime;
+
+        /* word 0 of a + x[i] * y + u * m is 0 by the choice of u */
+        uint64_t p = u32_muladd64(x[i], y[0], a[0], 0);
+        uint64_t q = u32_muladd64(u, mod->m[0], (uint32_t) p, 0);
+        uint32_t cp = (uint32_t) (p >> 32);
+        uint32_t cq = (uint32_t) (q >> 32);
+
+        /* a = (a + x[i] * y + u * m) div b */
+        for (unsigned j = 1; j < 8; j++) {
+            p = u32_muladd64(x[i], y[j], a[j], cp);
+            q = u32_muladd64(u, mod->m[j], (uint32_t) p, cq);
+            cp = (uint32_t) (p >> 32);
+            cq = (uint32_t) (q >> 32);
+            a[j - 1] = (uint32_t) q;
+        }
+
+        uint64_t sum = (uint64_t) a[8] + cp + cq;
+        a[7] = (uint32_t) sum;
+        a[8] = (uint32_t) (sum >> 32);
+    }
+
+    /* a = a > m ? a - m : a */
+    uint32_t carry_add = a[8];  // 0 or 1 since a < 2m, see HAC Note 14.37
+    uint32_t carry_sub = u256_sub(z, a, mod->m);
+    uint32_t use_sub = carry_add | (1 - carry_sub);     // see m256_add()
+    u256_cmov(z, a, 1 - use_sub);
+}
+#endif /* P256_BACKEND */
 
 /*
  * Montgomery modular multiplication modulo p.
@@ -958,41 +1032,84 @@ static void point_add(uint32_t x1[8], uint32_t y1[8], uint32_t z1[8],
 }
 
 /*
- * Point addition or doubling (affine to jacobian, Montgomery domain)
+ * In-place point addition in jacobian coordinates (Montgomery domain)
  *
- * in: P = (x1, y1) - must be on the curve and not 0
- *     Q = (x2, y2) - must be on the curve and not 0
- * out: (x3, y3) = R = P + Q
+ * in: P_in = (x1:y1:z1), must be on the curve or 0 (z1 == 0)
+ *     Q = (x2:y2:z2), must be on the curve or 0 (z2 == 0)
+ * out: P_out = (x1:y1:z1) = P_in + Q, z1 == 0 if that's 0
  *
- * Note: unlike point_add(), this function works if P = +- Q;
- * however it leaks information on its input through timing,
+ * Note: unlike point_add(), this function works for all inputs, including
+ * P = +- Q and 0; however it leaks information on its input through timing,
  * branches taken and memory access patterns (if observable).
  */
-static void point_add_or_double_leaky(
-                        uint32_t x3[8], uint32_t y3[8],
-                        const uint32_t x1[8], const uint32_t y1[8],
-                        const uint32_t x2[8], const uint32_t y2[8])
+static void point_add_jac_leaky(uint32_t x1[8], uint32_t y1[8], uint32_t z1[8],
+                                const uint32_t x2[8], const uint32_t y2[8],
+                                const uint32_t z2[8])
 {
+    /*
+     * This is formula 5 from [CMO98], with the special cases checked first.
+     */
+    uint32_t u1[8], u2[8], s1[8], s2[8], t[8];
 
-    uint32_t z3[8];
-    u256_cmov(x3, x1, 1);
-    u256_cmov(y3, y1, 1);
-    m256_set32(z3, 1, &p256_p);
-
-    if (u256_diff(x1, x2) != 0) {
-        // P != +- Q -> generic addition
-        point_add(x3, y3, z3, x2, y2);
-        point_to_affine(x3, y3, z3);
+    if (u256_diff0(z2) == 0) {
+        // Q == 0
+        return;
     }
-    else if (u256_diff(y1, y2) == 0) {
-        // P == Q -> double
-        point_double(x3, y3, z3);
-        point_to_affine(x3, y3, z3);
-    } else {
-        // P == -Q -> zero
-        m256_set32(x3, 0, &p256_p);
-        m256_set32(y3, 0, &p256_p);
+    if (u256_diff0(z1) == 0) {
+        // P == 0
+        u256_cmov(x1, x2, 1);
+        u256_cmov(y1, y2, 1);
+        u256_cmov(z1, z2, 1);
+        return;
+    }
+
+    /* u1 = x1 z2^2, s1 = y1 z2^3 */
+    m256_mul_p(t, z2, z2);
+    m256_mul_p(u1, x1, t);
+    m256_mul_p(t, t, z2);
+    m256_mul_p(s1, y1, t);
+
+    /* u2 = x2 z1^2, s2 = y2 z1^3 */
+    m256_mul_p(t, z1, z1);
+    m256_mul_p(u2, x2, t);
+    m256_mul_p(t, t, z1);
+    m256_mul_p(s2, y2, t);
+
+    if (u256_diff(u1, u2) == 0) {
+        if (u256_diff(s1, s2) == 0) {
+            // P == Q -> double
+            point_double(x1, y1, z1);
+        } else {
+            // P == -Q -> zero
+            u256_set32(z1, 0);
+        }
+        return;
     }
+
+    /* u2 = h = u2 - u1, s2 = r = s2 - s1 */
+    m256_sub_p(u2, u2, u1);
+    m256_sub_p(s2, s2, s1);
+
+    /* z3 = z1 z2 h */
+    m256_mul_p(z1, z1, z2);
+    m256_mul_p(z1, z1, u2);
+
+    /* u1 = u1 h^2, u2 = h^3 */
+    m256_mul_p(t, u2, u2);
+    m256_mul_p(u1, u1, t);
+    m256_mul_p(u2, u2, t);
+
+    /* x3 = r^2 - h^3 - 2 u1 h^2 */
+    m256_mul_p(x1, s2, s2);
+    m256_sub_p(x1, x1, u2);
+    m256_sub_p(x1, x1, u1);
+    m256_sub_p(x1, x1, u1);
+
+    /* y3 = r (u1 h^2 - x3) - s1 h^3 */
+    m256_sub_p(t, u1, x1);
+    m256_mul_p(t, t, s2);
+    m256_mul_p(s1, s1, u2);
+    m256_sub_p(y1, t, s1);
 }
 
 /*
@@ -1392,6 +1509,50 @@ int p256_ecdsa_sign(uint8_t sig[64], const uint8_t priv[32],
     return P256_SUCCESS;
 }
 
+/*
+ * Sum of two scalar multiplications, for verification
+ *
+ * in: u1, u2 in [0, n)
+ *     px, py affine coordinates of a point P on the curve (Montgomery domain)
+ * out: (rx:ry:rz) = u1 * G + u2 * P in jacobian coordinates
+ *      (Montgomery domain), rz == 0 if that's 0
+ *
+ * Note: this uses Shamir's trick, doubling once for both scalars, and no
+ * inversion. It leaks u1, u2 and P, which are public in verification,
+ * through timing, branches taken and memory access patterns.
+ */
+static void ecdsa_double_mult_leaky(uint32_t rx[8], uint32_t ry[8],
+                                    uint32_t rz[8], const uint32_t u1[8],
+                                    const uint32_t px[8], const uint32_t py[8],
+                                    const uint32_t u2[8])
+{
+    uint32_t one[8], sx[8], sy[8], sz[8];
+
+    /* (sx:sy:sz) = G + P */
+    m256_set32(one, 1, &p256_p);
+    u256_cmov(sx, p256_gx, 1);
+    u256_cmov(sy, p256_gy, 1);
+    u256_cmov(sz, one, 1);
+    point_add_jac_leaky(sx, sy, sz, px, py, one);
+
+    /* R = 0 */
+    u256_set32(rz, 0);
+
+    for (unsigned i = 256; i-- > 0;) {
+        if (u256_diff0(rz) != 0)
+            point_double(rx, ry, rz);
+
+        uint32_t b1 = (u1[i / 32] >> i % 32) & 1;
+        uint32_t b2 = (u2[i / 32] >> i % 32) & 1;
+        if (b1 && b2)
+            point_add_jac_leaky(rx, ry, rz, sx, sy, sz);
+        else if (b1)
+            point_add_jac_leaky(rx, ry, rz, p256_gx, p256_gy, one);
+        else if (b2)
+            point_add_jac_leaky(rx, ry, rz, px, py, one);
+    }
+}
+
 /*
  * ECDSA verify
  */
@@ -1432,37 +1593,40 @@ int p256_ecdsa_verify(const uint8_t sig[64], const uint8_t pub[64],
     m256_mul(u2, u2, s, &p256_n);    /* u2 = r * s^-1 mod n */
     m256_done(u2, &p256_n);          /* u2 out of Montgomery domain */
 
-    /* 5. Compute R (and re-use (u1, u2) to store its coordinates */
+    /* 5. Compute R = u1 * G + u2 * Qu, staying in jacobian coordinates */
     uint32_t px[8], py[8];
     ret = point_from_bytes(px, py, pub);
     if (ret != 0)
         return P256_INVALID_PUBKEY;
 
-    scalar_mult(e, s, px, py, u2);      /* (e, s) = R2 = u2 * Qu */
-
-    if (u256_diff0(u1) == 0) {
-        /* u1 out of range for scalar_mult() - just skip it */
-        u256_cmov(u1, e, 1);
-        /* we don't care about the y coordinate */
-    } else {
-        scalar_mult(px, py, p256_gx, p256_gy, u1); /* (px, py) = R1 = u1 * G */
+    uint32_t rx[8], ry[8], rz[8];
+    ecdsa_double_mult_leaky(rx, ry, rz, u1, px, py, u2);
 
-        /* (u1, u2) = R = R1 + R2 */
-        point_add_or_double_leaky(u1, u2, px, py, e, s);
-        /* No need to check if R == 0 here: if that's the case, it will be
-         * caught when comparating rx (which will be 0) to r (which isn't). */
-    }
-
-    /* 6. Convert xR to an integer */
-    m256_done(u1, &p256_p);
+    /* R == 0 can't have xR mod n == r */
+    if (u256_diff0(rz) == 0)
+        return P256_INVALID_SIGNATURE;
 
-    /* 7. Reduce xR mod n */
-    ecdsa_m256_mod_n(u1);
+    /*
+     * 6.-8. Compare xR mod n to r, without converting R to affine: with
+     * xR = rx / rz^2 in [0, p), xR mod n == r iff rx == r * rz^2, or
+     * r + n < p and rx == (r + n) * rz^2.
+     */
+    uint32_t zz[8], t[8];
+    m256_mul_p(zz, rz, rz);
 
-    /* 8. Compare xR mod n to r */
-    uint32_t diff = u256_diff(u1, r);
-    if (diff == 0)
+    u256_cmov(t, r, 1);
+    m256_prep(t, &p256_p);           /* r < n < p, as an element mod p */
+    m256_mul_p(t, t, zz);
+    if (u256_diff(t, rx) == 0)
         return P256_SUCCESS;
 
+    uint32_t carry = u256_add(t, r, p256_n.m);
+    if (carry == 0 && u256_sub(e, t, p256_p.m) == 1) { /* e unused now */
+        m256_prep(t, &p256_p);       /* r + n < p */
+        m256_mul_p(t, t, zz);
+        if (u256_diff(t, rx) == 0)
+            return P256_SUCCESS;
+    }
+
     return P256_INVALID_SIGNATURE;
 }
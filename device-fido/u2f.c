@@ -78,6 +78,11 @@ void u2f_init()
 
 static int wait_touched(uint32_t ledvalue)
 {
+#ifdef BENCH
+	// Counting instructions while waiting for a finger is no use
+	return 1;
+#endif
+
 	int touched = 0;
 
 	// make sure timer is stopped
@@ -91,6 +96,9 @@ static int wait_touched(uint32_t ledvalue)
 	// first a write, to ensure no stray touch?
 	*touch = 0;
 
+	// TODO blink and poll from the timer instead of this count, which
+	// ties the blink rate to the compiler's output and spins on MMIO
+	// the whole wait. That changes app.bin, and so the CDI.
 	const int loopcount = 130000;
 	int led_on = 0;
 	for (;;) {
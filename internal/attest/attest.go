@@ -0,0 +1,200 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Package attest signs new credentials with the attestation key the
+// U2F way (also the CTAP2 fido-u2f attestation format), doing all it
+// can while the TKey is still registering, so that little is left to
+// do once it replies: the request's part of the signed data is hashed,
+// and the nonce of the signature and all that follows from it is
+// computed in advance.
+//
+// The attestation key is the well-known dummy key of the attestation
+// package, so it needs no protection from side channels, which is what
+// lets the signature be split up and computed with math/big.
+//
+//	reg := attest.Start(attestation.PrivateKey, appliParam, challParam)
+//	// ... register on the TKey ...
+//	if !attest.ValidPublicKey(pubBytes) { ... }
+//	sig, err := reg.Finish(keyHandle, pubBytes)
+package attest
+
+import (
+	"crypto/ecdsa"
+	"crypto/elliptic"
+	"crypto/rand"
+	"crypto/sha256"
+	"fmt"
+	"hash"
+	"math/big"
+	"sync"
+)
+
+// Registration is the attestation signature of one registration,
+// started before the TKey has made the credential.
+type Registration struct {
+	key  *ecdsa.PrivateKey
+	hash hash.Hash
+
+	// Closed when the presignature below is done
+	presigned chan struct{}
+	// All of the signature that doesn't depend on the signed data,
+	// with nonce k: r, the x coordinate of k*G mod n, in DER, and, as
+	// s = k^-1 * (e + r*d) mod n, k^-1 and k^-1 * r*d mod n.
+	rDER         []byte
+	kInv, kInvRD *big.Int
+	presignErr   error
+}
+
+// Start begins the attestation signature over appliParam and
+// challParam, for the credential the TKey is about to make. The nonce
+// is computed in the background.
+func Start(key *ecdsa.PrivateKey, appliParam, challParam [32]byte) *Registration {
+	reg := &Registration{
+		key:       key,
+		hash:      sha256.New(),
+		presigned: make(chan struct{}),
+	}
+
+	go reg.presign()
+
+	reg.hash.Write([]byte{0x00}) // reserved byte
+	reg.hash.Write(appliParam[:])
+	reg.hash.Write(challParam[:])
+
+	return reg
+}
+
+func (reg *Registration) presign() {
+	defer close(reg.presigned)
+
+	params := reg.key.Curve.Params()
+	nMinus1 := new(big.Int).Sub(params.N, big.NewInt(1))
+
+	for {
+		// k uniform in [1, n-1]
+		k, err := rand.Int(rand.Reader, nMinus1)
+		if err != nil {
+			reg.presignErr = fmt.Errorf("rand.Int: %w", err)
+			return
+		}
+		k.Add(k, big.NewInt(1))
+
+		var kBytes [32]byte
+		r, _ := reg.key.Curve.ScalarBaseMult(k.FillBytes(kBytes[:]))
+		r.Mod(r, params.N)
+		if r.Sign() == 0 {
+			continue
+		}
+
+		reg.kInv = new(big.Int).ModInverse(k, params.N)
+		reg.kInvRD = new(big.Int).Mul(r, reg.key.D)
+		reg.kInvRD.Mul(reg.kInvRD, reg.kInv)
+		reg.kInvRD.Mod(reg.kInvRD, params.N)
+		reg.rDER = derInteger(r)
+
+		return
+	}
+}
+
+// Finish returns the ASN.1 DER encoded attestation signature of the
+// credential with keyHandle and the uncompressed public key pubBytes.
+func (reg *Registration) Finish(keyHandle, pubBytes []byte) ([]byte, error) {
+	reg.hash.Write(keyHandle)
+	reg.hash.Write(pubBytes)
+	var digest [sha256.Size]byte
+	reg.hash.Sum(digest[:0])
+
+	<-reg.presigned
+	if reg.presignErr != nil {
+		return nil, reg.presignErr
+	}
+
+	// s = k^-1 * e + k^-1 * r*d mod n, where e is the digest, which
+	// is as long as n
+	var e, s big.Int
+	e.SetBytes(digest[:])
+	s.Mul(&e, reg.kInv)
+	s.Add(&s, reg.kInvRD)
+	s.Mod(&s, reg.key.Curve.Params().N)
+	if s.Sign() == 0 {
+		// Practically impossible, but the nonce must then be
+		// another
+		sig, err := ecdsa.SignASN1(rand.Reader, reg.key, digest[:])
+		if err != nil {
+			return nil, fmt.Errorf("SignASN1: %w", err)
+		}
+		return sig, nil
+	}
+
+	// SEQUENCE { r INTEGER, s INTEGER }, short enough for a single
+	// byte length
+	sDER := derInteger(&s)
+	sig := make([]byte, 0, 2+len(reg.rDER)+len(sDER))
+	sig = append(sig, 0x30, byte(len(reg.rDER)+len(sDER)))
+	sig = append(sig, reg.rDER...)
+	sig = append(sig, sDER...)
+
+	return sig, nil
+}
+
+// derInteger is the DER encoding of x, which is positive and at most
+// 32 bytes.
+func derInteger(x *big.Int) []byte {
+	var b [32]byte
+	v := x.FillBytes(b[:])
+	for len(v) > 1 && v[0] == 0 {
+		v = v[1:]
+	}
+
+	der := make([]byte, 0, 2+1+len(v))
+	der = append(der, 0x02, 0)
+	if v[0]&0x80 != 0 {
+		der = append(der, 0x00)
+	}
+	der = append(der, v...)
+	der[1] = byte(len(der) - 2)
+
+	return der
+}
+
+// Scratch space for ValidPublicKey, so that it doesn't allocate
+type onCurveScratch struct {
+	x, y, lhs, rhs, t, q big.Int
+}
+
+var scratchPool = sync.Pool{
+	New: func() interface{} { return new(onCurveScratch) },
+}
+
+// ValidPublicKey tells whether pubBytes is an uncompressed P-256 point
+// on the curve, like elliptic.Unmarshal, but without allocating.
+func ValidPublicKey(pubBytes []byte) bool {
+	if len(pubBytes) != 1+64 || pubBytes[0] != 0x04 {
+		return false
+	}
+
+	s, _ := scratchPool.Get().(*onCurveScratch)
+	defer scratchPool.Put(s)
+
+	params := elliptic.P256().Params()
+	s.x.SetBytes(pubBytes[1:33])
+	s.y.SetBytes(pubBytes[33:])
+	if s.x.Cmp(params.P) >= 0 || s.y.Cmp(params.P) >= 0 {
+		return false
+	}
+
+	// y² + 3x = x³ + b (mod p), in that form to stay non-negative
+	s.t.Mul(&s.y, &s.y)
+	s.lhs.Lsh(&s.x, 1)
+	s.lhs.Add(&s.lhs, &s.x)
+	s.lhs.Add(&s.lhs, &s.t)
+	s.q.QuoRem(&s.lhs, params.P, &s.t)
+	s.lhs.Set(&s.t)
+
+	s.t.Mul(&s.x, &s.x)
+	s.rhs.Mul(&s.t, &s.x)
+	s.rhs.Add(&s.rhs, params.B)
+	s.q.QuoRem(&s.rhs, params.P, &s.t)
+
+	return s.lhs.Cmp(&s.t) == 0
+}
@@ -0,0 +1,166 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package attest_test
+
+import (
+	"crypto/ecdsa"
+	"crypto/elliptic"
+	"crypto/rand"
+	"crypto/sha256"
+	"testing"
+
+	"github.com/tillitis/tkey-fido/internal/attest"
+)
+
+type credential struct {
+	keyHandle []byte
+	pubBytes  []byte
+}
+
+func newCredential(tb testing.TB) credential {
+	tb.Helper()
+
+	key, err := ecdsa.GenerateKey(elliptic.P256(), rand.Reader)
+	if err != nil {
+		tb.Fatalf("GenerateKey: %v", err)
+	}
+	keyHandle := make([]byte, 64)
+	if _, err = rand.Read(keyHandle); err != nil {
+		tb.Fatalf("rand.Read: %v", err)
+	}
+
+	return credential{
+		keyHandle: keyHandle,
+		pubBytes:  elliptic.Marshal(elliptic.P256(), key.X, key.Y),
+	}
+}
+
+// signedData is the data of a U2F attestation signature, in one piece.
+func signedData(appliParam, challParam [32]byte, cred credential) []byte {
+	data := make([]byte, 0, 1+32+32+len(cred.keyHandle)+len(cred.pubBytes))
+	data = append(data, 0x00) // reserved byte
+	data = append(data, appliParam[:]...)
+	data = append(data, challParam[:]...)
+	data = append(data, cred.keyHandle...)
+	data = append(data, cred.pubBytes...)
+
+	return data
+}
+
+func TestFinish(t *testing.T) {
+	t.Parallel()
+
+	key, err := ecdsa.GenerateKey(elliptic.P256(), rand.Reader)
+	if err != nil {
+		t.Fatalf("GenerateKey: %v", err)
+	}
+	appliParam := sha256.Sum256([]byte("example.com"))
+	challParam := sha256.Sum256([]byte("challenge"))
+
+	for i := 0; i < 10; i++ {
+		cred := newCredential(t)
+		var sig []byte
+		sig, err = attest.Start(key, appliParam, challParam).Finish(cred.keyHandle, cred.pubBytes)
+		if err != nil {
+			t.Fatalf("Finish: %v", err)
+		}
+
+		digest := sha256.Sum256(signedData(appliParam, challParam, cred))
+		if !ecdsa.VerifyASN1(&key.PublicKey, digest[:], sig) {
+			t.Fatalf("signature %x not valid", sig)
+		}
+	}
+}
+
+func TestValidPublicKey(t *testing.T) {
+	t.Parallel()
+
+	for i := 0; i < 100; i++ {
+		pubBytes := newCredential(t).pubBytes
+		if !attest.ValidPublicKey(pubBytes) {
+			t.Fatalf("%x not valid", pubBytes)
+		}
+
+		// A flipped bit anywhere, also in the 0x04 marker, as
+		// elliptic.Unmarshal sees it
+		bit := i * 8 * len(pubBytes) / 100
+		pubBytes[bit/8] ^= 1 << (bit % 8)
+		x, _ := elliptic.Unmarshal(elliptic.P256(), pubBytes)
+		if got, want := attest.ValidPublicKey(pubBytes), x != nil; got != want {
+			t.Fatalf("%x: got %v, want %v", pubBytes, got, want)
+		}
+	}
+
+	// Coordinates not reduced mod p
+	p := elliptic.P256().Params().P
+	tooLarge := append([]byte{0x04}, p.FillBytes(make([]byte, 32))...)
+	tooLarge = append(tooLarge, make([]byte, 32)...)
+	for _, pubBytes := range [][]byte{nil, {0x04}, tooLarge, make([]byte, 65)} {
+		if attest.ValidPublicKey(pubBytes) {
+			t.Fatalf("%x valid", pubBytes)
+		}
+	}
+}
+
+// BenchmarkFinish measures the host work of the attestation signature
+// of a register once the TKey has replied, when the TKey took longer
+// to register than the nonce took to compute, as it does with a touch.
+func BenchmarkFinish(b *testing.B) {
+	key, err := ecdsa.GenerateKey(elliptic.P256(), rand.Reader)
+	if err != nil {
+		b.Fatalf("GenerateKey: %v", err)
+	}
+	cred := newCredential(b)
+	appliParam := sha256.Sum256([]byte("example.com"))
+	challParam := sha256.Sum256([]byte("challenge"))
+
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		b.StopTimer()
+		reg := attest.Start(key, appliParam, challParam)
+		reg.WaitPresigned()
+		b.StartTimer()
+
+		if !attest.ValidPublicKey(cred.pubBytes) {
+			b.Fatalf("public key not valid")
+		}
+		if _, err = reg.Finish(cred.keyHandle, cred.pubBytes); err != nil {
+			b.Fatalf("Finish: %v", err)
+		}
+	}
+}
+
+// BenchmarkFinishSequential is BenchmarkFinish the way it was done
+// before, all of it after the TKey has replied.
+func BenchmarkFinishSequential(b *testing.B) {
+	key, err := ecdsa.GenerateKey(elliptic.P256(), rand.Reader)
+	if err != nil {
+		b.Fatalf("GenerateKey: %v", err)
+	}
+	cred := newCredential(b)
+	appliParam := sha256.Sum256([]byte("example.com"))
+	challParam := sha256.Sum256([]byte("challenge"))
+
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		if x, _ := elliptic.Unmarshal(elliptic.P256(), cred.pubBytes); x == nil {
+			b.Fatalf("public key not valid")
+		}
+		digest := sha256.Sum256(signedData(appliParam, challParam, cred))
+		if _, err = ecdsa.SignASN1(rand.Reader, key, digest[:]); err != nil {
+			b.Fatalf("SignASN1: %v", err)
+		}
+	}
+}
+
+func BenchmarkValidPublicKey(b *testing.B) {
+	pubBytes := newCredential(b).pubBytes
+
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		if !attest.ValidPublicKey(pubBytes) {
+			b.Fatalf("public key not valid")
+		}
+	}
+}
@@ -0,0 +1,10 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package attest
+
+// WaitPresigned waits for the nonce of reg, as if the TKey took longer
+// than that to register.
+func (reg *Registration) WaitPresigned() {
+	<-reg.presigned
+}
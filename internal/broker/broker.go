@@ -0,0 +1,389 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Package broker lets several local programs share the TKeys one
+// process owns. The owner serves the U2F operations of the fido app on
+// a Unix socket, and clients call them as if they had the TKey, without
+// ever opening the serial port themselves. The owner also hands out
+// the U2F signature counters, so that they only go up, whichever client
+// signs.
+//
+// Each request and response is a frame of a 1 byte op or status, a
+// 2 byte big-endian length, and that many bytes of payload. A
+// connection has one request at a time in flight. Requests from
+// different connections are queued by the Backend.
+package broker
+
+import (
+	"context"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"net"
+	"sync"
+	"time"
+
+	"github.com/tillitis/tkey-fido/internal/unixsock"
+)
+
+const (
+	opRegister     = 0x01
+	opCheckOnly    = 0x02
+	opAuthenticate = 0x03
+	opCounter      = 0x04
+
+	statusOK    = 0x00
+	statusError = 0x01
+
+	maxPayload = 512
+)
+
+// Backend does the operations on the TKeys, safely for concurrent use.
+// The methods are those of the app's U2F commands, as in tk1fido. The
+// context is cancelled if the client goes away. NextCounter returns the
+// next signature counter of the credential key, as counterstore.Store
+// does.
+type Backend interface {
+	U2FRegister(ctx context.Context, appliParam [32]byte) (byte, []byte, []byte, error)
+	U2FCheckOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error)
+	U2FAuthenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error)
+	NextCounter(key [32]byte) (uint32, error)
+}
+
+// Listen creates the Unix socket at path, only usable by the user
+// running us. A stale socket at path is removed first, but not a live
+// one: two brokers would compete for the TKeys.
+func Listen(path string) (net.Listener, error) {
+	l, err := unixsock.Listen(path)
+	if err != nil {
+		return nil, fmt.Errorf("unixsock.Listen: %w", err)
+	}
+
+	return l, nil
+}
+
+// Serve handles clients connecting to l until accepting fails.
+func Serve(l net.Listener, backend Backend) error {
+	for {
+		conn, err := l.Accept()
+		if err != nil {
+			return fmt.Errorf("Accept: %w", err)
+		}
+		go serveConn(conn, backend)
+	}
+}
+
+type request struct {
+	op      byte
+	payload []byte
+}
+
+func serveConn(conn net.Conn, backend Backend) {
+	defer conn.Close()
+
+	ctx, cancel := context.WithCancel(context.Background())
+	defer cancel()
+
+	// Keep reading while a request is handled, to notice the client
+	// going away
+	requests := make(chan request)
+	go func() {
+		defer close(requests)
+		defer cancel()
+
+		for {
+			op, payload, err := readFrame(conn, make([]byte, 3+maxPayload))
+			if err != nil {
+				return
+			}
+			select {
+			case requests <- request{op, payload}:
+			case <-ctx.Done():
+				return
+			}
+		}
+	}()
+
+	for req := range requests {
+		rsp, err := handle(ctx, backend, req.op, req.payload)
+		if err != nil {
+			err = writeFrame(conn, statusError, []byte(err.Error()))
+		} else {
+			err = writeFrame(conn, statusOK, rsp)
+		}
+		if err != nil {
+			return
+		}
+	}
+}
+
+func handle(ctx context.Context, backend Backend, op byte, req []byte) ([]byte, error) {
+	switch op {
+	case opRegister:
+		if len(req) != 32 {
+			return nil, fmt.Errorf("bad register request")
+		}
+		userPresence, keyHandle, pubBytes, err := backend.U2FRegister(ctx, *(*[32]byte)(req))
+		if err != nil {
+			return nil, err
+		}
+		rsp := []byte{userPresence}
+		if userPresence != 0 {
+			rsp = append(rsp, keyHandle...)
+			rsp = append(rsp, pubBytes...)
+		}
+		return rsp, nil
+
+	case opCheckOnly:
+		if len(req) != 32+64 {
+			return nil, fmt.Errorf("bad checkonly request")
+		}
+		keyHandleValid, err := backend.U2FCheckOnly(ctx, *(*[32]byte)(req[0:32]), *(*[64]byte)(req[32:96]))
+		if err != nil {
+			return nil, err
+		}
+		return []byte{boolByte(keyHandleValid)}, nil
+
+	case opAuthenticate:
+		if len(req) != 32+32+64+1+4 {
+			return nil, fmt.Errorf("bad authenticate request")
+		}
+		keyHandleValid, userPresence, sigASN1, err := backend.U2FAuthenticate(ctx, *(*[32]byte)(req[0:32]),
+			*(*[32]byte)(req[32:64]), *(*[64]byte)(req[64:128]), req[128] != 0,
+			binary.BigEndian.Uint32(req[129:133]))
+		if err != nil {
+			return nil, err
+		}
+		rsp := []byte{boolByte(keyHandleValid), userPresence}
+		return append(rsp, sigASN1...), nil
+
+	case opCounter:
+		if len(req) != 32 {
+			return nil, fmt.Errorf("bad counter request")
+		}
+		counter, err := backend.NextCounter(*(*[32]byte)(req))
+		if err != nil {
+			return nil, err
+		}
+		return binary.BigEndian.AppendUint32(nil, counter), nil
+
+	default:
+		return nil, fmt.Errorf("unknown op 0x%02x", op)
+	}
+}
+
+// Client calls the operations of the Backend of a broker. It's safe
+// for concurrent use, and connects again if the broker went away.
+type Client struct {
+	path string
+	mu   sync.Mutex
+	conn net.Conn
+	buf  [3 + maxPayload]byte
+}
+
+// Dial connects to the broker at the Unix socket path.
+func Dial(path string) (*Client, error) {
+	c := &Client{path: path}
+
+	conn, err := net.Dial("unix", path)
+	if err != nil {
+		return nil, fmt.Errorf("Dial: %w", err)
+	}
+	c.conn = conn
+
+	return c, nil
+}
+
+func (c *Client) Close() error {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	if c.conn == nil {
+		return nil
+	}
+	err := c.conn.Close()
+	c.conn = nil
+
+	return err
+}
+
+// call sends one request and returns the payload of its response. If
+// ctx is done first, the connection is dropped, which cancels the
+// request at the broker.
+func (c *Client) call(ctx context.Context, op byte, req []byte) ([]byte, error) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	if c.conn == nil {
+		conn, err := net.Dial("unix", c.path)
+		if err != nil {
+			return nil, fmt.Errorf("Dial: %w", err)
+		}
+		c.conn = conn
+	}
+
+	status, rsp, err := c.exchange(ctx, op, req)
+	if err != nil {
+		c.conn.Close()
+		c.conn = nil
+		if ctx.Err() != nil {
+			return nil, ctx.Err()
+		}
+		// The connection's deadline, which is ctx's, can fire before
+		// ctx is done
+		if deadline, ok := ctx.Deadline(); ok && !time.Now().Before(deadline) {
+			return nil, context.DeadlineExceeded
+		}
+		return nil, err
+	}
+	if status != statusOK {
+		return nil, fmt.Errorf("broker: %s", rsp)
+	}
+
+	// rsp is in c.buf, which the next call reuses
+	return append([]byte(nil), rsp...), nil
+}
+
+func (c *Client) exchange(ctx context.Context, op byte, req []byte) (byte, []byte, error) {
+	// The goroutine below may still run after call dropped c.conn
+	conn := c.conn
+
+	deadline, _ := ctx.Deadline()
+	if err := conn.SetDeadline(deadline); err != nil {
+		return 0, nil, fmt.Errorf("SetDeadline: %w", err)
+	}
+
+	if ctx.Done() != nil {
+		stop := make(chan struct{})
+		defer close(stop)
+		go func() {
+			select {
+			case <-ctx.Done():
+				// Wakes up our read or write
+				_ = conn.SetDeadline(time.Now())
+			case <-stop:
+			}
+		}()
+	}
+
+	if err := writeFrame(conn, op, req); err != nil {
+		return 0, nil, err
+	}
+	return readFrame(conn, c.buf[:])
+}
+
+func (c *Client) U2FRegister(ctx context.Context, appliParam [32]byte) (byte, []byte, []byte, error) {
+	rsp, err := c.call(ctx, opRegister, appliParam[:])
+	if err != nil {
+		return 0, nil, nil, err
+	}
+
+	if len(rsp) < 1 {
+		return 0, nil, nil, fmt.Errorf("broker: short register response")
+	}
+	if rsp[0] == 0 {
+		return 0, nil, nil, nil
+	}
+	if len(rsp) != 1+64+65 {
+		return 0, nil, nil, fmt.Errorf("broker: short register response")
+	}
+
+	return rsp[0], rsp[1 : 1+64], rsp[1+64:], nil
+}
+
+func (c *Client) U2FCheckOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error) {
+	req := make([]byte, 0, 32+64)
+	req = append(req, appliParam[:]...)
+	req = append(req, keyHandle[:]...)
+
+	rsp, err := c.call(ctx, opCheckOnly, req)
+	if err != nil {
+		return false, err
+	}
+	if len(rsp) != 1 {
+		return false, fmt.Errorf("broker: bad checkonly response")
+	}
+
+	return rsp[0] != 0, nil
+}
+
+func (c *Client) U2FAuthenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error) {
+	req := make([]byte, 0, 32+32+64+1+4)
+	req = append(req, appliParam[:]...)
+	req = append(req, challParam[:]...)
+	req = append(req, keyHandle[:]...)
+	req = append(req, boolByte(checkUser))
+	req = binary.BigEndian.AppendUint32(req, counter)
+
+	rsp, err := c.call(ctx, opAuthenticate, req)
+	if err != nil {
+		return false, 0, nil, err
+	}
+	if len(rsp) < 2 {
+		return false, 0, nil, fmt.Errorf("broker: short authenticate response")
+	}
+
+	var sigASN1 []byte
+	if len(rsp) > 2 {
+		sigASN1 = rsp[2:]
+	}
+
+	return rsp[0] != 0, rsp[1], sigASN1, nil
+}
+
+// NextCounter returns the next signature counter of the credential
+// key, from the counters of the broker.
+func (c *Client) NextCounter(ctx context.Context, key [32]byte) (uint32, error) {
+	rsp, err := c.call(ctx, opCounter, key[:])
+	if err != nil {
+		return 0, err
+	}
+	if len(rsp) != 4 {
+		return 0, fmt.Errorf("broker: bad counter response")
+	}
+
+	return binary.BigEndian.Uint32(rsp), nil
+}
+
+func writeFrame(w io.Writer, code byte, payload []byte) error {
+	if len(payload) > maxPayload {
+		return fmt.Errorf("payload too long")
+	}
+
+	frame := make([]byte, 3, 3+len(payload))
+	frame[0] = code
+	binary.BigEndian.PutUint16(frame[1:], uint16(len(payload)))
+	frame = append(frame, payload...)
+
+	if _, err := w.Write(frame); err != nil {
+		return fmt.Errorf("Write: %w", err)
+	}
+	return nil
+}
+
+// readFrame reads a frame into buf, returning its code and payload.
+func readFrame(r io.Reader, buf []byte) (byte, []byte, error) {
+	if _, err := io.ReadFull(r, buf[:3]); err != nil {
+		return 0, nil, fmt.Errorf("Read: %w", err)
+	}
+
+	n := int(binary.BigEndian.Uint16(buf[1:3]))
+	if n > maxPayload {
+		return 0, nil, errors.New("payload too long")
+	}
+
+	payload := buf[3 : 3+n]
+	if _, err := io.ReadFull(r, payload); err != nil {
+		return 0, nil, fmt.Errorf("Read: %w", err)
+	}
+
+	return buf[0], payload, nil
+}
+
+func boolByte(b bool) byte {
+	if b {
+		return 1
+	}
+	return 0
+}
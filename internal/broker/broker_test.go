@@ -0,0 +1,252 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package broker_test
+
+import (
+	"bytes"
+	"context"
+	"errors"
+	"path/filepath"
+	"strings"
+	"testing"
+	"time"
+
+	"github.com/tillitis/tkey-fido/internal/broker"
+	"github.com/tillitis/tkey-fido/internal/counterstore"
+)
+
+// fakeBackend answers like a TKey would, from what it's given, and
+// hands out the counters of a real counterstore.
+type fakeBackend struct {
+	counters *counterstore.Store
+	// Closed when U2FRegister sees its context cancelled
+	registerCancelled chan struct{}
+}
+
+var errCheckOnly = errors.New("no TKey for that keyhandle")
+
+func (b *fakeBackend) U2FRegister(ctx context.Context, appliParam [32]byte) (byte, []byte, []byte, error) {
+	switch appliParam[0] {
+	case 0:
+		// User not present
+		return 0, nil, nil, nil
+	case 0xff:
+		// Waits for a touch that never comes
+		<-ctx.Done()
+		close(b.registerCancelled)
+		return 0, nil, nil, ctx.Err()
+	}
+
+	keyHandle := bytes.Repeat(appliParam[:1], 64)
+	pubBytes := append([]byte{0x04}, bytes.Repeat([]byte{appliParam[0] + 1}, 64)...)
+	return 1, keyHandle, pubBytes, nil
+}
+
+func (b *fakeBackend) U2FCheckOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error) {
+	if keyHandle[0] == 0xff {
+		return false, errCheckOnly
+	}
+	return keyHandle[0] == appliParam[0], nil
+}
+
+func (b *fakeBackend) U2FAuthenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error) {
+	if keyHandle[0] != appliParam[0] {
+		return false, 0, nil, nil
+	}
+
+	// A "signature" of what we got
+	sig := []byte{challParam[0], byte(counter >> 24), byte(counter >> 16), byte(counter >> 8), byte(counter)}
+	var userPresence byte
+	if checkUser {
+		userPresence = 1
+	}
+	return true, userPresence, sig, nil
+}
+
+func (b *fakeBackend) NextCounter(key [32]byte) (uint32, error) {
+	return b.counters.Next(key)
+}
+
+// serve runs a broker on a Unix socket with a fakeBackend, and returns
+// the path of the socket.
+func serve(t *testing.T) (string, *fakeBackend) {
+	t.Helper()
+	dir := t.TempDir()
+
+	counters, err := counterstore.Open(filepath.Join(dir, "counters"))
+	if err != nil {
+		t.Fatalf("counterstore.Open: %v", err)
+	}
+	t.Cleanup(func() {
+		if err := counters.Close(); err != nil {
+			t.Errorf("Close counters: %v", err)
+		}
+	})
+
+	path := filepath.Join(dir, "sock")
+	l, err := broker.Listen(path)
+	if err != nil {
+		t.Fatalf("Listen: %v", err)
+	}
+	t.Cleanup(func() { l.Close() })
+
+	backend := &fakeBackend{
+		counters:          counters,
+		registerCancelled: make(chan struct{}),
+	}
+	go func() {
+		// Returns when l is closed
+		_ = broker.Serve(l, backend)
+	}()
+
+	return path, backend
+}
+
+func dial(t *testing.T, path string) *broker.Client {
+	t.Helper()
+
+	c, err := broker.Dial(path)
+	if err != nil {
+		t.Fatalf("Dial: %v", err)
+	}
+	t.Cleanup(func() { c.Close() })
+
+	return c
+}
+
+func testContext(t *testing.T) context.Context {
+	ctx, cancel := context.WithTimeout(context.Background(), 10*time.Second)
+	t.Cleanup(cancel)
+
+	return ctx
+}
+
+func TestRoundTrip(t *testing.T) {
+	t.Parallel()
+	path, _ := serve(t)
+	c := dial(t, path)
+	ctx := testContext(t)
+
+	appliParam := [32]byte{0x42}
+	challParam := [32]byte{0x17}
+
+	userPresence, keyHandle, pubBytes, err := c.U2FRegister(ctx, appliParam)
+	if err != nil {
+		t.Fatalf("U2FRegister: %v", err)
+	}
+	if userPresence != 1 || !bytes.Equal(keyHandle, bytes.Repeat([]byte{0x42}, 64)) ||
+		len(pubBytes) != 65 || pubBytes[0] != 0x04 || pubBytes[1] != 0x43 {
+		t.Fatalf("U2FRegister: got %d, %x, %x", userPresence, keyHandle, pubBytes)
+	}
+
+	kh := *(*[64]byte)(keyHandle)
+
+	userPresence, keyHandle, pubBytes, err = c.U2FRegister(ctx, [32]byte{})
+	if err != nil {
+		t.Fatalf("U2FRegister without presence: %v", err)
+	}
+	if userPresence != 0 || keyHandle != nil || pubBytes != nil {
+		t.Fatalf("U2FRegister without presence: got %d, %x, %x", userPresence, keyHandle, pubBytes)
+	}
+
+	valid, err := c.U2FCheckOnly(ctx, appliParam, kh)
+	if err != nil || !valid {
+		t.Fatalf("U2FCheckOnly: got %v, %v, want valid", valid, err)
+	}
+	valid, err = c.U2FCheckOnly(ctx, [32]byte{0x41}, kh)
+	if err != nil || valid {
+		t.Fatalf("U2FCheckOnly of another origin: got %v, %v, want not valid", valid, err)
+	}
+
+	valid, userPresence, sig, err := c.U2FAuthenticate(ctx, appliParam, challParam, kh, true, 0x01020304)
+	if err != nil {
+		t.Fatalf("U2FAuthenticate: %v", err)
+	}
+	if !valid || userPresence != 1 || !bytes.Equal(sig, []byte{0x17, 1, 2, 3, 4}) {
+		t.Fatalf("U2FAuthenticate: got %v, %d, %x", valid, userPresence, sig)
+	}
+
+	valid, _, sig, err = c.U2FAuthenticate(ctx, [32]byte{0x41}, challParam, kh, false, 0)
+	if err != nil {
+		t.Fatalf("U2FAuthenticate of another origin: %v", err)
+	}
+	if valid || sig != nil {
+		t.Fatalf("U2FAuthenticate of another origin: got %v, %x", valid, sig)
+	}
+}
+
+func TestError(t *testing.T) {
+	t.Parallel()
+	path, _ := serve(t)
+	c := dial(t, path)
+	ctx := testContext(t)
+
+	_, err := c.U2FCheckOnly(ctx, [32]byte{}, [64]byte{0xff})
+	if err == nil || !strings.Contains(err.Error(), errCheckOnly.Error()) {
+		t.Fatalf("got %v, want the backend's error", err)
+	}
+
+	// The connection is still usable after an error status
+	if _, err = c.U2FCheckOnly(ctx, [32]byte{}, [64]byte{}); err != nil {
+		t.Fatalf("U2FCheckOnly after error: %v", err)
+	}
+}
+
+func TestCounters(t *testing.T) {
+	t.Parallel()
+	path, _ := serve(t)
+	ctx := testContext(t)
+
+	// Two clients, as two tkey-fido with --use-broker, signing with the
+	// same credential
+	a := dial(t, path)
+	b := dial(t, path)
+	key := counterstore.Key([32]byte{0x42}, [64]byte{0x42})
+	other := counterstore.Key([32]byte{0x41}, [64]byte{0x41})
+
+	var last uint32
+	for i := 0; i < 10; i++ {
+		c := a
+		if i%2 == 1 {
+			c = b
+		}
+
+		counter, err := c.NextCounter(ctx, key)
+		if err != nil {
+			t.Fatalf("NextCounter: %v", err)
+		}
+		if i > 0 && counter <= last {
+			t.Fatalf("counter went from %d to %d", last, counter)
+		}
+		last = counter
+
+		if _, err = c.NextCounter(ctx, other); err != nil {
+			t.Fatalf("NextCounter of another credential: %v", err)
+		}
+	}
+}
+
+func TestCancel(t *testing.T) {
+	t.Parallel()
+	path, backend := serve(t)
+	c := dial(t, path)
+
+	ctx, cancel := context.WithTimeout(context.Background(), 100*time.Millisecond)
+	defer cancel()
+	if _, _, _, err := c.U2FRegister(ctx, [32]byte{0xff}); !errors.Is(err, context.DeadlineExceeded) {
+		t.Fatalf("got %v, want DeadlineExceeded", err)
+	}
+
+	// The broker cancels the backend's wait for a touch
+	select {
+	case <-backend.registerCancelled:
+	case <-time.After(10 * time.Second):
+		t.Fatalf("backend not cancelled")
+	}
+
+	// And the client connects again
+	if _, err := c.U2FCheckOnly(testContext(t), [32]byte{}, [64]byte{}); err != nil {
+		t.Fatalf("U2FCheckOnly after cancel: %v", err)
+	}
+}
@@ -0,0 +1,508 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Package counterstore keeps the U2F signature counters persistent
+// across restarts of the host program, without making every
+// authentication wait for the disk.
+//
+// Counters are handed out from blocks that have already been reserved
+// on disk. The file is an append-only log of reservation records; on
+// start we continue after the highest reservation seen for each key,
+// so a crash only makes a counter skip ahead, never go backwards. The
+// next block is reserved in the background when the current one is
+// half used, and several reservations are written with a single
+// fsync. The log is compacted when it is opened, if it has grown much
+// larger than the set of live keys.
+//
+// Only one process at a time may have the log open, as two would hand
+// out the same counter values. Open takes an exclusive lock on a file
+// next to the log, and fails if another process holds it.
+//
+//	store, err := counterstore.Open(path)
+//	counter, err := store.Next(counterstore.Key(appliParam, keyHandle))
+package counterstore
+
+import (
+	"bytes"
+	"crypto/sha256"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"hash/crc32"
+	"io"
+	"log"
+	"os"
+	"path/filepath"
+	"runtime"
+	"sync"
+)
+
+const (
+	// DefaultBlockSize is how many counter values are reserved with
+	// each log record.
+	DefaultBlockSize = 64
+
+	magic      = "TKFC"
+	version    = 1
+	headerLen  = 8
+	keyLen     = 32
+	recordLen  = keyLen + 4 + 4 // key, reserved, crc32
+	compactMin = 1024           // records, before considering compaction
+	compactFac = 4              // compact when records > compactFac*keys
+)
+
+var ErrExhausted = errors.New("counter exhausted")
+
+// ErrLocked is returned by Open when another process has the log open.
+var ErrLocked = errors.New("counter log in use by another process")
+
+// Key returns the store key for a credential. Our keyhandles are
+// MACed with a secret derived from the CDI, so the keyhandle already
+// binds the device identity (TKey, app and USS) and the key needs no
+// separate device field.
+func Key(appliParam [32]byte, keyHandle [64]byte) [32]byte {
+	var in [32 + 64]byte
+	copy(in[:], appliParam[:])
+	copy(in[32:], keyHandle[:])
+	return sha256.Sum256(in[:])
+}
+
+type counter struct {
+	next     uint32 // next value to hand out
+	reserved uint32 // highest value durably reserved
+	pending  bool   // a reservation for this key is in flight
+}
+
+type Store struct {
+	path      string
+	blockSize uint32
+
+	mu       sync.Mutex
+	cond     *sync.Cond // signalled when a reservation is durable
+	counters map[[32]byte]*counter
+	queue    map[[32]byte]uint32 // reservations waiting for the writer
+	wake     chan struct{}
+	writeErr error
+	closed   bool
+	done     chan struct{}
+
+	f       *os.File
+	lock    *os.File // held for as long as the store is open
+	records int      // records in the log file
+	logger  *log.Logger
+}
+
+// WithBlockSize sets the number of counter values reserved per log
+// record.
+func WithBlockSize(n uint32) func(*Store) {
+	return func(s *Store) {
+		s.blockSize = n
+	}
+}
+
+// WithLogger sets where failures that the store recovers from, like a
+// failed compaction, are logged. The default is stderr.
+func WithLogger(logger *log.Logger) func(*Store) {
+	return func(s *Store) {
+		s.logger = logger
+	}
+}
+
+// Open opens, or creates, the counter log at path and starts the
+// background writer. A torn record at the end of the log, from a crash
+// during a write, is discarded. Returns ErrLocked if another process
+// has the log open.
+func Open(path string, options ...func(*Store)) (*Store, error) {
+	s := &Store{
+		path:      path,
+		blockSize: DefaultBlockSize,
+		counters:  make(map[[32]byte]*counter),
+		queue:     make(map[[32]byte]uint32),
+		wake:      make(chan struct{}, 1),
+		done:      make(chan struct{}),
+		logger:    log.New(os.Stderr, "", 0),
+	}
+	s.cond = sync.NewCond(&s.mu)
+
+	for _, opt := range options {
+		opt(s)
+	}
+	if s.blockSize < 2 {
+		return nil, fmt.Errorf("block size must be at least 2")
+	}
+
+	if err := os.MkdirAll(filepath.Dir(path), 0o700); err != nil {
+		return nil, fmt.Errorf("MkdirAll: %w", err)
+	}
+
+	// The lock is on a file of its own, as compaction replaces the
+	// log file
+	lock, err := os.OpenFile(path+".lock", os.O_RDWR|os.O_CREATE, 0o600)
+	if err != nil {
+		return nil, fmt.Errorf("OpenFile: %w", err)
+	}
+	if err = lockFile(lock); err != nil {
+		lock.Close()
+		return nil, err
+	}
+	s.lock = lock
+
+	f, err := os.OpenFile(path, os.O_RDWR|os.O_CREATE, 0o600)
+	if err != nil {
+		lock.Close()
+		return nil, fmt.Errorf("OpenFile: %w", err)
+	}
+	s.f = f
+
+	if err = s.load(); err != nil {
+		f.Close()
+		lock.Close()
+		return nil, err
+	}
+
+	if s.records > compactMin && s.records > compactFac*len(s.counters) {
+		// The old log is still good, so go on with it
+		if err = s.compact(); err != nil {
+			if s.f == nil {
+				lock.Close()
+				return nil, fmt.Errorf("compaction: %w", err)
+			}
+			s.logger.Printf("Compacting counter log %s failed: %v\n", path, err)
+		}
+	}
+
+	go s.writer()
+
+	return s, nil
+}
+
+// load replays the log into memory, writing a header to a new file and
+// truncating any partial record at the end.
+func (s *Store) load() error {
+	data, err := io.ReadAll(s.f)
+	if err != nil {
+		return fmt.Errorf("ReadAll: %w", err)
+	}
+
+	if len(data) < headerLen {
+		if err = s.f.Truncate(0); err != nil {
+			return fmt.Errorf("Truncate: %w", err)
+		}
+		if _, err = s.f.WriteAt(header(), 0); err != nil {
+			return fmt.Errorf("WriteAt: %w", err)
+		}
+		if err = s.f.Sync(); err != nil {
+			return fmt.Errorf("Sync: %w", err)
+		}
+		_, err = s.f.Seek(headerLen, io.SeekStart)
+		return err
+	}
+
+	if !bytes.Equal(data[:headerLen], header()) {
+		return fmt.Errorf("%s: not a counter log, or unknown version", s.path)
+	}
+
+	off := headerLen
+	for ; off+recordLen <= len(data); off += recordLen {
+		key, reserved, ok := decodeRecord(data[off : off+recordLen])
+		if !ok {
+			break
+		}
+		c := s.counters[key]
+		if c == nil {
+			c = &counter{}
+			s.counters[key] = c
+		}
+		if reserved > c.reserved {
+			c.reserved = reserved
+		}
+		s.records++
+	}
+
+	if off != len(data) {
+		if err = s.f.Truncate(int64(off)); err != nil {
+			return fmt.Errorf("Truncate: %w", err)
+		}
+	}
+
+	// Values up to reserved may have been handed out before we
+	// stopped, so continue after them.
+	for _, c := range s.counters {
+		c.next = c.reserved + 1
+	}
+
+	_, err = s.f.Seek(int64(off), io.SeekStart)
+	return err
+}
+
+// Next returns the next counter value for key. It only waits for the
+// disk when a key is new, or when its reserved block ran out before
+// the background reservation of the next one finished.
+func (s *Store) Next(key [32]byte) (uint32, error) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+
+	c := s.counters[key]
+	if c == nil {
+		c = &counter{next: 1}
+		s.counters[key] = c
+	}
+
+	for {
+		if s.closed {
+			return 0, fmt.Errorf("store closed")
+		}
+		if s.writeErr != nil {
+			return 0, s.writeErr
+		}
+		if c.next == 0 {
+			return 0, ErrExhausted
+		}
+
+		if c.next <= c.reserved {
+			break
+		}
+
+		s.reserve(key, c)
+		s.cond.Wait()
+	}
+
+	value := c.next
+	c.next++ // wraps to 0 when exhausted
+
+	// Reserve the next block when half of this one is used up
+	if c.reserved-value < s.blockSize/2 {
+		s.reserve(key, c)
+	}
+
+	return value, nil
+}
+
+// reserve queues a new block for key for the writer. Called with mu
+// held.
+func (s *Store) reserve(key [32]byte, c *counter) {
+	if c.pending {
+		return
+	}
+
+	upto := uint64(c.reserved) + uint64(s.blockSize)
+	if uint64(c.next) > uint64(c.reserved) {
+		upto = uint64(c.next) - 1 + uint64(s.blockSize)
+	}
+	if upto > 0xffffffff {
+		upto = 0xffffffff
+	}
+	if uint32(upto) <= c.reserved {
+		// Nothing more to reserve
+		return
+	}
+
+	c.pending = true
+	s.queue[key] = uint32(upto)
+
+	select {
+	case s.wake <- struct{}{}:
+	default:
+	}
+}
+
+// writer appends all queued reservations with one write and one
+// fsync, then makes them available to Next.
+func (s *Store) writer() {
+	defer close(s.done)
+
+	for range s.wake {
+		s.mu.Lock()
+		if len(s.queue) == 0 {
+			closed := s.closed
+			s.mu.Unlock()
+			if closed {
+				return
+			}
+			continue
+		}
+		batch := s.queue
+		s.queue = make(map[[32]byte]uint32)
+		s.mu.Unlock()
+
+		err := s.appendRecords(batch)
+
+		s.mu.Lock()
+		for key, upto := range batch {
+			c := s.counters[key]
+			c.pending = false
+			if err == nil {
+				c.reserved = upto
+			}
+		}
+		if err != nil {
+			s.writeErr = fmt.Errorf("counter log: %w", err)
+		}
+		closed := s.closed
+		s.cond.Broadcast()
+		s.mu.Unlock()
+
+		if closed {
+			return
+		}
+	}
+}
+
+func (s *Store) appendRecords(batch map[[32]byte]uint32) error {
+	buf := make([]byte, 0, len(batch)*recordLen)
+	for key, upto := range batch {
+		buf = appendRecord(buf, key, upto)
+	}
+
+	if _, err := s.f.Write(buf); err != nil {
+		return fmt.Errorf("Write: %w", err)
+	}
+	if err := s.f.Sync(); err != nil {
+		return fmt.Errorf("Sync: %w", err)
+	}
+	s.records += len(batch)
+
+	return nil
+}
+
+// compact replaces the log with one holding a single record per key.
+// Called by Open before the writer starts, so nothing else uses the
+// log. On failure, s.f is the old log, open for appending, or nil if
+// it couldn't be opened again.
+func (s *Store) compact() error {
+	tmpPath := s.path + ".tmp"
+
+	buf := make([]byte, 0, headerLen+len(s.counters)*recordLen)
+	buf = append(buf, header()...)
+	for key, c := range s.counters {
+		if c.reserved == 0 {
+			continue
+		}
+		buf = appendRecord(buf, key, c.reserved)
+	}
+
+	tmp, err := os.OpenFile(tmpPath, os.O_RDWR|os.O_CREATE|os.O_TRUNC, 0o600)
+	if err != nil {
+		return fmt.Errorf("OpenFile: %w", err)
+	}
+	if _, err = tmp.Write(buf); err != nil {
+		tmp.Close()
+		os.Remove(tmpPath)
+		return fmt.Errorf("Write: %w", err)
+	}
+	if err = tmp.Sync(); err != nil {
+		tmp.Close()
+		os.Remove(tmpPath)
+		return fmt.Errorf("Sync: %w", err)
+	}
+
+	// Windows can't rename over a file that is open
+	if err = s.f.Close(); err != nil {
+		tmp.Close()
+		os.Remove(tmpPath)
+		return s.reopen(fmt.Errorf("Close: %w", err))
+	}
+	if err = os.Rename(tmpPath, s.path); err != nil {
+		tmp.Close()
+		os.Remove(tmpPath)
+		return s.reopen(fmt.Errorf("Rename: %w", err))
+	}
+	// The new log is in place; if the rename isn't durable yet, a
+	// crash leaves the old one, which is just as good
+	if err = syncDir(filepath.Dir(s.path)); err != nil {
+		s.logger.Printf("Syncing counter log directory failed: %v\n", err)
+	}
+
+	s.f = tmp
+	s.records = (len(buf) - headerLen) / recordLen
+
+	return nil
+}
+
+// reopen opens the log again for appending after a failed compaction,
+// and returns err, or why it couldn't.
+func (s *Store) reopen(err error) error {
+	s.f = nil
+	f, openErr := os.OpenFile(s.path, os.O_RDWR, 0o600)
+	if openErr != nil {
+		return fmt.Errorf("%v, then OpenFile: %w", err, openErr)
+	}
+	if _, seekErr := f.Seek(0, io.SeekEnd); seekErr != nil {
+		f.Close()
+		return fmt.Errorf("%v, then Seek: %w", err, seekErr)
+	}
+	s.f = f
+
+	return err
+}
+
+// Close waits for queued reservations to be written and closes the
+// log.
+func (s *Store) Close() error {
+	s.mu.Lock()
+	if s.closed {
+		s.mu.Unlock()
+		return nil
+	}
+	s.closed = true
+	s.cond.Broadcast()
+	s.mu.Unlock()
+
+	select {
+	case s.wake <- struct{}{}:
+	default:
+	}
+	<-s.done
+
+	err := s.f.Close()
+	// Closing the file releases the lock
+	s.lock.Close()
+	if err != nil {
+		return fmt.Errorf("Close: %w", err)
+	}
+	return nil
+}
+
+func header() []byte {
+	h := make([]byte, headerLen)
+	copy(h, magic)
+	binary.BigEndian.PutUint32(h[4:], version)
+	return h
+}
+
+func appendRecord(buf []byte, key [32]byte, reserved uint32) []byte {
+	start := len(buf)
+	buf = append(buf, key[:]...)
+	buf = binary.BigEndian.AppendUint32(buf, reserved)
+	return binary.BigEndian.AppendUint32(buf, crc32.ChecksumIEEE(buf[start:]))
+}
+
+func decodeRecord(rec []byte) ([32]byte, uint32, bool) {
+	var key [32]byte
+
+	if crc32.ChecksumIEEE(rec[:keyLen+4]) != binary.BigEndian.Uint32(rec[keyLen+4:]) {
+		return key, 0, false
+	}
+	copy(key[:], rec[:keyLen])
+
+	return key, binary.BigEndian.Uint32(rec[keyLen:]), true
+}
+
+func syncDir(dir string) error {
+	// Directories can't be opened for syncing on Windows, where the
+	// rename is durable on its own.
+	if runtime.GOOS == "windows" {
+		return nil
+	}
+
+	d, err := os.Open(dir)
+	if err != nil {
+		return fmt.Errorf("Open: %w", err)
+	}
+	defer d.Close()
+
+	if err = d.Sync(); err != nil {
+		return fmt.Errorf("Sync: %w", err)
+	}
+	return nil
+}
@@ -0,0 +1,105 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package counterstore_test
+
+import (
+	"errors"
+	"os"
+	"path/filepath"
+	"testing"
+
+	"github.com/tillitis/tkey-fido/internal/counterstore"
+)
+
+func key(i int) [32]byte {
+	var k [32]byte
+	k[0] = byte(i)
+	k[1] = byte(i >> 8)
+	return k
+}
+
+func TestLocked(t *testing.T) {
+	t.Parallel()
+	path := filepath.Join(t.TempDir(), "counters")
+
+	s, err := counterstore.Open(path)
+	if err != nil {
+		t.Fatalf("Open: %v", err)
+	}
+
+	if _, err = counterstore.Open(path); !errors.Is(err, counterstore.ErrLocked) {
+		t.Fatalf("second Open: got %v, want ErrLocked", err)
+	}
+
+	if err = s.Close(); err != nil {
+		t.Fatalf("Close: %v", err)
+	}
+
+	s, err = counterstore.Open(path)
+	if err != nil {
+		t.Fatalf("Open after Close: %v", err)
+	}
+	s.Close()
+}
+
+// Counters continue after what was handed out before a restart, and
+// after compacting the log on open.
+func TestReopenAndCompact(t *testing.T) {
+	t.Parallel()
+	path := filepath.Join(t.TempDir(), "counters")
+	const keys = 4
+	// The header, then a record of 40 bytes per key
+	const compacted = 8 + keys*40
+
+	s, err := counterstore.Open(path, counterstore.WithBlockSize(2))
+	if err != nil {
+		t.Fatalf("Open: %v", err)
+	}
+	last := make(map[[32]byte]uint32)
+	// Enough reservations of a few keys to compact the log
+	var n uint32
+	for i := 0; i < 8192; i++ {
+		k := key(i % keys)
+		n, err = s.Next(k)
+		if err != nil {
+			t.Fatalf("Next: %v", err)
+		}
+		if n <= last[k] {
+			t.Fatalf("Next: got %d after %d", n, last[k])
+		}
+		last[k] = n
+	}
+	if err = s.Close(); err != nil {
+		t.Fatalf("Close: %v", err)
+	}
+
+	before, err := os.Stat(path)
+	if err != nil {
+		t.Fatalf("Stat: %v", err)
+	}
+
+	s, err = counterstore.Open(path, counterstore.WithBlockSize(2))
+	if err != nil {
+		t.Fatalf("Open: %v", err)
+	}
+	defer s.Close()
+
+	after, err := os.Stat(path)
+	if err != nil {
+		t.Fatalf("Stat: %v", err)
+	}
+	if after.Size() != compacted || before.Size() <= compacted {
+		t.Fatalf("log was %d bytes, compacted to %d, want %d", before.Size(), after.Size(), compacted)
+	}
+
+	for i := 0; i < keys; i++ {
+		n, err = s.Next(key(i))
+		if err != nil {
+			t.Fatalf("Next: %v", err)
+		}
+		if n <= last[key(i)] {
+			t.Fatalf("Next after reopen: got %d after %d", n, last[key(i)])
+		}
+	}
+}
@@ -0,0 +1,269 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package ctap2
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"math"
+	"unicode/utf8"
+)
+
+// Just enough CBOR (RFC 8949) for CTAP2 messages. The encoder leaves
+// it to the caller to write map keys in CTAP2 canonical order: integer
+// keys ascending, positive before negative, and shorter text keys
+// before longer.
+
+const (
+	majorUint   = 0
+	majorNegInt = 1
+	majorBytes  = 2
+	majorText   = 3
+	majorArray  = 4
+	majorMap    = 5
+	majorSimple = 7
+
+	simpleFalse = 20
+	simpleTrue  = 21
+	simpleNull  = 22
+
+	// CTAP2 messages nest at most 4 levels, extensions included,
+	// so this leaves some slack
+	maxDepth = 8
+)
+
+var errInvalidCBOR = errors.New("invalid CBOR")
+
+type encoder struct {
+	buf []byte
+}
+
+func (e *encoder) head(major byte, n uint64) {
+	major <<= 5
+
+	switch {
+	case n < 24:
+		e.buf = append(e.buf, major|byte(n))
+	case n <= math.MaxUint8:
+		e.buf = append(e.buf, major|24, byte(n))
+	case n <= math.MaxUint16:
+		e.buf = append(e.buf, major|25)
+		e.buf = binary.BigEndian.AppendUint16(e.buf, uint16(n))
+	case n <= math.MaxUint32:
+		e.buf = append(e.buf, major|26)
+		e.buf = binary.BigEndian.AppendUint32(e.buf, uint32(n))
+	default:
+		e.buf = append(e.buf, major|27)
+		e.buf = binary.BigEndian.AppendUint64(e.buf, n)
+	}
+}
+
+func (e *encoder) Int(v int64) {
+	if v < 0 {
+		e.head(majorNegInt, uint64(-1-v))
+		return
+	}
+	e.head(majorUint, uint64(v))
+}
+
+func (e *encoder) Bytes(b []byte) {
+	e.head(majorBytes, uint64(len(b)))
+	e.buf = append(e.buf, b...)
+}
+
+func (e *encoder) Text(s string) {
+	e.head(majorText, uint64(len(s)))
+	e.buf = append(e.buf, s...)
+}
+
+func (e *encoder) Bool(b bool) {
+	if b {
+		e.buf = append(e.buf, majorSimple<<5|simpleTrue)
+		return
+	}
+	e.buf = append(e.buf, majorSimple<<5|simpleFalse)
+}
+
+// Array starts an array of n items, which are encoded next.
+func (e *encoder) Array(n int) {
+	e.head(majorArray, uint64(n))
+}
+
+// Map starts a map of n pairs, which are encoded next as key, value,
+// key, value...
+func (e *encoder) Map(n int) {
+	e.head(majorMap, uint64(n))
+}
+
+// decode parses one CBOR data item that must make up all of data.
+// Integers become int64, byte strings []byte, text strings string,
+// arrays []interface{} and maps map[interface{}]interface{} with int64
+// or string keys. Floats, tags, indefinite lengths and simple values
+// other than false, true and null aren't used by CTAP2 and are
+// rejected.
+func decode(data []byte) (interface{}, error) {
+	d := decoder{data: data}
+
+	v, err := d.item(0)
+	if err != nil {
+		return nil, err
+	}
+	if d.off != len(d.data) {
+		return nil, fmt.Errorf("%w: trailing bytes", errInvalidCBOR)
+	}
+
+	return v, nil
+}
+
+type decoder struct {
+	data []byte
+	off  int
+}
+
+func (d *decoder) head() (byte, uint64, error) {
+	if d.off >= len(d.data) {
+		return 0, 0, fmt.Errorf("%w: truncated", errInvalidCBOR)
+	}
+
+	b := d.data[d.off]
+	d.off++
+	major, info := b>>5, b&0x1f
+
+	if major == majorSimple && info >= 24 {
+		// Floats, or a simple value in an extra byte, which
+		// must not be taken for the value of the bytes after
+		return 0, 0, fmt.Errorf("%w: unsupported simple value or float", errInvalidCBOR)
+	}
+
+	var n int
+	switch {
+	case info < 24:
+		return major, uint64(info), nil
+	case info == 24:
+		n = 1
+	case info == 25:
+		n = 2
+	case info == 26:
+		n = 4
+	case info == 27:
+		n = 8
+	default:
+		return 0, 0, fmt.Errorf("%w: unsupported additional info %d", errInvalidCBOR, info)
+	}
+
+	if len(d.data)-d.off < n {
+		return 0, 0, fmt.Errorf("%w: truncated", errInvalidCBOR)
+	}
+
+	var v uint64
+	for _, c := range d.data[d.off : d.off+n] {
+		v = v<<8 | uint64(c)
+	}
+	d.off += n
+
+	return major, v, nil
+}
+
+func (d *decoder) take(n uint64) ([]byte, error) {
+	if n > uint64(len(d.data)-d.off) {
+		return nil, fmt.Errorf("%w: truncated", errInvalidCBOR)
+	}
+
+	b := d.data[d.off : d.off+int(n)]
+	d.off += int(n)
+
+	return b, nil
+}
+
+func (d *decoder) item(depth int) (interface{}, error) {
+	if depth > maxDepth {
+		return nil, fmt.Errorf("%w: nested too deep", errInvalidCBOR)
+	}
+
+	major, n, err := d.head()
+	if err != nil {
+		return nil, err
+	}
+
+	switch major {
+	case majorUint:
+		if n > math.MaxInt64 {
+			return nil, fmt.Errorf("%w: integer overflow", errInvalidCBOR)
+		}
+		return int64(n), nil
+
+	case majorNegInt:
+		if n > math.MaxInt64 {
+			return nil, fmt.Errorf("%w: integer overflow", errInvalidCBOR)
+		}
+		return -1 - int64(n), nil
+
+	case majorBytes:
+		return d.take(n)
+
+	case majorText:
+		b, err := d.take(n)
+		if err != nil {
+			return nil, err
+		}
+		if !utf8.Valid(b) {
+			return nil, fmt.Errorf("%w: text not UTF-8", errInvalidCBOR)
+		}
+		return string(b), nil
+
+	case majorArray:
+		// Each item is at least 1 byte
+		if n > uint64(len(d.data)-d.off) {
+			return nil, fmt.Errorf("%w: truncated", errInvalidCBOR)
+		}
+		a := make([]interface{}, 0, n)
+		for i := uint64(0); i < n; i++ {
+			v, err := d.item(depth + 1)
+			if err != nil {
+				return nil, err
+			}
+			a = append(a, v)
+		}
+		return a, nil
+
+	case majorMap:
+		if n > uint64(len(d.data)-d.off)/2 {
+			return nil, fmt.Errorf("%w: truncated", errInvalidCBOR)
+		}
+		m := make(map[interface{}]interface{}, n)
+		for i := uint64(0); i < n; i++ {
+			k, err := d.item(depth + 1)
+			if err != nil {
+				return nil, err
+			}
+			switch k.(type) {
+			case int64, string:
+			default:
+				return nil, fmt.Errorf("%w: unsupported map key type", errInvalidCBOR)
+			}
+			if _, ok := m[k]; ok {
+				return nil, fmt.Errorf("%w: duplicate map key", errInvalidCBOR)
+			}
+			v, err := d.item(depth + 1)
+			if err != nil {
+				return nil, err
+			}
+			m[k] = v
+		}
+		return m, nil
+
+	case majorSimple:
+		switch n {
+		case simpleFalse:
+			return false, nil
+		case simpleTrue:
+			return true, nil
+		case simpleNull:
+			return nil, nil
+		}
+	}
+
+	return nil, fmt.Errorf("%w: unsupported major type %d", errInvalidCBOR, major)
+}
@@ -0,0 +1,478 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Package ctap2 parses and builds the CTAP2 messages we need to act as
+// a FIDO2 authenticator on top of the U2F operations of the fido app:
+// authenticatorGetInfo, authenticatorMakeCredential and
+// authenticatorGetAssertion.
+//
+// Since U2F signs appParam || user presence || counter || challenge,
+// an assertion signature from the TKey is a valid CTAP2 signature over
+// authData || clientDataHash when rpIdHash is the appParam, the flags
+// are just the UP bit and the challenge is the clientDataHash. The
+// same goes for fido-u2f attestation of new credentials. No app
+// changes needed.
+//
+// Reference document:
+//
+// SPEC-CTAP2: https://fidoalliance.org/specs/fido-v2.0-ps-20190130/fido-client-to-authenticator-protocol-v2.0-ps-20190130.html
+package ctap2
+
+import (
+	"crypto/sha256"
+	"encoding/binary"
+	"errors"
+	"fmt"
+)
+
+// Commands, the first byte of a CTAPHID_CBOR message
+const (
+	CmdMakeCredential   = 0x01
+	CmdGetAssertion     = 0x02
+	CmdGetInfo          = 0x04
+	CmdClientPIN        = 0x06
+	CmdReset            = 0x07
+	CmdGetNextAssertion = 0x08
+)
+
+// Status is the first byte of every CTAP2 response.
+type Status byte
+
+const (
+	StatusOK                   Status = 0x00
+	StatusInvalidCommand       Status = 0x01
+	StatusInvalidParameter     Status = 0x02
+	StatusInvalidLength        Status = 0x03
+	StatusChannelBusy          Status = 0x06
+	StatusCBORUnexpectedType   Status = 0x11
+	StatusInvalidCBOR          Status = 0x12
+	StatusMissingParameter     Status = 0x14
+	StatusCredentialExcluded   Status = 0x19
+	StatusUnsupportedAlgorithm Status = 0x26
+	StatusOperationDenied      Status = 0x27
+	StatusUnsupportedOption    Status = 0x2B
+	StatusInvalidOption        Status = 0x2C
+	StatusKeepAliveCancel      Status = 0x2D
+	StatusNoCredentials        Status = 0x2E
+	StatusUserActionTimeout    Status = 0x2F
+	StatusNotAllowed           Status = 0x30
+	StatusPINNotSet            Status = 0x35
+	StatusOther                Status = 0x7F
+)
+
+const (
+	flagUserPresent            = 0x01
+	flagAttestedCredentialData = 0x40
+	coseAlgES256               = -7
+	credentialType             = "public-key"
+)
+
+func (s Status) Error() string {
+	return fmt.Sprintf("CTAP2 status 0x%02x", byte(s))
+}
+
+// KeyHandleLen is the length of the fido app's keyhandles, which we
+// use as credential IDs.
+const KeyHandleLen = 64
+
+// The fido-u2f attestation format requires a zero AAGUID.
+var aaguid [16]byte
+
+type MakeCredentialRequest struct {
+	ClientDataHash [32]byte
+	RPID           string
+	// Credential IDs in the exclude list that could be ours
+	ExcludeList [][KeyHandleLen]byte
+}
+
+// AppParam is the U2F application parameter for the request's RP.
+func (r *MakeCredentialRequest) AppParam() [32]byte {
+	return sha256.Sum256([]byte(r.RPID))
+}
+
+type GetAssertionRequest struct {
+	RPID           string
+	ClientDataHash [32]byte
+	// Credential IDs in the allow list that could be ours
+	AllowList [][KeyHandleLen]byte
+	// UserPresence is false if the "up" option is false
+	UserPresence bool
+}
+
+// AppParam is the U2F application parameter for the request's RP.
+func (r *GetAssertionRequest) AppParam() [32]byte {
+	return sha256.Sum256([]byte(r.RPID))
+}
+
+// ParseMakeCredential parses the CBOR parameters of an
+// authenticatorMakeCredential command. Errors are of type Status.
+func ParseMakeCredential(data []byte) (*MakeCredentialRequest, error) {
+	m, err := decodeParams(data)
+	if err != nil {
+		return nil, err
+	}
+
+	var req MakeCredentialRequest
+
+	if err = bytes32(m, 1, &req.ClientDataHash); err != nil {
+		return nil, err
+	}
+
+	rp, err := mapParam(m, 2)
+	if err != nil {
+		return nil, err
+	}
+	if req.RPID, err = textParam(rp, "id"); err != nil {
+		return nil, err
+	}
+
+	if _, err = mapParam(m, 3); err != nil {
+		// user, which we don't store anything of
+		return nil, err
+	}
+
+	params, err := arrayParam(m, 4)
+	if err != nil {
+		return nil, err
+	}
+	es256 := false
+	for _, p := range params {
+		pm, ok := p.(map[interface{}]interface{})
+		if !ok {
+			return nil, StatusCBORUnexpectedType
+		}
+		alg, ok := pm["alg"].(int64)
+		if !ok {
+			return nil, StatusCBORUnexpectedType
+		}
+		var typ string
+		if typ, err = textParam(pm, "type"); err != nil {
+			return nil, err
+		}
+		if alg == coseAlgES256 && typ == credentialType {
+			es256 = true
+		}
+	}
+	if !es256 {
+		return nil, StatusUnsupportedAlgorithm
+	}
+
+	if _, ok := m[int64(5)]; ok {
+		if req.ExcludeList, err = credentialList(m, 5); err != nil {
+			return nil, err
+		}
+	}
+
+	if _, ok := m[int64(7)]; ok {
+		var opts map[interface{}]interface{}
+		if opts, err = mapParam(m, 7); err != nil {
+			return nil, err
+		}
+		// No resident keys, no user verification
+		var rk, uv bool
+		if rk, err = option(opts, "rk", false); err != nil {
+			return nil, err
+		}
+		if uv, err = option(opts, "uv", false); err != nil {
+			return nil, err
+		}
+		if rk || uv {
+			return nil, StatusUnsupportedOption
+		}
+	}
+
+	if _, ok := m[int64(8)]; ok {
+		// pinAuth, but we have no PIN
+		return nil, StatusPINNotSet
+	}
+
+	return &req, nil
+}
+
+// ParseGetAssertion parses the CBOR parameters of an
+// authenticatorGetAssertion command. Errors are of type Status.
+func ParseGetAssertion(data []byte) (*GetAssertionRequest, error) {
+	m, err := decodeParams(data)
+	if err != nil {
+		return nil, err
+	}
+
+	req := GetAssertionRequest{UserPresence: true}
+
+	if req.RPID, err = textParam(m, int64(1)); err != nil {
+		return nil, err
+	}
+
+	if err = bytes32(m, 2, &req.ClientDataHash); err != nil {
+		return nil, err
+	}
+
+	if _, ok := m[int64(3)]; ok {
+		if req.AllowList, err = credentialList(m, 3); err != nil {
+			return nil, err
+		}
+	}
+
+	if _, ok := m[int64(5)]; ok {
+		var opts map[interface{}]interface{}
+		if opts, err = mapParam(m, 5); err != nil {
+			return nil, err
+		}
+		var uv bool
+		if uv, err = option(opts, "uv", false); err != nil {
+			return nil, err
+		}
+		if uv {
+			return nil, StatusUnsupportedOption
+		}
+		if req.UserPresence, err = option(opts, "up", true); err != nil {
+			return nil, err
+		}
+	}
+
+	if _, ok := m[int64(6)]; ok {
+		return nil, StatusPINNotSet
+	}
+
+	return &req, nil
+}
+
+// GetInfo returns the authenticatorGetInfo response data.
+func GetInfo() []byte {
+	var e encoder
+
+	e.Map(4)
+
+	e.Int(1) // versions
+	e.Array(2)
+	e.Text("U2F_V2")
+	e.Text("FIDO_2_0")
+
+	e.Int(3) // aaguid
+	e.Bytes(aaguid[:])
+
+	e.Int(4) // options
+	e.Map(3)
+	e.Text("rk")
+	e.Bool(false)
+	e.Text("up")
+	e.Bool(true)
+	e.Text("plat")
+	e.Bool(false)
+
+	e.Int(9) // transports
+	e.Array(1)
+	e.Text("usb")
+
+	return e.buf
+}
+
+// MakeCredentialResponse returns the authenticatorMakeCredential
+// response data for a new credential with fido-u2f attestation.
+// pubKey is the uncompressed P-256 point (0x04, X, Y), attSig the
+// attestation signature the U2F way (ASN.1 DER) and attCert the
+// attestation certificate (DER).
+func MakeCredentialResponse(appParam [32]byte, keyHandle []byte, pubKey []byte, attCert []byte, attSig []byte) []byte {
+	authData := make([]byte, 0, 32+1+4+16+2+len(keyHandle)+77)
+	authData = append(authData, appParam[:]...)
+	authData = append(authData, flagUserPresent|flagAttestedCredentialData)
+	authData = binary.BigEndian.AppendUint32(authData, 0)
+	authData = append(authData, aaguid[:]...)
+	authData = binary.BigEndian.AppendUint16(authData, uint16(len(keyHandle)))
+	authData = append(authData, keyHandle...)
+	authData = appendCOSEKey(authData, pubKey)
+
+	var e encoder
+
+	e.Map(3)
+
+	e.Int(1) // fmt
+	e.Text("fido-u2f")
+
+	e.Int(2) // authData
+	e.Bytes(authData)
+
+	e.Int(3) // attStmt
+	e.Map(2)
+	e.Text("sig")
+	e.Bytes(attSig)
+	e.Text("x5c")
+	e.Array(1)
+	e.Bytes(attCert)
+
+	return e.buf
+}
+
+// GetAssertionResponse returns the authenticatorGetAssertion response
+// data. userPresence and counter must be what the TKey signed, and
+// sigASN1 the signature.
+func GetAssertionResponse(appParam [32]byte, keyHandle [KeyHandleLen]byte, userPresence byte, counter uint32, sigASN1 []byte) []byte {
+	authData := make([]byte, 0, 32+1+4)
+	authData = append(authData, appParam[:]...)
+	authData = append(authData, userPresence&flagUserPresent)
+	authData = binary.BigEndian.AppendUint32(authData, counter)
+
+	var e encoder
+
+	e.Map(3)
+
+	e.Int(1) // credential
+	e.Map(2)
+	e.Text("id")
+	e.Bytes(keyHandle[:])
+	e.Text("type")
+	e.Text(credentialType)
+
+	e.Int(2) // authData
+	e.Bytes(authData)
+
+	e.Int(3) // signature
+	e.Bytes(sigASN1)
+
+	return e.buf
+}
+
+// appendCOSEKey appends an uncompressed P-256 point as a COSE_Key.
+func appendCOSEKey(dst []byte, pubKey []byte) []byte {
+	e := encoder{buf: dst}
+
+	e.Map(5)
+	e.Int(1) // kty: EC2
+	e.Int(2)
+	e.Int(3) // alg: ES256
+	e.Int(coseAlgES256)
+	e.Int(-1) // crv: P-256
+	e.Int(1)
+	e.Int(-2) // x
+	e.Bytes(pubKey[1:33])
+	e.Int(-3) // y
+	e.Bytes(pubKey[33:65])
+
+	return e.buf
+}
+
+func decodeParams(data []byte) (map[interface{}]interface{}, error) {
+	v, err := decode(data)
+	if err != nil {
+		if errors.Is(err, errInvalidCBOR) {
+			return nil, StatusInvalidCBOR
+		}
+		return nil, StatusOther
+	}
+
+	m, ok := v.(map[interface{}]interface{})
+	if !ok {
+		return nil, StatusCBORUnexpectedType
+	}
+
+	return m, nil
+}
+
+func bytes32(m map[interface{}]interface{}, key int64, out *[32]byte) error {
+	v, ok := m[key]
+	if !ok {
+		return StatusMissingParameter
+	}
+	b, ok := v.([]byte)
+	if !ok {
+		return StatusCBORUnexpectedType
+	}
+	if len(b) != 32 {
+		return StatusInvalidLength
+	}
+	copy(out[:], b)
+
+	return nil
+}
+
+// textParam returns the text string at key, which is an int64 or a
+// string.
+func textParam(m map[interface{}]interface{}, key interface{}) (string, error) {
+	v, ok := m[key]
+	if !ok {
+		return "", StatusMissingParameter
+	}
+	s, ok := v.(string)
+	if !ok {
+		return "", StatusCBORUnexpectedType
+	}
+
+	return s, nil
+}
+
+// option returns the boolean option named key, or def if it's not
+// there.
+func option(m map[interface{}]interface{}, key string, def bool) (bool, error) {
+	v, ok := m[key]
+	if !ok {
+		return def, nil
+	}
+	b, ok := v.(bool)
+	if !ok {
+		return false, StatusCBORUnexpectedType
+	}
+
+	return b, nil
+}
+
+func mapParam(m map[interface{}]interface{}, key int64) (map[interface{}]interface{}, error) {
+	v, ok := m[key]
+	if !ok {
+		return nil, StatusMissingParameter
+	}
+	mv, ok := v.(map[interface{}]interface{})
+	if !ok {
+		return nil, StatusCBORUnexpectedType
+	}
+
+	return mv, nil
+}
+
+func arrayParam(m map[interface{}]interface{}, key int64) ([]interface{}, error) {
+	v, ok := m[key]
+	if !ok {
+		return nil, StatusMissingParameter
+	}
+	a, ok := v.([]interface{})
+	if !ok {
+		return nil, StatusCBORUnexpectedType
+	}
+
+	return a, nil
+}
+
+// credentialList returns the IDs in a list of
+// PublicKeyCredentialDescriptor that have the length of our
+// keyhandles. Others can't be ours and are skipped.
+func credentialList(m map[interface{}]interface{}, key int64) ([][KeyHandleLen]byte, error) {
+	list, err := arrayParam(m, key)
+	if err != nil {
+		return nil, err
+	}
+
+	var ids [][KeyHandleLen]byte
+	for _, c := range list {
+		cm, ok := c.(map[interface{}]interface{})
+		if !ok {
+			return nil, StatusCBORUnexpectedType
+		}
+		idv, ok := cm["id"]
+		if !ok {
+			return nil, StatusMissingParameter
+		}
+		id, ok := idv.([]byte)
+		if !ok {
+			return nil, StatusCBORUnexpectedType
+		}
+		var typ string
+		if typ, err = textParam(cm, "type"); err != nil {
+			return nil, err
+		}
+		if typ != credentialType || len(id) != KeyHandleLen {
+			continue
+		}
+		ids = append(ids, *(*[KeyHandleLen]byte)(id))
+	}
+
+	return ids, nil
+}
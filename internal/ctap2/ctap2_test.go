@@ -0,0 +1,239 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package ctap2_test
+
+import (
+	"bytes"
+	"encoding/hex"
+	"errors"
+	"strings"
+	"testing"
+
+	"github.com/tillitis/tkey-fido/internal/ctap2"
+)
+
+// Parameters of the authenticatorMakeCredential example of the CTAP
+// 2.0 spec
+const (
+	mcClientDataHash = "01" + "5820687134968222ec17202e42505f8ed2b16ae22f16bb05b88c25db9e602645f141"
+	mcRP             = "02" + "a2" + "626964" + "69746573742e63746170" + "646e616d65" + "69746573742e63746170"
+	mcUser           = "03" + "a3" +
+		"626964" + "58202b6689bb18f4169f069fbcdf50cb6ea3c60a861b9a7b63946983e0b577b78c70" +
+		"646e616d65" + "71746573746374617040637461702e636f6d" +
+		"6b646973706c61794e616d65" + "695465737420437461" + "70"
+	mcParams = "04" + "83" +
+		"a2" + "63616c67" + "26" + "6474797065" + "6a7075626c69632d6b6579" +
+		"a2" + "63616c67" + "390100" + "6474797065" + "6a7075626c69632d6b6579" +
+		"a2" + "63616c67" + "3824" + "6474797065" + "6a7075626c69632d6b6579"
+	mcOptions = "07" + "a1" + "62726b" + "f5"
+)
+
+// The spec example, with options {rk: true}
+const specMakeCredential = "a5" + mcClientDataHash + mcRP + mcUser + mcParams + mcOptions
+
+// The example without options, which we can do
+const makeCredential = "a4" + mcClientDataHash + mcRP + mcUser + mcParams
+
+// Parameters of an authenticatorGetAssertion for the example's RP
+const (
+	gaRPID           = "01" + "69746573742e63746170"
+	gaClientDataHash = "02" + "5820687134968222ec17202e42505f8ed2b16ae22f16bb05b88c25db9e602645f141"
+	// Two of our keyhandles around an ID that can't be ours
+	gaAllowList = "03" + "83" +
+		"a2" + "626964" + "5840000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f" +
+		"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f" +
+		"6474797065" + "6a7075626c69632d6b6579" +
+		"a2" + "626964" + "5001010101010101010101010101010101" +
+		"6474797065" + "6a7075626c69632d6b6579" +
+		"a2" + "626964" + "5840404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f" +
+		"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f" +
+		"6474797065" + "6a7075626c69632d6b6579"
+	gaOptions = "05" + "a1" + "627570" + "f4"
+)
+
+const getAssertion = "a4" + gaRPID + gaClientDataHash + gaAllowList + gaOptions
+
+var clientDataHash = [32]byte{
+	0x68, 0x71, 0x34, 0x96, 0x82, 0x22, 0xec, 0x17, 0x20, 0x2e, 0x42, 0x50, 0x5f, 0x8e, 0xd2, 0xb1,
+	0x6a, 0xe2, 0x2f, 0x16, 0xbb, 0x05, 0xb8, 0x8c, 0x25, 0xdb, 0x9e, 0x60, 0x26, 0x45, 0xf1, 0x41,
+}
+
+func mustHex(t *testing.T, s string) []byte {
+	t.Helper()
+
+	b, err := hex.DecodeString(s)
+	if err != nil {
+		t.Fatalf("DecodeString: %v", err)
+	}
+	return b
+}
+
+// checkStatus fails the test if err isn't the Status want, or isn't nil
+// if want is StatusOK.
+func checkStatus(t *testing.T, err error, want ctap2.Status) {
+	t.Helper()
+
+	if want == ctap2.StatusOK {
+		if err != nil {
+			t.Fatalf("got %v, want success", err)
+		}
+		return
+	}
+
+	var status ctap2.Status
+	if !errors.As(err, &status) || status != want {
+		t.Fatalf("got %v, want %v", err, want)
+	}
+}
+
+func TestParseMakeCredential(t *testing.T) {
+	t.Parallel()
+
+	tests := []struct {
+		name string
+		data string
+		want ctap2.Status
+	}{
+		{"spec example", specMakeCredential, ctap2.StatusUnsupportedOption},
+		{"no options", makeCredential, ctap2.StatusOK},
+		{"not a map", "80", ctap2.StatusCBORUnexpectedType},
+		{"empty", "", ctap2.StatusInvalidCBOR},
+		{"trailing bytes", makeCredential + "00", ctap2.StatusInvalidCBOR},
+		{"no parameters", "a0", ctap2.StatusMissingParameter},
+
+		// Over-long lengths
+		{"byte string", "a101" + "5affffffff" + "00", ctap2.StatusInvalidCBOR},
+		{"byte string, 64 bit", "a101" + "5bffffffffffffffff" + "00", ctap2.StatusInvalidCBOR},
+		{"text string", "a101" + "7a00000100" + "61", ctap2.StatusInvalidCBOR},
+		{"array", "a104" + "9bffffffffffffffff" + "a0", ctap2.StatusInvalidCBOR},
+		{"map", "bbffffffffffffffff" + "0000", ctap2.StatusInvalidCBOR},
+		{"integer", "a101" + "1bffffffffffffffff", ctap2.StatusInvalidCBOR},
+
+		// Nesting depth
+		{"nested too deep", "a104" + strings.Repeat("81", 16) + "00", ctap2.StatusInvalidCBOR},
+		{"nested maps", "a104" + strings.Repeat("a101", 16) + "00", ctap2.StatusInvalidCBOR},
+
+		// Not CTAP2 CBOR
+		{"float16 key", "a1" + "f90014" + "00", ctap2.StatusInvalidCBOR},
+		{"float16 option", "a5" + mcClientDataHash + mcRP + mcUser + mcParams + "07" + "a1" + "62726b" + "f90014", ctap2.StatusInvalidCBOR},
+		{"float32", "a101" + "fa00000014", ctap2.StatusInvalidCBOR},
+		{"float64", "a101" + "fb0000000000000014", ctap2.StatusInvalidCBOR},
+		{"simple value in extra byte", "a101" + "f814", ctap2.StatusInvalidCBOR},
+		{"reserved additional info", "a101" + "1c", ctap2.StatusInvalidCBOR},
+		{"indefinite length", "a101" + "5f4100ff", ctap2.StatusInvalidCBOR},
+		{"tag", "a101" + "c0" + "00", ctap2.StatusInvalidCBOR},
+		{"text not UTF-8", "a101" + "62c328", ctap2.StatusInvalidCBOR},
+
+		// Wrong key types
+		{"byte string key", "a1" + "4101" + "00", ctap2.StatusInvalidCBOR},
+		{"array key", "a1" + "8101" + "00", ctap2.StatusInvalidCBOR},
+		{"map key", "a1" + "a0" + "00", ctap2.StatusInvalidCBOR},
+		{"bool key", "a1" + "f5" + "00", ctap2.StatusInvalidCBOR},
+
+		// Wrong value types
+		{"clientDataHash text", "a4" + "01" + "7820" + strings.Repeat("61", 32) + mcRP + mcUser + mcParams, ctap2.StatusCBORUnexpectedType},
+		{"clientDataHash short", "a4" + "01" + "5810" + strings.Repeat("00", 16) + mcRP + mcUser + mcParams, ctap2.StatusInvalidLength},
+		{"rp not a map", "a4" + mcClientDataHash + "02" + "69746573742e63746170" + mcUser + mcParams, ctap2.StatusCBORUnexpectedType},
+		{"rp id not text", "a4" + mcClientDataHash + "02" + "a1" + "626964" + "01" + mcUser + mcParams, ctap2.StatusCBORUnexpectedType},
+		{"no rp id", "a4" + mcClientDataHash + "02" + "a0" + mcUser + mcParams, ctap2.StatusMissingParameter},
+		{"alg not an integer", "a4" + mcClientDataHash + mcRP + mcUser + "04" + "81" + "a2" + "63616c67" + "6126" + "6474797065" + "6a7075626c69632d6b6579", ctap2.StatusCBORUnexpectedType},
+		{"no ES256", "a4" + mcClientDataHash + mcRP + mcUser + "04" + "81" + "a2" + "63616c67" + "390100" + "6474797065" + "6a7075626c69632d6b6579", ctap2.StatusUnsupportedAlgorithm},
+		{"option not bool", "a5" + mcClientDataHash + mcRP + mcUser + mcParams + "07" + "a1" + "62726b" + "01", ctap2.StatusCBORUnexpectedType},
+
+		// Duplicate map keys
+		{"duplicate integer key", "a2" + "0100" + "0100", ctap2.StatusInvalidCBOR},
+		{"duplicate string key", "a1" + "02" + "a2" + "626964" + "6161" + "626964" + "6162", ctap2.StatusInvalidCBOR},
+		{"duplicate parameter", "a5" + mcClientDataHash + mcRP + mcUser + mcParams + mcClientDataHash, ctap2.StatusInvalidCBOR},
+	}
+
+	for _, test := range tests {
+		test := test
+		t.Run(test.name, func(t *testing.T) {
+			t.Parallel()
+
+			req, err := ctap2.ParseMakeCredential(mustHex(t, test.data))
+			checkStatus(t, err, test.want)
+			if err != nil {
+				return
+			}
+			if req.RPID != "test.ctap" || req.ClientDataHash != clientDataHash || len(req.ExcludeList) != 0 {
+				t.Fatalf("got RP ID %q, clientDataHash %x, exclude list %x",
+					req.RPID, req.ClientDataHash, req.ExcludeList)
+			}
+		})
+	}
+}
+
+func TestParseMakeCredentialTruncated(t *testing.T) {
+	t.Parallel()
+
+	data := mustHex(t, makeCredential)
+	for n := 0; n < len(data); n++ {
+		_, err := ctap2.ParseMakeCredential(data[:n])
+		var status ctap2.Status
+		if !errors.As(err, &status) || status != ctap2.StatusInvalidCBOR {
+			t.Fatalf("%d of %d bytes: got %v, want %v", n, len(data), err, ctap2.StatusInvalidCBOR)
+		}
+	}
+}
+
+func TestParseGetAssertion(t *testing.T) {
+	t.Parallel()
+
+	tests := []struct {
+		name string
+		data string
+		want ctap2.Status
+	}{
+		{"allow list", getAssertion, ctap2.StatusOK},
+		{"no rpId", "a1" + gaClientDataHash, ctap2.StatusMissingParameter},
+		{"rpId not text", "a2" + "01" + "4474657374" + gaClientDataHash, ctap2.StatusCBORUnexpectedType},
+		{"allow list not an array", "a3" + gaRPID + gaClientDataHash + "03" + "a0", ctap2.StatusCBORUnexpectedType},
+		{"credential id not bytes", "a3" + gaRPID + gaClientDataHash + "03" + "81" + "a2" + "626964" + "6161" + "6474797065" + "6a7075626c69632d6b6579", ctap2.StatusCBORUnexpectedType},
+		{"credential without id", "a3" + gaRPID + gaClientDataHash + "03" + "81" + "a1" + "6474797065" + "6a7075626c69632d6b6579", ctap2.StatusMissingParameter},
+		{"option not bool", "a3" + gaRPID + gaClientDataHash + "05" + "a1" + "627570" + "00", ctap2.StatusCBORUnexpectedType},
+		{"float16 option", "a3" + gaRPID + gaClientDataHash + "05" + "a1" + "627570" + "f90014", ctap2.StatusInvalidCBOR},
+		{"user verification", "a3" + gaRPID + gaClientDataHash + "05" + "a1" + "627576" + "f5", ctap2.StatusUnsupportedOption},
+		{"duplicate option", "a3" + gaRPID + gaClientDataHash + "05" + "a2" + "627570f4" + "627570f5", ctap2.StatusInvalidCBOR},
+		{"duplicate parameter", "a5" + gaRPID + gaClientDataHash + gaAllowList + gaOptions + gaRPID, ctap2.StatusInvalidCBOR},
+	}
+
+	for _, test := range tests {
+		test := test
+		t.Run(test.name, func(t *testing.T) {
+			t.Parallel()
+
+			_, err := ctap2.ParseGetAssertion(mustHex(t, test.data))
+			checkStatus(t, err, test.want)
+		})
+	}
+}
+
+func TestParseGetAssertionAllowList(t *testing.T) {
+	t.Parallel()
+
+	req, err := ctap2.ParseGetAssertion(mustHex(t, getAssertion))
+	if err != nil {
+		t.Fatalf("ParseGetAssertion: %v", err)
+	}
+
+	if req.RPID != "test.ctap" || req.ClientDataHash != clientDataHash || req.UserPresence {
+		t.Fatalf("got RP ID %q, clientDataHash %x, user presence %v",
+			req.RPID, req.ClientDataHash, req.UserPresence)
+	}
+
+	// The 16 byte ID is skipped
+	if len(req.AllowList) != 2 {
+		t.Fatalf("got %d credentials, want 2", len(req.AllowList))
+	}
+	for i, kh := range req.AllowList {
+		var want [ctap2.KeyHandleLen]byte
+		for j := range want {
+			want[j] = byte(i*ctap2.KeyHandleLen + j)
+		}
+		if !bytes.Equal(kh[:], want[:]) {
+			t.Fatalf("credential %d: got %x, want %x", i, kh, want)
+		}
+	}
+}
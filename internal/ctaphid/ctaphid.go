@@ -0,0 +1,429 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Package ctaphid is the CTAPHID transport of a FIDO authenticator. A
+// Token assembles the messages a browser writes as 64 byte HID
+// reports, allocates channels, answers CTAPHID_INIT and CTAPHID_PING
+// itself and hands CTAPHID_MSG (U2F) and CTAPHID_CBOR (CTAP2) requests
+// on as Events. Their responses, and the CTAPHID_KEEPALIVE messages
+// sent while waiting for the user, are framed back into reports.
+//
+// Reference document:
+//
+// SPEC-CTAP2: https://fidoalliance.org/specs/fido-v2.0-ps-20190130/fido-client-to-authenticator-protocol-v2.0-ps-20190130.html
+// (8.1 USB Human Interface Device)
+package ctaphid
+
+import (
+	"context"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"sync"
+)
+
+// ReportLen is the length of the HID reports of a FIDO device, both
+// ways.
+const ReportLen = 64
+
+const (
+	initDataLen = ReportLen - 7 // CID, CMD, BCNTH, BCNTL
+	contDataLen = ReportLen - 5 // CID, SEQ
+
+	// MaxMessageLen is the most an initialization packet and 128
+	// continuation packets hold.
+	MaxMessageLen = initDataLen + 128*contDataLen
+
+	broadcastChannel = 0xffffffff
+)
+
+// Command is the CMD of a CTAPHID message, with the bit telling an
+// initialization packet set.
+type Command byte
+
+const (
+	CmdPing      Command = 0x81
+	CmdMsg       Command = 0x83
+	CmdInit      Command = 0x86
+	CmdCBOR      Command = 0x90
+	CmdCancel    Command = 0x91
+	CmdKeepAlive Command = 0xbb
+	CmdError     Command = 0xbf
+)
+
+// Errors sent in CTAPHID_ERROR
+const (
+	errInvalidCmd     = 0x01
+	errInvalidLen     = 0x03
+	errInvalidSeq     = 0x04
+	errChannelBusy    = 0x06
+	errInvalidChannel = 0x0b
+)
+
+// Status of a CTAPHID_KEEPALIVE
+const (
+	StatusProcessing = 0x01
+	StatusUPNeeded   = 0x02
+)
+
+// Capabilities in the CTAPHID_INIT response
+const capCBOR = 0x04
+
+// ErrNotPending is returned when writing a response to a request the
+// host has since abandoned, by resynchronizing its channel.
+var ErrNotPending = errors.New("request no longer pending")
+
+// Device is a FIDO HID device, reading the reports the host writes
+// and writing reports to it.
+type Device interface {
+	ReadReport() ([]byte, error)
+	WriteReport(report []byte) error
+	Close() error
+}
+
+// Event is a CTAPHID_MSG or CTAPHID_CBOR request.
+type Event struct {
+	Cmd     Command
+	Channel uint32
+	// Seq numbers the requests of a Token, telling a request from
+	// earlier ones on the same channel.
+	Seq uint32
+	Msg []byte
+	// Cancelled is closed if the host sends CTAPHID_CANCEL, or
+	// resynchronizes the channel, before the request is answered.
+	Cancelled <-chan struct{}
+
+	req *request
+}
+
+// request is a message being assembled, or handled on a channel.
+type request struct {
+	cmd     Command
+	msg     []byte
+	want    int
+	seq     byte
+	handled bool
+
+	cancel    chan struct{}
+	cancelled bool
+}
+
+func (r *request) abort() {
+	if !r.cancelled {
+		r.cancelled = true
+		close(r.cancel)
+	}
+}
+
+// Token is a FIDO authenticator's end of CTAPHID on a Device.
+type Token struct {
+	dev    Device
+	events chan Event
+
+	writeMu sync.Mutex // the reports of one message at a time
+
+	mu       sync.Mutex
+	channels uint32 // allocated so far, from 1 and up
+	requests uint32 // handed on so far
+	pending  map[uint32]*request
+}
+
+func New(dev Device) *Token {
+	return &Token{
+		dev:     dev,
+		events:  make(chan Event, 64),
+		pending: make(map[uint32]*request),
+	}
+}
+
+// Events returns the requests for the authenticator, which answers
+// each with WriteResponse or WriteCBORResponse. It is closed when Run
+// returns.
+func (t *Token) Events() chan Event {
+	return t.events
+}
+
+// Run reads reports from the device until ctx is done or reading
+// fails, and closes the device.
+func (t *Token) Run(ctx context.Context) error {
+	defer close(t.events)
+
+	stop := make(chan struct{})
+	defer close(stop)
+	go func() {
+		select {
+		case <-ctx.Done():
+		case <-stop:
+		}
+		// Makes ReadReport return
+		t.dev.Close()
+	}()
+
+	for {
+		report, err := t.dev.ReadReport()
+		if err != nil {
+			if ctx.Err() != nil {
+				return fmt.Errorf("ctx.Err: %w", ctx.Err())
+			}
+			return fmt.Errorf("ReadReport: %w", err)
+		}
+
+		if err = t.handleReport(ctx, report); err != nil {
+			return err
+		}
+	}
+}
+
+// WriteResponse answers the CTAPHID_MSG request ev with a U2F response:
+// data and a status word.
+func (t *Token) WriteResponse(ctx context.Context, ev Event, data []byte, status uint16) error {
+	msg := make([]byte, 0, len(data)+2)
+	msg = append(msg, data...)
+	msg = append(msg, byte(status>>8), byte(status))
+
+	return t.respond(ctx, ev, CmdMsg, msg)
+}
+
+// WriteCBORResponse answers the CTAPHID_CBOR request ev with a CTAP2
+// status and CBOR data.
+func (t *Token) WriteCBORResponse(ctx context.Context, ev Event, status byte, data []byte) error {
+	msg := make([]byte, 0, 1+len(data))
+	msg = append(msg, status)
+	msg = append(msg, data...)
+
+	return t.respond(ctx, ev, CmdCBOR, msg)
+}
+
+// WriteKeepAlive tells the host that ev is still being handled.
+func (t *Token) WriteKeepAlive(ctx context.Context, ev Event, status byte) error {
+	if err := ctx.Err(); err != nil {
+		return fmt.Errorf("ctx.Err: %w", err)
+	}
+	if !t.isPending(ev) {
+		return ErrNotPending
+	}
+
+	return t.writeMessage(ev.Channel, CmdKeepAlive, []byte{status})
+}
+
+func (t *Token) respond(ctx context.Context, ev Event, cmd Command, msg []byte) error {
+	if err := ctx.Err(); err != nil {
+		return fmt.Errorf("ctx.Err: %w", err)
+	}
+	if !t.isPending(ev) {
+		return ErrNotPending
+	}
+
+	err := t.writeMessage(ev.Channel, cmd, msg)
+
+	t.mu.Lock()
+	if t.pending[ev.Channel] == ev.req {
+		delete(t.pending, ev.Channel)
+	}
+	t.mu.Unlock()
+
+	return err
+}
+
+func (t *Token) isPending(ev Event) bool {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+
+	return ev.req != nil && t.pending[ev.Channel] == ev.req
+}
+
+// handleReport takes one report from the host. Only a failing write
+// to the device is an error.
+func (t *Token) handleReport(ctx context.Context, report []byte) error {
+	if len(report) < ReportLen {
+		// Not from a FIDO client
+		return nil
+	}
+
+	channel := binary.BigEndian.Uint32(report)
+	if report[4]&0x80 == 0 {
+		return t.continuation(ctx, channel, report[4], report[5:ReportLen])
+	}
+
+	cmd := Command(report[4])
+	n := int(binary.BigEndian.Uint16(report[5:]))
+	data := report[7:ReportLen]
+
+	if cmd == CmdInit {
+		return t.init(channel, n, data)
+	}
+
+	t.mu.Lock()
+	valid := channel != 0 && channel <= t.channels
+	r := t.pending[channel]
+	t.mu.Unlock()
+
+	switch {
+	case !valid:
+		return t.writeError(channel, errInvalidChannel)
+	case cmd == CmdCancel:
+		if r != nil && r.handled {
+			t.mu.Lock()
+			r.abort()
+			t.mu.Unlock()
+		}
+		return nil
+	case r != nil && r.handled:
+		return t.writeError(channel, errChannelBusy)
+	case r != nil:
+		// A new message before the last one was complete
+		t.drop(channel)
+		return t.writeError(channel, errInvalidSeq)
+	case cmd != CmdPing && cmd != CmdMsg && cmd != CmdCBOR:
+		return t.writeError(channel, errInvalidCmd)
+	case n > MaxMessageLen:
+		return t.writeError(channel, errInvalidLen)
+	}
+
+	r = &request{cmd: cmd, msg: make([]byte, 0, n), want: n, cancel: make(chan struct{})}
+	r.msg = append(r.msg, data[:minInt(n, len(data))]...)
+
+	t.mu.Lock()
+	t.pending[channel] = r
+	t.mu.Unlock()
+
+	return t.complete(ctx, channel, r)
+}
+
+func (t *Token) continuation(ctx context.Context, channel uint32, seq byte, data []byte) error {
+	t.mu.Lock()
+	r := t.pending[channel]
+	t.mu.Unlock()
+
+	if r == nil || r.handled {
+		// Nothing to continue, spurious
+		return nil
+	}
+	if seq != r.seq {
+		t.drop(channel)
+		return t.writeError(channel, errInvalidSeq)
+	}
+
+	r.seq++
+	r.msg = append(r.msg, data[:minInt(r.want-len(r.msg), len(data))]...)
+
+	return t.complete(ctx, channel, r)
+}
+
+// complete passes r on if all of its message is here.
+func (t *Token) complete(ctx context.Context, channel uint32, r *request) error {
+	if len(r.msg) < r.want {
+		return nil
+	}
+
+	if r.cmd == CmdPing {
+		t.drop(channel)
+		return t.writeMessage(channel, CmdPing, r.msg)
+	}
+
+	t.mu.Lock()
+	r.handled = true
+	t.requests++
+	seq := t.requests
+	t.mu.Unlock()
+
+	select {
+	case t.events <- Event{Cmd: r.cmd, Channel: channel, Seq: seq, Msg: r.msg, Cancelled: r.cancel, req: r}:
+	case <-ctx.Done():
+	}
+
+	return nil
+}
+
+// init answers CTAPHID_INIT: a new channel when asked on the broadcast
+// channel, or resynchronizing the channel it was sent on.
+func (t *Token) init(channel uint32, n int, data []byte) error {
+	const nonceLen = 8
+	if n != nonceLen {
+		return t.writeError(channel, errInvalidLen)
+	}
+
+	// Answered on the channel it was sent on
+	reqChannel := channel
+
+	t.mu.Lock()
+	if channel == broadcastChannel {
+		t.channels++
+		if t.channels == broadcastChannel {
+			// Start over, some 4 billion channels later
+			t.channels = 1
+		}
+		channel = t.channels
+	} else if channel == 0 || channel > t.channels {
+		t.mu.Unlock()
+		return t.writeError(channel, errInvalidChannel)
+	}
+	t.mu.Unlock()
+	t.drop(channel)
+
+	// Nonce, channel, CTAPHID protocol version, device version and
+	// capabilities
+	rsp := make([]byte, 0, nonceLen+4+5)
+	rsp = append(rsp, data[:nonceLen]...)
+	rsp = binary.BigEndian.AppendUint32(rsp, channel)
+	rsp = append(rsp, 2, 0, 0, 0, capCBOR)
+
+	return t.writeMessage(reqChannel, CmdInit, rsp)
+}
+
+// drop forgets what's pending on channel, cancelling a request being
+// handled.
+func (t *Token) drop(channel uint32) {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+
+	if r := t.pending[channel]; r != nil {
+		r.abort()
+		delete(t.pending, channel)
+	}
+}
+
+func (t *Token) writeError(channel uint32, code byte) error {
+	return t.writeMessage(channel, CmdError, []byte{code})
+}
+
+// writeMessage writes msg in an initialization packet and as many
+// continuation packets as needed.
+func (t *Token) writeMessage(channel uint32, cmd Command, msg []byte) error {
+	if len(msg) > MaxMessageLen {
+		return fmt.Errorf("message too long: %d bytes", len(msg))
+	}
+
+	t.writeMu.Lock()
+	defer t.writeMu.Unlock()
+
+	var report [ReportLen]byte
+	binary.BigEndian.PutUint32(report[:], channel)
+	report[4] = byte(cmd)
+	binary.BigEndian.PutUint16(report[5:], uint16(len(msg)))
+	msg = msg[copy(report[7:], msg):]
+
+	if err := t.dev.WriteReport(report[:]); err != nil {
+		return fmt.Errorf("WriteReport: %w", err)
+	}
+
+	for seq := byte(0); len(msg) > 0; seq++ {
+		report = [ReportLen]byte{}
+		binary.BigEndian.PutUint32(report[:], channel)
+		report[4] = seq
+		msg = msg[copy(report[5:], msg):]
+
+		if err := t.dev.WriteReport(report[:]); err != nil {
+			return fmt.Errorf("WriteReport: %w", err)
+		}
+	}
+
+	return nil
+}
+
+func minInt(a, b int) int {
+	if a < b {
+		return a
+	}
+	return b
+}
@@ -0,0 +1,282 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package ctaphid_test
+
+import (
+	"bytes"
+	"context"
+	"encoding/binary"
+	"errors"
+	"testing"
+	"time"
+
+	"github.com/tillitis/tkey-fido/internal/ctaphid"
+)
+
+// hostDevice is the host's side of a Device, in place of a browser.
+type hostDevice struct {
+	out    chan []byte // written by the host
+	in     chan []byte // written by the token
+	closed chan struct{}
+}
+
+func newHostDevice() *hostDevice {
+	return &hostDevice{
+		out:    make(chan []byte, 256),
+		in:     make(chan []byte, 256),
+		closed: make(chan struct{}),
+	}
+}
+
+func (d *hostDevice) ReadReport() ([]byte, error) {
+	select {
+	case r := <-d.out:
+		return r, nil
+	case <-d.closed:
+		return nil, errors.New("closed")
+	}
+}
+
+func (d *hostDevice) WriteReport(report []byte) error {
+	d.in <- append([]byte(nil), report...)
+	return nil
+}
+
+func (d *hostDevice) Close() error {
+	select {
+	case <-d.closed:
+	default:
+		close(d.closed)
+	}
+	return nil
+}
+
+// send writes msg as the host would, in an initialization packet and
+// continuation packets.
+func (d *hostDevice) send(channel uint32, cmd ctaphid.Command, msg []byte) {
+	report := make([]byte, ctaphid.ReportLen)
+	binary.BigEndian.PutUint32(report, channel)
+	report[4] = byte(cmd)
+	binary.BigEndian.PutUint16(report[5:], uint16(len(msg)))
+	msg = msg[copy(report[7:], msg):]
+	d.out <- report
+
+	for seq := byte(0); len(msg) > 0; seq++ {
+		report = make([]byte, ctaphid.ReportLen)
+		binary.BigEndian.PutUint32(report, channel)
+		report[4] = seq
+		msg = msg[copy(report[5:], msg):]
+		d.out <- report
+	}
+}
+
+// receive reads a message from the token.
+func (d *hostDevice) receive(t *testing.T) (uint32, ctaphid.Command, []byte) {
+	t.Helper()
+
+	report := d.next(t)
+	channel := binary.BigEndian.Uint32(report)
+	cmd := ctaphid.Command(report[4])
+	n := int(binary.BigEndian.Uint16(report[5:]))
+	msg := append([]byte(nil), report[7:]...)
+
+	for seq := byte(0); len(msg) < n; seq++ {
+		report = d.next(t)
+		if binary.BigEndian.Uint32(report) != channel || report[4] != seq {
+			t.Fatalf("continuation packet %x, want channel %08x seq %d", report[:5], channel, seq)
+		}
+		msg = append(msg, report[5:]...)
+	}
+
+	return channel, cmd, msg[:n]
+}
+
+func (d *hostDevice) next(t *testing.T) []byte {
+	t.Helper()
+
+	select {
+	case r := <-d.in:
+		if len(r) != ctaphid.ReportLen {
+			t.Fatalf("report of %d bytes", len(r))
+		}
+		return r
+	case <-time.After(5 * time.Second):
+		t.Fatalf("no report from the token")
+		return nil
+	}
+}
+
+// initChannel allocates a channel with CTAPHID_INIT.
+func (d *hostDevice) initChannel(t *testing.T) uint32 {
+	t.Helper()
+
+	nonce := []byte{1, 2, 3, 4, 5, 6, 7, 8}
+	d.send(0xffffffff, ctaphid.CmdInit, nonce)
+
+	channel, cmd, msg := d.receive(t)
+	if channel != 0xffffffff || cmd != ctaphid.CmdInit || len(msg) != 17 || !bytes.Equal(msg[:8], nonce) {
+		t.Fatalf("INIT response on %08x cmd %02x: %x", channel, cmd, msg)
+	}
+	if msg[16]&0x04 == 0 {
+		t.Fatalf("INIT response without the CBOR capability: %x", msg)
+	}
+
+	return binary.BigEndian.Uint32(msg[8:])
+}
+
+func startToken(t *testing.T) (*ctaphid.Token, *hostDevice) {
+	t.Helper()
+
+	dev := newHostDevice()
+	token := ctaphid.New(dev)
+	ctx, cancel := context.WithCancel(context.Background())
+	done := make(chan struct{})
+	go func() {
+		defer close(done)
+		_ = token.Run(ctx)
+	}()
+	t.Cleanup(func() {
+		cancel()
+		<-done
+	})
+
+	return token, dev
+}
+
+func nextEvent(t *testing.T, token *ctaphid.Token) ctaphid.Event {
+	t.Helper()
+
+	select {
+	case ev := <-token.Events():
+		return ev
+	case <-time.After(5 * time.Second):
+		t.Fatalf("no event")
+		return ctaphid.Event{}
+	}
+}
+
+func TestInit(t *testing.T) {
+	t.Parallel()
+	_, dev := startToken(t)
+
+	first := dev.initChannel(t)
+	second := dev.initChannel(t)
+	if first == 0 || first == 0xffffffff || first == second {
+		t.Fatalf("allocated channels %08x and %08x", first, second)
+	}
+}
+
+func TestMsgAndResponse(t *testing.T) {
+	t.Parallel()
+	token, dev := startToken(t)
+	ctx := context.Background()
+	channel := dev.initChannel(t)
+
+	// Spans an initialization packet and several continuation packets
+	// each way
+	req := bytes.Repeat([]byte{0xa5, 0x5a, 0x01}, 100)
+	dev.send(channel, ctaphid.CmdMsg, req)
+
+	ev := nextEvent(t, token)
+	if ev.Cmd != ctaphid.CmdMsg || ev.Channel != channel || !bytes.Equal(ev.Msg, req) {
+		t.Fatalf("event cmd %02x channel %08x msg %x", ev.Cmd, ev.Channel, ev.Msg)
+	}
+
+	data := bytes.Repeat([]byte{0x42}, 200)
+	if err := token.WriteResponse(ctx, ev, data, 0x9000); err != nil {
+		t.Fatalf("WriteResponse: %v", err)
+	}
+	gotChannel, cmd, msg := dev.receive(t)
+	if gotChannel != channel || cmd != ctaphid.CmdMsg || !bytes.Equal(msg, append(data, 0x90, 0x00)) {
+		t.Fatalf("response on %08x cmd %02x: %x", gotChannel, cmd, msg)
+	}
+
+	if err := token.WriteResponse(ctx, ev, nil, 0x9000); !errors.Is(err, ctaphid.ErrNotPending) {
+		t.Fatalf("second WriteResponse: got %v, want ErrNotPending", err)
+	}
+}
+
+func TestCBORKeepAliveCancel(t *testing.T) {
+	t.Parallel()
+	token, dev := startToken(t)
+	ctx := context.Background()
+	channel := dev.initChannel(t)
+
+	dev.send(channel, ctaphid.CmdCBOR, []byte{0x04})
+	ev := nextEvent(t, token)
+	if ev.Cmd != ctaphid.CmdCBOR {
+		t.Fatalf("event cmd %02x", ev.Cmd)
+	}
+
+	if err := token.WriteKeepAlive(ctx, ev, ctaphid.StatusUPNeeded); err != nil {
+		t.Fatalf("WriteKeepAlive: %v", err)
+	}
+	if _, cmd, msg := dev.receive(t); cmd != ctaphid.CmdKeepAlive || !bytes.Equal(msg, []byte{ctaphid.StatusUPNeeded}) {
+		t.Fatalf("keepalive cmd %02x: %x", cmd, msg)
+	}
+
+	// Busy until answered
+	dev.send(channel, ctaphid.CmdCBOR, []byte{0x04})
+	if _, cmd, msg := dev.receive(t); cmd != ctaphid.CmdError || !bytes.Equal(msg, []byte{0x06}) {
+		t.Fatalf("second request: cmd %02x: %x, want ERR_CHANNEL_BUSY", cmd, msg)
+	}
+
+	dev.send(channel, ctaphid.CmdCancel, nil)
+	select {
+	case <-ev.Cancelled:
+	case <-time.After(5 * time.Second):
+		t.Fatalf("not cancelled")
+	}
+
+	if err := token.WriteCBORResponse(ctx, ev, 0x2d, nil); err != nil {
+		t.Fatalf("WriteCBORResponse: %v", err)
+	}
+	if _, cmd, msg := dev.receive(t); cmd != ctaphid.CmdCBOR || !bytes.Equal(msg, []byte{0x2d}) {
+		t.Fatalf("response cmd %02x: %x", cmd, msg)
+	}
+}
+
+func TestPing(t *testing.T) {
+	t.Parallel()
+	_, dev := startToken(t)
+	channel := dev.initChannel(t)
+
+	ping := bytes.Repeat([]byte{0x17}, ctaphid.MaxMessageLen)
+	dev.send(channel, ctaphid.CmdPing, ping)
+	if _, cmd, msg := dev.receive(t); cmd != ctaphid.CmdPing || !bytes.Equal(msg, ping) {
+		t.Fatalf("ping cmd %02x, %d bytes", cmd, len(msg))
+	}
+}
+
+func TestErrors(t *testing.T) {
+	t.Parallel()
+	_, dev := startToken(t)
+	channel := dev.initChannel(t)
+
+	expectError := func(what string, code byte) {
+		t.Helper()
+		if _, cmd, msg := dev.receive(t); cmd != ctaphid.CmdError || !bytes.Equal(msg, []byte{code}) {
+			t.Fatalf("%s: cmd %02x: %x, want error %02x", what, cmd, msg, code)
+		}
+	}
+
+	dev.send(channel+1, ctaphid.CmdMsg, []byte{0})
+	expectError("unallocated channel", 0x0b)
+
+	dev.send(channel, 0x88, nil) // CTAPHID_WINK
+	expectError("wink", 0x01)
+
+	// An initialization packet promising more, then a continuation
+	// packet out of sequence
+	report := make([]byte, ctaphid.ReportLen)
+	binary.BigEndian.PutUint32(report, channel)
+	report[4] = byte(ctaphid.CmdMsg)
+	report[6] = 100
+	dev.out <- report
+	report = make([]byte, ctaphid.ReportLen)
+	binary.BigEndian.PutUint32(report, channel)
+	report[4] = 1
+	dev.out <- report
+	expectError("sequence", 0x04)
+}
@@ -0,0 +1,173 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package ctaphid
+
+import (
+	"encoding/binary"
+	"fmt"
+	"os"
+	"sync"
+)
+
+// Events of /dev/uhid, from linux/uhid.h. Each read and write is a
+// struct uhid_event: a 32 bit type and a packed union of requests, of
+// which UHID_CREATE2 is the largest.
+const (
+	uhidDestroy        = 1
+	uhidOutput         = 6
+	uhidGetReport      = 9
+	uhidGetReportReply = 10
+	uhidCreate2        = 11
+	uhidInput2         = 12
+	uhidSetReport      = 13
+	uhidSetReportReply = 14
+
+	uhidEventLen = 4 + 128 + 64 + 64 + 2 + 2 + 4*4 + 4096
+	uhidDataMax  = 4096
+
+	busUSB = 0x03
+	eio    = 5
+)
+
+// The IDs the soft HID always had. Browsers find FIDO devices by the
+// usage page of the report descriptor, not by these.
+const (
+	vendorID  = 0x15d9
+	productID = 0x0a37
+)
+
+// fidoReportDescriptor is a FIDO usage page device with 64 byte input
+// and output reports, without report IDs.
+var fidoReportDescriptor = []byte{
+	0x06, 0xd0, 0xf1, // Usage Page (FIDO Alliance)
+	0x09, 0x01, // Usage (CTAPHID)
+	0xa1, 0x01, // Collection (Application)
+	0x09, 0x20, //   Usage (Input Report Data)
+	0x15, 0x00, //   Logical Minimum (0)
+	0x26, 0xff, 0x00, //   Logical Maximum (255)
+	0x75, 0x08, //   Report Size (8)
+	0x95, ReportLen, //   Report Count (64)
+	0x81, 0x02, //   Input (Data, Variable, Absolute)
+	0x09, 0x21, //   Usage (Output Report Data)
+	0x15, 0x00, //   Logical Minimum (0)
+	0x26, 0xff, 0x00, //   Logical Maximum (255)
+	0x75, 0x08, //   Report Size (8)
+	0x95, ReportLen, //   Report Count (64)
+	0x91, 0x02, //   Output (Data, Variable, Absolute)
+	0xc0, // End Collection
+}
+
+// UHID is a FIDO HID device created through /dev/uhid. The struct
+// fields of uhid_event are in host byte order, which is little-endian
+// on all machines we run on.
+type UHID struct {
+	f *os.File
+
+	writeMu sync.Mutex
+	in      [uhidEventLen]byte // only used by ReadReport
+}
+
+// OpenUHID creates a FIDO HID device called name. Close destroys it.
+func OpenUHID(name string) (*UHID, error) {
+	f, err := os.OpenFile("/dev/uhid", os.O_RDWR, 0)
+	if err != nil {
+		return nil, fmt.Errorf("OpenFile: %w", err)
+	}
+
+	var ev [uhidEventLen]byte
+	binary.LittleEndian.PutUint32(ev[0:], uhidCreate2)
+	copy(ev[4:4+127], name)
+	// phys and uniq left empty
+	binary.LittleEndian.PutUint16(ev[260:], uint16(len(fidoReportDescriptor)))
+	binary.LittleEndian.PutUint16(ev[262:], busUSB)
+	binary.LittleEndian.PutUint32(ev[264:], vendorID)
+	binary.LittleEndian.PutUint32(ev[268:], productID)
+	copy(ev[280:], fidoReportDescriptor)
+
+	if _, err = f.Write(ev[:]); err != nil {
+		f.Close()
+		return nil, fmt.Errorf("UHID_CREATE2: %w", err)
+	}
+
+	return &UHID{f: f}, nil
+}
+
+// ReadReport returns the next output report the host writes.
+func (u *UHID) ReadReport() ([]byte, error) {
+	for {
+		n, err := u.f.Read(u.in[:])
+		if err != nil {
+			return nil, fmt.Errorf("Read: %w", err)
+		}
+		if n < 4 {
+			continue
+		}
+
+		switch binary.LittleEndian.Uint32(u.in[0:]) {
+		case uhidOutput:
+			size := int(binary.LittleEndian.Uint16(u.in[4+uhidDataMax:]))
+			data := u.in[4 : 4+minInt(size, uhidDataMax)]
+			// hidraw passes on the report number, 0 as we have
+			// no report IDs, in front of the report
+			if len(data) == ReportLen+1 {
+				data = data[1:]
+			}
+			return append([]byte(nil), data...), nil
+
+		case uhidGetReport, uhidSetReport:
+			// We have no feature reports. The kernel waits for a
+			// reply to these.
+			reply := uint32(uhidGetReportReply)
+			if binary.LittleEndian.Uint32(u.in[0:]) == uhidSetReport {
+				reply = uhidSetReportReply
+			}
+			if err = u.reply(reply, binary.LittleEndian.Uint32(u.in[4:])); err != nil {
+				return nil, err
+			}
+		}
+		// UHID_START, UHID_STOP, UHID_OPEN and UHID_CLOSE need
+		// nothing from us
+	}
+}
+
+// reply fails the GET_REPORT or SET_REPORT request with id.
+func (u *UHID) reply(typ uint32, id uint32) error {
+	var ev [4 + 4 + 2 + 2]byte
+	binary.LittleEndian.PutUint32(ev[0:], typ)
+	binary.LittleEndian.PutUint32(ev[4:], id)
+	binary.LittleEndian.PutUint16(ev[8:], eio)
+
+	return u.write(ev[:])
+}
+
+// WriteReport sends an input report to the host.
+func (u *UHID) WriteReport(report []byte) error {
+	var ev [4 + 2 + ReportLen]byte
+	binary.LittleEndian.PutUint32(ev[0:], uhidInput2)
+	binary.LittleEndian.PutUint16(ev[4:], uint16(copy(ev[6:], report)))
+
+	return u.write(ev[:])
+}
+
+func (u *UHID) write(ev []byte) error {
+	u.writeMu.Lock()
+	defer u.writeMu.Unlock()
+
+	if _, err := u.f.Write(ev); err != nil {
+		return fmt.Errorf("Write: %w", err)
+	}
+	return nil
+}
+
+// Close destroys the device.
+func (u *UHID) Close() error {
+	var ev [4]byte
+	binary.LittleEndian.PutUint32(ev[:], uhidDestroy)
+	_ = u.write(ev[:])
+
+	if err := u.f.Close(); err != nil {
+		return fmt.Errorf("Close: %w", err)
+	}
+	return nil
+}
@@ -0,0 +1,18 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+//go:build !linux
+
+package ctaphid
+
+import "errors"
+
+// UHID is a FIDO HID device created through /dev/uhid, which only
+// Linux has.
+type UHID struct {
+	Device
+}
+
+func OpenUHID(name string) (*UHID, error) {
+	return nil, errors.New("no /dev/uhid, a soft HID needs Linux")
+}
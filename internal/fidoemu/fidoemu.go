@@ -0,0 +1,474 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Package fidoemu is a stand-in for a TKey running the fido app, for
+// measuring the host side without hardware. It speaks the app's frame
+// protocol (device-fido/main.c and app_proto.c) and uses the same
+// keyhandle scheme and P-256 keys as u2f.c, with configurable compute
+// time per command, touch behaviour and line rate.
+//
+// It behaves like a TKey whose app is already loaded: firmware
+// requests get the same NOK response as the real app gives them.
+//
+//	pty, err := fidoemu.OpenPTY()
+//	// Connect to pty.Path with tkeyclient as to any TKey
+//	err = fidoemu.New(fidoemu.WithLineRate(62500)).Serve(pty)
+package fidoemu
+
+import (
+	"crypto/ecdsa"
+	"crypto/elliptic"
+	"crypto/rand"
+	"crypto/sha256"
+	"crypto/subtle"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"math/big"
+	"sync"
+	"time"
+
+	"golang.org/x/crypto/blake2s"
+)
+
+// Frame protocol, as in tkey-libs proto.h
+const (
+	dstFW = 2
+	dstSW = 3
+
+	lenBytes1   = 0
+	lenBytes4   = 1
+	lenBytes32  = 2
+	lenBytes128 = 3
+
+	statusOK  = 0
+	statusBad = 1
+)
+
+// App protocol, as in app_proto.h
+const (
+	cmdGetNameVersion     = 0x01
+	rspGetNameVersion     = 0x02
+	cmdU2FRegister        = 0x03
+	rspU2FRegister        = 0x04
+	cmdU2FCheckOnly       = 0x05
+	rspU2FCheckOnly       = 0x06
+	cmdU2FAuthenticateSet = 0x07
+	cmdU2FAuthenticateGo  = 0x08
+	rspU2FAuthenticate    = 0x09
+	rspUnknownCmd         = 0xff
+)
+
+const (
+	appName0   = "tk1 "
+	appName1   = "fido"
+	appVersion = 0x00000001
+
+	// U2F_TOUCH_TIMEOUT_SECS in u2f.c
+	touchTimeout = 10 * time.Second
+)
+
+// Latency is the compute time the stand-in spends on each command
+// before replying.
+type Latency struct {
+	GetNameVersion  time.Duration
+	Register        time.Duration
+	CheckOnly       time.Duration
+	AuthenticateSet time.Duration
+	AuthenticateGo  time.Duration
+}
+
+type Device struct {
+	secret     [32]byte // stands in for the CDI
+	latency    Latency
+	touchAfter time.Duration
+	noTouch    bool
+	lineRate   int // bits per second, 0 for no limit
+
+	mu   sync.Mutex // one connection at a time
+	data [133]byte  // appli_param, chall_param, keyhandle, check_user, counter
+}
+
+// WithSecret sets the secret used for keyhandles and private keys,
+// which is the CDI on a real TKey. Without it a random one is used, so
+// keyhandles are only valid for this Device.
+func WithSecret(secret [32]byte) func(*Device) {
+	return func(d *Device) {
+		d.secret = secret
+	}
+}
+
+// WithLatency sets the compute time per command.
+func WithLatency(latency Latency) func(*Device) {
+	return func(d *Device) {
+		d.latency = latency
+	}
+}
+
+// WithTouchAfter makes the user touch the stand-in this long after it
+// starts waiting for touch. The default is to be touched immediately.
+func WithTouchAfter(after time.Duration) func(*Device) {
+	return func(d *Device) {
+		d.touchAfter = after
+	}
+}
+
+// WithNoTouch makes the user never touch the stand-in, which then
+// times out like the app does and reports no user presence.
+func WithNoTouch() func(*Device) {
+	return func(d *Device) {
+		d.noTouch = true
+	}
+}
+
+// WithLineRate limits the serial line to bps bits per second, at 10
+// bits per byte, in both directions.
+func WithLineRate(bps int) func(*Device) {
+	return func(d *Device) {
+		d.lineRate = bps
+	}
+}
+
+func New(options ...func(*Device)) *Device {
+	d := &Device{}
+
+	if _, err := rand.Read(d.secret[:]); err != nil {
+		panic(fmt.Sprintf("rand.Read: %v", err))
+	}
+
+	for _, opt := range options {
+		opt(d)
+	}
+
+	return d
+}
+
+// Serve runs the app protocol on rw until reading from it fails. It
+// returns nil at io.EOF.
+func (d *Device) Serve(rw io.ReadWriter) error {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+
+	var hdr [1]byte
+	var cmd [128]byte
+
+	for {
+		if _, err := io.ReadFull(rw, hdr[:]); err != nil {
+			if errors.Is(err, io.EOF) {
+				return nil
+			}
+			return fmt.Errorf("Read: %w", err)
+		}
+
+		// Reserved bit must be 0, else we look for the next header
+		// like the app does
+		if hdr[0]&0x80 != 0 {
+			continue
+		}
+
+		id := (hdr[0] >> 5) & 0x3
+		endpoint := (hdr[0] >> 3) & 0x3
+		n := frameBytes(hdr[0] & 0x3)
+
+		for i := range cmd {
+			cmd[i] = 0
+		}
+		if _, err := io.ReadFull(rw, cmd[:n]); err != nil {
+			return fmt.Errorf("Read: %w", err)
+		}
+		d.wire(1 + n)
+
+		if endpoint == dstFW {
+			if err := d.reply(rw, genhdr(id, endpoint, statusBad, lenBytes1), []byte{0}); err != nil {
+				return err
+			}
+			continue
+		}
+		if endpoint != dstSW {
+			continue
+		}
+
+		if err := d.handle(rw, id, endpoint, cmd[:n]); err != nil {
+			return err
+		}
+	}
+}
+
+// handle does one command, as the switch in main.c.
+func (d *Device) handle(w io.Writer, id, endpoint byte, cmd []byte) error {
+	var rsp [128]byte
+
+	switch cmd[0] {
+	case cmdGetNameVersion:
+		time.Sleep(d.latency.GetNameVersion)
+		if len(cmd) == 1 {
+			copy(rsp[0:], appName0)
+			copy(rsp[4:], appName1)
+			binary.LittleEndian.PutUint32(rsp[8:], appVersion)
+		}
+		return d.appreply(w, id, endpoint, rspGetNameVersion, rsp[:])
+
+	case cmdU2FRegister:
+		if len(cmd) != 128 {
+			rsp[0] = statusBad
+			return d.appreply(w, id, endpoint, rspU2FRegister, rsp[:])
+		}
+
+		userPresence := d.waitTouched()
+		if !userPresence {
+			// Returned early, so compute time doesn't count
+			rsp[0] = statusOK
+			if err := d.appreply(w, id, endpoint, rspU2FRegister, rsp[:]); err != nil {
+				return err
+			}
+			return d.appreply(w, id, endpoint, rspU2FRegister, rsp[:])
+		}
+
+		time.Sleep(d.latency.Register)
+
+		var appliParam, nonce [32]byte
+		copy(appliParam[:], cmd[1:])
+		if _, err := rand.Read(nonce[:]); err != nil {
+			return fmt.Errorf("rand.Read: %w", err)
+		}
+
+		priv := d.mac(appliParam[:], nonce[:])
+		key, err := keyFromBytes(priv[:])
+		if err != nil {
+			rsp[0] = statusBad
+			rsp[1] = 1
+			return d.appreply(w, id, endpoint, rspU2FRegister, rsp[:])
+		}
+		mac := d.mac(appliParam[:], priv[:])
+
+		// 1st response: user_presence and keyhandle
+		rsp[0] = statusOK
+		rsp[1] = 1
+		copy(rsp[2:], nonce[:])
+		copy(rsp[2+32:], mac[:])
+		if err = d.appreply(w, id, endpoint, rspU2FRegister, rsp[:]); err != nil {
+			return err
+		}
+
+		// 2nd response: pubkey
+		rsp = [128]byte{}
+		rsp[0] = statusOK
+		key.X.FillBytes(rsp[1 : 1+32])
+		key.Y.FillBytes(rsp[1+32 : 1+64])
+		return d.appreply(w, id, endpoint, rspU2FRegister, rsp[:])
+
+	case cmdU2FCheckOnly:
+		if len(cmd) != 128 {
+			rsp[0] = statusBad
+			return d.appreply(w, id, endpoint, rspU2FCheckOnly, rsp[:])
+		}
+
+		time.Sleep(d.latency.CheckOnly)
+
+		_, valid := d.checkKeyHandle(cmd[1:1+32], cmd[1+32:1+32+64])
+
+		rsp[0] = statusOK
+		if valid {
+			rsp[1] = 1
+		}
+		return d.appreply(w, id, endpoint, rspU2FCheckOnly, rsp[:])
+
+	case cmdU2FAuthenticateSet:
+		if len(cmd) != 128 {
+			rsp[0] = statusBad
+			return d.appreply(w, id, endpoint, rspU2FAuthenticate, rsp[:])
+		}
+
+		time.Sleep(d.latency.AuthenticateSet)
+
+		// pick up appli_param, chall_param
+		copy(d.data[:], cmd[1:1+32+32])
+		rsp[0] = statusOK
+		return d.appreply(w, id, endpoint, rspU2FAuthenticate, rsp[:])
+
+	case cmdU2FAuthenticateGo:
+		if len(cmd) != 128 {
+			rsp[0] = statusBad
+			return d.appreply(w, id, endpoint, rspU2FAuthenticate, rsp[:])
+		}
+
+		// pick up keyhandle, check_user, counter
+		copy(d.data[32+32:], cmd[1:1+64+1+4])
+
+		ret := d.authenticate(rsp[1:])
+		if ret != 0 {
+			rsp[0] = statusBad
+			rsp[1] = ret
+		} else {
+			rsp[0] = statusOK
+		}
+		return d.appreply(w, id, endpoint, rspU2FAuthenticate, rsp[:])
+
+	default:
+		return d.appreply(w, id, endpoint, rspUnknownCmd, rsp[:])
+	}
+}
+
+// authenticate is u2f_authenticate(), on the data picked up by SET and
+// GO.
+func (d *Device) authenticate(payload []byte) byte {
+	appliParam := d.data[0:32]
+	challParam := d.data[32:64]
+	keyHandle := d.data[64:128]
+	checkUser := d.data[128]
+	counter := d.data[129:133]
+
+	priv, valid := d.checkKeyHandle(appliParam, keyHandle)
+	if !valid {
+		payload[0] = 0
+		return 0
+	}
+
+	var userPresence byte
+	if checkUser != 0 {
+		if !d.waitTouched() {
+			payload[0] = 1
+			payload[1] = 0
+			return 0
+		}
+		userPresence = 1
+	}
+
+	time.Sleep(d.latency.AuthenticateGo)
+
+	var sigData []byte
+	sigData = append(sigData, appliParam...)
+	sigData = append(sigData, userPresence)
+	sigData = append(sigData, counter...)
+	sigData = append(sigData, challParam...)
+	hash := sha256.Sum256(sigData)
+
+	key, err := keyFromBytes(priv[:])
+	if err != nil {
+		return 1
+	}
+	r, s, err := ecdsa.Sign(rand.Reader, key, hash[:])
+	if err != nil {
+		return 1
+	}
+
+	payload[0] = 1
+	payload[1] = userPresence
+	r.FillBytes(payload[2 : 2+32])
+	s.FillBytes(payload[2+32 : 2+64])
+	return 0
+}
+
+// checkKeyHandle recovers the private key from the keyhandle's nonce
+// and tells whether the keyhandle's MAC is valid for it.
+func (d *Device) checkKeyHandle(appliParam, keyHandle []byte) ([32]byte, bool) {
+	nonce := keyHandle[:32]
+	mac := keyHandle[32:64]
+
+	priv := d.mac(appliParam, nonce)
+	macAgain := d.mac(appliParam, priv[:])
+
+	return priv, subtle.ConstantTimeCompare(mac, macAgain[:]) == 1
+}
+
+// mac is blake2s_mac() in u2f.c: keyed BLAKE2s over the two 32 byte
+// parts.
+func (d *Device) mac(part1, part2 []byte) [32]byte {
+	var out [32]byte
+
+	h, err := blake2s.New256(d.secret[:])
+	if err != nil {
+		panic(fmt.Sprintf("blake2s.New256: %v", err))
+	}
+	h.Write(part1)
+	h.Write(part2)
+	h.Sum(out[:0])
+
+	return out
+}
+
+func (d *Device) waitTouched() bool {
+	if d.noTouch {
+		time.Sleep(touchTimeout)
+		return false
+	}
+	time.Sleep(d.touchAfter)
+	return true
+}
+
+// appreply sends a response frame with rspcode and as many bytes from
+// buf as fit, as appreply() in app_proto.c.
+func (d *Device) appreply(w io.Writer, id, endpoint byte, rspcode byte, buf []byte) error {
+	var l byte
+
+	switch rspcode {
+	case rspGetNameVersion:
+		l = lenBytes32
+	case rspU2FRegister, rspU2FAuthenticate:
+		l = lenBytes128
+	case rspU2FCheckOnly:
+		l = lenBytes4
+	default:
+		l = lenBytes1
+	}
+
+	n := frameBytes(l)
+	payload := make([]byte, n)
+	payload[0] = rspcode
+	copy(payload[1:], buf[:n-1])
+
+	return d.reply(w, genhdr(id, endpoint, statusOK, l), payload)
+}
+
+func (d *Device) reply(w io.Writer, hdr byte, payload []byte) error {
+	frame := append([]byte{hdr}, payload...)
+
+	d.wire(len(frame))
+	if _, err := w.Write(frame); err != nil {
+		return fmt.Errorf("Write: %w", err)
+	}
+	return nil
+}
+
+// wire waits for the time it takes n bytes to pass the serial line.
+func (d *Device) wire(n int) {
+	if d.lineRate == 0 {
+		return
+	}
+	time.Sleep(time.Duration(n*10) * time.Second / time.Duration(d.lineRate))
+}
+
+func genhdr(id, endpoint, status, l byte) byte {
+	return id<<5 | endpoint<<3 | status<<2 | l
+}
+
+func frameBytes(l byte) int {
+	switch l {
+	case lenBytes1:
+		return 1
+	case lenBytes4:
+		return 4
+	case lenBytes32:
+		return 32
+	default:
+		return 128
+	}
+}
+
+// keyFromBytes is p256_keypair_from_bytes(): the private key is the 32
+// bytes big-endian, and must be in [1, n-1].
+func keyFromBytes(priv []byte) (*ecdsa.PrivateKey, error) {
+	curve := elliptic.P256()
+
+	k := new(big.Int).SetBytes(priv)
+	if k.Sign() == 0 || k.Cmp(curve.Params().N) >= 0 {
+		return nil, fmt.Errorf("private key out of range")
+	}
+
+	key := &ecdsa.PrivateKey{D: k}
+	key.Curve = curve
+	key.X, key.Y = curve.ScalarBaseMult(priv)
+
+	return key, nil
+}
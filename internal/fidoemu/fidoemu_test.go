@@ -0,0 +1,217 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package fidoemu_test
+
+import (
+	"bytes"
+	"crypto/ecdsa"
+	"crypto/elliptic"
+	"crypto/sha256"
+	"encoding/hex"
+	"io"
+	"math/big"
+	"net"
+	"testing"
+	"time"
+
+	"github.com/tillitis/tkey-fido/internal/fidoemu"
+	"golang.org/x/crypto/blake2s"
+)
+
+// The known answers of the app's crypto core, from kat() in
+// device-fido/host/bench.c, which are what the app on a TKey outputs.
+// The stand-in must give the same keys for the same CDI.
+const (
+	katMAC       = "9f8cac3d8b78aa7ad4618b8b2bd5190983668a032768ef6899a1f97df9d1a31a"
+	katKeyHandle = "a726a54d6711759b029ae965b76526a9faed7663b21a64cb15c03dc0ab6a4af5" +
+		"771b383e5c3dfeaa2c47107918ffbebe16a65643bacd49b7168b2de547f1d436"
+	katPubKey = "df743a66bab286b8c37be827423e833021668f9e92070345adfab89653d2a385" +
+		"7262460769cc9e4dc28c065d107e6c780db2506e594241e7f34fb835a86368b6"
+	// valid, user presence, r, s
+	katAuthenticate = "0101bb2d75e4fd6d9174506dd4454d40eca4bbc5a3013777c261816ef445b3b1" +
+		"0dece8f14da337d05da9e321c4dc72a6be51c3690a72206e2e6c3329b6bc9b8f" +
+		"d7c5"
+)
+
+// katSecret is kat_cdi in bench.c, as the bytes the app reads.
+func katSecret() [32]byte {
+	var secret [32]byte
+	for i := range secret {
+		secret[i] = byte(i)
+	}
+	return secret
+}
+
+func katParams() (appliParam, challParam [32]byte) {
+	for i := 0; i < 32; i++ {
+		appliParam[i] = byte(i)
+		challParam[i] = byte(0xff - i)
+	}
+	return appliParam, challParam
+}
+
+var katCounter = [4]byte{0x00, 0x00, 0x01, 0x00}
+
+func mustHex(t *testing.T, s string) []byte {
+	t.Helper()
+
+	b, err := hex.DecodeString(s)
+	if err != nil {
+		t.Fatalf("DecodeString: %v", err)
+	}
+	return b
+}
+
+// app is the host end of a connection to a served stand-in.
+type app struct {
+	t    *testing.T
+	conn net.Conn
+}
+
+func serve(t *testing.T, d *fidoemu.Device) *app {
+	t.Helper()
+
+	host, dev := net.Pipe()
+	done := make(chan error, 1)
+	go func() {
+		done <- d.Serve(dev)
+	}()
+	t.Cleanup(func() {
+		host.Close()
+		if err := <-done; err != nil {
+			t.Errorf("Serve: %v", err)
+		}
+	})
+
+	if err := host.SetDeadline(time.Now().Add(10 * time.Second)); err != nil {
+		t.Fatalf("SetDeadline: %v", err)
+	}
+	return &app{t: t, conn: host}
+}
+
+// command sends the app command cmd with payload in a 128 byte frame
+// and returns the payload of the response, after its response code,
+// which must be rsp.
+func (a *app) command(cmd, rsp byte, payload []byte, rspLen int) []byte {
+	a.t.Helper()
+
+	// Frame ID 1, app endpoint, 128 bytes
+	frame := make([]byte, 1+128)
+	frame[0] = 1<<5 | 3<<3 | 3
+	frame[1] = cmd
+	copy(frame[2:], payload)
+	if _, err := a.conn.Write(frame); err != nil {
+		a.t.Fatalf("Write: %v", err)
+	}
+
+	got := make([]byte, 1+rspLen)
+	if _, err := io.ReadFull(a.conn, got); err != nil {
+		a.t.Fatalf("Read: %v", err)
+	}
+	if got[0]&0x1c != 3<<3 || got[1] != rsp {
+		a.t.Fatalf("command %#02x: got response %x", cmd, got)
+	}
+
+	return got[2:]
+}
+
+func TestKATBlake2sMAC(t *testing.T) {
+	t.Parallel()
+
+	// The stand-in's keyhandle MAC is keyed BLAKE2s, with the CDI
+	// as key, as blake2s_mac() in u2f.c
+	secret := katSecret()
+	appliParam, challParam := katParams()
+
+	h, err := blake2s.New256(secret[:])
+	if err != nil {
+		t.Fatalf("New256: %v", err)
+	}
+	h.Write(appliParam[:])
+	h.Write(challParam[:])
+	if got := h.Sum(nil); !bytes.Equal(got, mustHex(t, katMAC)) {
+		t.Fatalf("got %x, want %s", got, katMAC)
+	}
+}
+
+func TestKATCheckOnly(t *testing.T) {
+	t.Parallel()
+
+	a := serve(t, fidoemu.New(fidoemu.WithSecret(katSecret())))
+	appliParam, _ := katParams()
+	keyHandle := mustHex(t, katKeyHandle)
+
+	payload := make([]byte, 0, 32+64)
+	payload = append(payload, appliParam[:]...)
+	payload = append(payload, keyHandle...)
+	if rsp := a.command(0x05, 0x06, payload, 4); rsp[0] != 0 || rsp[1] != 1 {
+		t.Fatalf("keyhandle of the app: got %x, want valid", rsp)
+	}
+
+	payload[len(payload)-1] ^= 1
+	if rsp := a.command(0x05, 0x06, payload, 4); rsp[0] != 0 || rsp[1] != 0 {
+		t.Fatalf("tampered keyhandle: got %x, want not valid", rsp)
+	}
+
+	// Valid only with the CDI it was made with
+	a = serve(t, fidoemu.New())
+	payload[len(payload)-1] ^= 1
+	if rsp := a.command(0x05, 0x06, payload, 4); rsp[0] != 0 || rsp[1] != 0 {
+		t.Fatalf("keyhandle of another CDI: got %x, want not valid", rsp)
+	}
+}
+
+func TestKATAuthenticate(t *testing.T) {
+	t.Parallel()
+
+	a := serve(t, fidoemu.New(fidoemu.WithSecret(katSecret())))
+	appliParam, challParam := katParams()
+	keyHandle := mustHex(t, katKeyHandle)
+
+	pub := mustHex(t, katPubKey)
+	key := &ecdsa.PublicKey{
+		Curve: elliptic.P256(),
+		X:     new(big.Int).SetBytes(pub[:32]),
+		Y:     new(big.Int).SetBytes(pub[32:]),
+	}
+	if !key.Curve.IsOnCurve(key.X, key.Y) {
+		t.Fatalf("public key not on the curve")
+	}
+
+	// What u2f_authenticate() signs, with check_user set
+	var sigData []byte
+	sigData = append(sigData, appliParam[:]...)
+	sigData = append(sigData, 1)
+	sigData = append(sigData, katCounter[:]...)
+	sigData = append(sigData, challParam[:]...)
+	digest := sha256.Sum256(sigData)
+
+	// The app's signature, to know the vectors fit together
+	want := mustHex(t, katAuthenticate)
+	if !ecdsa.Verify(key, digest[:], new(big.Int).SetBytes(want[2:2+32]), new(big.Int).SetBytes(want[2+32:])) {
+		t.Fatalf("the app's signature doesn't verify")
+	}
+
+	if rsp := a.command(0x07, 0x09, append(appliParam[:], challParam[:]...), 128); rsp[0] != 0 {
+		t.Fatalf("U2FAuthenticateSet: status %d", rsp[0])
+	}
+	payload := make([]byte, 0, 64+1+4)
+	payload = append(payload, keyHandle...)
+	payload = append(payload, 1) // check_user
+	payload = append(payload, katCounter[:]...)
+	rsp := a.command(0x08, 0x09, payload, 128)
+	if rsp[0] != 0 {
+		t.Fatalf("U2FAuthenticateGo: status %d", rsp[0])
+	}
+
+	// ECDSA signatures are randomized, so the stand-in's can only be
+	// verified with the app's key
+	got := rsp[1 : 1+2+64]
+	if !bytes.Equal(got[:2], want[:2]) {
+		t.Fatalf("got valid and user presence %x, want %x", got[:2], want[:2])
+	}
+	if !ecdsa.Verify(key, digest[:], new(big.Int).SetBytes(got[2:2+32]), new(big.Int).SetBytes(got[2+32:])) {
+		t.Fatalf("signature doesn't verify with the app's key")
+	}
+}
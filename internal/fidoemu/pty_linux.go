@@ -0,0 +1,72 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package fidoemu
+
+import (
+	"fmt"
+	"os"
+
+	"golang.org/x/sys/unix"
+	"golang.org/x/term"
+)
+
+// PTY is a pseudo terminal for a Device to Serve on. A client opens
+// Path as the serial port of a TKey.
+type PTY struct {
+	Path   string
+	master *os.File
+	slave  *os.File
+}
+
+func OpenPTY() (*PTY, error) {
+	master, err := os.OpenFile("/dev/ptmx", os.O_RDWR, 0)
+	if err != nil {
+		return nil, fmt.Errorf("OpenFile: %w", err)
+	}
+
+	fd := int(master.Fd())
+	if err = unix.IoctlSetPointerInt(fd, unix.TIOCSPTLCK, 0); err != nil {
+		master.Close()
+		return nil, fmt.Errorf("unlockpt: %w", err)
+	}
+	n, err := unix.IoctlGetUint32(fd, unix.TIOCGPTN)
+	if err != nil {
+		master.Close()
+		return nil, fmt.Errorf("ptsname: %w", err)
+	}
+	path := fmt.Sprintf("/dev/pts/%d", n)
+
+	// We keep the slave open ourselves, so reading the master blocks
+	// instead of failing when a client closes it, and clients can
+	// come and go like with a real TKey
+	slave, err := os.OpenFile(path, os.O_RDWR, 0)
+	if err != nil {
+		master.Close()
+		return nil, fmt.Errorf("OpenFile: %w", err)
+	}
+	if _, err = term.MakeRaw(int(slave.Fd())); err != nil {
+		slave.Close()
+		master.Close()
+		return nil, fmt.Errorf("MakeRaw: %w", err)
+	}
+
+	return &PTY{
+		Path:   path,
+		master: master,
+		slave:  slave,
+	}, nil
+}
+
+func (p *PTY) Read(b []byte) (int, error) {
+	return p.master.Read(b)
+}
+
+func (p *PTY) Write(b []byte) (int, error) {
+	return p.master.Write(b)
+}
+
+func (p *PTY) Close() error {
+	p.slave.Close()
+	return p.master.Close()
+}
@@ -0,0 +1,31 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+//go:build !linux
+
+package fidoemu
+
+import (
+	"fmt"
+	"runtime"
+)
+
+type PTY struct {
+	Path string
+}
+
+func OpenPTY() (*PTY, error) {
+	return nil, fmt.Errorf("pseudo terminals not supported on %s", runtime.GOOS)
+}
+
+func (p *PTY) Read(b []byte) (int, error) {
+	return 0, fmt.Errorf("not supported")
+}
+
+func (p *PTY) Write(b []byte) (int, error) {
+	return 0, fmt.Errorf("not supported")
+}
+
+func (p *PTY) Close() error {
+	return nil
+}
@@ -0,0 +1,296 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Package metrics keeps counters, gauges and histograms and serves
+// them in the Prometheus text exposition format, with just what
+// tkey-fido needs and no outside dependencies.
+//
+//	var reg metrics.Registry
+//	cmds := reg.NewCounter("fido_commands_total", "Commands run.", "command")
+//	cmds.Inc("register")
+//	err := metrics.ListenAndServe("unix:/run/user/1000/tkey-fido.metrics", &reg)
+package metrics
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+	"math"
+	"net"
+	"net/http"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/tillitis/tkey-fido/internal/unixsock"
+)
+
+type metric interface {
+	write(w *bufio.Writer)
+}
+
+// Registry is the metrics to serve. The zero value is ready to use.
+type Registry struct {
+	mu      sync.Mutex
+	metrics []metric
+}
+
+func (r *Registry) add(m metric) {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+
+	r.metrics = append(r.metrics, m)
+}
+
+// WriteTo writes all metrics in the text exposition format.
+func (r *Registry) WriteTo(w io.Writer) (int64, error) {
+	r.mu.Lock()
+	metrics := append([]metric(nil), r.metrics...)
+	r.mu.Unlock()
+
+	cw := &countingWriter{w: w}
+	bw := bufio.NewWriter(cw)
+	for _, m := range metrics {
+		m.write(bw)
+	}
+	err := bw.Flush()
+
+	return cw.n, err
+}
+
+func (r *Registry) ServeHTTP(w http.ResponseWriter, req *http.Request) {
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	_, _ = r.WriteTo(w)
+}
+
+// ListenAndServe serves reg on /metrics at addr, which is either
+// "unix:PATH" for a Unix socket only the user running us can connect
+// to, or "HOST:PORT". A stale socket at PATH is removed first.
+func ListenAndServe(addr string, reg *Registry) error {
+	var l net.Listener
+	var err error
+	if path := strings.TrimPrefix(addr, "unix:"); path != addr {
+		l, err = unixsock.Listen(path)
+	} else {
+		l, err = net.Listen("tcp", addr)
+	}
+	if err != nil {
+		return fmt.Errorf("Listen: %w", err)
+	}
+
+	mux := http.NewServeMux()
+	mux.Handle("/metrics", reg)
+
+	srv := &http.Server{
+		Handler:           mux,
+		ReadHeaderTimeout: 10 * time.Second,
+	}
+	if err = srv.Serve(l); err != nil {
+		return fmt.Errorf("Serve: %w", err)
+	}
+	return nil
+}
+
+// series is the values of a metric by label values, joined by "\x00".
+type series struct {
+	name   string
+	help   string
+	kind   string
+	labels []string
+}
+
+func (s *series) key(values []string) string {
+	if len(values) != len(s.labels) {
+		panic(fmt.Sprintf("metrics: %s has %d labels, got %d values", s.name, len(s.labels), len(values)))
+	}
+	return strings.Join(values, "\x00")
+}
+
+// The text format escapes only these, and takes other bytes of label
+// values and help as they are, as UTF-8
+var (
+	labelEscaper = strings.NewReplacer(`\`, `\\`, `"`, `\"`, "\n", `\n`)
+	helpEscaper  = strings.NewReplacer(`\`, `\\`, "\n", `\n`)
+)
+
+func (s *series) header(w *bufio.Writer) {
+	fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s %s\n", s.name, helpEscaper.Replace(s.help), s.name, s.kind)
+}
+
+// labelString formats the labels for key, with extra appended as a
+// preformatted label.
+func (s *series) labelString(key string, extra string) string {
+	var parts []string
+	if len(s.labels) > 0 {
+		for i, v := range strings.Split(key, "\x00") {
+			parts = append(parts, fmt.Sprintf(`%s="%s"`, s.labels[i], labelEscaper.Replace(v)))
+		}
+	}
+	if extra != "" {
+		parts = append(parts, extra)
+	}
+	if len(parts) == 0 {
+		return ""
+	}
+	return "{" + strings.Join(parts, ",") + "}"
+}
+
+func sortedKeys[V any](m map[string]V) []string {
+	keys := make([]string, 0, len(m))
+	for k := range m {
+		keys = append(keys, k)
+	}
+	sort.Strings(keys)
+	return keys
+}
+
+// Counter is a count that only goes up, by label values.
+type Counter struct {
+	series
+	mu     sync.Mutex
+	values map[string]float64
+}
+
+func (r *Registry) NewCounter(name, help string, labels ...string) *Counter {
+	c := &Counter{
+		series: series{name: name, help: help, kind: "counter", labels: labels},
+		values: make(map[string]float64),
+	}
+	r.add(c)
+	return c
+}
+
+func (c *Counter) Inc(labelValues ...string) {
+	c.Add(1, labelValues...)
+}
+
+func (c *Counter) Add(v float64, labelValues ...string) {
+	k := c.key(labelValues)
+
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	c.values[k] += v
+}
+
+func (c *Counter) write(w *bufio.Writer) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	c.header(w)
+	if len(c.labels) == 0 && len(c.values) == 0 {
+		fmt.Fprintf(w, "%s 0\n", c.name)
+	}
+	for _, k := range sortedKeys(c.values) {
+		fmt.Fprintf(w, "%s%s %s\n", c.name, c.labelString(k, ""), formatFloat(c.values[k]))
+	}
+}
+
+// GaugeFunc is a value read by calling a func when serving.
+type GaugeFunc struct {
+	series
+	f func() float64
+}
+
+func (r *Registry) NewGaugeFunc(name, help string, f func() float64) *GaugeFunc {
+	g := &GaugeFunc{
+		series: series{name: name, help: help, kind: "gauge"},
+		f:      f,
+	}
+	r.add(g)
+	return g
+}
+
+func (g *GaugeFunc) write(w *bufio.Writer) {
+	g.header(w)
+	fmt.Fprintf(w, "%s %s\n", g.name, formatFloat(g.f()))
+}
+
+// Histogram counts durations in buckets, by label values.
+type Histogram struct {
+	series
+	buckets []float64 // upper bounds in seconds, ascending
+	mu      sync.Mutex
+	values  map[string]*histogramValue
+}
+
+type histogramValue struct {
+	counts []uint64 // per bucket, not cumulative
+	count  uint64
+	sum    float64
+}
+
+// DurationBuckets suit what we time, from a checkonly over the serial
+// line to waiting for touch.
+var DurationBuckets = []float64{.005, .01, .025, .05, .1, .25, .5, 1, 2.5, 5, 10, 30}
+
+func (r *Registry) NewHistogram(name, help string, buckets []float64, labels ...string) *Histogram {
+	h := &Histogram{
+		series:  series{name: name, help: help, kind: "histogram", labels: labels},
+		buckets: buckets,
+		values:  make(map[string]*histogramValue),
+	}
+	r.add(h)
+	return h
+}
+
+func (h *Histogram) Observe(d time.Duration, labelValues ...string) {
+	k := h.key(labelValues)
+	v := d.Seconds()
+
+	h.mu.Lock()
+	defer h.mu.Unlock()
+
+	hv := h.values[k]
+	if hv == nil {
+		hv = &histogramValue{counts: make([]uint64, len(h.buckets))}
+		h.values[k] = hv
+	}
+
+	i := sort.SearchFloat64s(h.buckets, v)
+	if i < len(h.buckets) {
+		hv.counts[i]++
+	}
+	hv.count++
+	hv.sum += v
+}
+
+func (h *Histogram) write(w *bufio.Writer) {
+	h.mu.Lock()
+	defer h.mu.Unlock()
+
+	h.header(w)
+	for _, k := range sortedKeys(h.values) {
+		hv := h.values[k]
+
+		var cumulative uint64
+		for i, le := range h.buckets {
+			cumulative += hv.counts[i]
+			fmt.Fprintf(w, "%s_bucket%s %d\n", h.name,
+				h.labelString(k, fmt.Sprintf("le=%q", formatFloat(le))), cumulative)
+		}
+		fmt.Fprintf(w, "%s_bucket%s %d\n", h.name, h.labelString(k, `le="+Inf"`), hv.count)
+		fmt.Fprintf(w, "%s_sum%s %s\n", h.name, h.labelString(k, ""), formatFloat(hv.sum))
+		fmt.Fprintf(w, "%s_count%s %d\n", h.name, h.labelString(k, ""), hv.count)
+	}
+}
+
+func formatFloat(v float64) string {
+	if math.IsInf(v, +1) {
+		return "+Inf"
+	}
+	return strconv.FormatFloat(v, 'g', -1, 64)
+}
+
+type countingWriter struct {
+	w io.Writer
+	n int64
+}
+
+func (c *countingWriter) Write(p []byte) (int, error) {
+	n, err := c.w.Write(p)
+	c.n += int64(n)
+	return n, err
+}
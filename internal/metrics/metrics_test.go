@@ -0,0 +1,172 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package metrics_test
+
+import (
+	"bytes"
+	"io"
+	"net/http/httptest"
+	"testing"
+	"time"
+
+	"github.com/tillitis/tkey-fido/internal/metrics"
+)
+
+// checkOutput fails the test if reg doesn't write want.
+func checkOutput(t *testing.T, reg *metrics.Registry, want string) {
+	t.Helper()
+
+	var buf bytes.Buffer
+	n, err := reg.WriteTo(&buf)
+	if err != nil {
+		t.Fatalf("WriteTo: %v", err)
+	}
+	if got := buf.String(); got != want {
+		t.Fatalf("got:\n%s\nwant:\n%s", got, want)
+	}
+	if n != int64(buf.Len()) {
+		t.Fatalf("WriteTo returned %d, wrote %d bytes", n, buf.Len())
+	}
+}
+
+func TestCounter(t *testing.T) {
+	t.Parallel()
+
+	var reg metrics.Registry
+	cmds := reg.NewCounter("fido_commands_total", "Commands run.", "command", "result")
+	cmds.Inc("register", "ok")
+	cmds.Add(2, "checkonly", "ok")
+	cmds.Inc("checkonly", "error")
+	reg.NewCounter("fido_errors_total", "Errors.")
+	bytesRead := reg.NewCounter("fido_read_bytes_total", "Bytes read.")
+	bytesRead.Add(0.5)
+	bytesRead.Add(1e21)
+
+	// Sorted by label values, and 0 for a counter without labels
+	// that never counted
+	checkOutput(t, &reg, `# HELP fido_commands_total Commands run.
+# TYPE fido_commands_total counter
+fido_commands_total{command="checkonly",result="error"} 1
+fido_commands_total{command="checkonly",result="ok"} 2
+fido_commands_total{command="register",result="ok"} 1
+# HELP fido_errors_total Errors.
+# TYPE fido_errors_total counter
+fido_errors_total 0
+# HELP fido_read_bytes_total Bytes read.
+# TYPE fido_read_bytes_total counter
+fido_read_bytes_total 1e+21
+`)
+}
+
+func TestGaugeFunc(t *testing.T) {
+	t.Parallel()
+
+	var reg metrics.Registry
+	devices := 2.0
+	reg.NewGaugeFunc("fido_devices", "TKeys plugged in.", func() float64 { return devices })
+
+	checkOutput(t, &reg, `# HELP fido_devices TKeys plugged in.
+# TYPE fido_devices gauge
+fido_devices 2
+`)
+
+	// Read when written
+	devices = 0
+	checkOutput(t, &reg, `# HELP fido_devices TKeys plugged in.
+# TYPE fido_devices gauge
+fido_devices 0
+`)
+}
+
+func TestHistogram(t *testing.T) {
+	t.Parallel()
+
+	var reg metrics.Registry
+	latency := reg.NewHistogram("fido_latency_seconds", "Latency.", []float64{.1, .5, 1}, "command")
+	latency.Observe(62500*time.Microsecond, "authenticate")
+	// On a bucket's upper bound, so in it
+	latency.Observe(500*time.Millisecond, "authenticate")
+	// Over the last bucket, so only in +Inf
+	latency.Observe(2*time.Second, "authenticate")
+	latency.Observe(time.Second, "checkonly")
+	touch := reg.NewHistogram("fido_touch_seconds", "Touch wait.", []float64{1})
+	touch.Observe(1500 * time.Millisecond)
+
+	// Buckets cumulative, +Inf the count
+	checkOutput(t, &reg, `# HELP fido_latency_seconds Latency.
+# TYPE fido_latency_seconds histogram
+fido_latency_seconds_bucket{command="authenticate",le="0.1"} 1
+fido_latency_seconds_bucket{command="authenticate",le="0.5"} 2
+fido_latency_seconds_bucket{command="authenticate",le="1"} 2
+fido_latency_seconds_bucket{command="authenticate",le="+Inf"} 3
+fido_latency_seconds_sum{command="authenticate"} 2.5625
+fido_latency_seconds_count{command="authenticate"} 3
+fido_latency_seconds_bucket{command="checkonly",le="0.1"} 0
+fido_latency_seconds_bucket{command="checkonly",le="0.5"} 0
+fido_latency_seconds_bucket{command="checkonly",le="1"} 1
+fido_latency_seconds_bucket{command="checkonly",le="+Inf"} 1
+fido_latency_seconds_sum{command="checkonly"} 1
+fido_latency_seconds_count{command="checkonly"} 1
+# HELP fido_touch_seconds Touch wait.
+# TYPE fido_touch_seconds histogram
+fido_touch_seconds_bucket{le="1"} 0
+fido_touch_seconds_bucket{le="+Inf"} 1
+fido_touch_seconds_sum 1.5
+fido_touch_seconds_count 1
+`)
+}
+
+func TestEscaping(t *testing.T) {
+	t.Parallel()
+
+	var reg metrics.Registry
+	c := reg.NewCounter("fido_requests_total", "Requests by origin,\nas C:\\ paths \"quoted\".", "origin")
+	c.Inc("a\"b\\c\nd")
+	// Not escaped, UTF-8 as it is
+	c.Inc("håll\tden")
+
+	checkOutput(t, &reg, `# HELP fido_requests_total Requests by origin,\nas C:\\ paths "quoted".
+# TYPE fido_requests_total counter
+fido_requests_total{origin="a\"b\\c\nd"} 1
+fido_requests_total{origin="håll`+"\t"+`den"} 1
+`)
+}
+
+func TestLabelValues(t *testing.T) {
+	t.Parallel()
+
+	var reg metrics.Registry
+	c := reg.NewCounter("fido_commands_total", "Commands run.", "command")
+
+	defer func() {
+		if recover() == nil {
+			t.Fatalf("no panic on a missing label value")
+		}
+	}()
+	c.Inc()
+}
+
+func TestServeHTTP(t *testing.T) {
+	t.Parallel()
+
+	var reg metrics.Registry
+	reg.NewCounter("fido_errors_total", "Errors.").Inc()
+
+	rec := httptest.NewRecorder()
+	reg.ServeHTTP(rec, httptest.NewRequest("GET", "/metrics", nil))
+	rsp := rec.Result()
+	defer rsp.Body.Close()
+
+	if ct := rsp.Header.Get("Content-Type"); ct != "text/plain; version=0.0.4" {
+		t.Fatalf("Content-Type %q", ct)
+	}
+	body, err := io.ReadAll(rsp.Body)
+	if err != nil {
+		t.Fatalf("ReadAll: %v", err)
+	}
+	want := "# HELP fido_errors_total Errors.\n# TYPE fido_errors_total counter\nfido_errors_total 1\n"
+	if string(body) != want {
+		t.Fatalf("got:\n%s\nwant:\n%s", body, want)
+	}
+}
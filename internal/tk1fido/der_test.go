@@ -0,0 +1,117 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package tk1fido_test
+
+import (
+	"bytes"
+	"crypto/rand"
+	"encoding/asn1"
+	"math/big"
+	"testing"
+
+	"github.com/tillitis/tkey-fido/internal/tk1fido"
+)
+
+type ecdsaSignature struct {
+	R, S *big.Int
+}
+
+// asn1DER is how signatures were encoded before AppendSignatureDER.
+func asn1DER(t testing.TB, r, s []byte) []byte {
+	t.Helper()
+
+	der, err := asn1.Marshal(ecdsaSignature{new(big.Int).SetBytes(r), new(big.Int).SetBytes(s)})
+	if err != nil {
+		t.Fatalf("asn1.Marshal: %v", err)
+	}
+	return der
+}
+
+// scalar is a 32 byte big-endian integer, with the bytes of prefix
+// first and the rest filled with fill.
+func scalar(prefix []byte, fill byte) []byte {
+	b := bytes.Repeat([]byte{fill}, 32)
+	copy(b, prefix)
+	return b
+}
+
+// small is the 32 byte big-endian integer b.
+func small(b byte) []byte {
+	return append(make([]byte, 31), b)
+}
+
+func TestAppendSignatureDER(t *testing.T) {
+	t.Parallel()
+
+	tests := []struct {
+		name   string
+		r, s   []byte
+		length int // of the encoding
+	}{
+		{"high bit r and s", scalar(nil, 0xff), scalar(nil, 0x80), tk1fido.MaxSignatureDERLen},
+		{"high bit r", scalar([]byte{0x80}, 0x01), scalar([]byte{0x7f}, 0x01), 71},
+		{"high bit s", scalar([]byte{0x7f}, 0x01), scalar([]byte{0xc0}, 0x01), 71},
+		{"no high bit", scalar([]byte{0x7f}, 0xff), scalar([]byte{0x01}, 0xff), 70},
+		{"leading zero", scalar([]byte{0x00, 0x80}, 0x01), scalar([]byte{0x00, 0x00, 0x01}, 0x01), 68},
+		{"small", small(0x80), small(0x01), 9},
+		{"zero", small(0x00), small(0x00), 8},
+	}
+
+	for _, tt := range tests {
+		got := tk1fido.AppendSignatureDER(nil, tt.r, tt.s)
+		want := asn1DER(t, tt.r, tt.s)
+		if !bytes.Equal(got, want) {
+			t.Errorf("%s: got %x, want %x", tt.name, got, want)
+		}
+		if len(got) != tt.length {
+			t.Errorf("%s: got %d bytes, want %d", tt.name, len(got), tt.length)
+		}
+	}
+
+	var sig [64]byte
+	for i := 0; i < 10000; i++ {
+		if _, err := rand.Read(sig[:]); err != nil {
+			t.Fatalf("rand.Read: %v", err)
+		}
+		got := tk1fido.AppendSignatureDER(nil, sig[:32], sig[32:])
+		if want := asn1DER(t, sig[:32], sig[32:]); !bytes.Equal(got, want) {
+			t.Fatalf("got %x, want %x", got, want)
+		}
+	}
+}
+
+func TestAppendSignatureDERAppends(t *testing.T) {
+	t.Parallel()
+
+	r, s := scalar(nil, 0xff), scalar(nil, 0x80)
+	dst := make([]byte, 3, 3+tk1fido.MaxSignatureDERLen)
+	allocs := testing.AllocsPerRun(100, func() {
+		dst = tk1fido.AppendSignatureDER(dst[:3], r, s)
+	})
+	if allocs != 0 {
+		t.Errorf("allocated %.0f times with room in dst", allocs)
+	}
+	if !bytes.Equal(dst[3:], asn1DER(t, r, s)) {
+		t.Errorf("got %x after the prefix", dst[3:])
+	}
+}
+
+func BenchmarkAppendSignatureDER(b *testing.B) {
+	r, s := scalar(nil, 0xff), scalar([]byte{0x12}, 0x34)
+	dst := make([]byte, 0, tk1fido.MaxSignatureDERLen)
+
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		dst = tk1fido.AppendSignatureDER(dst[:0], r, s)
+	}
+}
+
+func BenchmarkASN1Marshal(b *testing.B) {
+	r, s := scalar(nil, 0xff), scalar([]byte{0x12}, 0x34)
+
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		asn1DER(b, r, s)
+	}
+}
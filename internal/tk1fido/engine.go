@@ -0,0 +1,441 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package tk1fido
+
+import (
+	"bufio"
+	"context"
+	"errors"
+	"fmt"
+	"io"
+	"sync"
+	"time"
+
+	"github.com/tillitis/tkeyclient"
+)
+
+// ErrClosed is returned by a Fido on an engine that has stopped,
+// because it was closed or reading the port failed.
+var ErrClosed = errors.New("tk1fido: closed")
+
+// transport moves frames between a Fido and the app. An exchange gets
+// its turn, and the frame ID to use, with acquire, and gives it back
+// with release along with the number of response frames it didn't
+// read.
+type transport interface {
+	acquire(ctx context.Context) (int, error)
+	release(id int, pending int)
+	// write returns when tx is written
+	write(ctx context.Context, tx []byte) (time.Time, error)
+	// readFrame returns the next frame with the frame ID, and when
+	// its first byte arrived, or the zero time if not known. The
+	// frame may be read into buf, so it's only valid until buf is
+	// used again.
+	readFrame(ctx context.Context, expectedResp appCmd, id int, buf *[1 + 128]byte) ([]byte, time.Time, error)
+	close() error
+}
+
+// blocking is the transport of tkeyclient, reading and writing on the
+// goroutine of the exchange. Only a deadline of the context is honoured while reading,
+// using a read timeout on the port.
+type blocking struct {
+	tk  *tkeyclient.TillitisKey
+	ids chan int
+}
+
+func newBlocking(tk *tkeyclient.TillitisKey) *blocking {
+	b := &blocking{
+		tk:  tk,
+		ids: make(chan int, 1),
+	}
+	b.ids <- exchangeID
+
+	return b
+}
+
+func (b *blocking) acquire(ctx context.Context) (int, error) {
+	select {
+	case id := <-b.ids:
+		return id, nil
+	case <-ctx.Done():
+		return 0, ctx.Err()
+	}
+}
+
+func (b *blocking) release(id int, pending int) {
+	b.ids <- id
+}
+
+func (b *blocking) write(ctx context.Context, tx []byte) (time.Time, error) {
+	if err := ctx.Err(); err != nil {
+		return time.Time{}, err
+	}
+
+	err := b.tk.Write(tx)
+	return time.Now(), err
+}
+
+func (b *blocking) readFrame(ctx context.Context, expectedResp appCmd, id int, _ *[1 + 128]byte) ([]byte, time.Time, error) {
+	if err := ctx.Err(); err != nil {
+		return nil, time.Time{}, err
+	}
+
+	if deadline, ok := ctx.Deadline(); ok {
+		// In whole seconds, rounded up
+		timeout := int((time.Until(deadline) + time.Second - 1) / time.Second)
+		if timeout < 1 {
+			timeout = 1
+		}
+		if err := b.tk.SetReadTimeout(timeout); err != nil {
+			return nil, time.Time{}, fmt.Errorf("SetReadTimeout: %w", err)
+		}
+		defer func() {
+			_ = b.tk.SetReadTimeout(0)
+		}()
+	}
+
+	rx, _, err := b.tk.ReadFrame(expectedResp, id)
+	return rx, time.Time{}, err
+}
+
+func (b *blocking) close() error {
+	return b.tk.Close()
+}
+
+// The frame ID is 2 bits
+const frameIDs = 4
+
+// exchangeID is the frame ID of every exchange. The app has a small
+// UART FIFO and answers one command at a time, so exchanges take turns
+// rather than having commands on several frame IDs in flight. The
+// engine only moves to another frame ID when responses on this one
+// never arrived.
+const exchangeID = 2
+
+// defaultDrainTimeout is how long the engine waits for the responses a
+// cancelled exchange didn't read. The app has answered by then, after
+// waiting at most 10 s for a touch, unless the responses were lost.
+const defaultDrainTimeout = 15 * time.Second
+
+// Frames received but not yet read by their exchange. Each response
+// is read right away, so this only fills up with responses the
+// exchange gave up waiting for.
+const engineSlots = 8
+
+// rxFrame is a frame as received, header byte first.
+type rxFrame struct {
+	buf     [1 + 128]byte
+	n       int
+	arrived time.Time // when the header byte was read
+}
+
+func (f *rxFrame) frame() []byte {
+	return f.buf[:f.n]
+}
+
+// engine owns the port, with a goroutine reading frames into a fixed
+// set of slots, handing each to the exchange waiting on its frame ID,
+// and a goroutine writing the commands queued. There is one exchange
+// at a time, so one command in the app's UART FIFO.
+//
+// An exchange that is cancelled leaves its frame ID with the engine
+// until the responses it didn't read have arrived and been thrown
+// away, so they are never taken for those of the next exchange. If
+// they haven't after drainTimeout, the next exchange gets another
+// frame ID, and they are thrown away whenever they arrive.
+type engine struct {
+	port    io.ReadWriteCloser
+	writes  chan writeReq
+	written chan writeResult // of the one write at a time
+
+	slots [engineSlots]rxFrame
+	free  chan int           // slots not in use
+	ready [frameIDs]chan int // slots received, by frame ID
+	ids   chan int           // the frame ID, when not in use
+
+	mu           sync.Mutex
+	inUse        [frameIDs]bool        // frame IDs acquired and not released
+	drain        [frameIDs]int         // frames to throw away, by frame ID
+	drainTimer   [frameIDs]*time.Timer // of the drain, by frame ID
+	drainTimeout time.Duration
+
+	done      chan struct{} // closed when reading stops
+	err       error         // why reading stopped
+	closeOnce sync.Once
+	closeErr  error
+}
+
+type writeReq struct {
+	ctx  context.Context
+	tx   []byte
+	done chan writeResult
+}
+
+type writeResult struct {
+	written time.Time
+	err     error
+}
+
+func newEngine(port io.ReadWriteCloser) *engine {
+	e := &engine{
+		port:    port,
+		writes:  make(chan writeReq),
+		written: make(chan writeResult, 1),
+		free:    make(chan int, engineSlots),
+		ids:     make(chan int, 1),
+		done:    make(chan struct{}),
+
+		drainTimeout: defaultDrainTimeout,
+	}
+
+	for i := range e.slots {
+		e.free <- i
+	}
+	for id := range e.ready {
+		e.ready[id] = make(chan int, engineSlots)
+	}
+	e.ids <- exchangeID
+
+	go e.readLoop()
+	go e.writeLoop()
+
+	return e
+}
+
+// WithDrainTimeout sets how long a Fido from NewWithPort waits for the
+// responses of a cancelled exchange before using another frame ID. The
+// default is 15 s.
+func WithDrainTimeout(d time.Duration) func(*Fido) {
+	return func(f *Fido) {
+		if e, ok := f.tr.(*engine); ok {
+			e.drainTimeout = d
+		}
+	}
+}
+
+func (e *engine) acquire(ctx context.Context) (int, error) {
+	select {
+	case id := <-e.ids:
+		e.mu.Lock()
+		e.inUse[id] = true
+		e.mu.Unlock()
+		return id, nil
+	case <-e.done:
+		return 0, ErrClosed
+	case <-ctx.Done():
+		return 0, ctx.Err()
+	}
+}
+
+func (e *engine) release(id int, pending int) {
+	e.mu.Lock()
+	defer e.mu.Unlock()
+
+	e.inUse[id] = false
+
+	// Frames that arrived after the exchange gave up waiting, all of
+	// them, as no more are delivered here once it's not in use
+drained:
+	for {
+		select {
+		case i := <-e.ready[id]:
+			pending--
+			if endsExchange(e.slots[i].frame()) {
+				pending = 0
+			}
+			e.free <- i
+		default:
+			break drained
+		}
+	}
+
+	if pending > 0 {
+		e.drain[id] = pending
+		e.drainTimer[id] = time.AfterFunc(e.drainTimeout, func() {
+			e.drainExpired(id)
+		})
+		return
+	}
+	e.ids <- id
+}
+
+// drainExpired hands out another frame ID than id if the frames to
+// throw away on id haven't all arrived, leaving them to be thrown
+// away whenever they do.
+func (e *engine) drainExpired(id int) {
+	e.mu.Lock()
+	defer e.mu.Unlock()
+
+	e.drainTimer[id] = nil
+
+	// The last one arrived while we waited for the lock
+	if e.drain[id] == 0 {
+		e.ids <- id
+		return
+	}
+
+	for i := 1; i < frameIDs; i++ {
+		next := (id + i) % frameIDs
+		if e.drain[next] == 0 {
+			e.ids <- next
+			return
+		}
+	}
+
+	// Responses lost on every frame ID. Whatever still arrives on id
+	// is taken for the next exchange's, which at worst fails it.
+	e.drain[id] = 0
+	e.ids <- id
+}
+
+// endsExchange tells if the app sends no more responses after the
+// frame rx, which is the case after a bad status.
+func endsExchange(rx []byte) bool {
+	return rx[0]&0x04 != 0 || (len(rx) >= 3 && rx[2] != tkeyclient.StatusOK)
+}
+
+func (e *engine) write(ctx context.Context, tx []byte) (time.Time, error) {
+	req := writeReq{ctx, tx, e.written}
+
+	select {
+	case e.writes <- req:
+	case <-e.done:
+		return time.Time{}, ErrClosed
+	case <-ctx.Done():
+		return time.Time{}, ctx.Err()
+	}
+
+	// tx is ours again only after this. Exchanges take turns, so
+	// there is no other write whose result we could get.
+	res := <-req.done
+	return res.written, res.err
+}
+
+func (e *engine) writeLoop() {
+	for {
+		select {
+		case req := <-e.writes:
+			// Not written if cancelled while queued
+			if err := req.ctx.Err(); err != nil {
+				req.done <- writeResult{err: err}
+				continue
+			}
+			_, err := e.port.Write(req.tx)
+			req.done <- writeResult{time.Now(), err}
+		case <-e.done:
+			return
+		}
+	}
+}
+
+func (e *engine) readFrame(ctx context.Context, expectedResp appCmd, id int, buf *[1 + 128]byte) ([]byte, time.Time, error) {
+	var i int
+	select {
+	case i = <-e.ready[id]:
+	case <-e.done:
+		// Whatever arrived before reading stopped comes first
+		select {
+		case i = <-e.ready[id]:
+		default:
+			return nil, time.Time{}, fmt.Errorf("%w: %v", ErrClosed, e.err)
+		}
+	case <-ctx.Done():
+		return nil, time.Time{}, ctx.Err()
+	}
+
+	f := &e.slots[i]
+	rx := buf[:copy(buf[:], f.frame())]
+	arrived := f.arrived
+	e.free <- i
+
+	if err := checkFrame(rx, expectedResp, id); err != nil {
+		return rx, arrived, err
+	}
+
+	return rx, arrived, nil
+}
+
+func (e *engine) readLoop() {
+	defer close(e.done)
+
+	r := bufio.NewReaderSize(e.port, 2*len(rxFrame{}.buf))
+	for {
+		hdr, err := r.ReadByte()
+		if err != nil {
+			e.err = err
+			return
+		}
+		arrived := time.Now()
+
+		i := <-e.free
+		f := &e.slots[i]
+		f.buf[0] = hdr
+		f.n = FrameLen(hdr)
+		f.arrived = arrived
+
+		if _, err = io.ReadFull(r, f.buf[1:f.n]); err != nil {
+			e.free <- i
+			e.err = err
+			return
+		}
+
+		e.deliver(FrameID(hdr), i)
+	}
+}
+
+func (e *engine) deliver(id int, i int) {
+	e.mu.Lock()
+	defer e.mu.Unlock()
+
+	switch {
+	case e.inUse[id]:
+		e.ready[id] <- i
+	case e.drain[id] > 0:
+		e.drain[id]--
+		if endsExchange(e.slots[i].frame()) {
+			e.drain[id] = 0
+		}
+		e.free <- i
+		// Unless drainExpired already handed out another frame ID,
+		// or is about to hand out this one
+		if e.drain[id] == 0 && e.drainTimer[id] != nil && e.drainTimer[id].Stop() {
+			e.drainTimer[id] = nil
+			e.ids <- id
+		}
+	default:
+		// Nobody asked for it
+		e.free <- i
+	}
+}
+
+func (e *engine) close() error {
+	e.closeOnce.Do(func() {
+		e.closeErr = e.port.Close()
+	})
+	return e.closeErr
+}
+
+// checkFrame does the checks of tkeyclient.ReadFrame on a received
+// frame.
+func checkFrame(rx []byte, expectedResp appCmd, id int) error {
+	hdr := rx[0]
+
+	if hdr&0x04 != 0 {
+		return fmt.Errorf("response status not OK")
+	}
+	if int(hdr>>5) != id {
+		return fmt.Errorf("expected ID %d, got %d", id, hdr>>5)
+	}
+	if tkeyclient.Endpoint((hdr>>3)&0x3) != expectedResp.Endpoint() {
+		return fmt.Errorf("expected endpoint %d, got %d", expectedResp.Endpoint(), (hdr>>3)&0x3)
+	}
+	if tkeyclient.CmdLen(hdr&0x3) != expectedResp.cmdLen {
+		return fmt.Errorf("expected cmdlen %v, got %v", expectedResp.cmdLen, tkeyclient.CmdLen(hdr&0x3))
+	}
+	if rx[1] != expectedResp.code {
+		return fmt.Errorf("expected %s, got 0x%02x", expectedResp, rx[1])
+	}
+
+	return nil
+}
@@ -0,0 +1,222 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package tk1fido_test
+
+import (
+	"context"
+	"errors"
+	"io"
+	"sync"
+	"testing"
+	"time"
+
+	"github.com/tillitis/tkey-fido/internal/tk1fido"
+)
+
+// fakeApp is the port of a Fido, with the test in place of the app.
+// It fails the test if a command is written before the last one is
+// answered.
+type fakeApp struct {
+	t    *testing.T
+	cmds chan []byte
+	r    *io.PipeReader
+	w    *io.PipeWriter
+
+	mu          sync.Mutex
+	outstanding int
+}
+
+func newFakeApp(t *testing.T) *fakeApp {
+	t.Helper()
+
+	r, w := io.Pipe()
+	return &fakeApp{
+		t:    t,
+		cmds: make(chan []byte, 16),
+		r:    r,
+		w:    w,
+	}
+}
+
+func (a *fakeApp) Read(p []byte) (int, error) {
+	return a.r.Read(p)
+}
+
+func (a *fakeApp) Write(p []byte) (int, error) {
+	a.mu.Lock()
+	a.outstanding++
+	if a.outstanding > 1 {
+		a.t.Errorf("command written with %d unanswered", a.outstanding-1)
+	}
+	a.mu.Unlock()
+
+	a.cmds <- append([]byte(nil), p...)
+	return len(p), nil
+}
+
+func (a *fakeApp) Close() error {
+	a.w.Close()
+	return a.r.Close()
+}
+
+func (a *fakeApp) command() []byte {
+	a.t.Helper()
+
+	select {
+	case cmd := <-a.cmds:
+		return cmd
+	case <-time.After(5 * time.Second):
+		a.t.Fatalf("no command")
+		return nil
+	}
+}
+
+// lose makes the app forget a command, as if it never arrived.
+func (a *fakeApp) lose() {
+	a.mu.Lock()
+	a.outstanding--
+	a.mu.Unlock()
+}
+
+// answerCheckOnly answers the U2FCheckOnly command cmd.
+func (a *fakeApp) answerCheckOnly(cmd []byte, valid bool) {
+	a.t.Helper()
+
+	a.lose()
+	a.respondCheckOnly(cmd, valid)
+}
+
+// respondCheckOnly writes a response to the U2FCheckOnly command cmd,
+// even one that was lost.
+func (a *fakeApp) respondCheckOnly(cmd []byte, valid bool) {
+	a.t.Helper()
+
+	// Frame ID of the command, app endpoint, 4 bytes
+	rsp := []byte{cmd[0]&0xe0 | 3<<3 | 1, 0x06, 0, 0, 0}
+	if valid {
+		rsp[3] = 1
+	}
+	if _, err := a.w.Write(rsp); err != nil {
+		a.t.Fatalf("Write: %v", err)
+	}
+}
+
+func TestCancelledResponseNotTaken(t *testing.T) {
+	t.Parallel()
+
+	app := newFakeApp(t)
+	fido := tk1fido.NewWithPort(app)
+	defer fido.Close()
+
+	var appliParam [32]byte
+	var keyHandle [64]byte
+
+	// Gives up before the response
+	ctx, cancel := context.WithCancel(context.Background())
+	errc := make(chan error, 1)
+	go func() {
+		_, err := fido.U2FCheckOnly(ctx, appliParam, keyHandle)
+		errc <- err
+	}()
+	stale := app.command()
+	cancel()
+	if err := <-errc; !errors.Is(err, context.Canceled) {
+		t.Fatalf("cancelled U2FCheckOnly: %v", err)
+	}
+
+	// Waits for the late response, which must not be taken for its own
+	validc := make(chan bool, 1)
+	go func() {
+		valid, err := fido.U2FCheckOnly(context.Background(), appliParam, keyHandle)
+		if err != nil {
+			t.Errorf("U2FCheckOnly: %v", err)
+		}
+		validc <- valid
+	}()
+	app.answerCheckOnly(stale, false)
+	app.answerCheckOnly(app.command(), true)
+
+	if !<-validc {
+		t.Fatalf("got the response of the cancelled exchange")
+	}
+}
+
+func TestCancelledResponseNeverArrives(t *testing.T) {
+	t.Parallel()
+
+	app := newFakeApp(t)
+	fido := tk1fido.NewWithPort(app, tk1fido.WithDrainTimeout(50*time.Millisecond))
+	defer fido.Close()
+
+	var appliParam [32]byte
+	var keyHandle [64]byte
+
+	ctx, cancel := context.WithCancel(context.Background())
+	errc := make(chan error, 1)
+	go func() {
+		_, err := fido.U2FCheckOnly(ctx, appliParam, keyHandle)
+		errc <- err
+	}()
+	stale := app.command()
+	cancel()
+	if err := <-errc; !errors.Is(err, context.Canceled) {
+		t.Fatalf("cancelled U2FCheckOnly: %v", err)
+	}
+
+	app.lose()
+
+	// Gets its turn after the drain timeout, on another frame ID
+	validc := make(chan bool, 1)
+	go func() {
+		ctx, cancel := context.WithTimeout(context.Background(), 5*time.Second)
+		defer cancel()
+		valid, err := fido.U2FCheckOnly(ctx, appliParam, keyHandle)
+		if err != nil {
+			t.Errorf("U2FCheckOnly: %v", err)
+		}
+		validc <- valid
+	}()
+	cmd := app.command()
+	if cmd[0]&0x60 == stale[0]&0x60 {
+		t.Fatalf("frame ID %d used again", stale[0]>>5)
+	}
+
+	// The stale response, arriving late after all, is thrown away
+	app.respondCheckOnly(stale, false)
+	app.answerCheckOnly(cmd, true)
+
+	if !<-validc {
+		t.Fatalf("got the response of the cancelled exchange")
+	}
+}
+
+func TestExchangesTakeTurns(t *testing.T) {
+	t.Parallel()
+
+	app := newFakeApp(t)
+	fido := tk1fido.NewWithPort(app)
+	defer fido.Close()
+
+	const n = 8
+	var wg sync.WaitGroup
+	for i := 0; i < n; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			var appliParam [32]byte
+			var keyHandle [64]byte
+			if _, err := fido.U2FCheckOnly(context.Background(), appliParam, keyHandle); err != nil {
+				t.Errorf("U2FCheckOnly: %v", err)
+			}
+		}()
+	}
+
+	for i := 0; i < n; i++ {
+		cmd := app.command()
+		// Room for a command written too early to show up
+		time.Sleep(time.Millisecond)
+		app.answerCheckOnly(cmd, true)
+	}
+	wg.Wait()
+}
@@ -11,11 +11,11 @@
 package tk1fido
 
 import (
-	"bytes"
-	"encoding/asn1"
+	"context"
 	"encoding/binary"
 	"fmt"
-	"math/big"
+	"io"
+	"time"
 
 	"github.com/tillitis/tkeyclient"
 )
@@ -30,6 +30,8 @@ var (
 	cmdU2FAuthenticateSet = appCmd{0x07, "cmdU2FAuthenticateSet", tkeyclient.CmdLen128}
 	cmdU2FAuthenticateGo  = appCmd{0x08, "cmdU2FAuthenticateGo", tkeyclient.CmdLen128}
 	rspU2FAuthenticate    = appCmd{0x09, "rspU2FAuthenticate", tkeyclient.CmdLen128}
+	cmdBenchCounters      = appCmd{0x40, "cmdBenchCounters", tkeyclient.CmdLen1}
+	rspBenchCounters      = appCmd{0x41, "rspBenchCounters", tkeyclient.CmdLen32}
 )
 
 type appCmd struct {
@@ -55,7 +57,62 @@ func (c appCmd) String() string {
 }
 
 type Fido struct {
-	tk *tkeyclient.TillitisKey // A connection to a TKey
+	tr    transport
+	debug bool
+	// Reused by every exchange, as they take turns: the exchange
+	// itself, its command and the response frames read
+	x  exchange
+	tx [1 + 128]byte
+	rx [1 + 128]byte
+
+	observer Observer
+	trace    *TraceWriter
+	stream   byte
+}
+
+// Exchange is the timing of one command sent to the app and its
+// responses, for finding out where the time of a slow operation goes.
+type Exchange struct {
+	Command string
+	// Write is the time writing the command frame took, including
+	// waiting for other commands to be written first.
+	Write time.Duration
+	// FirstByte is the time from the command being written until
+	// the first byte of the response arrived, that is the app's
+	// compute time and any wait for touch. Zero if not known.
+	FirstByte time.Duration
+	// Read is the time from the command being written until the
+	// last response frame was read.
+	Read      time.Duration
+	FramesOut int
+	FramesIn  int
+	BytesOut  int // on the wire, including frame headers
+	BytesIn   int
+	Err       error
+}
+
+// Observer gets the Exchange of every command a Fido sends, after its
+// last response is read or it fails. It's called on the goroutine
+// that called the Fido, and must be safe for concurrent use if the
+// Fido is.
+type Observer interface {
+	Exchange(Exchange)
+}
+
+// WithDebug makes Fido dump all frames sent and received using
+// tkeyclient.Dump. Without it we don't even format them.
+func WithDebug() func(*Fido) {
+	return func(f *Fido) {
+		f.debug = true
+	}
+}
+
+// WithObserver makes Fido report the timing of every exchange with
+// the app to o.
+func WithObserver(o Observer) func(*Fido) {
+	return func(f *Fido) {
+		f.observer = o
+	}
 }
 
 // New allocates a struct for communicating with the Fido app running
@@ -65,73 +122,87 @@ type Fido struct {
 //	tk := tkeyclient.New()
 //	err := tk.Connect(port)
 //	fido := tkeyclientfido.New(tk)
-func New(tk *tkeyclient.TillitisKey) Fido {
-	var fido Fido
+//
+// Reading and writing is done by tkeyclient on the calling goroutine,
+// one exchange at a time, and only a deadline of a context can stop
+// waiting for a response.
+func New(tk *tkeyclient.TillitisKey, options ...func(*Fido)) *Fido {
+	return newFido(newBlocking(tk), options...)
+}
 
-	fido.tk = tk
+// NewWithPort is like New, but for a port already opened, e.g. with
+// go.bug.st/serial after the app has been loaded using tkeyclient,
+// and then closed there. The Fido owns port, which it reads and writes
+// on goroutines of its own. It's safe for concurrent use, with
+// exchanges taking turns, and any cancelled context stops waiting.
+func NewWithPort(port io.ReadWriteCloser, options ...func(*Fido)) *Fido {
+	return newFido(newEngine(port), options...)
+}
+
+func newFido(tr transport, options ...func(*Fido)) *Fido {
+	fido := &Fido{
+		tr: tr,
+	}
+
+	for _, opt := range options {
+		opt(fido)
+	}
 
 	return fido
 }
 
 // Close closes the connection to the TKey
-func (f Fido) Close() error {
-	if err := f.tk.Close(); err != nil {
+func (f *Fido) Close() error {
+	if err := f.tr.close(); err != nil {
 		return fmt.Errorf("tk.Close: %w", err)
 	}
 	return nil
 }
 
 // GetAppNameVersion gets the name and version of the running app in
-// the same style as the stick itself.
-func (f Fido) GetAppNameVersion() (*tkeyclient.NameVersion, error) {
-	id := 2
-	tx, err := tkeyclient.NewFrameBuf(cmdGetNameVersion, id)
+// the same style as the stick itself. It waits at most 2 s for it.
+func (f *Fido) GetAppNameVersion(ctx context.Context) (*tkeyclient.NameVersion, error) {
+	ctx, cancel := context.WithTimeout(ctx, 2*time.Second)
+	defer cancel()
+
+	x, err := f.begin(ctx, cmdGetNameVersion)
 	if err != nil {
-		return nil, fmt.Errorf("NewFrameBuf: %w", err)
+		return nil, err
 	}
+	defer x.end()
 
-	tkeyclient.Dump("GetAppNameVersion tx", tx)
-	if err = f.tk.Write(tx); err != nil {
+	f.dump("GetAppNameVersion tx", x.tx)
+	if err := x.write(ctx, 1); err != nil {
 		return nil, fmt.Errorf("Write: %w", err)
 	}
 
-	err = f.tk.SetReadTimeout(2)
-	if err != nil {
-		return nil, fmt.Errorf("SetReadTimeout: %w", err)
-	}
-
-	rx, _, err := f.tk.ReadFrame(rspGetNameVersion, id)
+	rx, err := x.readFrame(ctx, rspGetNameVersion)
 	if err != nil {
 		return nil, fmt.Errorf("ReadFrame: %w", err)
 	}
 
-	err = f.tk.SetReadTimeout(0)
-	if err != nil {
-		return nil, fmt.Errorf("SetReadTimeout: %w", err)
-	}
-
 	nameVer := &tkeyclient.NameVersion{}
 	nameVer.Unpack(rx[2:])
 
 	return nameVer, nil
 }
 
-func (f Fido) U2FRegister(appliParam [32]byte) (byte, []byte, []byte, error) {
-	id := 2
-	tx, err := tkeyclient.NewFrameBuf(cmdU2FRegister, id)
+func (f *Fido) U2FRegister(ctx context.Context, appliParam [32]byte) (byte, []byte, []byte, error) {
+	x, err := f.begin(ctx, cmdU2FRegister)
 	if err != nil {
-		return 0, nil, nil, fmt.Errorf("NewFrameBuf: %w", err)
+		return 0, nil, nil, err
 	}
+	defer x.end()
 
-	copy(tx[2:], appliParam[:])
+	copy(x.tx[2:], appliParam[:])
 
-	tkeyclient.Dump("U2FRegister tx", tx)
-	if err = f.tk.Write(tx); err != nil {
+	f.dump("U2FRegister tx", x.tx)
+	if err := x.write(ctx, 2); err != nil {
 		return 0, nil, nil, fmt.Errorf("Write: %w", err)
 	}
 
-	rx, _, err := f.tk.ReadFrame(rspU2FRegister, id)
-	tkeyclient.Dump("U2FRegister rx", rx)
+	rx, err := x.readFrame(ctx, rspU2FRegister)
+	f.dump("U2FRegister rx", rx)
 	if err != nil {
 		return 0, nil, nil, fmt.Errorf("ReadFrame: %w", err)
 	}
@@ -144,12 +215,17 @@ func (f Fido) U2FRegister(appliParam [32]byte) (byte, []byte, []byte, error) {
 	}
 
 	userPresence, rx := shiftByte(rx)
-	keyHandle, _ := shiftBytes(rx, 64)
+
+	// The keyhandle and public key, in one allocation for the caller
+	// to keep, as rx is reused by the 2nd response
+	cred := make([]byte, 64+1+64)
+	keyHandle := cred[:64:64]
+	copy(keyHandle, rx[:64])
 
 	// Now read 2nd response
 
-	rx, _, err = f.tk.ReadFrame(rspU2FRegister, id)
-	tkeyclient.Dump("U2FRegister rx (2nd)", rx)
+	rx, err = x.readFrame(ctx, rspU2FRegister)
+	f.dump("U2FRegister rx (2nd)", rx)
 	if err != nil {
 		return 0, nil, nil, fmt.Errorf("ReadFrame (2nd): %w", err)
 	}
@@ -164,28 +240,30 @@ func (f Fido) U2FRegister(appliParam [32]byte) (byte, []byte, []byte, error) {
 	pubBytes, _ := shiftBytes(rx, 64)
 
 	// Prepending the 0x04 marker to indicate uncompressed form
-	return userPresence, keyHandle, append([]byte{0x04}, pubBytes...), nil
+	pub := cred[64:]
+	pub[0] = 0x04
+	copy(pub[1:], pubBytes)
+
+	return userPresence, keyHandle, pub, nil
 }
 
-func (f Fido) U2FCheckOnly(appliParam [32]byte, keyHandle [64]byte) (bool, error) {
-	id := 2
-	tx, err := tkeyclient.NewFrameBuf(cmdU2FCheckOnly, id)
+func (f *Fido) U2FCheckOnly(ctx context.Context, appliParam [32]byte, keyHandle [64]byte) (bool, error) {
+	x, err := f.begin(ctx, cmdU2FCheckOnly)
 	if err != nil {
-		return false, fmt.Errorf("NewFrameBuf: %w", err)
+		return false, err
 	}
+	defer x.end()
 
-	var buf bytes.Buffer
-	buf.Write(appliParam[:])
-	buf.Write(keyHandle[:])
-	copy(tx[2:], buf.Bytes())
+	copy(x.tx[2:], appliParam[:])
+	copy(x.tx[2+32:], keyHandle[:])
 
-	tkeyclient.Dump("U2FCheckOnly tx", tx)
-	if err = f.tk.Write(tx); err != nil {
+	f.dump("U2FCheckOnly tx", x.tx)
+	if err := x.write(ctx, 1); err != nil {
 		return false, fmt.Errorf("Write: %w", err)
 	}
 
-	rx, _, err := f.tk.ReadFrame(rspU2FCheckOnly, id)
-	tkeyclient.Dump("U2FCheckOnly rx", rx)
+	rx, err := x.readFrame(ctx, rspU2FCheckOnly)
+	f.dump("U2FCheckOnly rx", rx)
 	if err != nil {
 		return false, fmt.Errorf("ReadFrame: %w", err)
 	}
@@ -203,39 +281,52 @@ func (f Fido) U2FCheckOnly(appliParam [32]byte, keyHandle [64]byte) (bool, error
 	return keyHandleValid, nil
 }
 
-func (f Fido) U2FAuthenticate(appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error) {
-	// Send the 1st command with its data
-	err := f.u2fAuthenticateSet(appliParam, challParam)
+func (f *Fido) U2FAuthenticate(ctx context.Context, appliParam, challParam [32]byte, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error) {
+	// The app must get both commands back to back, so they are one
+	// turn on the port
+	x, err := f.begin(ctx, cmdU2FAuthenticateSet)
 	if err != nil {
 		return false, 0, nil, err
 	}
+	defer x.end()
+
+	// Send the 1st command with its data
+	if err = f.u2fAuthenticateSet(ctx, x, appliParam, challParam); err != nil {
+		return false, 0, nil, err
+	}
 
 	// Continue with the 2nd command
+	x.next(cmdU2FAuthenticateGo)
+	return f.u2fAuthenticateGo(ctx, x, keyHandle, checkUser, counter)
+}
 
-	id := 2
-	tx, err := tkeyclient.NewFrameBuf(cmdU2FAuthenticateGo, id)
+// U2FAuthenticateGo is the 2nd half of U2FAuthenticate, which must
+// follow U2FAuthenticateSet with no other command in between.
+func (f *Fido) U2FAuthenticateGo(ctx context.Context, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error) {
+	x, err := f.begin(ctx, cmdU2FAuthenticateGo)
 	if err != nil {
-		return false, 0, nil, fmt.Errorf("NewFrameBuf: %w", err)
+		return false, 0, nil, err
 	}
+	defer x.end()
 
-	var buf bytes.Buffer
-	buf.Write(keyHandle[:])
+	return f.u2fAuthenticateGo(ctx, x, keyHandle, checkUser, counter)
+}
+
+func (f *Fido) u2fAuthenticateGo(ctx context.Context, x *exchange, keyHandle [64]byte, checkUser bool, counter uint32) (bool, byte, []byte, error) {
+	copy(x.tx[2:], keyHandle[:])
 	if checkUser {
-		buf.WriteByte(1)
-	} else {
-		buf.WriteByte(0)
+		x.tx[2+64] = 1
 	}
 	// Counter in big-endian, ready for the sig_data
-	_ = binary.Write(&buf, binary.BigEndian, counter)
-	copy(tx[2:], buf.Bytes())
+	binary.BigEndian.PutUint32(x.tx[2+64+1:], counter)
 
-	tkeyclient.Dump("U2FAuthenticateGo tx", tx)
-	if err = f.tk.Write(tx); err != nil {
+	f.dump("U2FAuthenticateGo tx", x.tx)
+	if err := x.write(ctx, 1); err != nil {
 		return false, 0, nil, fmt.Errorf("Write: %w", err)
 	}
 
-	rx, _, err := f.tk.ReadFrame(rspU2FAuthenticate, id)
-	tkeyclient.Dump("U2FAuthenticate rx (Go)", rx)
+	rx, err := x.readFrame(ctx, rspU2FAuthenticate)
+	f.dump("U2FAuthenticate rx (Go)", rx)
 	if err != nil {
 		return false, 0, nil, fmt.Errorf("ReadFrame: %w", err)
 	}
@@ -256,39 +347,36 @@ func (f Fido) U2FAuthenticate(appliParam, challParam [32]byte, keyHandle [64]byt
 		return keyHandleValid, userPresence, nil, nil
 	}
 
-	seq := struct {
-		R, S *big.Int
-	}{
-		R: new(big.Int).SetBytes(sigBytes[:32]),
-		S: new(big.Int).SetBytes(sigBytes[32:]),
-	}
-	sigASN1, err := asn1.Marshal(seq)
-	if err != nil {
-		return false, 0, nil, fmt.Errorf("asn1.Marshal failed: %w", err)
-	}
+	// The caller keeps the signature, in the U2F response, so it
+	// gets a buffer of its own rather than one of the Fido's
+	sigASN1 := AppendSignatureDER(make([]byte, 0, MaxSignatureDERLen), sigBytes[:32], sigBytes[32:])
 
 	return keyHandleValid, userPresence, sigASN1, nil
 }
 
-func (f Fido) u2fAuthenticateSet(appliParam, challParam [32]byte) error {
-	id := 2
-	tx, err := tkeyclient.NewFrameBuf(cmdU2FAuthenticateSet, id)
+// U2FAuthenticateSet is the 1st half of U2FAuthenticate, passing the
+// parameters that don't fit in the frame of U2FAuthenticateGo.
+func (f *Fido) U2FAuthenticateSet(ctx context.Context, appliParam, challParam [32]byte) error {
+	x, err := f.begin(ctx, cmdU2FAuthenticateSet)
 	if err != nil {
-		return fmt.Errorf("NewFrameBuf: %w", err)
+		return err
 	}
+	defer x.end()
+
+	return f.u2fAuthenticateSet(ctx, x, appliParam, challParam)
+}
 
-	var buf bytes.Buffer
-	buf.Write(appliParam[:])
-	buf.Write(challParam[:])
-	copy(tx[2:], buf.Bytes())
+func (f *Fido) u2fAuthenticateSet(ctx context.Context, x *exchange, appliParam, challParam [32]byte) error {
+	copy(x.tx[2:], appliParam[:])
+	copy(x.tx[2+32:], challParam[:])
 
-	tkeyclient.Dump("U2FAuthenticateSet tx", tx)
-	if err = f.tk.Write(tx); err != nil {
+	f.dump("U2FAuthenticateSet tx", x.tx)
+	if err := x.write(ctx, 1); err != nil {
 		return fmt.Errorf("Write: %w", err)
 	}
 
-	rx, _, err := f.tk.ReadFrame(rspU2FAuthenticate, id)
-	tkeyclient.Dump("U2FAuthenticate rx (Set)", rx)
+	rx, err := x.readFrame(ctx, rspU2FAuthenticate)
+	f.dump("U2FAuthenticate rx (Set)", rx)
 	if err != nil {
 		return fmt.Errorf("ReadFrame: %w", err)
 	}
@@ -304,6 +392,224 @@ func (f Fido) u2fAuthenticateSet(appliParam, challParam [32]byte) error {
 	return nil
 }
 
+// BenchCounters gets the cycles and instructions the app spent on the
+// command before. Only an app built with -DBENCH has it.
+func (f *Fido) BenchCounters(ctx context.Context) (uint32, uint32, error) {
+	x, err := f.begin(ctx, cmdBenchCounters)
+	if err != nil {
+		return 0, 0, err
+	}
+	defer x.end()
+
+	f.dump("BenchCounters tx", x.tx)
+	if err := x.write(ctx, 1); err != nil {
+		return 0, 0, fmt.Errorf("Write: %w", err)
+	}
+
+	rx, err := x.readFrame(ctx, rspBenchCounters)
+	f.dump("BenchCounters rx", rx)
+	if err != nil {
+		return 0, 0, fmt.Errorf("ReadFrame: %w", err)
+	}
+
+	// Skip over frame header and app header (cmd)
+	rx = rx[2:]
+
+	status, rx := shiftByte(rx)
+	if status != tkeyclient.StatusOK {
+		return 0, 0, fmt.Errorf("BenchCounters NOK")
+	}
+
+	cycles := binary.LittleEndian.Uint32(rx[0:4])
+	instret := binary.LittleEndian.Uint32(rx[4:8])
+
+	return cycles, instret, nil
+}
+
+// exchange is one command to the app and its responses, during its
+// turn on the port.
+type exchange struct {
+	f       *Fido
+	id      int
+	tx      []byte
+	ex      Exchange
+	written time.Time
+	pending int // response frames not read yet
+}
+
+// begin waits for the turn of an exchange for cmd, and sets up the
+// exchange of the Fido, which is ours until end.
+func (f *Fido) begin(ctx context.Context, cmd appCmd) (*exchange, error) {
+	id, err := f.tr.acquire(ctx)
+	if err != nil {
+		return nil, fmt.Errorf("acquire: %w", err)
+	}
+
+	x := &f.x
+	*x = exchange{f: f, id: id}
+	x.setup(cmd)
+
+	return x, nil
+}
+
+// next reports the exchange so far, and starts over with cmd without
+// giving up the turn. All responses must have been read.
+func (x *exchange) next(cmd appCmd) {
+	if x.f.observer != nil {
+		x.f.observer.Exchange(x.ex)
+	}
+	x.setup(cmd)
+}
+
+// setup sets x.tx up as a zeroed frame for cmd, in the same way as
+// tkeyclient.NewFrameBuf but without allocating.
+func (x *exchange) setup(cmd appCmd) {
+	tx := x.f.tx[:1+cmdLenBytes(cmd.cmdLen)]
+	for i := range tx {
+		tx[i] = 0
+	}
+
+	// Frame Protocol header
+	tx[0] = (byte(x.id) << 5) | (byte(cmd.Endpoint()) << 3) | byte(cmd.cmdLen)
+	// App protocol header
+	tx[1] = cmd.code
+
+	x.tx = tx
+	x.ex = Exchange{
+		Command:   cmd.name,
+		FramesOut: 1,
+		BytesOut:  len(tx),
+	}
+	x.written = time.Time{}
+	x.pending = 0
+}
+
+// write writes the command, which the app answers with a number of
+// response frames.
+func (x *exchange) write(ctx context.Context, responses int) error {
+	start := time.Now()
+	written, err := x.f.tr.write(ctx, x.tx)
+	if err != nil {
+		x.ex.Err = err
+		return err
+	}
+	x.written = written
+	x.ex.Write = written.Sub(start)
+	x.pending = responses
+	if x.f.trace != nil {
+		x.f.trace.record(written, Written, x.f.stream, x.tx)
+	}
+
+	return nil
+}
+
+func (x *exchange) readFrame(ctx context.Context, expectedResp appCmd) ([]byte, error) {
+	rx, arrived, err := x.f.tr.readFrame(ctx, expectedResp, x.id, &x.f.rx)
+	x.ex.Read = time.Since(x.written)
+	if err != nil {
+		x.ex.Err = err
+		if rx == nil {
+			return rx, err
+		}
+	}
+	x.pending--
+	if endsExchange(rx) {
+		x.pending = 0
+	}
+	x.ex.FramesIn++
+	x.ex.BytesIn += len(rx)
+	if x.ex.FramesIn == 1 && !arrived.IsZero() {
+		x.ex.FirstByte = arrived.Sub(x.written)
+	}
+	if x.f.trace != nil {
+		if arrived.IsZero() {
+			arrived = time.Now()
+		}
+		x.f.trace.record(arrived, Read, x.f.stream, rx)
+	}
+
+	return rx, err
+}
+
+// end gives up the turn, and reports the exchange.
+func (x *exchange) end() {
+	// x is the next exchange's once released
+	f, ex := x.f, x.ex
+	f.tr.release(x.id, x.pending)
+
+	if f.observer != nil {
+		f.observer.Exchange(ex)
+	}
+}
+
+func (f *Fido) dump(s string, d []byte) {
+	if f.debug {
+		tkeyclient.Dump(s, d)
+	}
+}
+
+func cmdLenBytes(l tkeyclient.CmdLen) int {
+	switch l {
+	case tkeyclient.CmdLen1:
+		return 1
+	case tkeyclient.CmdLen4:
+		return 4
+	case tkeyclient.CmdLen32:
+		return 32
+	default:
+		return 128
+	}
+}
+
+// MaxSignatureDERLen is the longest possible DER encoding of a P-256
+// ECDSA signature.
+const MaxSignatureDERLen = 2 + 2*(2+1+32)
+
+// AppendSignatureDER appends the DER encoding (ANSI X9.62) of the
+// ECDSA signature (r, s) to dst and returns the extended slice. r and
+// s are 32 byte big-endian integers, as the TKey returns them. This
+// gives the same result as asn1.Marshal of two big.Int, but won't
+// allocate if dst has room for MaxSignatureDERLen more bytes.
+func AppendSignatureDER(dst []byte, r, s []byte) []byte {
+	r = trimInteger(r)
+	s = trimInteger(s)
+
+	rLen := derIntegerLen(r)
+	sLen := derIntegerLen(s)
+
+	// SEQUENCE, always short form length since at most 70 bytes
+	dst = append(dst, 0x30, byte(2+rLen+2+sLen))
+	dst = appendDERInteger(dst, r, rLen)
+	dst = appendDERInteger(dst, s, sLen)
+
+	return dst
+}
+
+// trimInteger strips leading zeros, leaving at least one byte.
+func trimInteger(b []byte) []byte {
+	for len(b) > 1 && b[0] == 0 {
+		b = b[1:]
+	}
+	return b
+}
+
+// derIntegerLen is the length of a trimmed unsigned integer's
+// content, which needs a leading zero if its top bit is set.
+func derIntegerLen(b []byte) int {
+	if b[0]&0x80 != 0 {
+		return len(b) + 1
+	}
+	return len(b)
+}
+
+func appendDERInteger(dst []byte, b []byte, n int) []byte {
+	dst = append(dst, 0x02, byte(n))
+	if n > len(b) {
+		dst = append(dst, 0x00)
+	}
+	return append(dst, b...)
+}
+
 func shiftByte(s []byte) (byte, []byte) {
 	return s[0], s[1:]
 }
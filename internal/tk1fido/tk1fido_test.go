@@ -0,0 +1,158 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package tk1fido_test
+
+import (
+	"bytes"
+	"context"
+	"io"
+	"sync"
+	"testing"
+
+	"github.com/tillitis/tkey-fido/internal/tk1fido"
+)
+
+// instantApp is the port of a Fido, answering each command of the fido
+// app right away with fixed responses, so that benchmarks measure the
+// encoding and decoding on the host and not the app.
+type instantApp struct {
+	mu     sync.Mutex
+	cond   *sync.Cond
+	out    bytes.Buffer // responses not read yet
+	closed bool
+
+	rsp [2][1 + 128]byte
+}
+
+func newInstantApp() *instantApp {
+	a := &instantApp{}
+	a.cond = sync.NewCond(&a.mu)
+	return a
+}
+
+func (a *instantApp) Read(p []byte) (int, error) {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+
+	for a.out.Len() == 0 && !a.closed {
+		a.cond.Wait()
+	}
+	if a.out.Len() == 0 {
+		return 0, io.EOF
+	}
+	return a.out.Read(p)
+}
+
+// Write takes a whole command frame, as a Fido writes them.
+func (a *instantApp) Write(p []byte) (int, error) {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+
+	// Frame ID of the command, app endpoint
+	hdr := p[0]&0xe0 | 3<<3
+	rsp := &a.rsp[0]
+	switch p[1] {
+	case 0x01: // cmdGetNameVersion
+		a.out.Write([]byte{hdr | 2, 0x02})
+		a.out.WriteString("tk1 fido")
+		a.out.Write(make([]byte, 32-1-8))
+	case 0x03: // cmdU2FRegister
+		rsp[0], rsp[1], rsp[2], rsp[3] = hdr|3, 0x04, 0, 1
+		a.out.Write(rsp[:])
+		rsp = &a.rsp[1]
+		rsp[0], rsp[1], rsp[2] = hdr|3, 0x04, 0
+		a.out.Write(rsp[:])
+	case 0x05: // cmdU2FCheckOnly
+		a.out.Write([]byte{hdr | 1, 0x06, 0, 1, 0})
+	case 0x07: // cmdU2FAuthenticateSet
+		rsp[0], rsp[1], rsp[2] = hdr|3, 0x09, 0
+		a.out.Write(rsp[:])
+	case 0x08: // cmdU2FAuthenticateGo
+		rsp[0], rsp[1], rsp[2], rsp[3], rsp[4] = hdr|3, 0x09, 0, 1, 1
+		// A signature with r and s of full length
+		for i := 5; i < 5+64; i++ {
+			rsp[i] = 0x80
+		}
+		a.out.Write(rsp[:])
+	}
+	a.cond.Broadcast()
+
+	return len(p), nil
+}
+
+func (a *instantApp) Close() error {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+
+	a.closed = true
+	a.cond.Broadcast()
+	return nil
+}
+
+func newInstantFido(b *testing.B) *tk1fido.Fido {
+	b.Helper()
+
+	fido := tk1fido.NewWithPort(newInstantApp())
+	b.Cleanup(func() {
+		fido.Close()
+	})
+	return fido
+}
+
+func BenchmarkGetAppNameVersion(b *testing.B) {
+	fido := newInstantFido(b)
+	ctx := context.Background()
+
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		if _, err := fido.GetAppNameVersion(ctx); err != nil {
+			b.Fatalf("GetAppNameVersion: %v", err)
+		}
+	}
+}
+
+func BenchmarkU2FRegister(b *testing.B) {
+	fido := newInstantFido(b)
+	ctx := context.Background()
+	var appliParam [32]byte
+
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		if _, _, _, err := fido.U2FRegister(ctx, appliParam); err != nil {
+			b.Fatalf("U2FRegister: %v", err)
+		}
+	}
+}
+
+func BenchmarkU2FCheckOnly(b *testing.B) {
+	fido := newInstantFido(b)
+	ctx := context.Background()
+	var appliParam [32]byte
+	var keyHandle [64]byte
+
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		if _, err := fido.U2FCheckOnly(ctx, appliParam, keyHandle); err != nil {
+			b.Fatalf("U2FCheckOnly: %v", err)
+		}
+	}
+}
+
+func BenchmarkU2FAuthenticate(b *testing.B) {
+	fido := newInstantFido(b)
+	ctx := context.Background()
+	var appliParam, challParam [32]byte
+	var keyHandle [64]byte
+
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		valid, _, sig, err := fido.U2FAuthenticate(ctx, appliParam, challParam, keyHandle, false, uint32(i))
+		if err != nil {
+			b.Fatalf("U2FAuthenticate: %v", err)
+		}
+		if !valid || len(sig) != tk1fido.MaxSignatureDERLen {
+			b.Fatalf("valid %v, signature %x", valid, sig)
+		}
+	}
+}
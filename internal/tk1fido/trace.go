@@ -0,0 +1,197 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package tk1fido
+
+import (
+	"bufio"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"sync"
+	"time"
+
+	"github.com/tillitis/tkeyclient"
+)
+
+// A trace is every frame a Fido wrote and read, with when, for
+// replaying the traffic later. It starts with traceMagic and the
+// start time as big-endian Unix nanoseconds, followed by a record per
+// frame:
+//
+//	1 B      direction (bit 0, 1 if read) and stream (bits 1-7)
+//	uvarint  nanoseconds since the record before, or the start
+//	n B      the frame, header byte first, its length given by it
+//
+// A stream is one TKey, so the frames of several can be told apart.
+const traceMagic = "TKFT\x01"
+
+// Direction of a frame in a trace.
+type Direction byte
+
+const (
+	Written Direction = 0
+	Read    Direction = 1
+)
+
+func (d Direction) String() string {
+	if d == Read {
+		return "rx"
+	}
+	return "tx"
+}
+
+// TraceRecord is a frame in a trace.
+type TraceRecord struct {
+	Time      time.Time
+	Direction Direction
+	Stream    byte
+	Frame     []byte
+}
+
+// TraceWriter writes a trace to the io.Writer it's made with, one
+// Write per frame. It's safe for concurrent use by several Fido.
+type TraceWriter struct {
+	mu   sync.Mutex
+	w    io.Writer
+	last time.Time
+	buf  []byte
+	err  error
+}
+
+func NewTraceWriter(w io.Writer) (*TraceWriter, error) {
+	t := &TraceWriter{
+		w:    w,
+		last: time.Now(),
+		buf:  make([]byte, 0, 1+binary.MaxVarintLen64+1+128),
+	}
+
+	hdr := append([]byte(traceMagic), make([]byte, 8)...)
+	binary.BigEndian.PutUint64(hdr[len(traceMagic):], uint64(t.last.UnixNano()))
+	if _, err := w.Write(hdr); err != nil {
+		return nil, fmt.Errorf("Write: %w", err)
+	}
+
+	return t, nil
+}
+
+// Err returns the first error writing the trace, after which nothing
+// more is written.
+func (t *TraceWriter) Err() error {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+
+	return t.err
+}
+
+func (t *TraceWriter) record(at time.Time, dir Direction, stream byte, frame []byte) {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+
+	if t.err != nil {
+		return
+	}
+
+	// Frames of concurrent exchanges can be recorded out of order
+	var delta uint64
+	if at.After(t.last) {
+		delta = uint64(at.Sub(t.last))
+		t.last = at
+	}
+
+	t.buf = append(t.buf[:0], byte(dir)|stream<<1)
+	t.buf = binary.AppendUvarint(t.buf, delta)
+	t.buf = append(t.buf, frame...)
+
+	if _, err := t.w.Write(t.buf); err != nil {
+		t.err = fmt.Errorf("Write: %w", err)
+	}
+}
+
+// WithTrace makes Fido record every frame it writes and reads to t,
+// as stream.
+func WithTrace(t *TraceWriter, stream byte) func(*Fido) {
+	return func(f *Fido) {
+		f.trace = t
+		f.stream = stream & 0x7f
+	}
+}
+
+// TraceReader reads the records of a trace.
+type TraceReader struct {
+	r    *bufio.Reader
+	last time.Time
+}
+
+func NewTraceReader(r io.Reader) (*TraceReader, error) {
+	br := bufio.NewReader(r)
+
+	var hdr [len(traceMagic) + 8]byte
+	if _, err := io.ReadFull(br, hdr[:]); err != nil {
+		return nil, fmt.Errorf("ReadFull: %w", err)
+	}
+	if string(hdr[:len(traceMagic)]) != traceMagic {
+		return nil, errors.New("not a trace")
+	}
+	start := int64(binary.BigEndian.Uint64(hdr[len(traceMagic):]))
+
+	return &TraceReader{
+		r:    br,
+		last: time.Unix(0, start),
+	}, nil
+}
+
+// Next returns the next record, or io.EOF after the last.
+func (t *TraceReader) Next() (TraceRecord, error) {
+	kind, err := t.r.ReadByte()
+	if err != nil {
+		return TraceRecord{}, err
+	}
+
+	delta, err := binary.ReadUvarint(t.r)
+	if err != nil {
+		return TraceRecord{}, fmt.Errorf("ReadUvarint: %w", io.ErrUnexpectedEOF)
+	}
+	t.last = t.last.Add(time.Duration(delta))
+
+	hdr, err := t.r.ReadByte()
+	if err != nil {
+		return TraceRecord{}, fmt.Errorf("ReadByte: %w", io.ErrUnexpectedEOF)
+	}
+	frame := make([]byte, FrameLen(hdr))
+	frame[0] = hdr
+	if _, err = io.ReadFull(t.r, frame[1:]); err != nil {
+		return TraceRecord{}, fmt.Errorf("ReadFull: %w", io.ErrUnexpectedEOF)
+	}
+
+	return TraceRecord{
+		Time:      t.last,
+		Direction: Direction(kind & 1),
+		Stream:    kind >> 1,
+		Frame:     frame,
+	}, nil
+}
+
+// FrameLen is the length of a frame with the header byte hdr,
+// including it.
+func FrameLen(hdr byte) int {
+	return 1 + cmdLenBytes(tkeyclient.CmdLen(hdr&0x3))
+}
+
+// FrameID is the frame ID in the header byte hdr.
+func FrameID(hdr byte) int {
+	return int(hdr >> 5)
+}
+
+// CommandName is the name of the app command with code, as in
+// Exchange.Command.
+func CommandName(code byte) string {
+	for _, cmd := range []appCmd{cmdGetNameVersion, cmdU2FRegister, cmdU2FCheckOnly,
+		cmdU2FAuthenticateSet, cmdU2FAuthenticateGo, cmdBenchCounters} {
+		if cmd.code == code {
+			return cmd.name
+		}
+	}
+	return fmt.Sprintf("cmd 0x%02x", code)
+}
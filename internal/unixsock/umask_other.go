@@ -0,0 +1,11 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+//go:build !unix
+
+package unixsock
+
+// withUmask runs f. There is no umask here.
+func withUmask(mask int, f func()) {
+	f()
+}
@@ -0,0 +1,27 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+//go:build unix
+
+package unixsock
+
+import (
+	"sync"
+
+	"golang.org/x/sys/unix"
+)
+
+var umaskMu sync.Mutex
+
+// withUmask runs f with the umask of the process set to mask. The
+// umask is for the whole process, so files created meanwhile by other
+// goroutines get it too. We only create sockets when starting up.
+func withUmask(mask int, f func()) {
+	umaskMu.Lock()
+	defer umaskMu.Unlock()
+
+	old := unix.Umask(mask)
+	defer unix.Umask(old)
+
+	f()
+}
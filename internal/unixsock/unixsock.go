@@ -0,0 +1,52 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Package unixsock creates the Unix sockets tkey-fido serves on, only
+// usable by the user running it.
+package unixsock
+
+import (
+	"errors"
+	"fmt"
+	"net"
+	"os"
+	"time"
+)
+
+// ErrInUse is returned when something is serving on the socket
+// already.
+var ErrInUse = errors.New("socket in use")
+
+// Listen creates the Unix socket at path, with only the owner allowed
+// to connect. A socket left at path by a process that is gone is
+// removed first, but nothing else is.
+func Listen(path string) (net.Listener, error) {
+	fi, err := os.Lstat(path)
+	switch {
+	case errors.Is(err, os.ErrNotExist):
+	case err != nil:
+		return nil, fmt.Errorf("Lstat: %w", err)
+	case fi.Mode()&os.ModeSocket == 0:
+		return nil, fmt.Errorf("%s exists and is not a socket", path)
+	default:
+		if conn, dialErr := net.DialTimeout("unix", path, time.Second); dialErr == nil {
+			conn.Close()
+			return nil, fmt.Errorf("%s: %w", path, ErrInUse)
+		}
+		if err = os.Remove(path); err != nil && !errors.Is(err, os.ErrNotExist) {
+			return nil, fmt.Errorf("Remove: %w", err)
+		}
+	}
+
+	var l net.Listener
+	// Created without group or other permissions, instead of changing
+	// them after others could already connect
+	withUmask(0o077, func() {
+		l, err = net.Listen("unix", path)
+	})
+	if err != nil {
+		return nil, fmt.Errorf("Listen: %w", err)
+	}
+
+	return l, nil
+}
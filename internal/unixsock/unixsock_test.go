@@ -0,0 +1,73 @@
+// Copyright (C) 2023 - Tillitis AB
+// SPDX-License-Identifier: GPL-2.0-only
+
+package unixsock_test
+
+import (
+	"errors"
+	"net"
+	"os"
+	"path/filepath"
+	"testing"
+
+	"github.com/tillitis/tkey-fido/internal/unixsock"
+)
+
+func TestListen(t *testing.T) {
+	t.Parallel()
+	path := filepath.Join(t.TempDir(), "sock")
+
+	l, err := unixsock.Listen(path)
+	if err != nil {
+		t.Fatalf("Listen: %v", err)
+	}
+	defer l.Close()
+
+	fi, err := os.Stat(path)
+	if err != nil {
+		t.Fatalf("Stat: %v", err)
+	}
+	if perm := fi.Mode().Perm(); perm&0o077 != 0 {
+		t.Errorf("socket mode %v, want no group or other permissions", perm)
+	}
+
+	if _, err = unixsock.Listen(path); !errors.Is(err, unixsock.ErrInUse) {
+		t.Errorf("Listen on a live socket: got %v, want ErrInUse", err)
+	}
+}
+
+func TestListenStale(t *testing.T) {
+	t.Parallel()
+	path := filepath.Join(t.TempDir(), "sock")
+
+	// A socket file with nobody serving on it, as after a crash
+	l, err := net.Listen("unix", path)
+	if err != nil {
+		t.Fatalf("net.Listen: %v", err)
+	}
+	l.(*net.UnixListener).SetUnlinkOnClose(false)
+	l.Close()
+
+	l, err = unixsock.Listen(path)
+	if err != nil {
+		t.Fatalf("Listen over a stale socket: %v", err)
+	}
+	l.Close()
+}
+
+func TestListenNotSocket(t *testing.T) {
+	t.Parallel()
+	path := filepath.Join(t.TempDir(), "file")
+
+	if err := os.WriteFile(path, []byte("keep me"), 0o600); err != nil {
+		t.Fatalf("WriteFile: %v", err)
+	}
+
+	if l, err := unixsock.Listen(path); err == nil {
+		l.Close()
+		t.Fatalf("Listen over a regular file succeeded")
+	}
+	if b, err := os.ReadFile(path); err != nil || string(b) != "keep me" {
+		t.Errorf("regular file changed: %q, %v", b, err)
+	}
+}